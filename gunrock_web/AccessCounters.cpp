@@ -0,0 +1,44 @@
+#include "AccessCounters.h"
+
+using namespace std;
+
+AccessCounters::AccessCounters() {
+  pthread_mutex_init(&lock, NULL);
+}
+
+AccessCounters::~AccessCounters() {
+  pthread_mutex_destroy(&lock);
+}
+
+void AccessCounters::touch(int inodeNumber) {
+  pthread_mutex_lock(&lock);
+  counts[inodeNumber]++;
+  pthread_mutex_unlock(&lock);
+}
+
+int AccessCounters::count(int inodeNumber) {
+  pthread_mutex_lock(&lock);
+  map<int, int>::iterator it = counts.find(inodeNumber);
+  int current = it != counts.end() ? it->second : 0;
+  pthread_mutex_unlock(&lock);
+  return current;
+}
+
+void AccessCounters::decay() {
+  pthread_mutex_lock(&lock);
+  for (map<int, int>::iterator it = counts.begin(); it != counts.end();) {
+    it->second /= 2;
+    if (it->second == 0) {
+      counts.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void AccessCounters::forget(int inodeNumber) {
+  pthread_mutex_lock(&lock);
+  counts.erase(inodeNumber);
+  pthread_mutex_unlock(&lock);
+}
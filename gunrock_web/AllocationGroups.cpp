@@ -0,0 +1,594 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <climits>
+
+#include "AllocationGroups.h"
+
+using namespace std;
+
+template <int BlockSize>
+AllocationGroups<BlockSize>::AllocationGroups(Disk *disk, InodeLocks *locks) {
+  this->disk = disk;
+  this->locks = locks;
+  this->groups = 0;
+  this->dataRegionAddr = 0;
+  this->rollbacks = 0;
+  pthread_mutex_init(&writeLock, NULL);
+  pthread_mutex_init(&zeroedLock, NULL);
+}
+
+template <int BlockSize>
+AllocationGroups<BlockSize>::~AllocationGroups() {
+  pthread_mutex_destroy(&zeroedLock);
+  pthread_mutex_destroy(&writeLock);
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::load(super_t *super) {
+  int groupInodes = super->group_inodes;
+  int groupBlocks = super->group_blocks;
+  // images made before groups, or with sizes that would let two groups
+  // share an inode region block, are one group
+  if (groupInodes <= 0 || groupBlocks <= 0 || groupInodes % Layout<BlockSize>::inodesPerBlock != 0
+      || groupBlocks % 8 != 0) {
+    groupInodes = super->num_inodes;
+    groupBlocks = super->num_data;
+  }
+  groups = max((super->num_inodes + groupInodes - 1) / groupInodes,
+               (super->num_data + groupBlocks - 1) / groupBlocks);
+  dataRegionAddr = super->data_region_addr;
+  locks->setGroupCount(groups);
+
+  inodes.addr = super->inode_bitmap_addr;
+  inodes.bits = super->num_inodes;
+  inodes.groupBits = groupInodes;
+  inodes.free = vector<atomic<int> >(groups);
+  blocks.addr = super->data_bitmap_addr;
+  blocks.bits = super->num_data;
+  blocks.groupBits = groupBlocks;
+  blocks.free = vector<atomic<int> >(groups);
+  makeChunks(inodes);
+  makeChunks(blocks);
+  rollbacks = disk->rollbackCount();
+
+  vector<unsigned char> bitmap((size_t)super->inode_bitmap_len * BlockSize);
+  disk->readBlocks(super->inode_bitmap_addr, super->inode_bitmap_len, bitmap.data());
+  countAll(inodes, bitmap.data());
+  bitmap.assign((size_t)super->data_bitmap_len * BlockSize, 0);
+  disk->readBlocks(super->data_bitmap_addr, super->data_bitmap_len, bitmap.data());
+  countAll(blocks, bitmap.data());
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::groupCount() {
+  return groups;
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::inodeGroup(int inodeNumber) {
+  return inodeNumber / inodes.groupBits;
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::blockGroup(unsigned int block) {
+  return (block - dataRegionAddr) / blocks.groupBits;
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::firstBlock(int group) {
+  return min(group * blocks.groupBits, blocks.bits - 1);
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::directoryGroup(int parentGroup) {
+  int best = parentGroup;
+  for (int i = 1; i < groups; ++i) {
+    int g = (parentGroup + i) % groups;
+    if (inodes.free[g] > 0 && (inodes.free[best] == 0 || blocks.free[g] > blocks.free[best])) {
+      best = g;
+    }
+  }
+  return best;
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::freeInodes() {
+  checkRollbacks();
+  return inodes.totalFree;
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::freeBlocks() {
+  checkRollbacks();
+  return blocks.totalFree;
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::allocateInode(int group) {
+  unsigned int inodeNumber;
+  if (!allocate(inodes, group, 1, 0, &inodeNumber)) {
+    return -1;
+  }
+  return inodeNumber;
+}
+
+template <int BlockSize>
+bool AllocationGroups<BlockSize>::allocateBlocks(int group, int count, unsigned int *taken, int keepFree) {
+  if (!allocate(blocks, group, count, keepFree, taken)) {
+    return false;
+  }
+  for (int i = 0; i < count; ++i) {
+    taken[i] += dataRegionAddr;
+  }
+  return true;
+}
+
+template <int BlockSize>
+bool AllocationGroups<BlockSize>::allocateZeroedBlocks(int group, int count, unsigned int *taken, int keepFree,
+                                                       int *zeroed) {
+  *zeroed = 0;
+  if (!allocate(blocks, group, count, keepFree, taken, zeroed)) {
+    return false;
+  }
+  for (int i = 0; i < count; ++i) {
+    taken[i] += dataRegionAddr;
+  }
+  return true;
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::zeroFreeBlocks(int count) {
+  AllocationLock allocating(locks, false);
+  checkRollbacks();
+  unsigned char zeros[BlockSize];
+  memset(zeros, 0, BlockSize);
+  int done = 0;
+  for (int g = 0; g < groups && done < count; ++g) {
+    GroupLock groupLock(locks, g);
+    for (int chunk = blocks.groupChunk[g + 1] - 1; chunk >= blocks.groupChunk[g] && done < count; --chunk) {
+      if (blocks.chunkFree[chunk] == 0) {
+        continue;
+      }
+      int first = blocks.chunkStart[chunk];
+      int end = blocks.chunkStart[chunk + 1];
+      vector<unsigned char> buffer;
+      int firstBit;
+      readBits(blocks, first, end, buffer, &firstBit);
+      // the group lock keeps the bits free until the zeros are written
+      for (int j = end - 1; j >= first && done < count; --j) {
+        int bit = j - firstBit;
+        if (buffer[bit / 8] & (1 << (bit % 8))) {
+          continue;
+        }
+        pthread_mutex_lock(&zeroedLock);
+        bool known = zeroed.count(j) > 0;
+        pthread_mutex_unlock(&zeroedLock);
+        if (known) {
+          continue;
+        }
+        disk->writeBlock(dataRegionAddr + j, zeros);
+        pthread_mutex_lock(&zeroedLock);
+        zeroed.insert(j);
+        pthread_mutex_unlock(&zeroedLock);
+        done++;
+      }
+    }
+  }
+  return done;
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::zeroedBlocks() {
+  pthread_mutex_lock(&zeroedLock);
+  int count = zeroed.size();
+  pthread_mutex_unlock(&zeroedLock);
+  return count;
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::allocateZeroedBits(int group, unsigned char *dataBitmap, int count,
+                                                    unsigned int *taken) {
+  checkRollbacks();
+  int found = 0;
+  pthread_mutex_lock(&zeroedLock);
+  set<int>::iterator it = zeroed.lower_bound(firstBlock(group));
+  int left = zeroed.size();
+  while (found < count && left-- > 0) {
+    if (it == zeroed.end()) {
+      it = zeroed.begin();
+    }
+    int index = *it;
+    zeroed.erase(it++);
+    // blocks the caller already allocated in its copy leave the pool too
+    if (dataBitmap[index / 8] & (1 << (index % 8))) {
+      continue;
+    }
+    dataBitmap[index / 8] |= (1 << (index % 8));
+    taken[found++] = index + dataRegionAddr;
+  }
+  pthread_mutex_unlock(&zeroedLock);
+  return found;
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::releaseInode(int inodeNumber) {
+  AllocationLock allocating(locks, false);
+  vector<int> indexes(1, inodeNumber);
+  release(inodes, indexes);
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::releaseBlocks(const vector<unsigned int> &released) {
+  AllocationLock allocating(locks, false);
+  vector<int> indexes;
+  for (size_t i = 0; i < released.size(); ++i) {
+    indexes.push_back(released[i] - dataRegionAddr);
+  }
+  release(blocks, indexes);
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::countInodes(const unsigned char *inodeBitmap) {
+  countAll(inodes, inodeBitmap);
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::countBlocks(const unsigned char *dataBitmap) {
+  countAll(blocks, dataBitmap);
+  pthread_mutex_lock(&zeroedLock);
+  for (set<int>::iterator it = zeroed.begin(); it != zeroed.end();) {
+    if (dataBitmap[*it / 8] & (1 << (*it % 8))) {
+      zeroed.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  pthread_mutex_unlock(&zeroedLock);
+}
+
+template <int BlockSize>
+bool AllocationGroups<BlockSize>::allocate(Bitmap &bitmap, int group, int count, int keepFree,
+                                           unsigned int *taken, int *pooled) {
+  if (count == 0) {
+    return true;
+  }
+  AllocationLock allocating(locks, false);
+  checkRollbacks();
+  // a failure counts the groups again before giving up, in case the
+  // counts are off
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    if (attempt > 0) {
+      refresh(bitmap);
+    }
+    // claimed from the total before any group is locked, so threads
+    // allocating in other groups can't take the same last free bits
+    int totalFree = bitmap.totalFree;
+    bool claimed = true;
+    do {
+      if (totalFree - count < keepFree) {
+        claimed = false;
+        break;
+      }
+    } while (!bitmap.totalFree.compare_exchange_weak(totalFree, totalFree - count));
+    if (!claimed) {
+      continue;
+    }
+
+    int found = 0;
+    if (pooled != NULL) {
+      found = takeZeroed(group, count, taken);
+      *pooled = found;
+    }
+    // in a row within one group if possible, so files read back in order
+    for (int i = 0; i < groups && found == 0 && count > 1; ++i) {
+      int g = (group + i) % groups;
+      if (bitmap.free[g] >= count) {
+        found = take(bitmap, g, count, true, taken);
+      }
+    }
+    for (int i = 0; i < groups && found < count; ++i) {
+      int g = (group + i) % groups;
+      if (bitmap.free[g] > 0) {
+        found += take(bitmap, g, count - found, false, taken + found);
+      }
+    }
+    if (found == count) {
+      return true;
+    }
+    bitmap.totalFree += count - found;
+    vector<int> indexes(taken, taken + found);
+    release(bitmap, indexes);
+  }
+  return false;
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::groupRange(Bitmap &bitmap, int group, int *first, int *end) {
+  *first = min((long long)group * bitmap.groupBits, (long long)bitmap.bits);
+  *end = min((long long)(group + 1) * bitmap.groupBits, (long long)bitmap.bits);
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::makeChunks(Bitmap &bitmap) {
+  int bitsPerBlock = Layout<BlockSize>::bitsPerBlock;
+  bitmap.chunkStart.clear();
+  bitmap.groupChunk.clear();
+  for (int g = 0; g < groups; ++g) {
+    int first;
+    int end;
+    groupRange(bitmap, g, &first, &end);
+    bitmap.groupChunk.push_back(bitmap.chunkStart.size());
+    for (int bit = first; bit < end; bit = min(end, (bit / bitsPerBlock + 1) * bitsPerBlock)) {
+      bitmap.chunkStart.push_back(bit);
+    }
+  }
+  bitmap.groupChunk.push_back(bitmap.chunkStart.size());
+  bitmap.chunkFree = vector<atomic<int> >(bitmap.chunkStart.size());
+  bitmap.chunkStart.push_back(bitmap.bits);
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::chunkOf(Bitmap &bitmap, int bit) {
+  return upper_bound(bitmap.chunkStart.begin(), bitmap.chunkStart.end(), bit) - bitmap.chunkStart.begin() - 1;
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::readBits(Bitmap &bitmap, int first, int end, vector<unsigned char> &buffer,
+                                           int *firstBit) {
+  int firstBlock = first / Layout<BlockSize>::bitsPerBlock;
+  int lastBlock = (max(end, first + 1) - 1) / Layout<BlockSize>::bitsPerBlock;
+  buffer.resize((size_t)(lastBlock - firstBlock + 1) * BlockSize);
+  disk->readBlocks(bitmap.addr + firstBlock, lastBlock - firstBlock + 1, buffer.data());
+  *firstBit = firstBlock * Layout<BlockSize>::bitsPerBlock;
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::writeBits(Bitmap &bitmap, int group, int first, int end,
+                                            const vector<unsigned char> &buffer, int firstBit) {
+  int bitsPerBlock = Layout<BlockSize>::bitsPerBlock;
+  int groupFirst;
+  int groupEnd;
+  groupRange(bitmap, group, &groupFirst, &groupEnd);
+  // the bits past the last inode or block belong to no group
+  long long ownedEnd = groupEnd == bitmap.bits ? LLONG_MAX : groupEnd;
+
+  for (int block = first / bitsPerBlock; block <= (end - 1) / bitsPerBlock; ++block) {
+    int blockFirst = block * bitsPerBlock;
+    const unsigned char *bits = &buffer[(blockFirst - firstBit) / 8];
+    // a block the group has to itself is written as it is
+    if (groupFirst <= blockFirst && blockFirst + bitsPerBlock <= ownedEnd) {
+      disk->writeBlock(bitmap.addr + block, (void *)bits);
+      continue;
+    }
+    // group boundaries are whole bytes
+    int from = max(groupFirst, blockFirst) - blockFirst;
+    int to = min(groupEnd, blockFirst + bitsPerBlock) - blockFirst;
+    unsigned char current[BlockSize];
+    pthread_mutex_lock(&writeLock);
+    disk->readBlock(bitmap.addr + block, current);
+    memcpy(current + from / 8, bits + from / 8, (to - from + 7) / 8);
+    disk->writeBlock(bitmap.addr + block, current);
+    pthread_mutex_unlock(&writeLock);
+  }
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::recount(Bitmap &bitmap, int firstChunk, int endChunk,
+                                         const unsigned char *bits, int firstBit) {
+  int change = 0;
+  for (int chunk = firstChunk; chunk < endChunk; ++chunk) {
+    int first = bitmap.chunkStart[chunk];
+    int end = bitmap.chunkStart[chunk + 1];
+    int free = 0;
+    int j = first;
+    for (; j < end && (j - firstBit) % 8 != 0; ++j) {
+      free += (bits[(j - firstBit) / 8] & (1 << ((j - firstBit) % 8))) == 0;
+    }
+    for (; j + 8 <= end; j += 8) {
+      free += 8 - __builtin_popcount(bits[(j - firstBit) / 8]);
+    }
+    for (; j < end; ++j) {
+      free += (bits[(j - firstBit) / 8] & (1 << ((j - firstBit) % 8))) == 0;
+    }
+    int chunkChange = free - bitmap.chunkFree[chunk];
+    bitmap.chunkFree[chunk] = free;
+    bitmap.free[first / bitmap.groupBits] += chunkChange;
+    change += chunkChange;
+  }
+  return change;
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::countAll(Bitmap &bitmap, const unsigned char *bits) {
+  recount(bitmap, 0, bitmap.chunkFree.size(), bits, 0);
+  int totalFree = 0;
+  for (int g = 0; g < groups; ++g) {
+    totalFree += bitmap.free[g];
+  }
+  bitmap.totalFree = totalFree;
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::refresh(Bitmap &bitmap) {
+  for (int g = 0; g < groups; ++g) {
+    int first;
+    int end;
+    groupRange(bitmap, g, &first, &end);
+    if (first == end) {
+      continue;
+    }
+    GroupLock groupLock(locks, g);
+    vector<unsigned char> buffer;
+    int firstBit;
+    readBits(bitmap, first, end, buffer, &firstBit);
+    bitmap.totalFree += recount(bitmap, bitmap.groupChunk[g], bitmap.groupChunk[g + 1], buffer.data(), firstBit);
+  }
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::checkRollbacks() {
+  int count = disk->rollbackCount();
+  if (rollbacks.exchange(count) == count) {
+    return;
+  }
+  AllocationLock allocating(locks, false);
+  refresh(inodes);
+  refresh(blocks);
+  forgetZeroed();
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::take(Bitmap &bitmap, int group, int count, bool run, unsigned int *taken) {
+  GroupLock groupLock(locks, group);
+  int found = 0;
+  int chunk = bitmap.groupChunk[group];
+  int endChunk = bitmap.groupChunk[group + 1];
+  while (chunk < endChunk && found < count) {
+    if (bitmap.chunkFree[chunk] == 0) {
+      chunk++;
+      continue;
+    }
+    // chunks with free bits next to each other are read together, so a
+    // run can go from one bitmap block into the next
+    int stretchEnd = chunk + 1;
+    while (stretchEnd < endChunk && bitmap.chunkFree[stretchEnd] > 0) {
+      stretchEnd++;
+    }
+    int first = bitmap.chunkStart[chunk];
+    int end = bitmap.chunkStart[stretchEnd];
+    vector<unsigned char> buffer;
+    int firstBit;
+    readBits(bitmap, first, end, buffer, &firstBit);
+
+    int before = found;
+    if (run) {
+      int inRow = 0;
+      for (int j = first; j < end && found < count; ++j) {
+        int bit = j - firstBit;
+        inRow = (buffer[bit / 8] & (1 << (bit % 8))) ? 0 : inRow + 1;
+        if (inRow == count) {
+          for (int i = 0; i < count; ++i) {
+            taken[i] = j - count + 1 + i;
+          }
+          found = count;
+        }
+      }
+    } else {
+      for (int j = first; j < end && found < count; ++j) {
+        int bit = j - firstBit;
+        if ((buffer[bit / 8] & (1 << (bit % 8))) == 0) {
+          taken[found++] = j;
+        }
+      }
+    }
+
+    for (int i = before; i < found; ++i) {
+      int bit = taken[i] - firstBit;
+      buffer[bit / 8] |= (1 << (bit % 8));
+    }
+    if (found > before) {
+      writeBits(bitmap, group, taken[before], taken[found - 1] + 1, buffer, firstBit);
+    }
+    // the taken bits were claimed from the total already. Counting the
+    // stretch again also corrects chunks whose counts were off.
+    bitmap.totalFree += recount(bitmap, chunk, stretchEnd, buffer.data(), firstBit) + found - before;
+    chunk = stretchEnd;
+  }
+  // the caller writes over what it takes
+  if (&bitmap == &blocks && found > 0) {
+    pthread_mutex_lock(&zeroedLock);
+    for (int i = 0; i < found; ++i) {
+      zeroed.erase(taken[i]);
+    }
+    pthread_mutex_unlock(&zeroedLock);
+  }
+  return found;
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::release(Bitmap &bitmap, vector<int> &indexes) {
+  int bitsPerBlock = Layout<BlockSize>::bitsPerBlock;
+  sort(indexes.begin(), indexes.end());
+  size_t i = 0;
+  while (i < indexes.size()) {
+    // one chunk at a time: the bits of one group in one bitmap block
+    int group = indexes[i] / bitmap.groupBits;
+    int block = indexes[i] / bitsPerBlock;
+    size_t end = i;
+    while (end < indexes.size() && indexes[end] / bitmap.groupBits == group && indexes[end] / bitsPerBlock == block) {
+      end++;
+    }
+    GroupLock groupLock(locks, group);
+    vector<unsigned char> buffer;
+    int firstBit;
+    readBits(bitmap, indexes[i], indexes[end - 1] + 1, buffer, &firstBit);
+    for (size_t j = i; j < end; ++j) {
+      int bit = indexes[j] - firstBit;
+      buffer[bit / 8] &= ~(1 << (bit % 8));
+    }
+    writeBits(bitmap, group, indexes[i], indexes[end - 1] + 1, buffer, firstBit);
+    int chunk = chunkOf(bitmap, indexes[i]);
+    bitmap.totalFree += recount(bitmap, chunk, chunk + 1, buffer.data(), firstBit);
+    i = end;
+  }
+}
+
+template <int BlockSize>
+int AllocationGroups<BlockSize>::takeZeroed(int group, int count, unsigned int *taken) {
+  vector<int> indexes;
+  pthread_mutex_lock(&zeroedLock);
+  set<int>::iterator it = zeroed.lower_bound(firstBlock(group));
+  while ((int)indexes.size() < count && !zeroed.empty()) {
+    if (it == zeroed.end()) {
+      it = zeroed.begin();
+    }
+    indexes.push_back(*it);
+    zeroed.erase(it++);
+  }
+  pthread_mutex_unlock(&zeroedLock);
+
+  // a chunk at a time like release. Bits taken since they were zeroed
+  // are left to their owners.
+  int bitsPerBlock = Layout<BlockSize>::bitsPerBlock;
+  sort(indexes.begin(), indexes.end());
+  int found = 0;
+  size_t i = 0;
+  while (i < indexes.size()) {
+    int g = indexes[i] / blocks.groupBits;
+    int block = indexes[i] / bitsPerBlock;
+    size_t end = i;
+    while (end < indexes.size() && indexes[end] / blocks.groupBits == g && indexes[end] / bitsPerBlock == block) {
+      end++;
+    }
+    GroupLock groupLock(locks, g);
+    vector<unsigned char> buffer;
+    int firstBit;
+    readBits(blocks, indexes[i], indexes[end - 1] + 1, buffer, &firstBit);
+    int before = found;
+    for (size_t j = i; j < end; ++j) {
+      int bit = indexes[j] - firstBit;
+      if ((buffer[bit / 8] & (1 << (bit % 8))) == 0) {
+        buffer[bit / 8] |= (1 << (bit % 8));
+        taken[found++] = indexes[j];
+      }
+    }
+    if (found > before) {
+      writeBits(blocks, g, taken[before], taken[found - 1] + 1, buffer, firstBit);
+    }
+    int chunk = chunkOf(blocks, indexes[i]);
+    blocks.totalFree += recount(blocks, chunk, chunk + 1, buffer.data(), firstBit) + found - before;
+    i = end;
+  }
+  return found;
+}
+
+template <int BlockSize>
+void AllocationGroups<BlockSize>::forgetZeroed() {
+  pthread_mutex_lock(&zeroedLock);
+  zeroed.clear();
+  pthread_mutex_unlock(&zeroedLock);
+}
+
+UFS_INSTANTIATE_BLOCK_SIZES(AllocationGroups)
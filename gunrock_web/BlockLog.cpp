@@ -0,0 +1,584 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "BlockLog.h"
+
+using namespace std;
+
+// FNV-1a, continued from hash over size more bytes
+static unsigned int checksum(unsigned int hash, const unsigned char *bytes, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+#define CHECKSUM_START (2166136261u)
+
+BlockLog::BlockLog(string imageFile, int blockSize, const super_t &super) {
+  this->imageFile = imageFile;
+  this->blockSize = blockSize;
+  this->logAddr = super.log_addr;
+  this->segmentBlocks = super.log_segment_blocks;
+  this->segments = segmentBlocks > 0 ? super.log_len / segmentBlocks : 0;
+  this->checkpointAddr = super.log_checkpoint_addr;
+  this->checkpointBlocks = super.log_checkpoint_len / 2;
+  this->summaryEntries = (blockSize - sizeof(log_summary_t)) / sizeof(unsigned int);
+  long long mapBytes = sizeof(log_checkpoint_t) + (long long)segments * segmentBlocks * sizeof(log_map_entry_t);
+  if (segments < 2 || segmentBlocks < 2 || (long long)checkpointBlocks * blockSize < mapBytes) {
+    cerr << "The block log of " << imageFile << " is too small" << endl;
+    exit(1);
+  }
+
+  // images that are only read can be read only
+  fd = open(imageFile.c_str(), O_RDWR);
+  if (fd < 0) {
+    fd = open(imageFile.c_str(), O_RDONLY);
+  }
+  if (fd < 0) {
+    cerr << "Could not open image file " << imageFile << endl;
+    exit(1);
+  }
+
+  pthread_mutex_init(&logLock, NULL);
+  pthread_cond_init(&cleanWanted, NULL);
+  pthread_rwlock_init(&mapLock, NULL);
+  head = 0;
+  headUsed = 0;
+  sequence = 0;
+  nextCheckpoint = 0;
+  checkpointNeeded = false;
+  cleanerStarted = false;
+  stopCleaner = false;
+  states.assign(segments, SEGMENT_FREE);
+  homes.assign((size_t)segments * segmentBlocks, -1);
+  live.assign(segments, 0);
+  recover();
+}
+
+BlockLog::~BlockLog() {
+  if (cleanerStarted) {
+    pthread_mutex_lock(&logLock);
+    stopCleaner = true;
+    pthread_cond_signal(&cleanWanted);
+    pthread_mutex_unlock(&logLock);
+    pthread_join(cleanerThread, NULL);
+  }
+  close(fd);
+  pthread_rwlock_destroy(&mapLock);
+  pthread_cond_destroy(&cleanWanted);
+  pthread_mutex_destroy(&logLock);
+}
+
+void BlockLog::readAt(long long blockNumber, int count, void *buffer) {
+  off_t offset = (off_t)blockNumber * blockSize;
+  size_t remaining = (size_t)count * blockSize;
+  char *out = (char *)buffer;
+  while (remaining > 0) {
+    ssize_t ret = pread(fd, out, remaining, offset);
+    if (ret <= 0) {
+      cerr << "Could not read file" << endl;
+      exit(1);
+    }
+    out += ret;
+    offset += ret;
+    remaining -= ret;
+  }
+}
+
+void BlockLog::writeAt(long long blockNumber, int count, const void *buffer) {
+  off_t offset = (off_t)blockNumber * blockSize;
+  size_t remaining = (size_t)count * blockSize;
+  const char *in = (const char *)buffer;
+  while (remaining > 0) {
+    ssize_t ret = pwrite(fd, in, remaining, offset);
+    if (ret <= 0) {
+      cerr << "Could not write file" << endl;
+      exit(1);
+    }
+    in += ret;
+    offset += ret;
+    remaining -= ret;
+  }
+}
+
+void BlockLog::sync() {
+  if (fdatasync(fd) != 0) {
+    cerr << "Could not sync " << imageFile << endl;
+    exit(1);
+  }
+}
+
+bool BlockLog::readCheckpoint(int copy, vector<log_map_entry_t> &entries, log_checkpoint_t *header) {
+  vector<unsigned char> region((size_t)checkpointBlocks * blockSize);
+  readAt(checkpointAddr + (long long)copy * checkpointBlocks, checkpointBlocks, region.data());
+  memcpy(header, region.data(), sizeof(log_checkpoint_t));
+  size_t bytes = sizeof(log_checkpoint_t) + (size_t)header->count * sizeof(log_map_entry_t);
+  if (header->magic != LOG_CHECKPOINT_MAGIC || header->count > homes.size() || bytes > region.size()
+      || header->head < 0 || header->head >= segments) {
+    return false;
+  }
+  ((log_checkpoint_t *)region.data())->checksum = 0;
+  if (checksum(CHECKSUM_START, region.data(), bytes) != header->checksum) {
+    return false;
+  }
+  log_map_entry_t *first = (log_map_entry_t *)(region.data() + sizeof(log_checkpoint_t));
+  entries.assign(first, first + header->count);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if ((int)entries[i].home >= checkpointAddr || entries[i].block >= homes.size()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int BlockLog::scanSegment(int segment, vector<Chunk> &chunks) {
+  int start = segment * segmentBlocks;
+  int used = 0;
+  long long last = -1;
+  vector<unsigned char> chunk;
+  while (segmentBlocks - used >= 2) {
+    chunk.resize(blockSize);
+    readAt(logAddr + start + used, 1, chunk.data());
+    log_summary_t summary;
+    memcpy(&summary, chunk.data(), sizeof(log_summary_t));
+    // chunks go into a segment in order, so an older one is left over from
+    // before it was used again
+    if (summary.magic != LOG_SUMMARY_MAGIC || summary.count == 0 || (int)summary.count > summaryEntries
+        || (int)summary.count > segmentBlocks - used - 1 || summary.sequence <= last) {
+      break;
+    }
+    // a segment that was started before the checkpoint and isn't the one
+    // it was filling has nothing after it
+    if (used == 0 && summary.sequence <= sequence && segment != head) {
+      break;
+    }
+    chunk.resize((size_t)(1 + summary.count) * blockSize);
+    readAt(logAddr + start + used + 1, summary.count, chunk.data() + blockSize);
+    ((log_summary_t *)chunk.data())->checksum = 0;
+    if (checksum(CHECKSUM_START, chunk.data(), chunk.size()) != summary.checksum) {
+      break;
+    }
+    if (summary.sequence > sequence) {
+      Chunk found;
+      found.sequence = summary.sequence;
+      found.more = summary.more != 0;
+      found.segment = segment;
+      unsigned int *chunkHomes = (unsigned int *)(chunk.data() + sizeof(log_summary_t));
+      for (unsigned int i = 0; i < summary.count; ++i) {
+        if ((int)chunkHomes[i] < checkpointAddr) {
+          found.blocks.push_back(make_pair((int)chunkHomes[i], start + used + 1 + (int)i));
+        }
+      }
+      chunks.push_back(found);
+    }
+    last = summary.sequence;
+    used += 1 + summary.count;
+  }
+  return used;
+}
+
+static bool earlier(const pair<long long, int> &a, const pair<long long, int> &b) {
+  return a.first < b.first;
+}
+
+void BlockLog::recover() {
+  // the newest whole copy of the block map
+  log_checkpoint_t newest;
+  vector<log_map_entry_t> entries;
+  bool found = false;
+  for (int copy = 0; copy < 2; ++copy) {
+    log_checkpoint_t header;
+    vector<log_map_entry_t> copyEntries;
+    if (readCheckpoint(copy, copyEntries, &header) && (!found || header.sequence > newest.sequence)) {
+      found = true;
+      newest = header;
+      entries.swap(copyEntries);
+      nextCheckpoint = 1 - copy;
+    }
+  }
+  if (found) {
+    sequence = newest.sequence;
+    head = newest.head;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      mapBlock(entries[i].home, entries[i].block);
+    }
+  }
+
+  // then the chunks written after it, in the order they were written. The
+  // chunks of a commit are in a row, and one that didn't get all of them
+  // written is left out.
+  vector<Chunk> chunks;
+  vector<int> used(segments);
+  for (int s = 0; s < segments; ++s) {
+    used[s] = scanSegment(s, chunks);
+  }
+  vector<pair<long long, int> > order;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    order.push_back(make_pair(chunks[i].sequence, (int)i));
+  }
+  sort(order.begin(), order.end(), earlier);
+  vector<pair<int, int> > commit;
+  long long previous = -1;
+  for (size_t i = 0; i < order.size(); ++i) {
+    Chunk &chunk = chunks[order[i].second];
+    if (chunk.sequence != previous + 1) {
+      commit.clear();
+    }
+    commit.insert(commit.end(), chunk.blocks.begin(), chunk.blocks.end());
+    if (!chunk.more) {
+      for (size_t j = 0; j < commit.size(); ++j) {
+        mapBlock(commit[j].first, commit[j].second);
+      }
+      commit.clear();
+    }
+    previous = chunk.sequence;
+  }
+  if (!order.empty()) {
+    sequence = order.back().first;
+    head = chunks[order.back().second].segment;
+    // segments that only have chunks from after the checkpoint can have
+    // nothing live in them now, but they are all the map has until the next
+    checkpointNeeded = true;
+  }
+  headUsed = used[head];
+  for (int s = 0; s < segments; ++s) {
+    states[s] = s == head ? SEGMENT_HEAD : live[s] > 0 ? SEGMENT_FULL : SEGMENT_FREE;
+  }
+}
+
+void BlockLog::mapBlock(int home, int block) {
+  map<int, int>::iterator it = blocks.find(home);
+  if (it != blocks.end()) {
+    homes[it->second] = -1;
+    live[it->second / segmentBlocks]--;
+    it->second = block;
+  } else {
+    blocks[home] = block;
+  }
+  homes[block] = home;
+  live[block / segmentBlocks]++;
+}
+
+void BlockLog::unmapBlock(int home) {
+  map<int, int>::iterator it = blocks.find(home);
+  if (it != blocks.end()) {
+    homes[it->second] = -1;
+    live[it->second / segmentBlocks]--;
+    blocks.erase(it);
+  }
+}
+
+void BlockLog::readBlock(int blockNumber, void *buffer) {
+  pthread_rwlock_rdlock(&mapLock);
+  map<int, vector<unsigned char> >::iterator pending = uncommitted.find(blockNumber);
+  if (pending != uncommitted.end()) {
+    memcpy(buffer, pending->second.data(), blockSize);
+  } else {
+    map<int, int>::iterator it = blocks.find(blockNumber);
+    readAt(it != blocks.end() ? logAddr + it->second : blockNumber, 1, buffer);
+  }
+  pthread_rwlock_unlock(&mapLock);
+}
+
+void BlockLog::readBlocks(int blockNumber, int count, void *buffer) {
+  unsigned char *out = (unsigned char *)buffer;
+  pthread_rwlock_rdlock(&mapLock);
+  // the range in one read, then the blocks that have a newer copy
+  readAt(blockNumber, count, buffer);
+  map<int, int>::iterator it = blocks.lower_bound(blockNumber);
+  for (; it != blocks.end() && it->first < blockNumber + count; ++it) {
+    readAt(logAddr + it->second, 1, out + (size_t)(it->first - blockNumber) * blockSize);
+  }
+  map<int, vector<unsigned char> >::iterator pending = uncommitted.lower_bound(blockNumber);
+  for (; pending != uncommitted.end() && pending->first < blockNumber + count; ++pending) {
+    memcpy(out + (size_t)(pending->first - blockNumber) * blockSize, pending->second.data(), blockSize);
+  }
+  pthread_rwlock_unlock(&mapLock);
+}
+
+void BlockLog::writeBlock(int blockNumber, const void *buffer, bool inTransaction) {
+  const unsigned char *bytes = (const unsigned char *)buffer;
+  pthread_rwlock_wrlock(&mapLock);
+  // a block a transaction wrote is changed along with it, the way the
+  // undo log would have put it back too
+  map<int, vector<unsigned char> >::iterator pending = uncommitted.find(blockNumber);
+  if (inTransaction || pending != uncommitted.end()) {
+    uncommitted[blockNumber].assign(bytes, bytes + blockSize);
+    pthread_rwlock_unlock(&mapLock);
+    return;
+  }
+  pthread_rwlock_unlock(&mapLock);
+
+  map<int, vector<unsigned char> > writes;
+  writes[blockNumber].assign(bytes, bytes + blockSize);
+  pthread_mutex_lock(&logLock);
+  append(writes);
+  pthread_mutex_unlock(&logLock);
+}
+
+void BlockLog::commit() {
+  pthread_mutex_lock(&logLock);
+  pthread_rwlock_rdlock(&mapLock);
+  map<int, vector<unsigned char> > writes(uncommitted);
+  pthread_rwlock_unlock(&mapLock);
+  if (!writes.empty()) {
+    append(writes);
+    // the map has them now, unless they were written again meanwhile
+    pthread_rwlock_wrlock(&mapLock);
+    map<int, vector<unsigned char> >::iterator it;
+    for (it = writes.begin(); it != writes.end(); ++it) {
+      map<int, vector<unsigned char> >::iterator pending = uncommitted.find(it->first);
+      if (pending != uncommitted.end() && pending->second == it->second) {
+        uncommitted.erase(pending);
+      }
+    }
+    pthread_rwlock_unlock(&mapLock);
+  }
+  pthread_mutex_unlock(&logLock);
+}
+
+void BlockLog::rollback() {
+  pthread_rwlock_wrlock(&mapLock);
+  uncommitted.clear();
+  pthread_rwlock_unlock(&mapLock);
+}
+
+int BlockLog::freeSegments() {
+  int count = 0;
+  for (int s = 0; s < segments; ++s) {
+    if (states[s] == SEGMENT_FREE) {
+      count++;
+    }
+  }
+  return count;
+}
+
+int BlockLog::freeBlocks() {
+  return segmentBlocks - headUsed + freeSegments() * segmentBlocks;
+}
+
+int BlockLog::blocksNeeded(int count) {
+  // what append will use: chunks in what is left of the head segment and
+  // then in new ones, skipping the end of a segment too short for a chunk
+  int needed = 0;
+  int used = headUsed;
+  while (count > 0) {
+    if (segmentBlocks - used < 2) {
+      needed += segmentBlocks - used;
+      used = 0;
+    }
+    int n = min(count, min(summaryEntries, segmentBlocks - used - 1));
+    needed += 1 + n;
+    used += 1 + n;
+    count -= n;
+  }
+  return needed;
+}
+
+bool BlockLog::openSegment() {
+  for (int i = 1; i <= segments; ++i) {
+    int s = (head + i) % segments;
+    if (states[s] == SEGMENT_FREE) {
+      states[head] = SEGMENT_FULL;
+      head = s;
+      headUsed = 0;
+      states[s] = SEGMENT_HEAD;
+      return true;
+    }
+  }
+  return false;
+}
+
+void BlockLog::append(const map<int, vector<unsigned char> > &writes) {
+  // a checkpoint only covers commits that are whole in the map
+  if (checkpointNeeded) {
+    checkpoint();
+  }
+  int count = writes.size();
+  while (blocksNeeded(count) > freeBlocks() && clean()) {
+  }
+  if (blocksNeeded(count) > freeBlocks()) {
+    writeHome(writes);
+    return;
+  }
+
+  vector<pair<int, int> > placed;
+  vector<unsigned char> chunk;
+  map<int, vector<unsigned char> >::const_iterator it = writes.begin();
+  int left = count;
+  while (left > 0) {
+    if (segmentBlocks - headUsed < 2) {
+      openSegment();
+    }
+    int n = min(left, min(summaryEntries, segmentBlocks - headUsed - 1));
+    chunk.assign((size_t)(1 + n) * blockSize, 0);
+    log_summary_t *summary = (log_summary_t *)chunk.data();
+    summary->magic = LOG_SUMMARY_MAGIC;
+    summary->count = n;
+    summary->sequence = ++sequence;
+    summary->more = left > n ? 1 : 0;
+    summary->checksum = 0;
+    unsigned int *chunkHomes = (unsigned int *)(chunk.data() + sizeof(log_summary_t));
+    int start = head * segmentBlocks + headUsed;
+    for (int i = 0; i < n; ++i, ++it) {
+      chunkHomes[i] = it->first;
+      memcpy(chunk.data() + (size_t)(1 + i) * blockSize, it->second.data(), blockSize);
+      placed.push_back(make_pair(it->first, start + 1 + i));
+    }
+    summary->checksum = checksum(CHECKSUM_START, chunk.data(), chunk.size());
+    writeAt(logAddr + start, 1 + n, chunk.data());
+    headUsed += 1 + n;
+    left -= n;
+  }
+  sync();
+
+  pthread_rwlock_wrlock(&mapLock);
+  for (size_t i = 0; i < placed.size(); ++i) {
+    mapBlock(placed[i].first, placed[i].second);
+  }
+  pthread_rwlock_unlock(&mapLock);
+
+  if (freeSegments() * 4 < segments) {
+    wakeCleaner();
+  }
+}
+
+void BlockLog::writeHome(const map<int, vector<unsigned char> > &writes) {
+  map<int, vector<unsigned char> >::const_iterator it;
+  for (it = writes.begin(); it != writes.end(); ++it) {
+    writeAt(it->first, 1, it->second.data());
+  }
+  sync();
+  pthread_rwlock_wrlock(&mapLock);
+  for (it = writes.begin(); it != writes.end(); ++it) {
+    unmapBlock(it->first);
+  }
+  pthread_rwlock_unlock(&mapLock);
+  checkpoint();
+}
+
+static bool fewerLive(const pair<int, int> &a, const pair<int, int> &b) {
+  return a.first < b.first;
+}
+
+bool BlockLog::clean() {
+  // the map only changes with the log lock held, so it can be read here
+  // without the map lock
+  vector<pair<int, int> > candidates;
+  for (int s = 0; s < segments; ++s) {
+    if (states[s] == SEGMENT_FULL) {
+      candidates.push_back(make_pair(live[s], s));
+    }
+  }
+  if (candidates.empty()) {
+    return false;
+  }
+  stable_sort(candidates.begin(), candidates.end(), fewerLive);
+
+  // the emptiest segments, until half the log would be free or a
+  // segment's worth of blocks has to be written home
+  int freeCount = freeSegments();
+  int moving = 0;
+  vector<int> victims;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (!victims.empty() && (moving + candidates[i].first > segmentBlocks
+                             || freeCount + (int)victims.size() >= segments / 2)) {
+      break;
+    }
+    victims.push_back(candidates[i].second);
+    moving += candidates[i].first;
+  }
+
+  // their live blocks go home in block order, with one sync
+  map<int, int> moves;
+  for (size_t i = 0; i < victims.size(); ++i) {
+    for (int b = victims[i] * segmentBlocks; b < (victims[i] + 1) * segmentBlocks; ++b) {
+      if (homes[b] >= 0) {
+        moves[homes[b]] = b;
+      }
+    }
+  }
+  vector<unsigned char> block(blockSize);
+  map<int, int>::iterator it;
+  for (it = moves.begin(); it != moves.end(); ++it) {
+    readAt(logAddr + it->second, 1, block.data());
+    writeAt(it->first, 1, block.data());
+  }
+  if (!moves.empty()) {
+    sync();
+  }
+  pthread_rwlock_wrlock(&mapLock);
+  for (it = moves.begin(); it != moves.end(); ++it) {
+    unmapBlock(it->first);
+  }
+  pthread_rwlock_unlock(&mapLock);
+
+  // after a crash the old map would still point into them
+  for (size_t i = 0; i < victims.size(); ++i) {
+    states[victims[i]] = SEGMENT_CLEANED;
+  }
+  checkpoint();
+  return true;
+}
+
+void BlockLog::checkpoint() {
+  size_t bytes = sizeof(log_checkpoint_t) + blocks.size() * sizeof(log_map_entry_t);
+  int count = (bytes + blockSize - 1) / blockSize;
+  vector<unsigned char> region((size_t)count * blockSize, 0);
+  log_checkpoint_t *header = (log_checkpoint_t *)region.data();
+  header->magic = LOG_CHECKPOINT_MAGIC;
+  header->count = blocks.size();
+  header->sequence = sequence;
+  header->head = head;
+  header->checksum = 0;
+  log_map_entry_t *entry = (log_map_entry_t *)(region.data() + sizeof(log_checkpoint_t));
+  map<int, int>::iterator it;
+  for (it = blocks.begin(); it != blocks.end(); ++it, ++entry) {
+    entry->home = it->first;
+    entry->block = it->second;
+  }
+  header->checksum = checksum(CHECKSUM_START, region.data(), bytes);
+  writeAt(checkpointAddr + (long long)nextCheckpoint * checkpointBlocks, count, region.data());
+  sync();
+  nextCheckpoint = 1 - nextCheckpoint;
+  checkpointNeeded = false;
+  for (int s = 0; s < segments; ++s) {
+    if (states[s] == SEGMENT_CLEANED) {
+      states[s] = SEGMENT_FREE;
+    }
+  }
+}
+
+void BlockLog::wakeCleaner() {
+  if (cleanerStarted) {
+    pthread_cond_signal(&cleanWanted);
+    return;
+  }
+  cleanerStarted = true;
+  if (pthread_create(&cleanerThread, NULL, cleaner, this) != 0) {
+    cerr << "could not start the log cleaner" << endl;
+    exit(1);
+  }
+}
+
+void *BlockLog::cleaner(void *arg) {
+  BlockLog *log = (BlockLog *)arg;
+  pthread_mutex_lock(&log->logLock);
+  while (!log->stopCleaner) {
+    // commits get the log in between segments
+    if (log->freeSegments() * 2 < log->segments && log->clean()) {
+      pthread_mutex_unlock(&log->logLock);
+      pthread_mutex_lock(&log->logLock);
+      continue;
+    }
+    pthread_cond_wait(&log->cleanWanted, &log->logLock);
+  }
+  pthread_mutex_unlock(&log->logLock);
+  return NULL;
+}
@@ -0,0 +1,81 @@
+#include <cstring>
+
+#include "ColdTier.h"
+#include "Layout.h"
+
+using namespace std;
+
+template <int BlockSize>
+ColdTier<BlockSize> *ColdTier<BlockSize>::open(string imageFile) {
+  // read with the smallest block size first, like LocalFileSystem::mount
+  super_t super;
+  Disk probe(imageFile, UFS_BLOCK_SIZE);
+  char buffer[UFS_BLOCK_SIZE];
+  probe.readBlock(0, buffer);
+  memcpy(&super, buffer, sizeof(super_t));
+  if (!(super.features & UFS_FEATURE_COLD_TIER) || super.block_size != BlockSize) {
+    return NULL;
+  }
+  return new ColdTier<BlockSize>(new Disk(imageFile, BlockSize), super);
+}
+
+template <int BlockSize>
+ColdTier<BlockSize>::ColdTier(Disk *disk, const super_t &super) : disk(disk), super(super), groups(disk, &locks) {
+  groups.load(&this->super);
+}
+
+template <int BlockSize>
+ColdTier<BlockSize>::~ColdTier() {
+  delete disk;
+}
+
+template <int BlockSize>
+int ColdTier<BlockSize>::tierId() {
+  return super.tier_id;
+}
+
+template <int BlockSize>
+void ColdTier<BlockSize>::setTierId(int tierId) {
+  unsigned char block[BlockSize];
+  disk->readBlock(0, block);
+  super.tier_id = tierId;
+  memcpy(block, &super, sizeof(super_t));
+  disk->writeBlock(0, block);
+}
+
+template <int BlockSize>
+void ColdTier<BlockSize>::joinTransactions(Disk *imageDisk) {
+  imageDisk->linkTransactions(disk);
+}
+
+template <int BlockSize>
+int ColdTier<BlockSize>::dataBlocks() {
+  return super.num_data;
+}
+
+template <int BlockSize>
+int ColdTier<BlockSize>::freeBlocks() {
+  return groups.freeBlocks();
+}
+
+template <int BlockSize>
+bool ColdTier<BlockSize>::allocateBlocks(int count, unsigned int *blocks) {
+  return groups.allocateBlocks(0, count, blocks, 0);
+}
+
+template <int BlockSize>
+void ColdTier<BlockSize>::releaseBlocks(const vector<unsigned int> &blocks) {
+  groups.releaseBlocks(blocks);
+}
+
+template <int BlockSize>
+void ColdTier<BlockSize>::readBlock(unsigned int block, void *buffer) {
+  disk->readBlock(block, buffer);
+}
+
+template <int BlockSize>
+void ColdTier<BlockSize>::writeBlock(unsigned int block, const void *buffer) {
+  disk->writeBlock(block, (void *)buffer);
+}
+
+UFS_INSTANTIATE_BLOCK_SIZES(ColdTier)
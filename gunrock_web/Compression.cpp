@@ -0,0 +1,174 @@
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "Compression.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_OFFSET (65535)
+#define LZ_HASH_BITS (13)
+
+Codec *Codec::byId(unsigned int id) {
+  static LzCodec lz;
+  static StoredCodec stored;
+  switch (id) {
+  case UFS_CODEC_LZ:
+    return &lz;
+  case UFS_CODEC_STORED:
+    return &stored;
+  default:
+    return NULL;
+  }
+}
+
+// Writes the extra bytes of a count that didn't fit in its 4 token bits
+bool writeLength(int length, unsigned char *out, int *outPos, int capacity) {
+  for (length -= 15; length >= 255; length -= 255) {
+    if (*outPos >= capacity) {
+      return false;
+    }
+    out[(*outPos)++] = 255;
+  }
+  if (*outPos >= capacity) {
+    return false;
+  }
+  out[(*outPos)++] = length;
+  return true;
+}
+
+bool readLength(const unsigned char *in, int size, int *inPos, int *length) {
+  if (*length != 15) {
+    return true;
+  }
+  unsigned char next;
+  do {
+    if (*inPos >= size) {
+      return false;
+    }
+    next = in[(*inPos)++];
+    *length += next;
+  } while (next == 255);
+  return true;
+}
+
+// Writes one sequence. A matchLength of 0 ends the stream after the literals.
+bool writeSequence(const unsigned char *literals, int literalCount, int offset, int matchLength,
+                   unsigned char *out, int *outPos, int capacity) {
+  if (*outPos >= capacity) {
+    return false;
+  }
+  int matchCode = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+  out[(*outPos)++] = (min(literalCount, 15) << 4) | min(matchCode, 15);
+  if (literalCount >= 15 && !writeLength(literalCount, out, outPos, capacity)) {
+    return false;
+  }
+  if (literalCount > capacity - *outPos) {
+    return false;
+  }
+  memcpy(out + *outPos, literals, literalCount);
+  *outPos += literalCount;
+
+  if (matchLength == 0) {
+    return true;
+  }
+  if (capacity - *outPos < 2) {
+    return false;
+  }
+  out[(*outPos)++] = offset & 0xff;
+  out[(*outPos)++] = offset >> 8;
+  return matchCode < 15 || writeLength(matchCode, out, outPos, capacity);
+}
+
+int LzCodec::compress(const unsigned char *in, int size, unsigned char *out, int capacity) {
+  // last position where each hash of 4 bytes was seen
+  vector<int> table(1 << LZ_HASH_BITS, -1);
+  int anchor = 0;
+  int pos = 0;
+  int outPos = 0;
+
+  while (pos + LZ_MIN_MATCH <= size) {
+    unsigned int sequence;
+    memcpy(&sequence, in + pos, sizeof(sequence));
+    unsigned int hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+    int candidate = table[hash];
+    table[hash] = pos;
+
+    if (candidate < 0 || pos - candidate > LZ_MAX_OFFSET
+        || memcmp(in + candidate, in + pos, LZ_MIN_MATCH) != 0) {
+      // step faster through data that doesn't match, so incompressible
+      // input is given up on quickly
+      pos += 1 + ((pos - anchor) >> 6);
+      continue;
+    }
+
+    int matchLength = LZ_MIN_MATCH;
+    while (pos + matchLength < size && in[candidate + matchLength] == in[pos + matchLength]) {
+      matchLength++;
+    }
+    if (!writeSequence(in + anchor, pos - anchor, pos - candidate, matchLength, out, &outPos, capacity)) {
+      return -1;
+    }
+    pos += matchLength;
+    anchor = pos;
+  }
+
+  if (!writeSequence(in + anchor, size - anchor, 0, 0, out, &outPos, capacity)) {
+    return -1;
+  }
+  return outPos;
+}
+
+int LzCodec::decompress(const unsigned char *in, int size, unsigned char *out, int capacity) {
+  int inPos = 0;
+  int outPos = 0;
+
+  while (inPos < size) {
+    int token = in[inPos++];
+    int literalCount = token >> 4;
+    if (!readLength(in, size, &inPos, &literalCount)
+        || literalCount > size - inPos || literalCount > capacity - outPos) {
+      return -1;
+    }
+    memcpy(out + outPos, in + inPos, literalCount);
+    inPos += literalCount;
+    outPos += literalCount;
+
+    if (inPos == size) {
+      break;
+    }
+    if (size - inPos < 2) {
+      return -1;
+    }
+    int offset = in[inPos] | (in[inPos + 1] << 8);
+    inPos += 2;
+    int matchLength = token & 15;
+    if (!readLength(in, size, &inPos, &matchLength)) {
+      return -1;
+    }
+    matchLength += LZ_MIN_MATCH;
+    if (offset == 0 || offset > outPos || matchLength > capacity - outPos) {
+      return -1;
+    }
+    // byte by byte, matches can overlap the bytes they produce
+    for (int i = 0; i < matchLength; ++i) {
+      out[outPos + i] = out[outPos - offset + i];
+    }
+    outPos += matchLength;
+  }
+  return outPos;
+}
+
+int StoredCodec::compress(const unsigned char *in, int size, unsigned char *out, int capacity) {
+  if (size > capacity) {
+    return -1;
+  }
+  memcpy(out, in, size);
+  return size;
+}
+
+int StoredCodec::decompress(const unsigned char *in, int size, unsigned char *out, int capacity) {
+  return compress(in, size, out, capacity);
+}
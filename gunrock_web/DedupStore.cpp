@@ -0,0 +1,218 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include "DedupStore.h"
+#include "ufs.h"
+
+using namespace std;
+
+template <int BlockSize>
+DedupStore<BlockSize>::DedupStore(Disk *disk, super_t *super) {
+  this->disk = disk;
+  this->super = super;
+  this->dedup = (super->features & UFS_FEATURE_DEDUP) != 0;
+  this->slots = super->fingerprint_len * Layout<BlockSize>::slotsPerBlock;
+}
+
+template <int BlockSize>
+unsigned long long DedupStore<BlockSize>::fingerprint(const unsigned char *block) {
+  // a multiply and rotate per 8 bytes, then a final mix so that every
+  // input bit affects every bit of the result
+  const unsigned long long prime1 = 0x9E3779B185EBCA87ULL;
+  const unsigned long long prime2 = 0xC2B2AE3D27D4EB4FULL;
+  unsigned long long hash = 0x27D4EB2F165667C5ULL;
+  for (int i = 0; i < BlockSize; i += sizeof(unsigned long long)) {
+    unsigned long long word;
+    memcpy(&word, block + i, sizeof(word));
+    hash ^= word * prime2;
+    hash = ((hash << 31) | (hash >> 33)) * prime1;
+  }
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  hash *= prime1;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+template <int BlockSize>
+unsigned char *DedupStore<BlockSize>::regionBlock(unsigned int block, bool modify) {
+  map<unsigned int, vector<unsigned char> >::iterator iter = cache.find(block);
+  if (iter == cache.end()) {
+    iter = cache.insert(make_pair(block, vector<unsigned char>(BlockSize))).first;
+    disk->readBlock(block, iter->second.data());
+  }
+  if (modify) {
+    dirty.insert(block);
+  }
+  return iter->second.data();
+}
+
+template <int BlockSize>
+unsigned int *DedupStore<BlockSize>::refCount(unsigned int block, bool modify) {
+  int index = block - super->data_region_addr;
+  unsigned int *counts = (unsigned int *)regionBlock(super->refcount_addr + index / Layout<BlockSize>::refsPerBlock, modify);
+  return &counts[index % Layout<BlockSize>::refsPerBlock];
+}
+
+template <int BlockSize>
+dedup_slot_t *DedupStore<BlockSize>::slot(unsigned int index, bool modify) {
+  dedup_slot_t *table = (dedup_slot_t *)regionBlock(super->fingerprint_addr + index / Layout<BlockSize>::slotsPerBlock, modify);
+  return &table[index % Layout<BlockSize>::slotsPerBlock];
+}
+
+// The block whose content is block, or 0 if there isn't one
+template <int BlockSize>
+unsigned int DedupStore<BlockSize>::find(unsigned long long fingerprint, const unsigned char *block) {
+  unsigned char existing[BlockSize];
+  for (unsigned int i = fingerprint % slots; ; i = (i + 1) % slots) {
+    dedup_slot_t *entry = slot(i, false);
+    if (entry->block == 0) {
+      return 0;
+    }
+    if (entry->fingerprint == fingerprint) {
+      disk->readBlock(entry->block, existing);
+      if (memcmp(existing, block, BlockSize) == 0) {
+        return entry->block;
+      }
+    }
+  }
+}
+
+template <int BlockSize>
+void DedupStore<BlockSize>::insert(unsigned long long fingerprint, unsigned int block) {
+  // there are at least twice as many slots as data blocks, so a free one
+  // always turns up
+  unsigned int i = fingerprint % slots;
+  while (slot(i, false)->block != 0) {
+    i = (i + 1) % slots;
+  }
+  dedup_slot_t *entry = slot(i, true);
+  entry->fingerprint = fingerprint;
+  entry->block = block;
+}
+
+template <int BlockSize>
+void DedupStore<BlockSize>::remove(unsigned long long fingerprint, unsigned int block) {
+  unsigned int hole = fingerprint % slots;
+  while (slot(hole, false)->block != block) {
+    if (slot(hole, false)->block == 0) {
+      return;
+    }
+    hole = (hole + 1) % slots;
+  }
+
+  // Backward shift deletion: later entries of the probe run move into the
+  // hole unless that would put them before their home slot, so lookups
+  // can keep stopping at the first empty slot
+  for (unsigned int i = (hole + 1) % slots; slot(i, false)->block != 0; i = (i + 1) % slots) {
+    unsigned int home = slot(i, false)->fingerprint % slots;
+    bool homeInRun = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+    if (!homeInRun) {
+      *slot(hole, true) = *slot(i, false);
+      hole = i;
+    }
+  }
+  memset(slot(hole, true), 0, sizeof(dedup_slot_t));
+}
+
+template <int BlockSize>
+int DedupStore<BlockSize>::blocksNeeded(const unsigned char *blocks, int count) {
+  if (!dedup) {
+    return count;
+  }
+  int needed = 0;
+  vector<unsigned long long> fingerprints(count);
+  for (int i = 0; i < count; ++i) {
+    const unsigned char *block = blocks + i * BlockSize;
+    fingerprints[i] = fingerprint(block);
+
+    bool shared = false;
+    for (int j = 0; j < i && !shared; ++j) {
+      shared = fingerprints[j] == fingerprints[i]
+        && memcmp(blocks + j * BlockSize, block, BlockSize) == 0;
+    }
+    if (!shared && find(fingerprints[i], block) == 0) {
+      needed++;
+    }
+  }
+  return needed;
+}
+
+template <int BlockSize>
+unsigned int DedupStore<BlockSize>::store(const unsigned char *block, vector<unsigned int> &spareBlocks) {
+  unsigned long long hash = dedup ? fingerprint(block) : 0;
+  unsigned int blockNumber = dedup ? find(hash, block) : 0;
+  if (blockNumber == 0) {
+    blockNumber = spareBlocks.back();
+    spareBlocks.pop_back();
+    disk->writeBlock(blockNumber, (void *)block);
+    if (dedup) {
+      insert(hash, blockNumber);
+    }
+  }
+  (*refCount(blockNumber, true))++;
+  return blockNumber;
+}
+
+template <int BlockSize>
+bool DedupStore<BlockSize>::release(unsigned int block) {
+  unsigned int *count = refCount(block, true);
+  if (*count > 1) {
+    (*count)--;
+    return false;
+  }
+  *count = 0;
+
+  if (dedup) {
+    unsigned char content[BlockSize];
+    disk->readBlock(block, content);
+    remove(fingerprint(content), block);
+  }
+  return true;
+}
+
+template <int BlockSize>
+void DedupStore<BlockSize>::share(unsigned int block) {
+  (*refCount(block, true))++;
+}
+
+template <int BlockSize>
+unsigned int DedupStore<BlockSize>::references(unsigned int block) {
+  return *refCount(block, false);
+}
+
+template <int BlockSize>
+void DedupStore<BlockSize>::setReferences(unsigned int block, unsigned int count) {
+  *refCount(block, true) = count;
+}
+
+template <int BlockSize>
+void DedupStore<BlockSize>::reindex() {
+  if (!dedup) {
+    return;
+  }
+  for (int i = 0; i < super->fingerprint_len; ++i) {
+    memset(regionBlock(super->fingerprint_addr + i, true), 0, BlockSize);
+  }
+  unsigned char content[BlockSize];
+  for (int i = 0; i < super->num_data; ++i) {
+    unsigned int block = super->data_region_addr + i;
+    if (references(block) > 0) {
+      disk->readBlock(block, content);
+      insert(fingerprint(content), block);
+    }
+  }
+}
+
+template <int BlockSize>
+void DedupStore<BlockSize>::flush() {
+  for (set<unsigned int>::iterator iter = dirty.begin(); iter != dirty.end(); ++iter) {
+    disk->writeBlock(*iter, cache[*iter].data());
+  }
+  dirty.clear();
+}
+
+UFS_INSTANTIATE_BLOCK_SIZES(DedupStore)
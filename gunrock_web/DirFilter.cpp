@@ -0,0 +1,172 @@
+#include <algorithm>
+
+#include "DirFilter.h"
+
+using namespace std;
+
+// Bits per name and bits set for each name. A full filter lets about
+// one name in a hundred through that isn't there.
+#define FILTER_BITS_PER_NAME (10)
+#define FILTER_HASHES (7)
+// A filter has room for this many names, or twice what the directory
+// had when it was made, so it can grow before it is made again
+#define FILTER_MIN_CAPACITY (64)
+// The filters of all directories together
+#define MAX_FILTER_BYTES (8 << 20)
+
+DirFilters::DirFilters(Disk *disk) : filtered(0), passed(0), falsePositives(0) {
+  this->disk = disk;
+  this->rollbacks = disk->rollbackCount();
+  this->bytes = 0;
+  pthread_mutex_init(&lock, NULL);
+}
+
+DirFilters::~DirFilters() {
+  pthread_mutex_destroy(&lock);
+}
+
+void DirFilters::hash(const string &name, unsigned int *first, unsigned int *step) {
+  // 64 bit FNV-1a, whose halves are the two hashes of double hashing
+  unsigned long long hash = 14695981039346656037ull;
+  for (size_t i = 0; i < name.length(); ++i) {
+    hash = (hash ^ (unsigned char)name[i]) * 1099511628211ull;
+  }
+  *first = (unsigned int)hash;
+  *step = (unsigned int)(hash >> 32) | 1;
+}
+
+void DirFilters::insert(Filter &filter, const string &name) {
+  unsigned int first;
+  unsigned int step;
+  hash(name, &first, &step);
+  unsigned int size = filter.bits.size() * 64;
+  for (int i = 0; i < FILTER_HASHES; ++i) {
+    unsigned int bit = (first + i * step) % size;
+    filter.bits[bit / 64] |= 1ull << (bit % 64);
+  }
+  filter.names++;
+}
+
+void DirFilters::refresh() {
+  int rollbackCount = disk->rollbackCount();
+  if (rollbackCount != rollbacks) {
+    filters.clear();
+    bytes = 0;
+    rollbacks = rollbackCount;
+  }
+}
+
+bool DirFilters::check(int dir, const string &name, bool *mayContain, int *rollbacksSeen) {
+  unsigned int first;
+  unsigned int step;
+  hash(name, &first, &step);
+
+  pthread_mutex_lock(&lock);
+  refresh();
+  *rollbacksSeen = rollbacks;
+  map<int, Filter>::iterator it = filters.find(dir);
+  if (it == filters.end()) {
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  const Filter &filter = it->second;
+  unsigned int size = filter.bits.size() * 64;
+  *mayContain = true;
+  for (int i = 0; i < FILTER_HASHES && *mayContain; ++i) {
+    unsigned int bit = (first + i * step) % size;
+    *mayContain = (filter.bits[bit / 64] & (1ull << (bit % 64))) != 0;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (*mayContain) {
+    passed++;
+  } else {
+    filtered++;
+  }
+  return true;
+}
+
+void DirFilters::build(int dir, const vector<string> &names, int rollbacksSeen) {
+  Filter filter;
+  filter.capacity = max(FILTER_MIN_CAPACITY, 2 * (int)names.size());
+  filter.bits.resize((filter.capacity * FILTER_BITS_PER_NAME + 63) / 64);
+  filter.names = 0;
+  filter.removed = 0;
+  for (size_t i = 0; i < names.size(); ++i) {
+    insert(filter, names[i]);
+  }
+
+  pthread_mutex_lock(&lock);
+  refresh();
+  if (rollbacksSeen == rollbacks) {
+    map<int, Filter>::iterator it = filters.find(dir);
+    if (it != filters.end()) {
+      bytes -= it->second.bits.size() * 8;
+    }
+    bytes += filter.bits.size() * 8;
+    filters[dir].bits.swap(filter.bits);
+    filters[dir].capacity = filter.capacity;
+    filters[dir].names = filter.names;
+    filters[dir].removed = 0;
+    trim();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void DirFilters::add(int dir, const string &name) {
+  pthread_mutex_lock(&lock);
+  map<int, Filter>::iterator it = filters.find(dir);
+  if (it != filters.end()) {
+    if (it->second.names >= it->second.capacity) {
+      bytes -= it->second.bits.size() * 8;
+      filters.erase(it);
+    } else {
+      insert(it->second, name);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void DirFilters::remove(int dir) {
+  pthread_mutex_lock(&lock);
+  map<int, Filter>::iterator it = filters.find(dir);
+  if (it != filters.end() && ++it->second.removed * 4 > it->second.names) {
+    bytes -= it->second.bits.size() * 8;
+    filters.erase(it);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void DirFilters::drop(int dir) {
+  pthread_mutex_lock(&lock);
+  map<int, Filter>::iterator it = filters.find(dir);
+  if (it != filters.end()) {
+    bytes -= it->second.bits.size() * 8;
+    filters.erase(it);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void DirFilters::clear() {
+  pthread_mutex_lock(&lock);
+  filters.clear();
+  bytes = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+void DirFilters::trim() {
+  while (bytes > MAX_FILTER_BYTES && !filters.empty()) {
+    bytes -= filters.begin()->second.bits.size() * 8;
+    filters.erase(filters.begin());
+  }
+}
+
+void DirFilters::falsePositive() {
+  falsePositives++;
+}
+
+void DirFilters::stats(LookupStats *stats) {
+  stats->filtered = filtered;
+  stats->passed = passed;
+  stats->falsePositives = falsePositives;
+}
@@ -0,0 +1,299 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "DirIndex.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Index of the child of an interior node that covers name
+template <typename Node>
+int childIndex(Node *node, const char *name) {
+  int child = 0;
+  for (int i = 1; i < node->count; ++i) {
+    if (strcmp(node->entries[i].name, name) > 0) {
+      break;
+    }
+    child = i;
+  }
+  return child;
+}
+
+// Index of the first entry of a node whose name sorts after name
+template <typename Node>
+int upperBound(Node *node, const char *name) {
+  int i = 0;
+  while (i < node->count && strcmp(node->entries[i].name, name) <= 0) {
+    i++;
+  }
+  return i;
+}
+
+template <int BlockSize>
+DirIndex<BlockSize>::DirIndex(Disk *disk, unsigned int rootBlock) {
+  this->disk = disk;
+  this->root = rootBlock;
+}
+
+template <int BlockSize>
+void DirIndex<BlockSize>::format(Disk *disk, unsigned int block, const dir_ent_t *entries, int count) {
+  Node node;
+  memset(&node, 0, sizeof(Node));
+  node.leaf = 1;
+  node.count = count;
+  memcpy(node.entries, entries, count * sizeof(dir_ent_t));
+  disk->writeBlock(block, &node);
+}
+
+template <int BlockSize>
+int DirIndex<BlockSize>::buildBlocksNeeded(int count) {
+  int fanout = Layout<BlockSize>::indexFanout;
+  int nodes = (count + fanout - 1) / fanout;
+  int total = nodes;
+  while (nodes > 1) {
+    nodes = (nodes + fanout - 1) / fanout;
+    total += nodes;
+  }
+  return total;
+}
+
+template <int BlockSize>
+unsigned int DirIndex<BlockSize>::build(Disk *disk, const vector<dir_ent_t> &entries,
+                                        vector<unsigned int> &blocks) {
+  int fanout = Layout<BlockSize>::indexFanout;
+
+  // the leaves, each linked to the next, then a level of interior nodes
+  // over them at a time. children holds the first entry of every node of
+  // the level below, pointing at the node.
+  vector<dir_ent_t> children;
+  int leaves = (entries.size() + fanout - 1) / fanout;
+  for (int i = 0; i < leaves; ++i) {
+    children.push_back(entries[i * fanout]);
+    children.back().inum = blocks.back();
+    blocks.pop_back();
+  }
+  Node node;
+  for (int i = 0; i < leaves; ++i) {
+    memset(&node, 0, sizeof(Node));
+    node.leaf = 1;
+    node.count = min((int)entries.size() - i * fanout, fanout);
+    node.next = i + 1 < leaves ? children[i + 1].inum : 0;
+    memcpy(node.entries, entries.data() + i * fanout, node.count * sizeof(dir_ent_t));
+    disk->writeBlock(children[i].inum, &node);
+  }
+
+  while (children.size() > 1) {
+    vector<dir_ent_t> parents;
+    for (size_t i = 0; i < children.size(); i += fanout) {
+      memset(&node, 0, sizeof(Node));
+      node.leaf = 0;
+      node.count = min(children.size() - i, (size_t)fanout);
+      memcpy(node.entries, children.data() + i, node.count * sizeof(dir_ent_t));
+      parents.push_back(children[i]);
+      parents.back().inum = blocks.back();
+      blocks.pop_back();
+      disk->writeBlock(parents.back().inum, &node);
+    }
+    children.swap(parents);
+  }
+  return children[0].inum;
+}
+
+template <int BlockSize>
+unsigned int DirIndex<BlockSize>::rootBlock() {
+  return root;
+}
+
+template <int BlockSize>
+int DirIndex<BlockSize>::spareBlocksNeeded() {
+  // every level can split once, plus a new root on top
+  int height = 1;
+  Node node;
+  disk->readBlock(root, &node);
+  while (!node.leaf) {
+    disk->readBlock(node.entries[0].inum, &node);
+    height++;
+  }
+  return height + 1;
+}
+
+template <int BlockSize>
+unsigned int DirIndex<BlockSize>::findLeaf(const string &name) {
+  unsigned int block = root;
+  Node node;
+  disk->readBlock(block, &node);
+  while (!node.leaf) {
+    block = node.entries[childIndex(&node, name.c_str())].inum;
+    disk->readBlock(block, &node);
+  }
+  return block;
+}
+
+template <int BlockSize>
+void DirIndex<BlockSize>::insert(const dir_ent_t &entry, vector<unsigned int> &spareBlocks) {
+  dir_ent_t separator;
+  if (!insertInto(root, entry, spareBlocks, &separator)) {
+    return;
+  }
+
+  // the root split, so the tree grows by one level
+  unsigned int newRoot = spareBlocks.back();
+  spareBlocks.pop_back();
+
+  Node node;
+  memset(&node, 0, sizeof(Node));
+  node.leaf = 0;
+  node.count = 2;
+  node.entries[0].inum = root;
+  node.entries[1] = separator;
+  disk->writeBlock(newRoot, &node);
+  root = newRoot;
+}
+
+// Inserts entry in the subtree at block. When the node has to split, the
+// upper half moves to a new node and separator is filled in with its
+// first name and block so the caller can link it in.
+template <int BlockSize>
+bool DirIndex<BlockSize>::insertInto(unsigned int block, const dir_ent_t &entry,
+                          vector<unsigned int> &spareBlocks, dir_ent_t *separator) {
+  Node node;
+  disk->readBlock(block, &node);
+
+  dir_ent_t toInsert = entry;
+  int position;
+  if (node.leaf) {
+    position = upperBound(&node, entry.name);
+  } else {
+    int child = childIndex(&node, entry.name);
+    if (!insertInto(node.entries[child].inum, entry, spareBlocks, &toInsert)) {
+      return false;
+    }
+    position = child + 1;
+  }
+
+  // one extra slot for the entry that makes a full node split
+  vector<dir_ent_t> entries(node.entries, node.entries + node.count);
+  entries.insert(entries.begin() + position, toInsert);
+
+  if (entries.size() <= (size_t)Layout<BlockSize>::indexFanout) {
+    node.count = entries.size();
+    memcpy(node.entries, entries.data(), entries.size() * sizeof(dir_ent_t));
+    disk->writeBlock(block, &node);
+    return false;
+  }
+
+  unsigned int rightBlock = spareBlocks.back();
+  spareBlocks.pop_back();
+  int leftCount = entries.size() / 2;
+
+  Node right;
+  memset(&right, 0, sizeof(Node));
+  right.leaf = node.leaf;
+  right.count = entries.size() - leftCount;
+  memcpy(right.entries, entries.data() + leftCount, right.count * sizeof(dir_ent_t));
+  if (node.leaf) {
+    right.next = node.next;
+    node.next = rightBlock;
+  }
+
+  node.count = leftCount;
+  memset(node.entries, 0, sizeof(node.entries));
+  memcpy(node.entries, entries.data(), leftCount * sizeof(dir_ent_t));
+
+  // the new node goes first so the tree never points at an unwritten block
+  disk->writeBlock(rightBlock, &right);
+  disk->writeBlock(block, &node);
+
+  *separator = right.entries[0];
+  separator->inum = rightBlock;
+  return true;
+}
+
+template <int BlockSize>
+bool DirIndex<BlockSize>::remove(const string &name) {
+  unsigned int block = findLeaf(name);
+  Node node;
+  disk->readBlock(block, &node);
+
+  for (int i = 0; i < node.count; ++i) {
+    if (strcmp(node.entries[i].name, name.c_str()) == 0) {
+      memmove(&node.entries[i], &node.entries[i + 1], (node.count - i - 1) * sizeof(dir_ent_t));
+      node.count--;
+      memset(&node.entries[node.count], 0, sizeof(dir_ent_t));
+      disk->writeBlock(block, &node);
+      return true;
+    }
+  }
+  return false;
+}
+
+template <int BlockSize>
+bool DirIndex<BlockSize>::replace(const dir_ent_t &entry) {
+  unsigned int block = findLeaf(entry.name);
+  Node node;
+  disk->readBlock(block, &node);
+
+  for (int i = 0; i < node.count; ++i) {
+    if (strcmp(node.entries[i].name, entry.name) == 0) {
+      node.entries[i] = entry;
+      disk->writeBlock(block, &node);
+      return true;
+    }
+  }
+  return false;
+}
+
+template <int BlockSize>
+bool DirIndex<BlockSize>::find(const string &name, dir_ent_t *entry) {
+  Node node;
+  disk->readBlock(findLeaf(name), &node);
+
+  for (int i = 0; i < node.count; ++i) {
+    if (strcmp(node.entries[i].name, name.c_str()) == 0) {
+      *entry = node.entries[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+template <int BlockSize>
+void DirIndex<BlockSize>::list(const string &marker, int maxEntries, vector<dir_ent_t> &entries) {
+  entries.clear();
+
+  // start at the leaf that would hold marker and follow the leaf chain
+  unsigned int block = findLeaf(marker);
+  Node node;
+  while (block != 0) {
+    disk->readBlock(block, &node);
+    for (int i = upperBound(&node, marker.c_str()); i < node.count; ++i) {
+      if (maxEntries >= 0 && (int)entries.size() >= maxEntries) {
+        return;
+      }
+      entries.push_back(node.entries[i]);
+    }
+    block = node.next;
+  }
+}
+
+template <int BlockSize>
+void DirIndex<BlockSize>::nodeBlocks(vector<unsigned int> &blocks) {
+  blocks.clear();
+  blocks.push_back(root);
+
+  // the blocks vector doubles as the queue of a breadth first walk
+  Node node;
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    disk->readBlock(blocks[i], &node);
+    if (!node.leaf) {
+      for (int j = 0; j < node.count; ++j) {
+        blocks.push_back(node.entries[j].inum);
+      }
+    }
+  }
+}
+
+UFS_INSTANTIATE_BLOCK_SIZES(DirIndex)
@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "DirScan.h"
+
+using namespace std;
+
+// The fingerprints kept for all directories together
+#define MAX_FINGERPRINT_BYTES (4 << 20)
+
+DirName::DirName(const string &name) {
+  memset(padded, 0, sizeof(padded));
+  // names fill at most all but the terminator of an entry
+  if (name.length() >= DIR_ENT_NAME_SIZE || name.find('\0') != string::npos) {
+    length = -1;
+    compared = 0;
+    print = 0;
+    return;
+  }
+  memcpy(padded, name.data(), name.length());
+  length = name.length();
+  compared = (1u << (length + 1)) - 1;
+  print = fingerprint(name.data(), length);
+}
+
+unsigned char DirName::fingerprint(const char *name, int length) {
+  // FNV-1a, folded into a byte
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < length; ++i) {
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return (unsigned char)(hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24));
+}
+
+void DirName::fingerprints(const dir_ent_t *entries, int count, unsigned char *out) {
+  for (int i = 0; i < count; ++i) {
+    out[i] = fingerprint(entries[i].name, strnlen(entries[i].name, DIR_ENT_NAME_SIZE));
+  }
+}
+
+bool DirName::matches(const dir_ent_t &entry) const {
+#if defined(__SSE2__)
+  // the second half runs into inum, which compared leaves out
+  const unsigned char *bytes = (const unsigned char *)&entry;
+  __m128i low = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)bytes),
+                               _mm_load_si128((const __m128i *)padded));
+  __m128i high = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(bytes + 16)),
+                                _mm_load_si128((const __m128i *)(padded + 16)));
+  unsigned int equal = (unsigned int)_mm_movemask_epi8(low) | ((unsigned int)_mm_movemask_epi8(high) << 16);
+  return (equal & compared) == compared;
+#else
+  return memcmp(entry.name, padded, length + 1) == 0;
+#endif
+}
+
+unsigned int DirName::candidates(const unsigned char *fingerprints, int count) const {
+#if defined(__SSE2__)
+  if (count == 16) {
+    __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)fingerprints), _mm_set1_epi8((char)print));
+    return (unsigned int)_mm_movemask_epi8(equal);
+  }
+#endif
+  unsigned int bits = 0;
+  for (int i = 0; i < count; ++i) {
+    if (fingerprints[i] == print) {
+      bits |= 1u << i;
+    }
+  }
+  return bits;
+}
+
+int DirName::find(const dir_ent_t *entries, int count, const unsigned char *fingerprints) const {
+  if (length < 0) {
+    return -1;
+  }
+  if (fingerprints == NULL) {
+    for (int i = 0; i < count; ++i) {
+      if (matches(entries[i])) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  for (int i = 0; i < count; i += 16) {
+    unsigned int bits = candidates(fingerprints + i, min(16, count - i));
+    while (bits != 0) {
+      int j = i + __builtin_ctz(bits);
+      if (matches(entries[j])) {
+        return j;
+      }
+      bits &= bits - 1;
+    }
+  }
+  return -1;
+}
+
+bool DirName::mayBeIn(const unsigned char *fingerprints, int count) const {
+  if (length < 0) {
+    return false;
+  }
+  for (int i = 0; i < count; i += 16) {
+    if (candidates(fingerprints + i, min(16, count - i)) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+DirFingerprints::DirFingerprints(Disk *disk, int entriesPerBlock) {
+  this->disk = disk;
+  this->entriesPerBlock = entriesPerBlock;
+  this->maxBlocks = MAX_FINGERPRINT_BYTES / entriesPerBlock;
+  this->rollbacks = disk->rollbackCount();
+  pthread_mutex_init(&lock, NULL);
+}
+
+DirFingerprints::~DirFingerprints() {
+  pthread_mutex_destroy(&lock);
+}
+
+bool DirFingerprints::get(unsigned int block, unsigned char *out, int *rollbacksSeen) {
+  int rollbackCount = disk->rollbackCount();
+  pthread_mutex_lock(&lock);
+  if (rollbackCount != rollbacks) {
+    blocks.clear();
+    rollbacks = rollbackCount;
+  }
+  *rollbacksSeen = rollbackCount;
+  map<unsigned int, vector<unsigned char> >::iterator it = blocks.find(block);
+  bool found = it != blocks.end();
+  if (found) {
+    memcpy(out, it->second.data(), entriesPerBlock);
+  }
+  pthread_mutex_unlock(&lock);
+  return found;
+}
+
+void DirFingerprints::set(unsigned int block, const dir_ent_t *entries, int rollbacksSeen) {
+  vector<unsigned char> prints(entriesPerBlock);
+  DirName::fingerprints(entries, entriesPerBlock, prints.data());
+
+  int rollbackCount = disk->rollbackCount();
+  pthread_mutex_lock(&lock);
+  if (rollbackCount != rollbacks) {
+    blocks.clear();
+    rollbacks = rollbackCount;
+  }
+  if (rollbacksSeen != rollbacks) {
+    // what was read may have been rolled back, and the block has to be
+    // dropped in case it was known before
+    blocks.erase(block);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  if (blocks.size() >= maxBlocks && blocks.find(block) == blocks.end()) {
+    blocks.erase(blocks.begin());
+  }
+  blocks[block].swap(prints);
+  pthread_mutex_unlock(&lock);
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <climits>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -10,6 +11,7 @@
 #include <sys/mman.h>
 
 #include "Disk.h"
+#include "BlockLog.h"
 #include "dthread.h"
 
 using namespace std;
@@ -17,6 +19,12 @@ using namespace std;
 Disk::Disk(string imageFile, int blockSize) {
   this->imageFile = imageFile;
   this->blockSize = blockSize;
+  this->isInTransaction = false;
+  this->rollbacks = 0;
+  this->log = NULL;
+  this->linked = NULL;
+  pthread_mutex_init(&this->transactionLock, NULL);
+  pthread_cond_init(&this->transactionEnded, NULL);
 
   struct stat stat;
   int imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
@@ -40,18 +48,35 @@ Disk::Disk(string imageFile, int blockSize) {
     cerr << "  imageSize % blockSize: " << this->imageFileSize % this->blockSize << endl;
     exit(1);
   }
-  
+  // block numbers are ints here and 32 bits on disk
+  if (this->imageFileSize / this->blockSize > INT_MAX) {
+    cerr << "Your disk image has more than " << INT_MAX << " blocks" << endl;
+    exit(1);
+  }
+
 }
 
 int Disk::numberOfBlocks() {
   return this->imageFileSize / this->blockSize;
 }
 
+void Disk::setLog(BlockLog *log) {
+  this->log = log;
+}
+
+void Disk::linkTransactions(Disk *other) {
+  this->linked = other;
+}
+
 void Disk::readBlock(int blockNumber, void *buffer) {
-  if (blockNumber < 0 || blockNumber > this->numberOfBlocks()) {
+  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
+  if (log != NULL) {
+    log->readBlock(blockNumber, buffer);
+    return;
+  }
 
   int fd = open(this->imageFile.c_str(), O_RDONLY);
   if (fd < 0) {
@@ -59,15 +84,14 @@ void Disk::readBlock(int blockNumber, void *buffer) {
     exit(1);
   }
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
+  off_t offset = (off_t)blockNumber * this->blockSize;
+  if (lseek(fd, offset, SEEK_SET) != offset) {
     perror("read::lseek");
     cerr << "Could not seek to file" << endl;
     exit(1);
   }
 
-  ret = read(fd, buffer, this->blockSize);
+  int ret = read(fd, buffer, this->blockSize);
   if (ret != this->blockSize) {
     cerr << "Could not read file" << endl;
     exit(1);
@@ -76,35 +100,79 @@ void Disk::readBlock(int blockNumber, void *buffer) {
   close(fd);
 }
 
+void Disk::readBlocks(int blockNumber, int count, void *buffer) {
+  if (blockNumber < 0 || count < 0 || (long long)blockNumber + count > this->numberOfBlocks()) {
+    cerr << "Invalid block range " << blockNumber << " + " << count << endl;
+    exit(1);
+  }
+  if (log != NULL) {
+    log->readBlocks(blockNumber, count, buffer);
+    return;
+  }
+
+  int fd = open(this->imageFile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Could not open image file " << this->imageFile << endl;
+    exit(1);
+  }
+
+  // one sequential read for the whole range, in pieces only if the kernel
+  // returns less than was asked for
+  off_t offset = (off_t)blockNumber * this->blockSize;
+  size_t remaining = (size_t)count * this->blockSize;
+  char *out = (char *)buffer;
+  while (remaining > 0) {
+    ssize_t ret = pread(fd, out, remaining, offset);
+    if (ret <= 0) {
+      cerr << "Could not read file" << endl;
+      exit(1);
+    }
+    out += ret;
+    offset += ret;
+    remaining -= ret;
+  }
+
+  close(fd);
+}
+
 void Disk::writeBlock(int blockNumber, void *buffer) {  
-  if (blockNumber < 0 || blockNumber > this->numberOfBlocks()) {
+  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
+  // the log keeps what a transaction wrote until it ends, so there is
+  // nothing to undo
+  if (log != NULL) {
+    log->writeBlock(blockNumber, buffer, ownsTransaction());
+    return;
+  }
 
-  if (isInTransaction) {
+  // the undo log is only touched by the thread that owns it
+  if (ownsTransaction()) {
     struct UndoRecord undoRecord;
     undoRecord.blockNumber = blockNumber;
     undoRecord.blockData = new unsigned char[blockSize];
     this->readBlock(blockNumber, undoRecord.blockData);
     undoLog.push_front(undoRecord);
   }
-  
+  storeBlock(blockNumber, buffer);
+}
+
+void Disk::storeBlock(int blockNumber, void *buffer) {
   int fd = open(this->imageFile.c_str(), O_RDWR);
   if (fd < 0) {
     cerr << "Could not open image file " << this->imageFile << endl;
     exit(1);
   }
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
-  if (ret != offset) {
+  off_t offset = (off_t)blockNumber * this->blockSize;
+  if (lseek(fd, offset, SEEK_SET) != offset) {
     perror("write::lseek");
     cerr << "Could not seek to file" << endl;
     exit(1);
   }
 
-  ret = write(fd, buffer, this->blockSize);
+  int ret = write(fd, buffer, this->blockSize);
   if (ret != this->blockSize) {
     cerr << "Could not write file" << endl;
     exit(1);
@@ -113,29 +181,78 @@ void Disk::writeBlock(int blockNumber, void *buffer) {
   close(fd);
 }
 
+bool Disk::ownsTransaction() {
+  pthread_mutex_lock(&transactionLock);
+  bool owns = isInTransaction && pthread_equal(transactionOwner, pthread_self());
+  pthread_mutex_unlock(&transactionLock);
+  return owns;
+}
+
 void Disk::beginTransaction() {
-  if (isInTransaction) {
+  pthread_mutex_lock(&transactionLock);
+  if (isInTransaction && pthread_equal(transactionOwner, pthread_self())) {
     cerr << "You can't start a new transaction: one already exists" << endl;
     exit(1);
   }
+  while (isInTransaction) {
+    pthread_cond_wait(&transactionEnded, &transactionLock);
+  }
   isInTransaction = true;
+  transactionOwner = pthread_self();
+  pthread_mutex_unlock(&transactionLock);
+  if (linked != NULL) {
+    linked->beginTransaction();
+  }
 }
 
 void Disk::commit() {
-  isInTransaction = false;
+  if (!ownsTransaction()) {
+    return;
+  }
+  if (linked != NULL) {
+    linked->commit();
+  }
+  if (log != NULL) {
+    log->commit();
+  }
   deque<struct UndoRecord>::iterator iter;
   for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
     delete [] iter->blockData;
   }
   undoLog.clear();
+  pthread_mutex_lock(&transactionLock);
+  isInTransaction = false;
+  pthread_cond_broadcast(&transactionEnded);
+  pthread_mutex_unlock(&transactionLock);
 }
 
 void Disk::rollback() {
-  isInTransaction = false;
+  if (!ownsTransaction()) {
+    return;
+  }
+  if (linked != NULL) {
+    linked->rollback();
+  }
+  if (log != NULL) {
+    log->rollback();
+  }
+  // the old contents go back before another thread can start writing
   deque<struct UndoRecord>::iterator iter;
   for (iter = undoLog.begin(); iter != undoLog.end(); iter++) {
-    this->writeBlock(iter->blockNumber, iter->blockData);
+    this->storeBlock(iter->blockNumber, iter->blockData);
     delete [] iter->blockData;
   }
   undoLog.clear();
+  pthread_mutex_lock(&transactionLock);
+  isInTransaction = false;
+  rollbacks++;
+  pthread_cond_broadcast(&transactionEnded);
+  pthread_mutex_unlock(&transactionLock);
+}
+
+int Disk::rollbackCount() {
+  pthread_mutex_lock(&transactionLock);
+  int count = rollbacks;
+  pthread_mutex_unlock(&transactionLock);
+  return count;
 }
@@ -18,8 +18,31 @@ using namespace std;
 
 
 
-DistributedFileSystemService::DistributedFileSystemService(string diskFile) : HttpService("/ds3/") {
-  this->fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE));
+DistributedFileSystemService::DistributedFileSystemService(string diskFile, const WriteBackOptions &writeBack,
+                                                           const TieringOptions &tiering)
+  : HttpService("/ds3/") {
+  this->fileSystem = LocalFileSystem::mount(diskFile);
+  if (this->fileSystem == NULL) {
+    cerr << diskFile << " has a block size this server doesn't support" << endl;
+    exit(1);
+  }
+  // the cold tier comes first, since flushing the journal and freeing
+  // orphans can release cold blocks
+  super_t super;
+  this->fileSystem->readSuperBlock(&super);
+  if (!tiering.coldImageFile.empty()) {
+    if (this->fileSystem->attachColdTier(tiering.coldImageFile) < 0) {
+      cerr << tiering.coldImageFile << " is not a cold tier " << diskFile << " can use" << endl;
+      exit(1);
+    }
+  } else if (super.features & UFS_FEATURE_TIERED) {
+    cerr << diskFile << " has files in a cold tier, start with -c" << endl;
+    exit(1);
+  }
+  this->fileSystem->setWriteBack(writeBack);
+  this->fileSystem->startReclaimer();
+  this->fileSystem->startZeroer();
+  this->fileSystem->startMigrator(tiering);
 }  
 
 vector<string> handleGetPath(const string &path) {
@@ -37,28 +60,65 @@ vector<string> handleGetPath(const string &path) {
     return components;
 }
 
-void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response) {
-  // Extract and validate path
-  vector<string> components = handleGetPath(request->getPath());
+// Snapshots live under /ds3/.snapshots/ and are read only, apart from
+// taking one with POST and deleting one with DELETE, which this routes to
+// the snapshot calls. path is below /ds3/. Everything else that writes
+// resolves its path with RESOLVE_NO_SNAPSHOTS, which keeps it out of the
+// snapshots however the path is spelled.
+bool isSnapshotPath(const string &path) {
+  size_t start = path.find_first_not_of('/');
+  if (start == string::npos) {
+    return false;
+  }
+  size_t end = path.find('/', start);
+  return path.compare(start, end == string::npos ? string::npos : end - start, UFS_SNAPSHOT_DIR) == 0;
+}
 
-  // Traverse the directory structure to find the target file or directory
-  int currentInodeNum = UFS_ROOT_DIRECTORY_INODE_NUMBER;
-  LocalFileSystem *fs = this->fileSystem;
+// Whether a path below /ds3/ names nothing but the root
+bool isRootPath(const string &path) {
+  return path.find_first_not_of('/') == string::npos;
+}
 
-  // Check if it exists
-  for (size_t i = 0; i < components.size(); ++i) {
-    int nextInodeNum = fs->lookup(currentInodeNum, components[i]);
-    if (nextInodeNum < 0) {
-      throw ClientError::notFound();
-    }
-    currentInodeNum = nextInodeNum;
+// Maps the errors from resolving a path that has to be there to a
+// client error
+ClientError resolveError(int ret) {
+  if (ret == -EINVALIDNAME) {
+    return ClientError::badRequest();
+  }
+  if (ret == -ENOTSUPPORTED) {
+    return ClientError::forbidden();
   }
+  return ClientError::notFound();
+}
 
-  // Load the inode information
-  inode_t targetInode;
-  if (fs->stat(currentInodeNum, &targetInode) != 0) {
-    throw ClientError::notFound();
+// Maps the errors from resolving a path with RESOLVE_MAKE_DIRS to a
+// client error
+ClientError makeDirsError(int ret) {
+  if (ret == -EINVALIDTYPE) {
+    return ClientError::conflict();
+  }
+  if (ret == -EINVALIDNAME) {
+    return ClientError::badRequest();
+  }
+  if (ret == -ENOTSUPPORTED) {
+    return ClientError::forbidden();
+  }
+  return ClientError::insufficientStorage();
+}
+
+void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response) {
+  // delayed allocation flushes between requests, never inside a transaction
+  this->fileSystem->flushExpired();
+  // Find the target file or directory, which comes with its inode
+  string path = request->getPath().substr(this->pathPrefix().size());
+  LocalFileSystem *fs = this->fileSystem;
+  ResolvedPath target;
+  int ret = fs->resolve(path, 0, &target);
+  if (ret < 0 || target.inodeNumber < 0) {
+    throw resolveError(ret);
   }
+  int currentInodeNum = target.inodeNumber;
+  const inode_t &targetInode = target.inode;
 
   if (targetInode.type == UFS_REGULAR_FILE) {
     // Allocate buffer dynamically to handle large files
@@ -69,47 +129,45 @@ void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *respo
     }
     response->setBody(string(reinterpret_cast<char*>(buffer.data()), bytesRead));
   } else if (targetInode.type == UFS_DIRECTORY) {
-    vector<string> entries;
-    unsigned char blockBuffer[UFS_BLOCK_SIZE];
-    // Calculate # of blocks it used
-    int numBlocks = targetInode.size / UFS_BLOCK_SIZE;
-    if ((targetInode.size % UFS_BLOCK_SIZE) != 0) {
-      numBlocks += 1;
-    }
-
-    for (int i = 0; i < numBlocks; ++i) {
-      if (targetInode.direct[i] != 0) {
-        fs->disk->readBlock(targetInode.direct[i], blockBuffer);
-        dir_ent_t* dirEntries = (dir_ent_t*)(blockBuffer);
-
-        // Blocks can have different # of entries
-        int numEntries = (targetInode.size % UFS_BLOCK_SIZE) / sizeof(dir_ent_t);
-        if (i == numBlocks - 1) { // in case the last block is not full
-          numEntries = (targetInode.size % UFS_BLOCK_SIZE) / sizeof(dir_ent_t);
-        } else {
-          numEntries = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
-        }
-
-        // for every entry in a block
-        for (int j = 0; j < numEntries; ++j) {
-          if (strcmp(dirEntries[j].name, ".") != 0 && strcmp(dirEntries[j].name, "..") != 0) {
-            inode_t entryInode;
-            string entryName = dirEntries[j].name;
-            if (fs->stat(dirEntries[j].inum, &entryInode) == 0) {
-              if (entryInode.type == UFS_DIRECTORY) { // if entry is a dir, add '/' then list
-                entryName += "/";
-              }
-              entries.push_back(entryName);
-            }
-          }
-        }
+    // Listings come back in name order, and big directories can be paged
+    // with ?max-keys=<n>&marker=<last name of the previous page>
+    map<string, string> params = request->getParams();
+    string marker = params["marker"];
+    int maxKeys = -1;
+    if (params.count("max-keys") > 0) {
+      char *end = NULL;
+      maxKeys = strtol(params["max-keys"].c_str(), &end, 10);
+      if (params["max-keys"].empty() || *end != '\0' || maxKeys < 0) {
+        throw ClientError::badRequest();
       }
     }
 
-    sort(entries.begin(), entries.end());
+    // '.' and '..' get skipped, and one more entry than asked for tells us
+    // whether there is another page
+    int limit = maxKeys < 0 ? -1 : maxKeys + 3;
+    vector<DirEntry> dirEntries;
+    if (fs->readdirSorted(currentInodeNum, marker, limit, dirEntries) < 0) {
+      throw ClientError::notFound();
+    }
+
     string body;
-    for (const auto& entry : entries) {
-      body += entry + "\n";
+    string lastName = marker;
+    int listed = 0;
+    for (const auto& dirEntry : dirEntries) {
+      if (dirEntry.name == "." || dirEntry.name == "..") {
+        continue;
+      }
+      if (maxKeys >= 0 && listed == maxKeys) {
+        response->setHeader("X-Next-Marker", lastName);
+        break;
+      }
+      body += dirEntry.name;
+      if (dirEntry.type == UFS_DIRECTORY) { // if entry is a dir, add '/' then list
+        body += "/";
+      }
+      body += "\n";
+      lastName = dirEntry.name;
+      listed++;
     }
     response->setBody(body);
   } else { // not supported type
@@ -122,96 +180,256 @@ void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *respo
 
 
 void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *response) {
+  this->fileSystem->flushExpired();
   // Extract and validate path
-  this->fileSystem->disk->beginTransaction();
-  vector<string> components = handleGetPath(request->getPath());
+  string path = request->getPath().substr(this->pathPrefix().size());
+  if (isRootPath(path)) {
+    throw ClientError::badRequest();
+  }
 
   // Extract the data from the request
   string data = request->getBody();
+  LocalFileSystem *fs = this->fileSystem;
+
+  this->fileSystem->disk->beginTransaction();
+  try {
+    // One pass down the path makes the directories that aren't there
+    // and finds out whether the file is
+    ResolvedPath target;
+    int ret = fs->resolve(path, RESOLVE_MAKE_DIRS | RESOLVE_NO_SNAPSHOTS, &target);
+    if (ret < 0) {
+      throw makeDirsError(ret);
+    }
 
-  // Traverse the directory structure and create directories if needed
-  int currentInodeNum = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+    if (target.inodeNumber >= 0) {
+      // File exists, overwrite it
+      if (fs->write(target.inodeNumber, data.c_str(), data.size()) < 0) {
+        throw ClientError::insufficientStorage();
+      }
+    } else {
+      // Create a new file
+      int newFileInodeNum = fs->create(target.parent, UFS_REGULAR_FILE, target.name);
+      if (newFileInodeNum < 0) {
+        throw ClientError::insufficientStorage();
+      }
+
+      if (fs->write(newFileInodeNum, data.c_str(), data.size()) < 0) {
+        throw ClientError::insufficientStorage();
+      }
+    }
+  } catch (ClientError &) {
+    this->fileSystem->disk->rollback(); // Roll back on error
+    throw;
+  }
+
+  // Set the response status to 200 OK
+  this->fileSystem->disk->commit();
+  response->setStatus(200);
+}
+
+// Maps the errors from append and truncate to a client error
+ClientError sizeChangeError(int ret) {
+  if (ret == -ENOTENOUGHSPACE) {
+    return ClientError::insufficientStorage();
+  }
+  return ClientError::badRequest();
+}
+
+void DistributedFileSystemService::post(HTTPRequest *request, HTTPResponse *response) {
+  this->fileSystem->flushExpired();
+  string path = request->getPath().substr(this->pathPrefix().size());
+  if (isRootPath(path)) {
+    throw ClientError::badRequest();
+  }
+
+  map<string, string> params = request->getParams();
   LocalFileSystem *fs = this->fileSystem;
 
-  for (size_t i = 0; i < components.size() - 1; ++i) {
-    // iterately look for the next directory
-    int nextInodeNum = fs->lookup(currentInodeNum, components[i]);
-    if (nextInodeNum < 0) { // entry does not exist, create it
-      if (nextInodeNum == -ENOTFOUND) {
-        int newDirInodeNum = fs->create(currentInodeNum, UFS_DIRECTORY, components[i]);
-        if (newDirInodeNum < 0) {
-          this->fileSystem->disk->rollback(); // Roll back on error
+  if (isSnapshotPath(path)) {
+    // POST /ds3/.snapshots/<name> takes a snapshot of everything else
+    vector<string> components = handleGetPath(request->getPath());
+    if (components.size() != 2 || !params.empty()) {
+      throw ClientError::forbidden();
+    }
+    fs->sync();
+    this->fileSystem->disk->beginTransaction();
+    int ret = fs->snapshot(components[1]);
+    if (ret < 0) {
+      this->fileSystem->disk->rollback();
+      if (ret == -EINVALIDNAME) {
+        throw ClientError::conflict();
+      }
+      throw sizeChangeError(ret);
+    }
+    this->fileSystem->disk->commit();
+  } else if (params.count("append") > 0) {
+    // POST /ds3/path?append adds the body to the end of the object, and
+    // creates the object and its directories like PUT if it's missing
+    string data = request->getBody();
+    this->fileSystem->disk->beginTransaction();
+    try {
+      ResolvedPath target;
+      int ret = fs->resolve(path, RESOLVE_MAKE_DIRS | RESOLVE_NO_SNAPSHOTS, &target);
+      if (ret < 0) {
+        throw makeDirsError(ret);
+      }
+      int fileInode = target.inodeNumber;
+      if (fileInode < 0) {
+        fileInode = fs->create(target.parent, UFS_REGULAR_FILE, target.name);
+        if (fileInode < 0) {
           throw ClientError::insufficientStorage();
         }
-        currentInodeNum = newDirInodeNum;
-      } else {
-        throw ClientError::badRequest();
       }
-    } else { // entry exists, check for if it's a directory
-      inode_t inode;
-      if (fs->stat(nextInodeNum, &inode) < 0 || inode.type != UFS_DIRECTORY) {
-        throw ClientError::conflict();
+      ret = fs->append(fileInode, data.c_str(), data.size());
+      if (ret < 0) {
+        throw sizeChangeError(ret);
       }
-      currentInodeNum = nextInodeNum;
+    } catch (ClientError &) {
+      this->fileSystem->disk->rollback();
+      throw;
+    }
+    this->fileSystem->disk->commit();
+  } else if (params.count("truncate") > 0) {
+    // POST /ds3/path?truncate=N sets the size of an existing object to N
+    const string &sizeParam = params["truncate"];
+    char *end = NULL;
+    long size = strtol(sizeParam.c_str(), &end, 10);
+    if (sizeParam.empty() || *end != '\0' || size < 0 || size > fs->maxFileSize()) {
+      throw ClientError::badRequest();
     }
-  }
 
-  // Get the file name
-  string fileName = components[components.size() - 1];
+    ResolvedPath target;
+    int ret = fs->resolve(path, RESOLVE_NO_SNAPSHOTS, &target);
+    if (ret < 0 || target.inodeNumber < 0) {
+      throw resolveError(ret);
+    }
 
-  // Check if the final path component already exists as a file or directory
-  int fileInode = fs->lookup(currentInodeNum, fileName);
-  if (fileInode > 0) {
-    // File exists, overwrite it
-    if (fs->write(fileInode, data.c_str(), data.size()) < 0) {
-      this->fileSystem->disk->rollback(); // Roll back on error
-      throw ClientError::insufficientStorage();
+    this->fileSystem->disk->beginTransaction();
+    ret = fs->truncate(target.inodeNumber, size);
+    if (ret < 0) {
+      this->fileSystem->disk->rollback();
+      throw sizeChangeError(ret);
     }
+    this->fileSystem->disk->commit();
   } else {
-    // Create a new file
-    int newFileInodeNum = fs->create(currentInodeNum, UFS_REGULAR_FILE, fileName);
-    if (newFileInodeNum < 0) {
-      this->fileSystem->disk->rollback(); // Roll back on error
-      throw ClientError::insufficientStorage();
-    }
-    
-    if (fs->write(newFileInodeNum, data.c_str(), data.size()) < 0) {
-      this->fileSystem->disk->rollback(); // Roll back on error
-      throw ClientError::insufficientStorage();
+    throw ClientError::badRequest();
+  }
+
+  response->setStatus(200);
+}
+
+
+
+// Maps the errors from rename to a client error
+ClientError renameError(int ret) {
+  switch (ret) {
+  case -ENOTFOUND:
+    return ClientError::notFound();
+  case -EINVALIDTYPE:
+  case -EDIRNOTEMPTY:
+    return ClientError::conflict();
+  case -ENOTENOUGHSPACE:
+    return ClientError::insufficientStorage();
+  default:
+    return ClientError::badRequest();
+  }
+}
+
+void DistributedFileSystemService::move(HTTPRequest *request, HTTPResponse *response) {
+  this->fileSystem->flushExpired();
+  string path = request->getPath().substr(this->pathPrefix().size());
+  if (isRootPath(path)) {
+    throw ClientError::badRequest();
+  }
+
+  // MOVE /ds3/a/b.txt with a "Destination: /ds3/c/d.txt" header. Clients
+  // following WebDAV send a full URL, so drop the scheme and host.
+  string destination;
+  try {
+    destination = request->getHeader("Destination");
+  } catch (...) {
+    try {
+      destination = request->getHeader("destination");
+    } catch (...) {
+      throw ClientError::badRequest();
     }
   }
+  size_t schemeEnd = destination.find("://");
+  if (schemeEnd != string::npos) {
+    size_t pathStart = destination.find('/', schemeEnd + 3);
+    destination = pathStart == string::npos ? "/" : destination.substr(pathStart);
+  }
+  if (destination.compare(0, this->pathPrefix().size(), this->pathPrefix()) != 0) {
+    throw ClientError::badRequest();
+  }
+  string dstPath = destination.substr(this->pathPrefix().size());
+  if (isRootPath(dstPath)) {
+    throw ClientError::badRequest();
+  }
+  // rename finds out whether the source itself is there
+  LocalFileSystem *fs = this->fileSystem;
+  ResolvedPath src;
+  int ret = fs->resolve(path, RESOLVE_NO_SNAPSHOTS, &src);
+  if (ret < 0) {
+    throw resolveError(ret);
+  }
 
-  // Set the response status to 200 OK
+  // Missing directories on the destination side get created like PUT
+  // does, in the same transaction as the move itself
+  this->fileSystem->disk->beginTransaction();
+  try {
+    ResolvedPath dst;
+    ret = fs->resolve(dstPath, RESOLVE_MAKE_DIRS | RESOLVE_NO_SNAPSHOTS, &dst);
+    if (ret < 0) {
+      throw makeDirsError(ret);
+    }
+    ret = fs->rename(src.parent, src.name, dst.parent, dst.name);
+    if (ret < 0) {
+      throw renameError(ret);
+    }
+  } catch (ClientError &) {
+    this->fileSystem->disk->rollback();
+    throw;
+  }
   this->fileSystem->disk->commit();
+
   response->setStatus(200);
 }
 
 
 
-
 void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *response) {
-    vector<string> components = handleGetPath(request->getPath());
-    if (components.empty()) {
+    this->fileSystem->flushExpired();
+    string path = request->getPath().substr(this->pathPrefix().size());
+    if (isRootPath(path)) {
         throw ClientError::badRequest();
     }
 
-    int currentInodeNum = UFS_ROOT_DIRECTORY_INODE_NUMBER;
-    int parentInodeNum = currentInodeNum;
-
-    // a b c.txt
-    for (size_t i = 0; i < components.size(); ++i) {
-        parentInodeNum = currentInodeNum;
-        currentInodeNum = this->fileSystem->lookup(currentInodeNum, components[i]);
-        if (currentInodeNum < 0) {
-            this->fileSystem->disk->rollback(); // Roll back on error
+    if (isSnapshotPath(path)) {
+        // DELETE /ds3/.snapshots/<name> drops a whole snapshot
+        vector<string> components = handleGetPath(request->getPath());
+        if (components.size() != 2) {
+            throw ClientError::forbidden();
+        }
+        this->fileSystem->disk->beginTransaction();
+        if (this->fileSystem->deleteSnapshot(components[1]) < 0) {
+            this->fileSystem->disk->rollback();
             throw ClientError::notFound();
         }
+        this->fileSystem->disk->commit();
+        response->setStatus(200);
+        return;
+    }
+
+    ResolvedPath target;
+    int ret = this->fileSystem->resolve(path, RESOLVE_NO_SNAPSHOTS, &target);
+    if (ret < 0 || target.inodeNumber < 0) {
+        throw resolveError(ret);
     }
 
-    string entryName = components.back();
     // Start the transaction before making changes
     this->fileSystem->disk->beginTransaction();
-    int ret = this->fileSystem->unlink(parentInodeNum, entryName);
+    ret = this->fileSystem->unlink(target.parent, target.name);
     if (ret != 0) {
         this->fileSystem->disk->rollback(); // Roll back on error
         throw ClientError::badRequest();
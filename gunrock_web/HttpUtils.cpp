@@ -15,6 +15,10 @@ map<string, string> HttpUtils::params(string query) {
   for (unsigned idx = 0; idx < pairs.size(); idx++) {
     string param = pairs[idx];
     vector<string> elements = split(param, '=');
+    if (elements.size() == 1 && param.find('=') == string::npos) {
+      // flag style parameters like ?append have no value
+      elements.push_back("");
+    }
     if (elements.size() != 2) {
       throw MalformedQueryString(query);
     }
@@ -0,0 +1,212 @@
+#include <iostream>
+#include <map>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "InodeLocks.h"
+
+using namespace std;
+
+// What the calling thread holds of one InodeLocks, so it can lock things
+// again without waiting on itself
+struct HeldLocks {
+  HeldLocks() : fileSystemDepth(0), fileSystemExclusive(false), allocationDepth(0),
+                allocationExclusive(false), group(-1), groupDepth(0) {}
+  int fileSystemDepth;
+  bool fileSystemExclusive;
+  map<int, pair<int, bool> > inodes;  // depth and whether it's exclusive
+  int allocationDepth;
+  bool allocationExclusive;
+  int group;  // the one group held, or -1
+  int groupDepth;
+};
+
+static thread_local map<const InodeLocks *, HeldLocks> heldLocks;
+
+static void checkLock(int ret, const char *operation) {
+  if (ret != 0) {
+    cerr << operation << " failed: " << ret << endl;
+    exit(1);
+  }
+}
+
+InodeLocks::InodeLocks() {
+  checkLock(pthread_rwlock_init(&fileSystemLock, NULL), "pthread_rwlock_init");
+  checkLock(pthread_mutex_init(&renameLock, NULL), "pthread_mutex_init");
+  checkLock(pthread_mutex_init(&tableLock, NULL), "pthread_mutex_init");
+
+  // threads allocating in groups hold it shared most of the time, so
+  // calls that need all of them would wait forever if readers went first
+  pthread_rwlockattr_t writerFirst;
+  pthread_rwlockattr_init(&writerFirst);
+  pthread_rwlockattr_setkind_np(&writerFirst, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  checkLock(pthread_rwlock_init(&allocationLock, &writerFirst), "pthread_rwlock_init");
+  pthread_rwlockattr_destroy(&writerFirst);
+  setGroupCount(1);
+}
+
+InodeLocks::~InodeLocks() {
+  pthread_rwlock_destroy(&fileSystemLock);
+  pthread_mutex_destroy(&renameLock);
+  pthread_rwlock_destroy(&allocationLock);
+  pthread_mutex_destroy(&tableLock);
+  for (size_t i = 0; i < groupLocks.size(); ++i) {
+    pthread_mutex_destroy(&groupLocks[i]);
+  }
+  for (map<int, Entry *>::iterator it = inodeLocks.begin(); it != inodeLocks.end(); ++it) {
+    pthread_rwlock_destroy(&it->second->lock);
+    delete it->second;
+  }
+}
+
+void InodeLocks::lockFileSystem(bool exclusive) {
+  HeldLocks &held = heldLocks[this];
+  if (held.fileSystemDepth > 0) {
+    assert(!exclusive || held.fileSystemExclusive);
+    held.fileSystemDepth++;
+    return;
+  }
+  if (exclusive) {
+    checkLock(pthread_rwlock_wrlock(&fileSystemLock), "pthread_rwlock_wrlock");
+  } else {
+    checkLock(pthread_rwlock_rdlock(&fileSystemLock), "pthread_rwlock_rdlock");
+  }
+  held.fileSystemDepth = 1;
+  held.fileSystemExclusive = exclusive;
+}
+
+void InodeLocks::unlockFileSystem() {
+  HeldLocks &held = heldLocks[this];
+  assert(held.fileSystemDepth > 0);
+  if (--held.fileSystemDepth == 0) {
+    held.fileSystemExclusive = false;
+    checkLock(pthread_rwlock_unlock(&fileSystemLock), "pthread_rwlock_unlock");
+  }
+}
+
+void InodeLocks::lockRename() {
+  checkLock(pthread_mutex_lock(&renameLock), "pthread_mutex_lock");
+}
+
+void InodeLocks::unlockRename() {
+  checkLock(pthread_mutex_unlock(&renameLock), "pthread_mutex_unlock");
+}
+
+void InodeLocks::lockInode(int inodeNumber, bool exclusive) {
+  HeldLocks &held = heldLocks[this];
+  // nobody else is in the file system
+  if (held.fileSystemExclusive) {
+    return;
+  }
+  map<int, pair<int, bool> >::iterator it = held.inodes.find(inodeNumber);
+  if (it != held.inodes.end()) {
+    assert(!exclusive || it->second.second);
+    it->second.first++;
+    return;
+  }
+
+  checkLock(pthread_mutex_lock(&tableLock), "pthread_mutex_lock");
+  Entry *entry = inodeLocks[inodeNumber];
+  if (entry == NULL) {
+    entry = new Entry;
+    checkLock(pthread_rwlock_init(&entry->lock, NULL), "pthread_rwlock_init");
+    entry->users = 0;
+    inodeLocks[inodeNumber] = entry;
+  }
+  entry->users++;
+  checkLock(pthread_mutex_unlock(&tableLock), "pthread_mutex_unlock");
+
+  if (exclusive) {
+    checkLock(pthread_rwlock_wrlock(&entry->lock), "pthread_rwlock_wrlock");
+  } else {
+    checkLock(pthread_rwlock_rdlock(&entry->lock), "pthread_rwlock_rdlock");
+  }
+  held.inodes[inodeNumber] = make_pair(1, exclusive);
+}
+
+void InodeLocks::unlockInode(int inodeNumber) {
+  HeldLocks &held = heldLocks[this];
+  if (held.fileSystemExclusive) {
+    return;
+  }
+  map<int, pair<int, bool> >::iterator it = held.inodes.find(inodeNumber);
+  assert(it != held.inodes.end());
+  if (--it->second.first > 0) {
+    return;
+  }
+  held.inodes.erase(it);
+
+  checkLock(pthread_mutex_lock(&tableLock), "pthread_mutex_lock");
+  Entry *entry = inodeLocks[inodeNumber];
+  checkLock(pthread_rwlock_unlock(&entry->lock), "pthread_rwlock_unlock");
+  if (--entry->users == 0) {
+    pthread_rwlock_destroy(&entry->lock);
+    delete entry;
+    inodeLocks.erase(inodeNumber);
+  }
+  checkLock(pthread_mutex_unlock(&tableLock), "pthread_mutex_unlock");
+}
+
+void InodeLocks::lockAllocation(bool exclusive) {
+  HeldLocks &held = heldLocks[this];
+  if (held.allocationDepth > 0) {
+    assert(!exclusive || held.allocationExclusive);
+    held.allocationDepth++;
+    return;
+  }
+  if (exclusive) {
+    checkLock(pthread_rwlock_wrlock(&allocationLock), "pthread_rwlock_wrlock");
+  } else {
+    checkLock(pthread_rwlock_rdlock(&allocationLock), "pthread_rwlock_rdlock");
+  }
+  held.allocationDepth = 1;
+  held.allocationExclusive = exclusive;
+}
+
+void InodeLocks::unlockAllocation() {
+  HeldLocks &held = heldLocks[this];
+  assert(held.allocationDepth > 0);
+  if (--held.allocationDepth == 0) {
+    assert(held.group < 0);
+    held.allocationExclusive = false;
+    checkLock(pthread_rwlock_unlock(&allocationLock), "pthread_rwlock_unlock");
+  }
+}
+
+void InodeLocks::setGroupCount(int count) {
+  for (size_t i = 0; i < groupLocks.size(); ++i) {
+    pthread_mutex_destroy(&groupLocks[i]);
+  }
+  groupLocks.resize(count);
+  for (int i = 0; i < count; ++i) {
+    checkLock(pthread_mutex_init(&groupLocks[i], NULL), "pthread_mutex_init");
+  }
+}
+
+bool InodeLocks::lockGroup(int group) {
+  HeldLocks &held = heldLocks[this];
+  assert(held.allocationDepth > 0);
+  // nobody else is allocating
+  if (held.allocationExclusive) {
+    return false;
+  }
+  // one group at a time, so groups need no order
+  if (held.group == group) {
+    held.groupDepth++;
+    return true;
+  }
+  assert(held.group < 0);
+  checkLock(pthread_mutex_lock(&groupLocks[group]), "pthread_mutex_lock");
+  held.group = group;
+  held.groupDepth = 1;
+  return true;
+}
+
+void InodeLocks::unlockGroup(int group) {
+  HeldLocks &held = heldLocks[this];
+  assert(held.group == group);
+  if (--held.groupDepth == 0) {
+    held.group = -1;
+    checkLock(pthread_mutex_unlock(&groupLocks[group]), "pthread_mutex_unlock");
+  }
+}
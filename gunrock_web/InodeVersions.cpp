@@ -0,0 +1,63 @@
+#include "InodeVersions.h"
+
+using namespace std;
+
+InodeVersions::InodeVersions() {
+  epoch = 0;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&unpinned, NULL);
+}
+
+InodeVersions::~InodeVersions() {
+  pthread_cond_destroy(&unpinned);
+  pthread_mutex_destroy(&lock);
+}
+
+long long InodeVersions::pin(int inodeNumber) {
+  pthread_mutex_lock(&lock);
+  long long pinned = epoch;
+  readers[inodeNumber][pinned]++;
+  pthread_mutex_unlock(&lock);
+  return pinned;
+}
+
+void InodeVersions::unpin(int inodeNumber, long long pinned) {
+  pthread_mutex_lock(&lock);
+  map<int, map<long long, int> >::iterator it = readers.find(inodeNumber);
+  if (--it->second[pinned] == 0) {
+    it->second.erase(pinned);
+    if (it->second.empty()) {
+      readers.erase(it);
+    }
+    pthread_cond_broadcast(&unpinned);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void InodeVersions::waitForReaders(int inodeNumber) {
+  pthread_mutex_lock(&lock);
+  long long current = ++epoch;
+  // the epochs of an inode's readers are in order, so the oldest says it
+  for (;;) {
+    map<int, map<long long, int> >::iterator it = readers.find(inodeNumber);
+    if (it == readers.end() || it->second.begin()->first >= current) {
+      break;
+    }
+    pthread_cond_wait(&unpinned, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+long long InodeVersions::generation(int inodeNumber) {
+  pthread_mutex_lock(&lock);
+  map<int, long long>::iterator it = generations.find(inodeNumber);
+  long long current = it != generations.end() ? it->second : 0;
+  pthread_mutex_unlock(&lock);
+  return current;
+}
+
+void InodeVersions::freed(int inodeNumber) {
+  pthread_mutex_lock(&lock);
+  generations[inodeNumber]++;
+  pthread_mutex_unlock(&lock);
+}
@@ -1,9 +1,20 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <set>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include "LocalFileSystem.h"
+#include "DirIndex.h"
+#include "DedupStore.h"
+#include "Compression.h"
+#include "Layout.h"
+#include "BlockLog.h"
 #include "ufs.h"
 #include <cstring>
 using namespace std;
@@ -13,6 +24,242 @@ LocalFileSystem::LocalFileSystem(Disk *disk) {
   this->disk = disk;
 }
 
+LocalFileSystem::~LocalFileSystem() {
+}
+
+LocalFileSystem *LocalFileSystem::mount(string imageFile) {
+  // the superblock is at the start of block 0 whatever the block size, so
+  // it can be read with the smallest one
+  super_t super;
+  Disk probe(imageFile, UFS_BLOCK_SIZE);
+  char buffer[UFS_BLOCK_SIZE];
+  probe.readBlock(0, buffer);
+  memcpy(&super, buffer, sizeof(super_t));
+
+  int blockSize = super.block_size == 0 ? UFS_BLOCK_SIZE : super.block_size;
+  if (!UFS_VALID_BLOCK_SIZE(blockSize)) {
+    return NULL;
+  }
+  // the log regions never move, so the copy of the super block at home
+  // has them even when the log has a newer one
+  Disk *disk = new Disk(imageFile, blockSize);
+  if (super.features & UFS_FEATURE_LOG) {
+    disk->setLog(new BlockLog(imageFile, blockSize, super));
+  }
+  switch (blockSize) {
+  case 4096:
+    return new UfsFileSystem<4096>(disk);
+  case 16384:
+    return new UfsFileSystem<16384>(disk);
+  default:
+    return new UfsFileSystem<65536>(disk);
+  }
+}
+
+template <int BlockSize>
+UfsFileSystem<BlockSize>::UfsFileSystem(Disk *disk)
+  : LocalFileSystem(disk), groups(disk, &locks), fingerprints(disk, Layout<BlockSize>::entriesPerBlock),
+    filters(disk) {
+  this->journal = NULL;
+  this->pendingBytes = 0;
+  this->reservedBlocks = 0;
+  this->reclaimerStarted = false;
+  this->orphansWaiting = false;
+  this->stopReclaimer = false;
+  pthread_mutex_init(&orphanLock, NULL);
+  pthread_cond_init(&orphansAdded, NULL);
+  this->zeroerStarted = false;
+  this->poolLow = false;
+  this->stopZeroer = false;
+  pthread_mutex_init(&zeroerLock, NULL);
+  pthread_cond_init(&zeroingWanted, NULL);
+  this->cold = NULL;
+  this->migratorStarted = false;
+  this->spaceWanted = false;
+  this->stopMigrator = false;
+  pthread_mutex_init(&migratorLock, NULL);
+  pthread_cond_init(&migrationWanted, NULL);
+  super_t super;
+  readSuperBlock(&super);
+  groups.load(&super);
+}
+
+template <int BlockSize>
+UfsFileSystem<BlockSize>::~UfsFileSystem() {
+  // orphans the reclaimer didn't get to stay on the list for next time
+  if (reclaimerStarted) {
+    pthread_mutex_lock(&orphanLock);
+    stopReclaimer = true;
+    pthread_cond_signal(&orphansAdded);
+    pthread_mutex_unlock(&orphanLock);
+    pthread_join(reclaimerThread, NULL);
+  }
+  if (zeroerStarted) {
+    pthread_mutex_lock(&zeroerLock);
+    stopZeroer = true;
+    pthread_cond_signal(&zeroingWanted);
+    pthread_mutex_unlock(&zeroerLock);
+    pthread_join(zeroerThread, NULL);
+  }
+  if (migratorStarted) {
+    pthread_mutex_lock(&migratorLock);
+    stopMigrator = true;
+    pthread_cond_signal(&migrationWanted);
+    pthread_mutex_unlock(&migratorLock);
+    pthread_join(migratorThread, NULL);
+  }
+  // flushing buffered content can release blocks of cold files
+  sync();
+  delete journal;
+  if (cold != NULL) {
+    disk->linkTransactions(NULL);
+    delete cold;
+  }
+  pthread_mutex_destroy(&orphanLock);
+  pthread_cond_destroy(&orphansAdded);
+  pthread_mutex_destroy(&zeroerLock);
+  pthread_cond_destroy(&zeroingWanted);
+  pthread_mutex_destroy(&migratorLock);
+  pthread_cond_destroy(&migrationWanted);
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::blockSize() {
+  return BlockSize;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::maxFileSize() {
+  return Layout<BlockSize>::maxFileSize;
+}
+
+// Finds count free data blocks, marks them as used in the in-memory bitmap and
+// stores their block numbers in blocks. keepFree more blocks have to stay
+// free afterwards, for writes that delayed allocation has reserved them
+// for. The search starts at bitmap index start, the first block of the
+// allocation group to allocate in, and wraps around. Returns false
+// without touching the bitmap if there are not enough free blocks.
+bool allocateDataBlocks(super_t *super, unsigned char *dataBitmap, int count, unsigned int *blocks,
+                        int keepFree, int start = 0) {
+  int found = 0;
+  int spare = 0;
+  for (int i = 0; i < super->num_data && (found < count || spare < keepFree); ++i) {
+    int j = (start + i) % super->num_data;
+    if ((dataBitmap[j / 8] & (1 << (j % 8))) == 0) {
+      if (found < count) {
+        blocks[found++] = j + super->data_region_addr;
+      } else {
+        spare++;
+      }
+    }
+  }
+  if (found < count || spare < keepFree) {
+    return false;
+  }
+  for (int i = 0; i < count; ++i) {
+    int bitmapIndex = blocks[i] - super->data_region_addr;
+    dataBitmap[bitmapIndex / 8] |= (1 << (bitmapIndex % 8));
+  }
+  return true;
+}
+
+// Whether name in parentInodeNumber is the root's UFS_SNAPSHOT_DIR entry,
+// which only the snapshot calls make, change and remove
+bool isSnapshotDirEntry(super_t *super, int parentInodeNumber, const string &name) {
+  return (super->features & UFS_FEATURE_SNAPSHOTS) && parentInodeNumber == UFS_ROOT_DIRECTORY_INODE_NUMBER
+    && name == UFS_SNAPSHOT_DIR;
+}
+
+// Gives blocks that were reserved with allocateDataBlocks but not used back
+// to the in-memory bitmap
+void releaseDataBlocks(super_t *super, unsigned char *dataBitmap, const vector<unsigned int> &blocks) {
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    int bitmapIndex = blocks[i] - super->data_region_addr;
+    dataBitmap[bitmapIndex / 8] &= ~(1 << (bitmapIndex % 8));
+  }
+}
+
+// Like allocateDataBlocks, but takes the first run of count free blocks in
+// a row if there is one, so the content of a file can be read back in
+// order. Falls back to the first free blocks otherwise.
+bool allocateDataRun(super_t *super, unsigned char *dataBitmap, int count, unsigned int *blocks,
+                     int keepFree, int start = 0) {
+  if (!allocateDataBlocks(super, dataBitmap, count, blocks, keepFree, start)) {
+    return false;
+  }
+  if (count == 0 || blocks[count - 1] - blocks[0] == (unsigned int)count - 1) {
+    return true;
+  }
+  vector<unsigned int> firstFree(blocks, blocks + count);
+  releaseDataBlocks(super, dataBitmap, firstFree);
+  int run = 0;
+  for (int i = 0; i < super->num_data; ++i) {
+    int j = (start + i) % super->num_data;
+    // runs don't wrap around the end of the region
+    if (j == 0) {
+      run = 0;
+    }
+    if (dataBitmap[j / 8] & (1 << (j % 8))) {
+      run = 0;
+    } else if (++run == count) {
+      for (int k = 0; k < count; ++k) {
+        blocks[k] = j - count + 1 + k + super->data_region_addr;
+      }
+      break;
+    }
+  }
+  if (run < count) {
+    copy(firstFree.begin(), firstFree.end(), blocks);
+  }
+  for (int i = 0; i < count; ++i) {
+    int bitmapIndex = blocks[i] - super->data_region_addr;
+    dataBitmap[bitmapIndex / 8] |= (1 << (bitmapIndex % 8));
+  }
+  return true;
+}
+
+// Drops a file's reference to block and frees it in the in-memory bitmap,
+// unless other files still share it. dedup is NULL on images without
+// UFS_FEATURE_REFCOUNTS. Returns true if the block was freed.
+template <int BlockSize>
+bool releaseFileBlock(super_t *super, unsigned char *dataBitmap, DedupStore<BlockSize> *dedup, unsigned int block) {
+  if (dedup != NULL && !dedup->release(block)) {
+    return false;
+  }
+  int bitmapIndex = block - super->data_region_addr;
+  dataBitmap[bitmapIndex / 8] &= ~(1 << (bitmapIndex % 8));
+  return true;
+}
+
+// Finds a free inode and marks it as used in the in-memory bitmap.
+// Returns -1 if there is none.
+int allocateInode(super_t *super, unsigned char *inodeBitmap) {
+  for (int i = 0; i < super->num_inodes; ++i) {
+    if ((inodeBitmap[i / 8] & (1 << (i % 8))) == 0) {
+      inodeBitmap[i / 8] |= (1 << (i % 8));
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Index order, see DirIndex
+static bool entryNameLess(const dir_ent_t &a, const dir_ent_t &b) {
+  return strcmp(a.name, b.name) < 0;
+}
+
+// Fills in a directory entry. On images with UFS_FEATURE_DIRENT_TYPE the
+// type of the entry goes in the last name byte so readdir doesn't need
+// to load the inode.
+void setDirEntry(super_t *super, dir_ent_t *entry, const string &name, int inum, int type) {
+  memset(entry->name, 0, DIR_ENT_NAME_SIZE);
+  strncpy(entry->name, name.c_str(), DIR_ENT_NAME_SIZE - 1);
+  if (super->features & UFS_FEATURE_DIRENT_TYPE) {
+    entry->name[DIR_ENT_TYPE_INDEX] = DIR_ENT_TYPE(type);
+  }
+  entry->inum = inum;
+}
+
 /**
  * Lookup an inode.
  *
@@ -24,7 +271,10 @@ LocalFileSystem::LocalFileSystem(Disk *disk) {
  * Failure: return -ENOTFOUND, -EINVALIDINODE.
  * Failure modes: invalid parentInodeNumber, name does not exist.
  */
-int LocalFileSystem::lookup(int parentInodeNumber, std::string name) {
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::lookup(int parentInodeNumber, std::string name) {
+    FileSystemLock fileSystemLock(&locks, false);
+    InodeLock parentLock(&locks, parentInodeNumber, false);
     super_t super;
     readSuperBlock(&super);
 
@@ -45,37 +295,245 @@ int LocalFileSystem::lookup(int parentInodeNumber, std::string name) {
     if (parentInode.type != UFS_DIRECTORY) {
         return -EINVALIDINODE;
     }
+    return lookupIn(parentInodeNumber, &parentInode, name);
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::lookupIn(int parentInodeNumber, inode_t *parentInode, const string &name) {
+    // Most names that aren't there stop at the directory's filter. The
+    // first lookup makes it, which reads every entry anyway.
+    bool mayContain;
+    int rollbacks;
+    if (!filters.check(parentInodeNumber, name, &mayContain, &rollbacks)) {
+      return buildFilter(parentInodeNumber, parentInode, name, rollbacks);
+    }
+    if (!mayContain) {
+      return -ENOTFOUND;
+    }
+
+    // Indexed directories find the name in a few blocks instead of a scan
+    dir_ent_t entry;
+    bool found;
+    if (parentInode->flags & UFS_INODE_DIR_INDEX) {
+      DirIndex<BlockSize> index(disk, parentInode->direct[DIR_INDEX_PTR]);
+      found = index.find(name, &entry);
+    } else {
+      found = findDirEntry(parentInode, name, &entry) >= 0;
+    }
+    if (!found) {
+      filters.falsePositive();
+      return -ENOTFOUND; // Name not found in the directory
+    }
+    return entry.inum;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::resolve(const string &path, int flags, ResolvedPath *resolved) {
+  FileSystemLock fileSystemLock(&locks, false);
+  super_t super;
+  readSuperBlock(&super);
+
+  // Each directory stays locked until the next one on the path is, so
+  // the entry that led there can't change in between and every inode on
+  // the way is loaded once
+  int current = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  inode_t inode;
+  locks.lockInode(current, false);
+  loadInode(&super, current, &inode);
+  resolved->parent = current;
+  resolved->name.clear();
+
+  size_t start = path.find_first_not_of('/');
+  while (start != string::npos) {
+    size_t end = path.find('/', start);
+    resolved->parent = current;
+    resolved->name = path.substr(start, end == string::npos ? string::npos : end - start);
+    start = path.find_first_not_of('/', end);
+    bool last = start == string::npos;
+
+    if (inode.type != UFS_DIRECTORY) {
+      locks.unlockInode(current);
+      return -EINVALIDTYPE;
+    }
+    if (resolved->name == "." || resolved->name == "..") {
+      locks.unlockInode(current);
+      return -EINVALIDNAME;
+    }
+    if ((flags & RESOLVE_NO_SNAPSHOTS) && current == UFS_ROOT_DIRECTORY_INODE_NUMBER
+        && resolved->name == UFS_SNAPSHOT_DIR) {
+      locks.unlockInode(current);
+      return -ENOTSUPPORTED;
+    }
+    int next = lookupIn(current, &inode, resolved->name);
+    if (next == -ENOTFOUND && last) {
+      locks.unlockInode(current);
+      resolved->inodeNumber = -ENOTFOUND;
+      return 0;
+    }
+    if (next == -ENOTFOUND && (flags & RESOLVE_MAKE_DIRS)) {
+      // create locks the directory exclusively, and someone else may
+      // make the same directory first once it is unlocked
+      locks.unlockInode(current);
+      next = create(current, UFS_DIRECTORY, resolved->name);
+      if (next == -EINVALIDNAME) {
+        int existing = lookup(current, resolved->name);
+        next = existing >= 0 ? existing : next;
+      }
+      if (next < 0) {
+        return next;
+      }
+      locks.lockInode(next, false);
+    } else if (next < 0) {
+      locks.unlockInode(current);
+      return next;
+    } else {
+      locks.lockInode(next, false);
+      locks.unlockInode(current);
+    }
+    current = next;
+    loadInode(&super, current, &inode);
+  }
+
+  // as stat, content buffered by delayed allocation is what the file holds
+  {
+    AllocationLock allocationLock(&locks);
+    typename map<int, PendingWrite>::iterator it = pending.find(current);
+    if (it != pending.end()) {
+      inode.size = it->second.content.size();
+    }
+  }
+  locks.unlockInode(current);
+  resolved->inodeNumber = current;
+  resolved->inode = inode;
+  return 0;
+}
 
-    // Buffer to read directory entries
-    unsigned char blockBuffer[UFS_BLOCK_SIZE];
-    
-    // Iterate over the direct pointers in the parent directory inode
-    int fileBlocks = parentInode.size / UFS_BLOCK_SIZE;
-    if ((parentInode.size % UFS_BLOCK_SIZE) != 0) {
-      fileBlocks += 1;
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::lookupStats(LookupStats *stats) {
+  filters.stats(stats);
+}
+
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::readdir(int inodeNumber, vector<DirEntry> &entries) {
+    FileSystemLock fileSystemLock(&locks, false);
+    InodeLock dirLock(&locks, inodeNumber, false);
+    super_t super;
+    readSuperBlock(&super);
+
+    if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+        return -EINVALIDINODE;
+    }
+    inode_t dirInode;
+    if (stat(inodeNumber, &dirInode) != 0 || dirInode.type != UFS_DIRECTORY) {
+        return -EINVALIDINODE;
     }
-    for (int i = 0; i < fileBlocks; ++i) {
-      int blockNum = parentInode.direct[i];
 
-      // Read the block from the disk
-      disk->readBlock(blockNum, blockBuffer);
+    // Entries without a recorded type fall back to the inode, and the
+    // inode region is loaded once for all of them
+    bool hasTypes = (super.features & UFS_FEATURE_DIRENT_TYPE) != 0;
+    vector<inode_t> inodes;
+
+    entries.clear();
+    unsigned char blockBuffer[BlockSize];
+    int entriesPerBlock = Layout<BlockSize>::entriesPerBlock;
+    int totalEntries = dirInode.size / sizeof(dir_ent_t);
+    for (int i = 0; i * entriesPerBlock < totalEntries; ++i) {
+      disk->readBlock(dirInode.direct[i], blockBuffer);
       dir_ent_t *dirEntries = (dir_ent_t *)blockBuffer;
 
-      // Iterate over directory entries in this block, account for the last not full block
-      int numEntries = min(UFS_BLOCK_SIZE/sizeof(dir_ent_t), 
-                          (parentInode.size % UFS_BLOCK_SIZE)/sizeof(dir_ent_t));
+      int numEntries = min(entriesPerBlock, totalEntries - i * entriesPerBlock);
       for (int j = 0; j < numEntries; ++j) {
-        if (name == string(dirEntries[j].name)) {
-          return dirEntries[j].inum; // Found the entry
+        DirEntry entry;
+        entry.inum = dirEntries[j].inum;
+        entry.type = -1;
+        if (hasTypes) {
+          entry.type = DIR_ENT_TYPE_OF(dirEntries[j].name[DIR_ENT_TYPE_INDEX]);
+          dirEntries[j].name[DIR_ENT_TYPE_INDEX] = '\0';
+        }
+        entry.name = dirEntries[j].name;
+
+        if (entry.type < 0 && entry.inum >= 0 && entry.inum < super.num_inodes) {
+          if (inodes.empty()) {
+            inodes.resize(super.num_inodes);
+            readInodeRegion(&super, inodes.data());
+          }
+          entry.type = inodes[entry.inum].type;
         }
+        entries.push_back(entry);
       }
     }
 
-    return -ENOTFOUND; // Name not found in the directory
+    return entries.size();
 }
 
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::readdirSorted(int inodeNumber, const string &marker, int maxEntries,
+                                            vector<DirEntry> &entries) {
+    FileSystemLock fileSystemLock(&locks, false);
+    InodeLock dirLock(&locks, inodeNumber, false);
+    super_t super;
+    readSuperBlock(&super);
+
+    if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+        return -EINVALIDINODE;
+    }
+    inode_t dirInode;
+    if (stat(inodeNumber, &dirInode) != 0 || dirInode.type != UFS_DIRECTORY) {
+        return -EINVALIDINODE;
+    }
+
+    entries.clear();
+    if (!(dirInode.flags & UFS_INODE_DIR_INDEX)) {
+        // without an index we have to sort every entry in memory
+        vector<DirEntry> allEntries;
+        int ret = readdir(inodeNumber, allEntries);
+        if (ret < 0) {
+            return ret;
+        }
+        sort(allEntries.begin(), allEntries.end(), [](const DirEntry &a, const DirEntry &b) {
+            return strcmp(a.name.c_str(), b.name.c_str()) < 0;
+        });
+        for (const auto &entry : allEntries) {
+            if (maxEntries >= 0 && (int)entries.size() >= maxEntries) {
+                break;
+            }
+            if (strcmp(entry.name.c_str(), marker.c_str()) > 0) {
+                entries.push_back(entry);
+            }
+        }
+        return entries.size();
+    }
+
+    // the index is already in name order and starts right at the marker
+    DirIndex<BlockSize> index(disk, dirInode.direct[DIR_INDEX_PTR]);
+    vector<dir_ent_t> indexEntries;
+    index.list(marker, maxEntries, indexEntries);
+    for (size_t i = 0; i < indexEntries.size(); ++i) {
+        DirEntry entry;
+        entry.inum = indexEntries[i].inum;
+        entry.type = -1;
+        if (super.features & UFS_FEATURE_DIRENT_TYPE) {
+            entry.type = DIR_ENT_TYPE_OF(indexEntries[i].name[DIR_ENT_TYPE_INDEX]);
+            indexEntries[i].name[DIR_ENT_TYPE_INDEX] = '\0';
+        }
+        entry.name = indexEntries[i].name;
+
+        // '..' can't be locked after the directory, but the type of a
+        // linked inode doesn't change anyway
+        if (entry.type < 0 && entry.inum >= 0 && entry.inum < super.num_inodes) {
+            inode_t entryInode;
+            loadInode(&super, entry.inum, &entryInode);
+            entry.type = entryInode.type;
+        }
+        entries.push_back(entry);
+    }
+
+    return entries.size();
+}
 
-int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::stat(int inodeNumber, inode_t *inode) {
     /**
    * Read an inode.
    *
@@ -86,25 +544,59 @@ int LocalFileSystem::stat(int inodeNumber, inode_t *inode) {
    * Failure: return -EINVALIDINODE
    * Failure modes: invalid inodeNumber
    */
+  FileSystemLock fileSystemLock(&locks, false);
+  InodeLock inodeLock(&locks, inodeNumber, false);
   super_t super;
   readSuperBlock(&super);
   if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
     return -EINVALIDINODE; // Invalid inode number
   }
+  loadInode(&super, inodeNumber, inode);
+  // only stale inode numbers lead to orphans, whose size isn't a size
+  if (inode->flags & UFS_INODE_ORPHAN) {
+    return -EINVALIDINODE;
+  }
+
+  // content buffered by delayed allocation has no blocks yet, but it is
+  // what the file holds
+  AllocationLock allocationLock(&locks);
+  typename map<int, PendingWrite>::iterator it = pending.find(inodeNumber);
+  if (it != pending.end()) {
+    inode->size = it->second.content.size();
+  }
+
+  return 0;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::loadInode(super_t *super, int inodeNumber, inode_t *inode) {
   // find the inode address in the block
   // find # of inodes in a block
-  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
+  int inodesPerBlock = Layout<BlockSize>::inodesPerBlock;
   // starting from the start address, go to the block that has that inode
-  int blockNumber = super.inode_region_addr + (inodeNumber / inodesPerBlock);
+  int blockNumber = super->inode_region_addr + (inodeNumber / inodesPerBlock);
   // in that block, find the offset of it in size of inode
   int inodeOffset = (inodeNumber % inodesPerBlock) * sizeof(inode_t);
 
   // same idea, make the buffer sufficiently large in case 
-  unsigned char buffer[UFS_BLOCK_SIZE];
+  unsigned char buffer[BlockSize];
   disk->readBlock(blockNumber, buffer);
   memcpy(inode, buffer + inodeOffset, sizeof(inode_t));
+}
 
-  return 0;
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::ancestors(int inodeNumber, vector<int> &chain) {
+  chain.clear();
+  int current = inodeNumber;
+  chain.push_back(current);
+  while (current != UFS_ROOT_DIRECTORY_INODE_NUMBER) {
+    int parent = lookup(current, "..");
+    if (parent < 0 || parent == current) {
+      break;
+    }
+    current = parent;
+    chain.push_back(current);
+  }
 }
 
 int min_of_three(int a, int b, int c){
@@ -117,6 +609,54 @@ int min_of_three(int a, int b, int c){
   }
   return min;
 }
+// Number of data blocks used by a file or directory. Inline files use none.
+template <int BlockSize>
+int fileBlockCount(inode_t *inode) {
+  if (inode->flags & UFS_INODE_INLINE) {
+    return 0;
+  }
+  // the size of a compressed file says nothing about its blocks, but the
+  // ones it uses are always the first direct pointers
+  if (inode->flags & UFS_INODE_COMPRESSED) {
+    int blocks = 0;
+    while (blocks < DIRECT_PTRS && inode->direct[blocks] != 0) {
+      blocks++;
+    }
+    return blocks;
+  }
+  return (inode->size + BlockSize - 1) / BlockSize;
+}
+
+// Compresses size bytes of content, which start where a chunk does, into
+// stored as chunks (see UFS_COMPRESSION_CHUNK_BLOCKS). Returns how many
+// blocks they take.
+template <int BlockSize>
+int compressChunks(const unsigned char *content, int size, vector<unsigned char> &stored) {
+  int chunkBytes = UFS_COMPRESSION_CHUNK_BLOCKS * BlockSize;
+  stored.clear();
+  for (int offset = 0; offset < size; offset += chunkBytes) {
+    int chunkSize = min(chunkBytes, size - offset);
+    size_t start = stored.size();
+    stored.resize(start + sizeof(compressed_header_t) + chunkSize, 0);
+    compressed_header_t *header = (compressed_header_t *)&stored[start];
+    unsigned char *out = &stored[start + sizeof(compressed_header_t)];
+    header->codec = UFS_CODEC_LZ;
+    int length = Codec::byId(UFS_CODEC_LZ)->compress(content + offset, chunkSize, out, chunkSize - 1);
+    if (length < 0) {
+      header->codec = UFS_CODEC_STORED;
+      length = Codec::byId(UFS_CODEC_STORED)->compress(content + offset, chunkSize, out, chunkSize);
+    }
+    header->length = length;
+    // the next chunk starts in a block of its own, and the bytes up to it
+    // are zero so equal chunks make equal blocks
+    size_t end = start + sizeof(compressed_header_t) + length;
+    size_t blocks = (end + BlockSize - 1) / BlockSize;
+    stored.resize(blocks * BlockSize, 0);
+    fill(stored.begin() + end, stored.end(), 0);
+  }
+  return stored.size() / BlockSize;
+}
+
   /**
  * Read the contents of a file or directory.
  *
@@ -128,8 +668,10 @@ int min_of_three(int a, int b, int c){
  * Failure: -EINVALIDINODE, -EINVALIDSIZE.
  * Failure modes: invalid inodeNumber, invalid size.
  */
-int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
-  if (size < 0 || size > MAX_FILE_SIZE) {
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::read(int inodeNumber, void *buffer, int size) {
+  FileSystemLock fileSystemLock(&locks, false);
+  if (size < 0 || size > Layout<BlockSize>::maxFileSize) {
     return -EINVALIDSIZE; // Invalid size
   }
   super_t super;
@@ -137,31 +679,76 @@ int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
   if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
     return -EINVALIDINODE;
   }
+
+  // The lock is only held to load the inode. Its blocks are read from the
+  // version pinned here, which writes leave alone (see InodeVersions).
   inode_t inode;
-  // fill in the inode with the specified inodeNum
-  int ret = stat(inodeNumber, &inode);
-  if (ret != 0) {
-      return -EINVALIDINODE; 
+  long long epoch;
+  {
+    InodeLock inodeLock(&locks, inodeNumber, false);
+    // fill in the inode with the specified inodeNum
+    int ret = stat(inodeNumber, &inode);
+    if (ret != 0) {
+        return -EINVALIDINODE; 
+    }
+
+    AllocationLock allocationLock(&locks);
+    typename map<int, PendingWrite>::iterator it = pending.find(inodeNumber);
+    if (it != pending.end()) {
+      int bytesRead = min(size, inode.size);
+      memcpy(buffer, it->second.content.data(), bytesRead);
+      return bytesRead;
+    }
+    allocationLock.unlock();
+
+    // directory blocks are freed without waiting for readers
+    if (inode.type == UFS_DIRECTORY) {
+      return readContent(&inode, buffer, size);
+    }
+    touch(inodeNumber);
+    epoch = versions.pin(inodeNumber);
+  }
+  VersionPin pin(&versions, inodeNumber, epoch);
+  return readContent(&inode, buffer, size);
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::readContent(inode_t *inode, void *buffer, int size) {
+  if ((inode->flags & UFS_INODE_COLD) && cold == NULL) {
+    return -ENOTSUPPORTED;
+  }
+  if (inode->flags & UFS_INODE_INLINE) {
+    // tiny files live in the inode, there is no data block to read
+    int bytesRead = min(size, inode->size);
+    memcpy(buffer, inode->direct, bytesRead);
+    return bytesRead;
+  }
+
+  if (inode->flags & UFS_INODE_COMPRESSED) {
+    // only the chunks with the part asked for are decompressed
+    int bytesRead = min(size, inode->size);
+    int ret = readChunks(inode, 0, 0, bytesRead, (unsigned char *)buffer);
+    return ret < 0 ? ret : bytesRead;
   }
 
   int bytesRead = 0;
-  while (bytesRead < size && bytesRead < inode.size) {
+  while (bytesRead < size && bytesRead < inode->size) {
     // locate the current block index and offset
-    int blockIndex = (bytesRead / UFS_BLOCK_SIZE);
-    int blockOffset = (bytesRead % UFS_BLOCK_SIZE);
+    int blockIndex = (bytesRead / BlockSize);
+    int blockOffset = (bytesRead % BlockSize);
     // For the current reading, get the max bytes we can read
     int remaining_bytes_required = size - bytesRead; //user wanted byte size
-    int remaining_bytes_cur_block = UFS_BLOCK_SIZE - blockOffset; // remaining in cur block
-    int remaining_bytes_in_file = inode.size - bytesRead; // remaining in the file
+    int remaining_bytes_cur_block = BlockSize - blockOffset; // remaining in cur block
+    int remaining_bytes_in_file = inode->size - bytesRead; // remaining in the file
 
     int bytesReadCurrent = min_of_three(remaining_bytes_required,
                                         remaining_bytes_cur_block, 
                                         remaining_bytes_in_file);
 
     // create a block to store and read them
-    int blockNum = inode.direct[blockIndex];
-    unsigned char blockBuffer[UFS_BLOCK_SIZE];
-    disk->readBlock(blockNum, blockBuffer);
+    int blockNum = inode->direct[blockIndex];
+    unsigned char blockBuffer[BlockSize];
+    readFileBlock(inode, blockNum, blockBuffer);
     memcpy((unsigned char*)buffer + bytesRead, blockBuffer + blockOffset, bytesReadCurrent);
     bytesRead += bytesReadCurrent;
   }
@@ -169,9 +756,147 @@ int LocalFileSystem::read(int inodeNumber, void *buffer, int size) {
   return bytesRead; // Success: return the number of bytes read
 }
 
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::chunkSlot(inode_t *inode, int chunk) {
+  int storedBlocks = fileBlockCount<BlockSize>(inode);
+  int slot = 0;
+  for (int i = 0; i < chunk; ++i) {
+    if (slot >= storedBlocks) {
+      return -EINVALIDINODE;
+    }
+    unsigned char block[BlockSize];
+    readFileBlock(inode, inode->direct[slot], block);
+    compressed_header_t *header = (compressed_header_t *)block;
+    slot += (sizeof(compressed_header_t) + (long long)header->length + BlockSize - 1) / BlockSize;
+  }
+  return slot <= storedBlocks ? slot : -EINVALIDINODE;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::readChunks(inode_t *inode, int slot, int offset, int size, unsigned char *out) {
+  int chunkBytes = UFS_COMPRESSION_CHUNK_BLOCKS * BlockSize;
+  int storedBlocks = fileBlockCount<BlockSize>(inode);
+  int maxChunkBlocks = (sizeof(compressed_header_t) + chunkBytes + BlockSize - 1) / BlockSize;
+  vector<unsigned char> stored(maxChunkBlocks * BlockSize);
+  vector<unsigned char> content(chunkBytes);
+  for (int done = 0; done < size; done += chunkBytes) {
+    if (slot >= storedBlocks) {
+      return -EINVALIDINODE;
+    }
+    readFileBlock(inode, inode->direct[slot], stored.data());
+    compressed_header_t *header = (compressed_header_t *)stored.data();
+    Codec *codec = Codec::byId(header->codec);
+    long long end = sizeof(compressed_header_t) + (long long)header->length;
+    int blocks = (end + BlockSize - 1) / BlockSize;
+    if (codec == NULL || blocks > maxChunkBlocks || slot + blocks > storedBlocks) {
+      return -EINVALIDINODE;
+    }
+    for (int i = 1; i < blocks; ++i) {
+      readFileBlock(inode, inode->direct[slot + i], &stored[i * BlockSize]);
+    }
+    int chunkSize = min(chunkBytes, inode->size - offset - done);
+    if (codec->decompress(&stored[sizeof(compressed_header_t)], header->length, content.data(), chunkBytes)
+        != chunkSize) {
+      return -EINVALIDINODE;
+    }
+    memcpy(out + done, content.data(), min(chunkSize, size - done));
+    slot += blocks;
+  }
+  return slot;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::rewriteChunks(super_t *super, int inodeNumber, inode_t *inode, int size,
+                                            const unsigned char *appended) {
+  // the chunk with the first byte that changes and everything after it
+  int chunkBytes = UFS_COMPRESSION_CHUNK_BLOCKS * BlockSize;
+  int kept = min(inode->size, size);
+  int chunk = kept / chunkBytes;
+  int start = chunk * chunkBytes;
+  int slot = chunkSlot(inode, chunk);
+  if (slot < 0) {
+    return slot;
+  }
+  vector<unsigned char> content(size - start, 0);
+  int ret = readChunks(inode, slot, start, kept - start, content.data());
+  if (ret < 0) {
+    return ret;
+  }
+  if (appended != NULL) {
+    memcpy(&content[kept - start], appended, size - kept);
+  }
+  vector<unsigned char> stored;
+  int count = compressChunks<BlockSize>(content.data(), content.size(), stored);
+  if (slot + count >= (size + BlockSize - 1) / BlockSize) {
+    return 1;
+  }
+
+  /*out of storage errors, before modify anything*/
+  AllocationLock allocationLock(&locks);
+  int currentFileBlocks = fileBlockCount<BlockSize>(inode);
+  vector<unsigned char> dataBitmap(super->data_bitmap_len * BlockSize);
+  readDataBitmap(super, dataBitmap.data());
+  DedupStore<BlockSize> dedup(disk, super);
+  vector<unsigned int> spareBlocks(dedup.blocksNeeded(stored.data(), count));
+  if (!allocateDataBlocks(super, dataBitmap.data(), spareBlocks.size(), spareBlocks.data(), reservedBlocks,
+                          groups.firstBlock(groups.inodeGroup(inodeNumber)))) {
+    return -ENOTENOUGHSPACE;
+  }
+  // the old chunks may be shared, so they are released, not overwritten
+  vector<unsigned int> oldBlocks(inode->direct + slot, inode->direct + currentFileBlocks);
+  for (int i = slot; i < currentFileBlocks; ++i) {
+    inode->direct[i] = 0;
+  }
+  for (int i = 0; i < count; ++i) {
+    inode->direct[slot + i] = dedup.store(&stored[i * BlockSize], spareBlocks);
+  }
+  versions.waitForReaders(inodeNumber);
+  for (size_t i = 0; i < oldBlocks.size(); ++i) {
+    releaseFileBlock(super, dataBitmap.data(), &dedup, oldBlocks[i]);
+  }
+  dedup.flush();
+
+  writeDataBitmap(super, dataBitmap.data());
+  inode->size = size;
+  writeInode(super, inodeNumber, inode);
+  return 0;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::readFileBlock(inode_t *inode, unsigned int block, void *buffer) {
+  if (inode->flags & UFS_INODE_COLD) {
+    cold->readBlock(block, buffer);
+  } else {
+    disk->readBlock(block, buffer);
+  }
+}
+
+
 
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::create(int parentInodeNumber, int type, std::string name) {
+  // snapshot makes UFS_SNAPSHOT_DIR with tryCreate
+  if (parentInodeNumber == UFS_ROOT_DIRECTORY_INODE_NUMBER && name == UFS_SNAPSHOT_DIR) {
+    super_t super;
+    readSuperBlock(&super);
+    if (isSnapshotDirEntry(&super, parentInodeNumber, name)) {
+      return -EINVALIDNAME;
+    }
+  }
+  // the orphans may hold the space it needs
+  int ret = tryCreate(parentInodeNumber, type, name);
+  if (ret == -ENOTENOUGHSPACE && reclaimOrphans(-1) > 0) {
+    ret = tryCreate(parentInodeNumber, type, name);
+  }
+  return ret;
+}
 
-int LocalFileSystem::create(int parentInodeNumber, int type, std::string name) {
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::tryCreate(int parentInodeNumber, int type, std::string name) {
+    // the new inode isn't linked anywhere until the parent is written, so
+    // it doesn't need a lock
+    FileSystemLock fileSystemLock(&locks, false);
+    InodeLock parentLock(&locks, parentInodeNumber, true);
     super_t super;
     readSuperBlock(&super);
 
@@ -193,418 +918,2035 @@ int LocalFileSystem::create(int parentInodeNumber, int type, std::string name) {
         return -EINVALIDINODE;
     }
 
-    // Load inode region
-    inode_t inodes[super.num_inodes];
-    readInodeRegion(&super, inodes);
-
-    // Calculate the blocks it used
-    int parentFileBlocks = parentInode.size / UFS_BLOCK_SIZE;
-    if ((parentInode.size % UFS_BLOCK_SIZE) != 0) {
-        parentFileBlocks += 1;
-    }
-
     // Check for existing name in the directory
-    unsigned char blockBuffer[UFS_BLOCK_SIZE];
-    for (int i = 0; i < parentFileBlocks; ++i) {
-        disk->readBlock(parentInode.direct[i], blockBuffer);
-        dir_ent_t* dirEntries = (dir_ent_t*)blockBuffer;
-        int numEntries = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
-        for (int j = 0; j < numEntries; ++j) {
-            if (name == string(dirEntries[j].name)) {
-                return -EINVALIDNAME;  // Name already exists
-            }
-        }
+    if (lookup(parentInodeNumber, name) >= 0) {
+        return -EINVALIDNAME;  // Name already exists
     }
 
-    // Find a free inode
-    unsigned char inodeBitmap[super.inode_bitmap_len * UFS_BLOCK_SIZE];
-    readInodeBitmap(&super, inodeBitmap);
-    int freeInodeNum = -1;
-    for (int i = 0; i < super.num_inodes; ++i) {
-        if ((inodeBitmap[i / 8] & (1 << (i % 8))) == 0) {
-            freeInodeNum = i;
-            break;
-        }
+    // A new directory needs a block for '.' and '..' plus one for its
+    // index, and the parent may need blocks for the new entry
+    bool newDirIndexed = type == UFS_DIRECTORY && (super.features & UFS_FEATURE_DIR_INDEX);
+    int newDirBlocks = (type == UFS_DIRECTORY ? 1 : 0) + (newDirIndexed ? 1 : 0);
+    int entryBlocks = addDirEntryBlocksNeeded(&parentInode);
+    if (entryBlocks < 0) {
+        return entryBlocks;
     }
-    if (freeInodeNum == -1) {
-        return -ENOTENOUGHSPACE;
-    }
-
-    // Add the entry to the parent directory
-    bool entryAdded = false;
-    for (int i = 0; i < DIRECT_PTRS; ++i) {
-        if (parentInode.direct[i] != 0) { // block is used, check if still has space
-            disk->readBlock(parentInode.direct[i], blockBuffer);
-            dir_ent_t* dirEntries = (dir_ent_t*)blockBuffer;
-            unsigned numEntries = parentInode.size / sizeof(dir_ent_t);
-            if(numEntries < UFS_BLOCK_SIZE / sizeof(dir_ent_t)){// there is a space for entry
-              dirEntries[numEntries].inum = freeInodeNum;
-              strncpy(dirEntries[numEntries].name, name.c_str(), DIR_ENT_NAME_SIZE - 1);
-              dirEntries[numEntries].name[DIR_ENT_NAME_SIZE - 1] = '\0';
-              disk->writeBlock(parentInode.direct[i], blockBuffer);
-              entryAdded = true;
-              parentInode.size += sizeof(dir_ent_t);  // Update parent inode size
-              break;
-            }
 
-            if (entryAdded) break;
-        }
+    // Files go in the parent's group, directories spread out over the
+    // groups. Everything is allocated up front so running out of space
+    // doesn't leave anything half written.
+    AllocationLock allocationLock(&locks, false);
+    int group = groups.inodeGroup(parentInodeNumber);
+    int newGroup = type == UFS_DIRECTORY ? groups.directoryGroup(group) : group;
+    int freeInodeNum = groups.allocateInode(newGroup);
+    if (freeInodeNum < 0) {
+        return -ENOTENOUGHSPACE;
     }
-
-    unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
-    readDataBitmap(&super, dataBitmap);
-
-    int firstFreeBlockNum = -1, secondFreeBlockNum = -1;
-    // Allocate new block for the parent directory if needed
-    if (!entryAdded) {
-        for (int i = 0; i < super.num_data; ++i) {
-            int byteIndex = i / 8;
-            int bitIndex = i % 8;
-            if ((dataBitmap[byteIndex] & (1 << bitIndex)) == 0) {
-                firstFreeBlockNum = i + super.data_region_addr;
-                dataBitmap[byteIndex] |= (1 << bitIndex);  // Mark as used
-                break;
-            }
-        }
-        if (firstFreeBlockNum == -1) {
-            return -ENOTENOUGHSPACE;
-        }
-
-        for (int i = 0; i < DIRECT_PTRS; ++i) {
-            if (parentInode.direct[i] == 0) {
-                parentInode.direct[i] = firstFreeBlockNum;
-                memset(blockBuffer, 0, UFS_BLOCK_SIZE);
-                dir_ent_t* dirEntries = (dir_ent_t*)blockBuffer;
-                dirEntries[0].inum = freeInodeNum;
-                strncpy(dirEntries[0].name, name.c_str(), DIR_ENT_NAME_SIZE - 1);
-                dirEntries[0].name[DIR_ENT_NAME_SIZE - 1] = '\0';
-                disk->writeBlock(parentInode.direct[i], blockBuffer);
-                entryAdded = true;
-                parentInode.size += sizeof(dir_ent_t);  // Update parent inode size
-                break;
-            }
-        }
+    newGroup = groups.inodeGroup(freeInodeNum);
+    vector<unsigned int> reserved(entryBlocks);
+    vector<unsigned int> newDirReserved(newDirBlocks);
+    if (!groups.allocateBlocks(group, entryBlocks, reserved.data(), reservedBlocks)) {
+        groups.releaseInode(freeInodeNum);
+        return -ENOTENOUGHSPACE;
     }
-
-    if (!entryAdded) {
+    if (!groups.allocateBlocks(newGroup, newDirBlocks, newDirReserved.data(), reservedBlocks)) {
+        groups.releaseBlocks(reserved);
+        groups.releaseInode(freeInodeNum);
         return -ENOTENOUGHSPACE;
     }
 
     // Set up the new inode
-    inode_t newInode = {type, 0, {0}};
+    inode_t newInode = {(short)type, 0, 0, {0}};
     if (type == UFS_DIRECTORY) {
         // Initialize the new directory
-        memset(blockBuffer, 0, UFS_BLOCK_SIZE);
+        unsigned char blockBuffer[BlockSize];
+        memset(blockBuffer, 0, BlockSize);
         dir_ent_t* newDirEntries = (dir_ent_t*)blockBuffer;
-        newDirEntries[0].inum = freeInodeNum;
-        strncpy(newDirEntries[0].name, ".", DIR_ENT_NAME_SIZE - 1);
-        newDirEntries[0].name[DIR_ENT_NAME_SIZE - 1] = '\0';
-
-        newDirEntries[1].inum = parentInodeNumber;
-        strncpy(newDirEntries[1].name, "..", DIR_ENT_NAME_SIZE - 1);
-        newDirEntries[1].name[DIR_ENT_NAME_SIZE - 1] = '\0';
-
-        for (int i = 0; i < super.num_data; ++i) {
-            int byteIndex = i / 8;
-            int bitIndex = i % 8;
-            if ((dataBitmap[byteIndex] & (1 << bitIndex)) == 0) {
-                secondFreeBlockNum = i + super.data_region_addr;
-                dataBitmap[byteIndex] |= (1 << bitIndex);  // Mark as used
-                break;
-            }
-        }
-        if (secondFreeBlockNum == -1) {
-            return -ENOTENOUGHSPACE;
-        }
-        newInode.direct[0] = secondFreeBlockNum;
-        disk->writeBlock(secondFreeBlockNum, blockBuffer);
+        setDirEntry(&super, &newDirEntries[0], ".", freeInodeNum, UFS_DIRECTORY);
+        setDirEntry(&super, &newDirEntries[1], "..", parentInodeNumber, UFS_DIRECTORY);
+
+        newInode.direct[0] = newDirReserved.back();
+        newDirReserved.pop_back();
+        writeDirBlock(newInode.direct[0], blockBuffer);
         newInode.size = 2 * sizeof(dir_ent_t);
+
+        if (newDirIndexed) {
+            newInode.flags |= UFS_INODE_DIR_INDEX;
+            newInode.direct[DIR_INDEX_PTR] = newDirReserved.back();
+            newDirReserved.pop_back();
+            DirIndex<BlockSize>::format(disk, newInode.direct[DIR_INDEX_PTR], newDirEntries, 2);
+        }
     }
+    storeInode(&super, freeInodeNum, &newInode);
 
-    // Update the inodes
-    inodes[freeInodeNum] = newInode;
-    inodes[parentInodeNumber] = parentInode;
-    inodeBitmap[freeInodeNum / 8] |= (1 << (freeInodeNum % 8));  // Mark inode as used
+    // Add the entry to the parent directory
+    dir_ent_t entry;
+    setDirEntry(&super, &entry, name, freeInodeNum, type);
+    addDirEntry(&parentInode, entry, reserved);
+    groups.releaseBlocks(reserved);
+    storeInode(&super, parentInodeNumber, &parentInode);
+    filters.add(parentInodeNumber, name);
+    filters.drop(freeInodeNum);
 
-    // Write updated inodes and bitmaps back to the disk
-    writeInodeRegion(&super, inodes);
-    writeInodeBitmap(&super, inodeBitmap);
-    writeDataBitmap(&super, dataBitmap);
     return freeInodeNum;
 }
 
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::createBatch(int parentInodeNumber, const vector<NewEntry> &entries,
+                                          vector<int> &inodeNumbers) {
+  int ret = tryCreateBatch(parentInodeNumber, entries, inodeNumbers);
+  if (ret == -ENOTENOUGHSPACE && reclaimOrphans(-1) > 0) {
+    ret = tryCreateBatch(parentInodeNumber, entries, inodeNumbers);
+  }
+  if (ret < 0) {
+    return ret;
+  }
 
-
-int LocalFileSystem::unlink(int parentInodeNumber, std::string name) {
-    if (name == "." || name == "..") {
-        return -EUNLINKNOTALLOWED;  // Prevent unlinking special directory entries
+  // Content that doesn't fit in the inode goes through write, so it is
+  // compressed, deduped and buffered like any other. The files are only
+  // named by the new entries, so the batch is taken back out if it
+  // doesn't fit.
+  super_t super;
+  readSuperBlock(&super);
+  bool inlineData = (super.features & UFS_FEATURE_INLINE_DATA) != 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].data.empty() || (inlineData && entries[i].data.size() <= UFS_INLINE_SIZE)) {
+      continue;
     }
+    ret = write(inodeNumbers[i], entries[i].data.data(), entries[i].data.size());
+    if (ret < 0) {
+      for (size_t j = 0; j < entries.size(); ++j) {
+        unlink(parentInodeNumber, entries[j].name);
+      }
+      inodeNumbers.clear();
+      return ret;
+    }
+  }
+  return 0;
+}
 
-    super_t super;
-    readSuperBlock(&super);
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::tryCreateBatch(int parentInodeNumber, const vector<NewEntry> &entries,
+                                             vector<int> &inodeNumbers) {
+  FileSystemLock fileSystemLock(&locks, false);
+  InodeLock parentLock(&locks, parentInodeNumber, true);
+  super_t super;
+  readSuperBlock(&super);
+  inodeNumbers.clear();
 
-    if (parentInodeNumber < 0 || parentInodeNumber >= super.num_inodes) {
-        return -EINVALIDINODE; 
-    }
-    if (name.empty() || name.length() >= DIR_ENT_NAME_SIZE - 1) {
-        return -EINVALIDNAME;
-    }
-    inode_t parentInode;
+  if (parentInodeNumber < 0 || parentInodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  }
+  inode_t parentInode;
+  if (stat(parentInodeNumber, &parentInode) != 0 || parentInode.type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+
+  // the directory is read once for every name in the batch
+  vector<DirEntry> existing;
+  readdir(parentInodeNumber, existing);
+  set<string> names;
+  for (size_t i = 0; i < existing.size(); ++i) {
+    names.insert(existing[i].name);
+  }
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].name.length() >= DIR_ENT_NAME_SIZE - 1 || !names.insert(entries[i].name).second
+        || isSnapshotDirEntry(&super, parentInodeNumber, entries[i].name)) {
+      return -EINVALIDNAME;
+    }
+    if (entries[i].type == UFS_DIRECTORY) {
+      if (!entries[i].data.empty()) {
+        return -EINVALIDTYPE;
+      }
+    } else if (entries[i].type != UFS_REGULAR_FILE) {
+      return -EINVALIDTYPE;
+    } else if (entries[i].data.size() > (size_t)Layout<BlockSize>::maxFileSize) {
+      return -EINVALIDSIZE;
+    }
+  }
+  if (entries.empty()) {
+    return 0;
+  }
+  int entryBlocks = addDirEntriesBlocksNeeded(&parentInode, entries.size());
+  if (entryBlocks < 0) {
+    return entryBlocks;
+  }
+
+  // Like create: files in the parent's group, directories spread out,
+  // and everything allocated before anything is written
+  bool newDirIndexed = (super.features & UFS_FEATURE_DIR_INDEX) != 0;
+  int newDirBlocks = newDirIndexed ? 2 : 1;
+  AllocationLock allocationLock(&locks, false);
+  int group = groups.inodeGroup(parentInodeNumber);
+  vector<unsigned int> reserved(entryBlocks);
+  if (!groups.allocateBlocks(group, entryBlocks, reserved.data(), reservedBlocks)) {
+    return -ENOTENOUGHSPACE;
+  }
+  vector<unsigned int> dirBlocks;
+  bool allocated = true;
+  for (size_t i = 0; i < entries.size() && allocated; ++i) {
+    bool directory = entries[i].type == UFS_DIRECTORY;
+    int inodeNumber = groups.allocateInode(directory ? groups.directoryGroup(group) : group);
+    if (inodeNumber < 0) {
+      allocated = false;
+      break;
+    }
+    inodeNumbers.push_back(inodeNumber);
+    if (directory) {
+      unsigned int blocks[2];
+      allocated = groups.allocateBlocks(groups.inodeGroup(inodeNumber), newDirBlocks, blocks, reservedBlocks);
+      dirBlocks.insert(dirBlocks.end(), blocks, blocks + (allocated ? newDirBlocks : 0));
+    }
+  }
+  if (!allocated) {
+    groups.releaseBlocks(reserved);
+    groups.releaseBlocks(dirBlocks);
+    for (size_t i = 0; i < inodeNumbers.size(); ++i) {
+      groups.releaseInode(inodeNumbers[i]);
+    }
+    inodeNumbers.clear();
+    return -ENOTENOUGHSPACE;
+  }
+
+  // The new inodes and directories first, nothing names them until the
+  // parent inode is written
+  vector<inode_t> newInodes(entries.size());
+  vector<dir_ent_t> newEntries(entries.size());
+  vector<unsigned int>::iterator nextDirBlock = dirBlocks.begin();
+  bool inlineData = (super.features & UFS_FEATURE_INLINE_DATA) != 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    inode_t newInode = {(short)entries[i].type, 0, 0, {0}};
+    const string &data = entries[i].data;
+    if (!data.empty() && inlineData && data.size() <= UFS_INLINE_SIZE) {
+      memcpy(newInode.direct, data.data(), data.size());
+      newInode.flags |= UFS_INODE_INLINE;
+      newInode.size = data.size();
+    } else if (entries[i].type == UFS_DIRECTORY) {
+      unsigned char blockBuffer[BlockSize];
+      memset(blockBuffer, 0, BlockSize);
+      dir_ent_t *newDirEntries = (dir_ent_t *)blockBuffer;
+      setDirEntry(&super, &newDirEntries[0], ".", inodeNumbers[i], UFS_DIRECTORY);
+      setDirEntry(&super, &newDirEntries[1], "..", parentInodeNumber, UFS_DIRECTORY);
+      newInode.direct[0] = *nextDirBlock++;
+      writeDirBlock(newInode.direct[0], blockBuffer);
+      newInode.size = 2 * sizeof(dir_ent_t);
+      if (newDirIndexed) {
+        newInode.flags |= UFS_INODE_DIR_INDEX;
+        newInode.direct[DIR_INDEX_PTR] = *nextDirBlock++;
+        DirIndex<BlockSize>::format(disk, newInode.direct[DIR_INDEX_PTR], newDirEntries, 2);
+      }
+    }
+    newInodes[i] = newInode;
+    setDirEntry(&super, &newEntries[i], entries[i].name, inodeNumbers[i], entries[i].type);
+  }
+  storeInodes(&super, inodeNumbers, newInodes);
+
+  vector<unsigned int> freed;
+  addDirEntries(&parentInode, newEntries, reserved, freed);
+  groups.releaseBlocks(reserved);
+  storeInode(&super, parentInodeNumber, &parentInode);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    filters.add(parentInodeNumber, entries[i].name);
+    filters.drop(inodeNumbers[i]);
+  }
+  groups.releaseBlocks(freed);
+  return 0;
+}
+
+
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::unlink(int parentInodeNumber, std::string name) {
+    if (name == "." || name == "..") {
+        return -EUNLINKNOTALLOWED;  // Prevent unlinking special directory entries
+    }
+    FileSystemLock fileSystemLock(&locks, false);
+    InodeLock parentLock(&locks, parentInodeNumber, true);
+
+    super_t super;
+    readSuperBlock(&super);
+
+    if (parentInodeNumber < 0 || parentInodeNumber >= super.num_inodes) {
+        return -EINVALIDINODE; 
+    }
+    if (name.empty() || name.length() >= DIR_ENT_NAME_SIZE - 1) {
+        return -EINVALIDNAME;
+    }
+    if (isSnapshotDirEntry(&super, parentInodeNumber, name)) {
+        return -EUNLINKNOTALLOWED;
+    }
+    inode_t parentInode;
     if (stat(parentInodeNumber, &parentInode) < 0 
         || parentInode.type != UFS_DIRECTORY) {
         return -EINVALIDINODE;  
     }
-    if(lookup(parentInodeNumber, name) < 0){ // not found
-      return 0;
+
+    dir_ent_t entry;
+    int position = findDirEntry(&parentInode, name, &entry);
+    if (position < 0) {
+        return 0;  // Entry not found is treated as a non-error in unlinking
+    }
+    int inodeToRemove = entry.inum;
+    InodeLock inodeLock(&locks, inodeToRemove, true);
+
+    // If it's a directory, ensure it's empty before changing anything
+    inode_t inodeToDelete;
+    loadInode(&super, inodeToRemove, &inodeToDelete);
+    if (inodeToDelete.type == UFS_DIRECTORY && (unsigned) inodeToDelete.size > 2 * sizeof(dir_ent_t)) {
+        return -EDIRNOTEMPTY;
+    }
+    filters.remove(parentInodeNumber);
+    filters.drop(inodeToRemove);
+
+    // While the reclaimer runs, a file with blocks only leaves its
+    // directory and goes on the orphan list, which takes the same few
+    // writes whatever its size
+    bool hasBlocks = inodeToDelete.type == UFS_REGULAR_FILE && !(inodeToDelete.flags & UFS_INODE_INLINE)
+        && inodeToDelete.direct[0] != 0;
+    vector<unsigned int> freed;
+    if (hasBlocks && reclaimerStarted && (super.features & UFS_FEATURE_ORPHAN_LIST)) {
+        discardPending(inodeToRemove);
+        AllocationLock allocationLock(&locks, false);
+        removeDirEntry(&super, &parentInode, position, freed);
+        storeInode(&super, parentInodeNumber, &parentInode);
+        addOrphan(inodeToRemove, &inodeToDelete);
+        groups.releaseBlocks(freed);
+        return 0;
+    }
+
+    if (hasBlocks && (super.features & UFS_FEATURE_REFCOUNTS)) {
+        // the reference counts of shared blocks are one region for every
+        // group, so they are released with the whole regions in memory
+        AllocationLock allocationLock(&locks);
+        vector<inode_t> inodes(super.num_inodes);
+        readInodeRegion(&super, inodes.data());
+        vector<unsigned char> dataBitmap(super.data_bitmap_len * BlockSize);
+        readDataBitmap(&super, dataBitmap.data());
+        vector<unsigned char> inodeBitmap(super.inode_bitmap_len * BlockSize);
+        readInodeBitmap(&super, inodeBitmap.data());
+
+        removeDirEntry(&super, &parentInode, position, freed);
+        releaseDataBlocks(&super, dataBitmap.data(), freed);
+        freeInode(&super, inodes.data(), inodeToRemove, inodeBitmap.data(), dataBitmap.data());
+
+        writeDataBitmap(&super, dataBitmap.data());
+        writeInodeBitmap(&super, inodeBitmap.data());
+
+        // Update the parent inode and all other inodes in the inode region
+        inodes[parentInodeNumber] = parentInode;
+        writeInodeRegion(&super, inodes.data());
+        return 0;
+    }
+
+    // Otherwise nothing else uses the inode's blocks, and they go back to
+    // their groups once nothing points at them any more
+    discardPending(inodeToRemove);
+    AllocationLock allocationLock(&locks, false);
+    removeDirEntry(&super, &parentInode, position, freed);
+    storeInode(&super, parentInodeNumber, &parentInode);
+    vector<unsigned int> released;
+    versions.waitForReaders(inodeToRemove);
+    releaseInodeBlocks(&inodeToDelete, NULL, released);
+    freed.insert(freed.end(), released.begin(), released.end());
+    memset(&inodeToDelete, 0, sizeof(inode_t));
+    storeInode(&super, inodeToRemove, &inodeToDelete);
+    versions.freed(inodeToRemove);
+    counters.forget(inodeToRemove);
+    groups.releaseInode(inodeToRemove);
+    groups.releaseBlocks(freed);
+
+    return 0;
+}
+
+
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::rename(int srcParentInodeNumber, std::string srcName,
+                                     int dstParentInodeNumber, std::string dstName) {
+  int ret = tryRename(srcParentInodeNumber, srcName, dstParentInodeNumber, dstName);
+  if (ret == -ENOTENOUGHSPACE && reclaimOrphans(-1) > 0) {
+    ret = tryRename(srcParentInodeNumber, srcName, dstParentInodeNumber, dstName);
+  }
+  return ret;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::tryRename(int srcParentInodeNumber, std::string srcName,
+                                        int dstParentInodeNumber, std::string dstName) {
+    if (srcName == "." || srcName == ".." || dstName == "." || dstName == "..") {
+        return -EUNLINKNOTALLOWED;
+    }
+
+    super_t super;
+    readSuperBlock(&super);
+
+    if (srcParentInodeNumber < 0 || srcParentInodeNumber >= super.num_inodes
+        || dstParentInodeNumber < 0 || dstParentInodeNumber >= super.num_inodes) {
+        return -EINVALIDINODE;
+    }
+    if (srcName.empty() || srcName.length() >= DIR_ENT_NAME_SIZE - 1
+        || dstName.empty() || dstName.length() >= DIR_ENT_NAME_SIZE - 1) {
+        return -EINVALIDNAME;
+    }
+    if (isSnapshotDirEntry(&super, srcParentInodeNumber, srcName)
+        || isSnapshotDirEntry(&super, dstParentInodeNumber, dstName)) {
+        return -EINVALIDMOVE;
+    }
+
+    // Only renames move directories, so under the rename lock the paths
+    // to both parents hold still. That gives the order to lock them in,
+    // a directory before anything below it, and tells whether a
+    // directory would move into itself.
+    FileSystemLock fileSystemLock(&locks, false);
+    RenameLock renameLock(&locks);
+    vector<int> srcAncestors;
+    vector<int> dstAncestors;
+    ancestors(srcParentInodeNumber, srcAncestors);
+    ancestors(dstParentInodeNumber, dstAncestors);
+    bool srcFirst = srcAncestors.size() < dstAncestors.size()
+        || (srcAncestors.size() == dstAncestors.size() && srcParentInodeNumber < dstParentInodeNumber);
+    InodeLock firstParentLock(&locks, srcFirst ? srcParentInodeNumber : dstParentInodeNumber, true);
+    InodeLock secondParentLock(&locks, srcFirst ? dstParentInodeNumber : srcParentInodeNumber, true);
+
+    // The moved inode and the one it replaces are locked next. Neither is
+    // above a parent: the move check rules that out for the first, and
+    // the second is refused unless it's a file or an empty directory.
+    inode_t srcParentInode;
+    inode_t dstParentInode;
+    dir_ent_t movedEntry;
+    dir_ent_t replacedEntry;
+    loadInode(&super, srcParentInodeNumber, &srcParentInode);
+    loadInode(&super, dstParentInodeNumber, &dstParentInode);
+    if (srcParentInode.type != UFS_DIRECTORY || dstParentInode.type != UFS_DIRECTORY) {
+        return -EINVALIDINODE;
+    }
+    if (findDirEntry(&srcParentInode, srcName, &movedEntry) < 0) {
+        return -ENOTFOUND;
+    }
+    if (find(dstAncestors.begin(), dstAncestors.end(), movedEntry.inum) != dstAncestors.end()) {
+        return -EINVALIDMOVE;
+    }
+    int replacedInodeNumber = -1;
+    if (findDirEntry(&dstParentInode, dstName, &replacedEntry) >= 0 && replacedEntry.inum != movedEntry.inum) {
+        inode_t moved;
+        inode_t replaced;
+        loadInode(&super, movedEntry.inum, &moved);
+        loadInode(&super, replacedEntry.inum, &replaced);
+        if (replaced.type != moved.type) {
+            return -EINVALIDTYPE;
+        }
+        if (replaced.type == UFS_DIRECTORY && (unsigned) replaced.size > 2 * sizeof(dir_ent_t)) {
+            return -EDIRNOTEMPTY;
+        }
+        replacedInodeNumber = replacedEntry.inum;
+    }
+    int firstChild = movedEntry.inum;
+    int secondChild = replacedInodeNumber;
+    if (secondChild >= 0 && secondChild < firstChild) {
+        swap(firstChild, secondChild);
+    }
+    InodeLock firstChildLock(&locks, firstChild, true);
+    InodeLock secondChildLock(&locks, secondChild >= 0 ? secondChild : firstChild, true);
+    AllocationLock allocationLock(&locks);
+
+    // Both parents are changed through the inode region, so renaming
+    // within one directory updates a single inode
+    vector<inode_t> inodes(super.num_inodes);
+    readInodeRegion(&super, inodes.data());
+    inode_t &srcParent = inodes[srcParentInodeNumber];
+    inode_t &dstParent = inodes[dstParentInodeNumber];
+    if (srcParent.type != UFS_DIRECTORY || dstParent.type != UFS_DIRECTORY) {
+        return -EINVALIDINODE;
+    }
+
+    dir_ent_t srcEntry;
+    int srcPosition = findDirEntry(&srcParent, srcName, &srcEntry);
+    if (srcPosition < 0) {
+        return -ENOTFOUND;
+    }
+    int inodeNumber = srcEntry.inum;
+    inode_t &inode = inodes[inodeNumber];
+
+    dir_ent_t dstEntry;
+    int dstPosition = findDirEntry(&dstParent, dstName, &dstEntry);
+    if (dstPosition >= 0 && dstEntry.inum == inodeNumber) {
+        return 0;  // renaming something to itself
+    }
+
+    // An existing destination is replaced like rename(2) does, as long as
+    // it has the same type and isn't a directory with entries in it
+    if (dstPosition >= 0) {
+        inode_t &replaced = inodes[dstEntry.inum];
+        if (replaced.type != inode.type) {
+            return -EINVALIDTYPE;
+        }
+        if (replaced.type == UFS_DIRECTORY && (unsigned) replaced.size > 2 * sizeof(dir_ent_t)) {
+            return -EDIRNOTEMPTY;
+        }
+    }
+
+    vector<unsigned char> dataBitmap(super.data_bitmap_len * BlockSize);
+    readDataBitmap(&super, dataBitmap.data());
+    vector<unsigned char> inodeBitmap(super.inode_bitmap_len * BlockSize);
+    readInodeBitmap(&super, inodeBitmap.data());
+
+    // Check for space before writing anything. Only a new destination
+    // entry can need blocks.
+    vector<unsigned int> reserved;
+    if (dstPosition < 0) {
+        int entryBlocks = addDirEntryBlocksNeeded(&dstParent);
+        if (entryBlocks < 0) {
+            return entryBlocks;
+        }
+        reserved.resize(entryBlocks);
+        if (!allocateDataBlocks(&super, dataBitmap.data(), reserved.size(), reserved.data(), reservedBlocks,
+                                groups.firstBlock(groups.inodeGroup(dstParentInodeNumber)))) {
+            return -ENOTENOUGHSPACE;
+        }
+    }
+
+    // Link the new name first so a crash never loses the object, then
+    // remove the old one
+    dir_ent_t entry;
+    setDirEntry(&super, &entry, dstName, inodeNumber, inode.type);
+    if (dstPosition >= 0) {
+        int replacedInodeNumber = dstEntry.inum;
+        replaceDirEntry(&dstParent, dstPosition, entry);
+        freeInode(&super, inodes.data(), replacedInodeNumber, inodeBitmap.data(), dataBitmap.data());
+        filters.drop(replacedInodeNumber);
+    } else {
+        addDirEntry(&dstParent, entry, reserved);
+        releaseDataBlocks(&super, dataBitmap.data(), reserved);
+        filters.add(dstParentInodeNumber, dstName);
+    }
+
+    // The destination entry may have moved the source entry when both
+    // are in the same directory, so look it up again
+    srcPosition = findDirEntry(&srcParent, srcName, &srcEntry);
+    vector<unsigned int> freed;
+    removeDirEntry(&super, &srcParent, srcPosition, freed);
+    releaseDataBlocks(&super, dataBitmap.data(), freed);
+    filters.remove(srcParentInodeNumber);
+
+    // A directory that changed parents has to point '..' at the new one
+    if (inode.type == UFS_DIRECTORY && srcParentInodeNumber != dstParentInodeNumber) {
+        dir_ent_t dotDot;
+        int dotDotPosition = findDirEntry(&inode, "..", &dotDot);
+        dotDot.inum = dstParentInodeNumber;
+        replaceDirEntry(&inode, dotDotPosition, dotDot);
+    }
+
+    writeDataBitmap(&super, dataBitmap.data());
+    writeInodeBitmap(&super, inodeBitmap.data());
+    writeInodeRegion(&super, inodes.data());
+
+    return 0;
+}
+
+
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::snapshot(std::string name) {
+  int ret = trySnapshot(name);
+  if (ret == -ENOTENOUGHSPACE && reclaimOrphans(-1) > 0) {
+    ret = trySnapshot(name);
+  }
+  return ret;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::trySnapshot(std::string name) {
+    // the whole tree is copied, nothing may change under it
+    FileSystemLock fileSystemLock(&locks, true);
+    super_t super;
+    readSuperBlock(&super);
+
+    // cold files are copied within the cold tier
+    if (!(super.features & UFS_FEATURE_SNAPSHOTS) || ((super.features & UFS_FEATURE_TIERED) && cold == NULL)) {
+        return -ENOTSUPPORTED;
+    }
+    if (name.empty() || name == "." || name == ".." || name.length() >= DIR_ENT_NAME_SIZE - 1) {
+        return -EINVALIDNAME;
+    }
+    // the snapshot has to see buffered content, and shares its blocks
+    sync();
+    readSuperBlock(&super);
+    int snapshotDir = lookup(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_SNAPSHOT_DIR);
+    if (snapshotDir >= 0 && lookup(snapshotDir, name) >= 0) {
+        return -EINVALIDNAME;
+    }
+
+    // Check for space before writing anything. The snapshot directory
+    // itself may have to be created, and it needs room for the new entry.
+    int inodesNeeded = 0;
+    int blocksNeeded = 0;
+    int coldBlocksNeeded = 0;
+    countTree(UFS_ROOT_DIRECTORY_INODE_NUMBER, &inodesNeeded, &blocksNeeded, &coldBlocksNeeded);
+    int entryBlocks;
+    if (snapshotDir < 0) {
+        inode_t root;
+        stat(UFS_ROOT_DIRECTORY_INODE_NUMBER, &root);
+        int rootEntryBlocks = addDirEntryBlocksNeeded(&root);
+        if (rootEntryBlocks < 0) {
+            return rootEntryBlocks;
+        }
+        // its entry block and index, plus the splits of both indexes
+        inodesNeeded += 1;
+        blocksNeeded += 2 + rootEntryBlocks;
+        entryBlocks = 2;
+    } else {
+        inode_t snapshotDirInode;
+        stat(snapshotDir, &snapshotDirInode);
+        entryBlocks = addDirEntryBlocksNeeded(&snapshotDirInode);
+        if (entryBlocks < 0) {
+            return entryBlocks;
+        }
+    }
+
+    if (!diskHasSpace(&super, inodesNeeded, 0, blocksNeeded + entryBlocks)
+        || (coldBlocksNeeded > 0 && cold->freeBlocks() < coldBlocksNeeded)) {
+        return -ENOTENOUGHSPACE;
+    }
+
+    if (snapshotDir < 0) {
+        snapshotDir = tryCreate(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, UFS_SNAPSHOT_DIR);
+        if (snapshotDir < 0) {
+            return snapshotDir;
+        }
+    }
+
+    // Copy the tree in memory and write the regions back once
+    vector<inode_t> inodes(super.num_inodes);
+    readInodeRegion(&super, inodes.data());
+    vector<unsigned char> inodeBitmap(super.inode_bitmap_len * BlockSize);
+    readInodeBitmap(&super, inodeBitmap.data());
+    vector<unsigned char> dataBitmap(super.data_bitmap_len * BlockSize);
+    readDataBitmap(&super, dataBitmap.data());
+    inode_t snapshotDirInode = inodes[snapshotDir];
+    vector<unsigned int> reserved(blocksNeeded + addDirEntryBlocksNeeded(&snapshotDirInode));
+    allocateDataBlocks(&super, dataBitmap.data(), reserved.size(), reserved.data(), reservedBlocks);
+
+    // the copies are new directories in inodes that may have been others
+    filters.clear();
+    DedupStore<BlockSize> store(disk, &super);
+    int copy = copyTree(&super, inodes.data(), inodeBitmap.data(), &store, UFS_ROOT_DIRECTORY_INODE_NUMBER,
+                        snapshotDir, reserved);
+    inodes[copy].flags |= UFS_INODE_SNAPSHOT;
+
+    dir_ent_t entry;
+    setDirEntry(&super, &entry, name, copy, UFS_DIRECTORY);
+    addDirEntry(&inodes[snapshotDir], entry, reserved);
+    releaseDataBlocks(&super, dataBitmap.data(), reserved);
+
+    store.flush();
+    writeDataBitmap(&super, dataBitmap.data());
+    writeInodeBitmap(&super, inodeBitmap.data());
+    writeInodeRegion(&super, inodes.data());
+
+    return copy;
+}
+
+
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::deleteSnapshot(std::string name) {
+    FileSystemLock fileSystemLock(&locks, true);
+    super_t super;
+    readSuperBlock(&super);
+
+    int snapshotDir = lookup(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_SNAPSHOT_DIR);
+    if (snapshotDir < 0 || name == "." || name == "..") {
+        return -ENOTFOUND;
     }
-    inode_t inodes[super.num_inodes];
-    readInodeRegion(&super, inodes);
 
-    unsigned char blockBuffer[UFS_BLOCK_SIZE];
-    bool found = false;
-    int inodeToRemove = -1;
-    int blockNumToRemove = -1;
-    int entryIndexToRemove = -1;
+    vector<inode_t> inodes(super.num_inodes);
+    readInodeRegion(&super, inodes.data());
+    dir_ent_t entry;
+    int position = findDirEntry(&inodes[snapshotDir], name, &entry);
+    if (position < 0 || inodes[entry.inum].type != UFS_DIRECTORY
+        || !(inodes[entry.inum].flags & UFS_INODE_SNAPSHOT)) {
+        return -ENOTFOUND;
+    }
+
+    vector<unsigned char> inodeBitmap(super.inode_bitmap_len * BlockSize);
+    readInodeBitmap(&super, inodeBitmap.data());
+    vector<unsigned char> dataBitmap(super.data_bitmap_len * BlockSize);
+    readDataBitmap(&super, dataBitmap.data());
+
+    freeTree(&super, inodes.data(), entry.inum, inodeBitmap.data(), dataBitmap.data());
+    freeInode(&super, inodes.data(), entry.inum, inodeBitmap.data(), dataBitmap.data());
+    filters.clear();
+    vector<unsigned int> freed;
+    removeDirEntry(&super, &inodes[snapshotDir], position, freed);
+    // the directory goes with the last snapshot, so the root only lists
+    // it while there are snapshots
+    if ((unsigned) inodes[snapshotDir].size <= 2 * sizeof(dir_ent_t)) {
+        dir_ent_t snapshotsEntry;
+        int rootPosition = findDirEntry(&inodes[UFS_ROOT_DIRECTORY_INODE_NUMBER], UFS_SNAPSHOT_DIR, &snapshotsEntry);
+        removeDirEntry(&super, &inodes[UFS_ROOT_DIRECTORY_INODE_NUMBER], rootPosition, freed);
+        freeInode(&super, inodes.data(), snapshotDir, inodeBitmap.data(), dataBitmap.data());
+    }
+    releaseDataBlocks(&super, dataBitmap.data(), freed);
+
+    writeDataBitmap(&super, dataBitmap.data());
+    writeInodeBitmap(&super, inodeBitmap.data());
+    writeInodeRegion(&super, inodes.data());
+
+    return 0;
+}
+
+
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::write(int inodeNumber, const void *buffer, int size) {
+  touch(inodeNumber);
+  int ret = tryWrite(inodeNumber, buffer, size);
+  if (ret == -ENOTENOUGHSPACE && reclaimOrphans(-1) > 0) {
+    ret = tryWrite(inodeNumber, buffer, size);
+  }
+  if (ret == -ENOTENOUGHSPACE) {
+    wakeMigrator();
+  }
+  return ret;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::tryWrite(int inodeNumber, const void *buffer, int size) {
+  FileSystemLock fileSystemLock(&locks, false);
+  // the content is written out before the inode is locked, see writeThrough
+  if (writeBack.flushIntervalMs <= 0) {
+    return writeThrough(inodeNumber, buffer, size);
+  }
+  InodeLock inodeLock(&locks, inodeNumber, true);
+
+  super_t super;
+  readSuperBlock(&super);
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  }
+  inode_t inode;
+  if (stat(inodeNumber, &inode) != 0) {
+    return -EINVALIDINODE;
+  }
+  if (inode.type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+  if (size < 0 || size > Layout<BlockSize>::maxFileSize) {
+    return -EINVALIDSIZE;
+  }
+
+  // The most blocks the content can take once it is flushed. Compression
+  // and dedup only ever need fewer, and tiny files go in the inode.
+  bool storeInline = (super.features & UFS_FEATURE_INLINE_DATA) && size <= (int)UFS_INLINE_SIZE;
+  int reserve = storeInline ? 0 : Layout<BlockSize>::blocksFor(size);
+
+  // reservations are part of allocation, and a write that can't buffer
+  // keeps the lock until it's done so its reservation can't go to anyone else
+  AllocationLock allocationLock(&locks);
+  typename map<int, PendingWrite>::iterator it = pending.find(inodeNumber);
+  int alreadyReserved = it != pending.end() ? it->second.reservedBlocks : 0;
+  long long alreadyBuffered = it != pending.end() ? it->second.content.size() : 0;
+  int otherReserved = reservedBlocks - alreadyReserved;
+
+  // the blocks the file has now are only freed when the new content is
+  // flushed, so the reservation has to fit next to them. Its own
+  // reservation can be reused.
+  if (!diskHasSpace(&super, 0, 0, reserve - alreadyReserved)
+      || pendingBytes - alreadyBuffered + size > writeBack.maxBufferedBytes) {
+    // no room to buffer it, the content goes to disk right away in place
+    // of whatever was buffered, which can use the file's own reservation
+    reservedBlocks -= alreadyReserved;
+    int ret = writeThrough(inodeNumber, buffer, size);
+    reservedBlocks += alreadyReserved;
+    if (ret >= 0) {
+      discardPending(inodeNumber);
+    }
+    return ret;
+  }
+
+  if (journal != NULL) {
+    journal->logWrite(inodeNumber, buffer, size);
+  }
+  if (it == pending.end()) {
+    it = pending.insert(make_pair(inodeNumber, PendingWrite())).first;
+    it->second.since = chrono::steady_clock::now();
+  }
+  it->second.content.assign((const unsigned char *)buffer, (const unsigned char *)buffer + size);
+  it->second.reservedBlocks = reserve;
+  reservedBlocks = otherReserved + reserve;
+  pendingBytes += size - alreadyBuffered;
+
+  return size;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::flushPending(int inodeNumber) {
+  // the reservation is what the write is about to allocate, so nobody
+  // else may allocate until it has
+  InodeLock inodeLock(&locks, inodeNumber, true);
+  AllocationLock allocationLock(&locks);
+  typename map<int, PendingWrite>::iterator it = pending.find(inodeNumber);
+  if (it == pending.end()) {
+    return;
+  }
+  reservedBlocks -= it->second.reservedBlocks;
+  pendingBytes -= it->second.content.size();
+  vector<unsigned char> content;
+  content.swap(it->second.content);
+  pending.erase(it);
+
+  if (writeThrough(inodeNumber, content.data(), content.size()) < 0) {
+    cerr << "could not flush inode " << inodeNumber << endl;
+    exit(1);
+  }
+  if (journal != NULL) {
+    journal->logDiscard(inodeNumber);
+    if (pending.empty()) {
+      journal->clear();
+    }
+  }
+}
+
+template <int BlockSize>
+bool UfsFileSystem<BlockSize>::isPending(int inodeNumber) {
+  AllocationLock allocationLock(&locks);
+  return pending.count(inodeNumber) > 0;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::discardPending(int inodeNumber) {
+  AllocationLock allocationLock(&locks);
+  typename map<int, PendingWrite>::iterator it = pending.find(inodeNumber);
+  if (it == pending.end()) {
+    return;
+  }
+  reservedBlocks -= it->second.reservedBlocks;
+  pendingBytes -= it->second.content.size();
+  pending.erase(it);
+  if (journal != NULL) {
+    journal->logDiscard(inodeNumber);
+    if (pending.empty()) {
+      journal->clear();
+    }
+  }
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::setWriteBack(const WriteBackOptions &options) {
+  FileSystemLock fileSystemLock(&locks, true);
+  sync();
+  delete journal;
+  journal = NULL;
+  writeBack = options;
+  if (options.journalFile.empty()) {
+    return;
+  }
+
+  // content a crash kept from reaching the image, for files that still
+  // exist. The inodes are checked since the journal is only as good as
+  // the image it was written next to.
+  journal = new WriteJournal(options.journalFile);
+  map<int, vector<unsigned char> > writes;
+  journal->replay(writes);
+  for (map<int, vector<unsigned char> >::iterator it = writes.begin(); it != writes.end(); ++it) {
+    inode_t inode;
+    if (stat(it->first, &inode) == 0 && inode.type == UFS_REGULAR_FILE
+        && writeThrough(it->first, it->second.data(), it->second.size()) < 0) {
+      cerr << "could not replay journal " << options.journalFile << endl;
+      exit(1);
+    }
+  }
+  journal->clear();
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::flushExpired() {
+  FileSystemLock fileSystemLock(&locks, false);
+  chrono::steady_clock::time_point expired =
+    chrono::steady_clock::now() - chrono::milliseconds(writeBack.flushIntervalMs);
+  // inode locks come before the allocation lock, so the list is made
+  // first and each inode checked again once it is locked
+  vector<int> inodeNumbers;
+  AllocationLock allocationLock(&locks);
+  for (typename map<int, PendingWrite>::iterator it = pending.begin(); it != pending.end(); ++it) {
+    if (it->second.since <= expired) {
+      inodeNumbers.push_back(it->first);
+    }
+  }
+  allocationLock.unlock();
+  for (size_t i = 0; i < inodeNumbers.size(); ++i) {
+    flushPending(inodeNumbers[i]);
+  }
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::sync() {
+  FileSystemLock fileSystemLock(&locks, false);
+  vector<int> inodeNumbers;
+  AllocationLock allocationLock(&locks);
+  for (typename map<int, PendingWrite>::iterator it = pending.begin(); it != pending.end(); ++it) {
+    inodeNumbers.push_back(it->first);
+  }
+  allocationLock.unlock();
+  for (size_t i = 0; i < inodeNumbers.size(); ++i) {
+    flushPending(inodeNumbers[i]);
+  }
+}
+
+// Blocks the reclaimer frees between two looks at whether a request
+// is waiting for the Disk
+#define RECLAIM_BATCH_BLOCKS (64)
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::startReclaimer() {
+  FileSystemLock fileSystemLock(&locks, true);
+  super_t super;
+  readSuperBlock(&super);
+  if (reclaimerStarted || !(super.features & UFS_FEATURE_ORPHAN_LIST)) {
+    return;
+  }
+  reclaimOrphans(-1);
+  reclaimerStarted = true;
+  if (pthread_create(&reclaimerThread, NULL, reclaimer, this) != 0) {
+    cerr << "could not start the reclaimer" << endl;
+    exit(1);
+  }
+}
+
+template <int BlockSize>
+void *UfsFileSystem<BlockSize>::reclaimer(void *arg) {
+  UfsFileSystem<BlockSize> *fs = (UfsFileSystem<BlockSize> *)arg;
+  pthread_mutex_lock(&fs->orphanLock);
+  while (!fs->stopReclaimer) {
+    if (!fs->orphansWaiting) {
+      pthread_cond_wait(&fs->orphansAdded, &fs->orphanLock);
+      continue;
+    }
+    fs->orphansWaiting = false;
+    pthread_mutex_unlock(&fs->orphanLock);
+
+    // A batch is its own transaction, so a caller's rollback can't undo
+    // it, and callers can start theirs in between
+    fs->disk->beginTransaction();
+    int reclaimed = fs->reclaimOrphans(RECLAIM_BATCH_BLOCKS);
+    fs->disk->commit();
+
+    pthread_mutex_lock(&fs->orphanLock);
+    if (reclaimed > 0) {
+      fs->orphansWaiting = true;
+    }
+  }
+  pthread_mutex_unlock(&fs->orphanLock);
+  return NULL;
+}
+
+// Free blocks the zeroer keeps zeroed. It fills the pool again once half
+// of it is used.
+#define ZERO_POOL_BLOCKS (64)
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::startZeroer() {
+  // with dedup, the zero blocks truncate adds all share one block
+  super_t super;
+  readSuperBlock(&super);
+  if (zeroerStarted || (super.features & UFS_FEATURE_DEDUP)) {
+    return;
+  }
+  zeroerStarted = true;
+  poolLow = true;
+  if (pthread_create(&zeroerThread, NULL, zeroer, this) != 0) {
+    cerr << "could not start the zeroer" << endl;
+    exit(1);
+  }
+}
+
+template <int BlockSize>
+void *UfsFileSystem<BlockSize>::zeroer(void *arg) {
+  UfsFileSystem<BlockSize> *fs = (UfsFileSystem<BlockSize> *)arg;
+  pthread_mutex_lock(&fs->zeroerLock);
+  while (!fs->stopZeroer) {
+    if (!fs->poolLow) {
+      pthread_cond_wait(&fs->zeroingWanted, &fs->zeroerLock);
+      continue;
+    }
+    fs->poolLow = false;
+    pthread_mutex_unlock(&fs->zeroerLock);
+
+    // In a transaction of its own like the reclaimer's batches, and while
+    // it is open no caller has one whose rollback could hand a block it
+    // freed back to the file that had it
+    fs->disk->beginTransaction();
+    {
+      FileSystemLock fileSystemLock(&fs->locks, false);
+      fs->groups.zeroFreeBlocks(ZERO_POOL_BLOCKS - fs->groups.zeroedBlocks());
+    }
+    fs->disk->commit();
+
+    pthread_mutex_lock(&fs->zeroerLock);
+  }
+  pthread_mutex_unlock(&fs->zeroerLock);
+  return NULL;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::wakeZeroer() {
+  if (!zeroerStarted || groups.zeroedBlocks() >= ZERO_POOL_BLOCKS / 2) {
+    return;
+  }
+  pthread_mutex_lock(&zeroerLock);
+  poolLow = true;
+  pthread_cond_signal(&zeroingWanted);
+  pthread_mutex_unlock(&zeroerLock);
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::attachColdTier(string coldImageFile) {
+  FileSystemLock fileSystemLock(&locks, true);
+  super_t super;
+  readSuperBlock(&super);
+  if (cold != NULL || super.version == 0 || (super.features & UFS_FEATURE_LOG)) {
+    return -ENOTSUPPORTED;
+  }
+  ColdTier<BlockSize> *tier = ColdTier<BlockSize>::open(coldImageFile);
+  if (tier == NULL) {
+    return -ENOTSUPPORTED;
+  }
+  if (super.tier_id != tier->tierId()) {
+    delete tier;
+    return -ENOTSUPPORTED;
+  }
+  if (super.tier_id == 0) {
+    // the image first, so a crash in between leaves two images that
+    // don't pair instead of a cold tier that pairs with any image
+    int tierId = (int)((time(NULL) ^ ((long long)getpid() << 16)) & 0x7fffffff);
+    super.tier_id = tierId != 0 ? tierId : 1;
+    super.features |= UFS_FEATURE_TIERED;
+    writeSuperBlock(&super);
+    tier->setTierId(super.tier_id);
+  }
+  tier->joinTransactions(disk);
+  cold = tier;
+  return 0;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::startMigrator(const TieringOptions &options) {
+  if (migratorStarted || cold == NULL) {
+    return;
+  }
+  tiering = options;
+  migratorStarted = true;
+  if (pthread_create(&migratorThread, NULL, migrator, this) != 0) {
+    cerr << "could not start the migrator" << endl;
+    exit(1);
+  }
+}
+
+template <int BlockSize>
+void *UfsFileSystem<BlockSize>::migrator(void *arg) {
+  UfsFileSystem<BlockSize> *fs = (UfsFileSystem<BlockSize> *)arg;
+  pthread_mutex_lock(&fs->migratorLock);
+  while (!fs->stopMigrator) {
+    // a pass every interval, or right away for a write that ran out of
+    // space
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long nanoseconds = deadline.tv_nsec + fs->tiering.intervalMs * 1000000LL;
+    deadline.tv_sec += nanoseconds / 1000000000LL;
+    deadline.tv_nsec = nanoseconds % 1000000000LL;
+    while (!fs->stopMigrator && !fs->spaceWanted
+           && pthread_cond_timedwait(&fs->migrationWanted, &fs->migratorLock, &deadline) != ETIMEDOUT) {
+    }
+    if (fs->stopMigrator) {
+      break;
+    }
+    fs->spaceWanted = false;
+    pthread_mutex_unlock(&fs->migratorLock);
+
+    fs->migrate();
+    fs->counters.decay();
+
+    pthread_mutex_lock(&fs->migratorLock);
+  }
+  pthread_mutex_unlock(&fs->migratorLock);
+  return NULL;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::wakeMigrator() {
+  if (!migratorStarted) {
+    return;
+  }
+  pthread_mutex_lock(&migratorLock);
+  spaceWanted = true;
+  pthread_cond_signal(&migrationWanted);
+  pthread_mutex_unlock(&migratorLock);
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::touch(int inodeNumber) {
+  // without a migrator nothing decays the counts
+  if (migratorStarted) {
+    counters.touch(inodeNumber);
+  }
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::releaseColdBlocks(const vector<unsigned int> &blocks) {
+  if (cold != NULL && !blocks.empty()) {
+    cold->releaseBlocks(blocks);
+  }
+}
+
+// A file the migrator could move, see migrate
+struct TierCandidate {
+  int inodeNumber;
+  int accesses;
+  int blocks;
+};
+
+// The least used first, and the bigger of two files used as much, which
+// makes more room
+static bool colderFirst(const TierCandidate &a, const TierCandidate &b) {
+  if (a.accesses != b.accesses) {
+    return a.accesses < b.accesses;
+  }
+  return a.blocks > b.blocks;
+}
+
+static bool hotterFirst(const TierCandidate &a, const TierCandidate &b) {
+  return a.accesses > b.accesses;
+}
+
+// Whether the migrator can move the blocks of a file at all
+static bool canMigrate(inode_t *inode) {
+  return inode->type == UFS_REGULAR_FILE && !(inode->flags & (UFS_INODE_INLINE | UFS_INODE_ORPHAN))
+    && inode->direct[0] != 0;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::migrate() {
+  // The files to pick from, as they are now. Each move looks at its
+  // file again with the file locked.
+  super_t super;
+  readSuperBlock(&super);
+  vector<inode_t> inodes(super.num_inodes);
+  {
+    FileSystemLock fileSystemLock(&locks, false);
+    readInodeRegion(&super, inodes.data());
+  }
+  vector<TierCandidate> hot;
+  vector<TierCandidate> coldFiles;
+  for (int i = 0; i < super.num_inodes; ++i) {
+    if (!canMigrate(&inodes[i])) {
+      continue;
+    }
+    TierCandidate candidate = {i, counters.count(i), fileBlockCount<BlockSize>(&inodes[i])};
+    if (inodes[i].flags & UFS_INODE_COLD) {
+      coldFiles.push_back(candidate);
+    } else {
+      hot.push_back(candidate);
+    }
+  }
+  sort(hot.begin(), hot.end(), colderFirst);
+  sort(coldFiles.begin(), coldFiles.end(), hotterFirst);
+
+  long long high = (long long)super.num_data * tiering.highPercent / 100;
+  long long low = (long long)super.num_data * tiering.lowPercent / 100;
+  size_t next = 0;
+  bool coldFull = false;
+
+  // Above the high watermark the least used files go down until usage is
+  // under the low one
+  if (super.num_data - groups.freeBlocks() > high) {
+    while (next < hot.size() && !coldFull && super.num_data - groups.freeBlocks() > low) {
+      coldFull = migrateFile(hot[next++].inodeNumber, true) == -ENOTENOUGHSPACE;
+    }
+  }
+
+  // Cold files in use come back up where they fit under the low
+  // watermark, and files used less than them make room
+  for (size_t i = 0; i < coldFiles.size() && coldFiles[i].accesses >= tiering.promoteAccesses; ++i) {
+    while (super.num_data - groups.freeBlocks() + coldFiles[i].blocks > low && next < hot.size() && !coldFull
+           && hot[next].accesses < coldFiles[i].accesses) {
+      coldFull = migrateFile(hot[next++].inodeNumber, true) == -ENOTENOUGHSPACE;
+    }
+    if (super.num_data - groups.freeBlocks() + coldFiles[i].blocks > low) {
+      break;
+    }
+    migrateFile(coldFiles[i].inodeNumber, false);
+  }
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::migrateFile(int inodeNumber, bool toCold) {
+  // a transaction of its own like a reclaimer batch. Nothing is changed
+  // before a move fails, so it is always committed.
+  disk->beginTransaction();
+  int ret = toCold ? moveDown(inodeNumber) : moveUp(inodeNumber);
+  disk->commit();
+  return ret;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::moveDown(int inodeNumber) {
+  FileSystemLock fileSystemLock(&locks, false);
+  // held for the whole move, so the file can't change in between
+  InodeLock inodeLock(&locks, inodeNumber, true);
+  super_t super;
+  readSuperBlock(&super);
+  inode_t inode;
+  loadInode(&super, inodeNumber, &inode);
+  if (!canMigrate(&inode) || (inode.flags & UFS_INODE_COLD) || isPending(inodeNumber)) {
+    return -EINVALIDTYPE;
+  }
+
+  // Refcounts are one region for every group, see writeThrough, and
+  // blocks shared with a snapshot or another file stay where they are
+  bool refcounts = (super.features & UFS_FEATURE_REFCOUNTS) != 0;
+  AllocationLock allocationLock(&locks, refcounts);
+  DedupStore<BlockSize> dedup(disk, &super);
+  int count = fileBlockCount<BlockSize>(&inode);
+  for (int i = 0; i < count && refcounts; ++i) {
+    if (dedup.references(inode.direct[i]) != 1) {
+      return -EINVALIDTYPE;
+    }
+  }
+  if (!refcounts) {
+    allocationLock.unlock();
+  }
+
+  vector<unsigned int> hotBlocks(inode.direct, inode.direct + count);
+  inode_t moved = inode;
+  if (!cold->allocateBlocks(count, moved.direct)) {
+    return -ENOTENOUGHSPACE;
+  }
+  moved.flags |= UFS_INODE_COLD;
+  unsigned char block[BlockSize];
+  for (int i = 0; i < count; ++i) {
+    disk->readBlock(hotBlocks[i], block);
+    cold->writeBlock(moved.direct[i], block);
+  }
+
+  if (refcounts) {
+    vector<unsigned char> dataBitmap(super.data_bitmap_len * BlockSize);
+    readDataBitmap(&super, dataBitmap.data());
+    storeInode(&super, inodeNumber, &moved);
+    versions.waitForReaders(inodeNumber);
+    for (int i = 0; i < count; ++i) {
+      releaseFileBlock(&super, dataBitmap.data(), &dedup, hotBlocks[i]);
+    }
+    dedup.flush();
+    writeDataBitmap(&super, dataBitmap.data());
+    return count;
+  }
+  allocationLock.lock();
+  storeInode(&super, inodeNumber, &moved);
+  allocationLock.unlock();
+  versions.waitForReaders(inodeNumber);
+  allocationLock.lock();
+  groups.releaseBlocks(hotBlocks);
+  return count;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::moveUp(int inodeNumber) {
+  FileSystemLock fileSystemLock(&locks, false);
+  InodeLock inodeLock(&locks, inodeNumber, true);
+  super_t super;
+  readSuperBlock(&super);
+  inode_t inode;
+  loadInode(&super, inodeNumber, &inode);
+  if (!canMigrate(&inode) || !(inode.flags & UFS_INODE_COLD) || isPending(inodeNumber)) {
+    return -EINVALIDTYPE;
+  }
+
+  int count = fileBlockCount<BlockSize>(&inode);
+  vector<unsigned int> coldBlocks(inode.direct, inode.direct + count);
+  vector<unsigned char> content(count * BlockSize);
+  for (int i = 0; i < count; ++i) {
+    cold->readBlock(coldBlocks[i], &content[i * BlockSize]);
+  }
+  inode_t moved = inode;
+  moved.flags &= ~UFS_INODE_COLD;
+  int group = groups.inodeGroup(inodeNumber);
+
+  if (super.features & UFS_FEATURE_REFCOUNTS) {
+    // stored like the content of a write, see writeThrough
+    AllocationLock allocationLock(&locks);
+    DedupStore<BlockSize> dedup(disk, &super);
+    vector<unsigned int> newBlocks(dedup.blocksNeeded(content.data(), count));
+    vector<unsigned char> dataBitmap(super.data_bitmap_len * BlockSize);
+    readDataBitmap(&super, dataBitmap.data());
+    if (!allocateDataRun(&super, dataBitmap.data(), newBlocks.size(), newBlocks.data(), reservedBlocks,
+                         groups.firstBlock(group))) {
+      return -ENOTENOUGHSPACE;
+    }
+    reverse(newBlocks.begin(), newBlocks.end());
+    for (int i = 0; i < count; ++i) {
+      moved.direct[i] = dedup.store(&content[i * BlockSize], newBlocks);
+    }
+    dedup.flush();
+    storeInode(&super, inodeNumber, &moved);
+    writeDataBitmap(&super, dataBitmap.data());
+  } else {
+    AllocationLock allocationLock(&locks, false);
+    if (!groups.allocateBlocks(group, count, moved.direct, reservedBlocks)) {
+      return -ENOTENOUGHSPACE;
+    }
+    allocationLock.unlock();
+    for (int i = 0; i < count; ++i) {
+      disk->writeBlock(moved.direct[i], &content[i * BlockSize]);
+    }
+    allocationLock.lock();
+    storeInode(&super, inodeNumber, &moved);
+  }
+  versions.waitForReaders(inodeNumber);
+  cold->releaseBlocks(coldBlocks);
+  return count;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::addOrphan(int inodeNumber, inode_t *inode) {
+  pthread_mutex_lock(&orphanLock);
+  super_t super;
+  readSuperBlock(&super);
+  inode->flags |= UFS_INODE_ORPHAN;
+  inode->size = super.orphan_head;
+  storeInode(&super, inodeNumber, inode);
+  super.orphan_head = inodeNumber;
+  writeSuperBlock(&super);
+  orphansWaiting = true;
+  pthread_cond_signal(&orphansAdded);
+  pthread_mutex_unlock(&orphanLock);
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::reclaimOrphans(int batchBlocks) {
+  FileSystemLock fileSystemLock(&locks, false);
+  int orphans = 0;
+  int blocks = 0;
+  while (batchBlocks < 0 || blocks < batchBlocks) {
+    super_t super;
+    readSuperBlock(&super);
+    if (!(super.features & UFS_FEATURE_ORPHAN_LIST) || super.orphan_head == 0) {
+      break;
+    }
+    // the newest orphan is the easiest to take off the list, and another
+    // thread freeing it first just means looking again
+    int freed = reclaimOrphan(super.orphan_head);
+    if (freed >= 0) {
+      orphans++;
+      blocks += freed;
+    }
+  }
+  return orphans;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::reclaimOrphan(int inodeNumber) {
+  // nothing names an orphan, only stale inode numbers can lock it too
+  InodeLock inodeLock(&locks, inodeNumber, true);
+  super_t super;
+  readSuperBlock(&super);
+  inode_t orphan;
+  loadInode(&super, inodeNumber, &orphan);
+  if (!(orphan.flags & UFS_INODE_ORPHAN)) {
+    return -1;
+  }
+
+  // The orphan stops pointing at its blocks before they are released, so
+  // a crash in between leaks them rather than releasing them twice.
+  // Refcounts are one region for every group, see writeThrough.
+  bool refcounts = (super.features & UFS_FEATURE_REFCOUNTS) != 0;
+  AllocationLock allocationLock(&locks, refcounts);
+  pthread_mutex_lock(&orphanLock);
+  inode_t cleared;
+  loadInode(&super, inodeNumber, &cleared);
+  memset(cleared.direct, 0, sizeof(cleared.direct));
+  cleared.flags = UFS_INODE_ORPHAN;
+  storeInode(&super, inodeNumber, &cleared);
+  pthread_mutex_unlock(&orphanLock);
+
+  DedupStore<BlockSize> store(disk, &super);
+  vector<unsigned int> freed;
+  versions.waitForReaders(inodeNumber);
+  releaseInodeBlocks(&orphan, refcounts ? &store : NULL, freed);
+  allocationLock.unlock();
+  groups.releaseBlocks(freed);
+
+  // Take it off the list, the list first so a crash leaks the inode
+  // instead of leaving a free inode on the list. Newer orphans point at
+  // it when it isn't the head.
+  allocationLock.lock();
+  pthread_mutex_lock(&orphanLock);
+  readSuperBlock(&super);
+  loadInode(&super, inodeNumber, &cleared);
+  if (super.orphan_head == inodeNumber) {
+    super.orphan_head = cleared.size;
+    writeSuperBlock(&super);
+  } else {
+    inode_t newer;
+    for (int current = super.orphan_head; current != 0; current = newer.size) {
+      loadInode(&super, current, &newer);
+      if (newer.size == inodeNumber) {
+        newer.size = cleared.size;
+        storeInode(&super, current, &newer);
+        break;
+      }
+    }
+  }
+  memset(&cleared, 0, sizeof(inode_t));
+  storeInode(&super, inodeNumber, &cleared);
+  pthread_mutex_unlock(&orphanLock);
+  versions.freed(inodeNumber);
+  counters.forget(inodeNumber);
+  groups.releaseInode(inodeNumber);
+  return freed.size();
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::writeThrough(int inodeNumber, const void *buffer, int size) {
+  super_t super;
+  readSuperBlock(&super);
+
+  // Error check: invalid inode number
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+      return -EINVALIDINODE;
+  }
+  if (size < 0 || size > Layout<BlockSize>::maxFileSize) {
+      return -EINVALIDSIZE;
+  }
 
-    int parentFileBlocks = (parentInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  // The content is put together without the inode lock. The inode is
+  // loaded again to point it at the new blocks, and the generation says
+  // whether it is still the same file by then.
+  inode_t fileInode;
+  long long generation;
+  {
+      InodeLock inodeLock(&locks, inodeNumber, false);
+      loadInode(&super, inodeNumber, &fileInode);
+      generation = versions.generation(inodeNumber);
+  }
+  if (fileInode.flags & UFS_INODE_ORPHAN) {
+      return -EINVALIDINODE;
+  }
+  if (fileInode.type != UFS_REGULAR_FILE) {
+      return -EINVALIDTYPE;
+  }
 
-    for (int i = 0; i < DIRECT_PTRS && parentInode.direct[i] != 0; i++) {
-        if (parentInode.direct[i] == 0) continue;
-        disk->readBlock(parentInode.direct[i], blockBuffer);
-        dir_ent_t* dirEntries = reinterpret_cast<dir_ent_t*>(blockBuffer);
+  // Tiny files are stored in the inode itself and don't need any blocks
+  bool storeInline = (super.features & UFS_FEATURE_INLINE_DATA) && size <= (int)UFS_INLINE_SIZE;
 
-        // Calculate the number of entries valid in the current block
-        int numEntries = min(UFS_BLOCK_SIZE/sizeof(dir_ent_t), 
-                          (parentInode.size % UFS_BLOCK_SIZE)/sizeof(dir_ent_t));
-        if (i == parentFileBlocks - 1) {
-            numEntries = (parentInode.size % UFS_BLOCK_SIZE) / sizeof(dir_ent_t);
-        }
+  // Calculate the number of blocks needed for the new size
+  int newFileBlocks = size / BlockSize;
+  if (size % BlockSize != 0) {
+      newFileBlocks += 1;
+  }
+  if (storeInline) {
+      newFileBlocks = 0;
+  }
 
-        for (int j = 0; j < numEntries; j++) {
-            if (strcmp(dirEntries[j].name, name.c_str()) == 0) {
-                inodeToRemove = dirEntries[j].inum;
-                blockNumToRemove = parentInode.direct[i];
-                entryIndexToRemove = j;
-                found = true;
-                dirEntries[entryIndexToRemove] = dirEntries[numEntries - 1];  // Move the last entry to the deleted spot
-                memset(&(dirEntries[numEntries - 1]), 0, sizeof(dir_ent_t));  // Clear the last entry
-                disk->writeBlock(blockNumToRemove, blockBuffer);
-                break;
-            }
-        }
-        if (found){
-          break;
-        } 
-    }
+  // Larger files are compressed in chunks when that saves at least one
+  // block, and kept as they are otherwise (UFS_FEATURE_COMPRESSION)
+  const char *data = (const char *)buffer;
+  int storedSize = size;
+  vector<unsigned char> compressed;
+  bool storeCompressed = false;
+  if ((super.features & UFS_FEATURE_COMPRESSION) && newFileBlocks > 1) {
+      int compressedBlocks = compressChunks<BlockSize>((const unsigned char *)buffer, size, compressed);
+      if (compressedBlocks < newFileBlocks) {
+          storeCompressed = true;
+          data = (const char *)compressed.data();
+          storedSize = compressed.size();
+          newFileBlocks = compressedBlocks;
+      }
+  }
 
-    if (!found) {
-        return 0;  // Entry not found is treated as a non-error in unlinking
-    }
+  // The new block pointers and how the content is stored. The rest of
+  // the inode is taken from what it is when they are swapped in.
+  inode_t newInode;
+  memset(&newInode, 0, sizeof(inode_t));
+  unsigned short storedFlags = storeCompressed ? UFS_INODE_COMPRESSED : 0;
+  if (storeInline) {
+      // an inline file has its content where the block pointers go
+      memcpy(newInode.direct, data, size);
+      storedFlags = UFS_INODE_INLINE;
+  }
 
-    // If it's a directory, ensure it's empty
-    inode_t& inodeToDelete = inodes[inodeToRemove];
-    if (inodeToDelete.type == UFS_DIRECTORY && (unsigned) inodeToDelete.size > 2 * sizeof(dir_ent_t)) {
-        return -EDIRNOTEMPTY;
-    }
+  // The refcounts are one region shared with every file, so with
+  // UFS_FEATURE_REFCOUNTS the whole bitmap is used with every group held
+  // and the inode locked throughout
+  if (super.features & UFS_FEATURE_REFCOUNTS) {
+      InodeLock inodeLock(&locks, inodeNumber, true);
+      loadInode(&super, inodeNumber, &fileInode);
+      if (versions.generation(inodeNumber) != generation || (fileInode.flags & UFS_INODE_ORPHAN)) {
+          return -EINVALIDINODE;
+      }
+      newInode.type = fileInode.type;
+      newInode.flags = (fileInode.flags & ~(UFS_INODE_INLINE | UFS_INODE_COMPRESSED | UFS_INODE_COLD))
+          | storedFlags;
+      newInode.size = size;
+      AllocationLock allocationLock(&locks);
+      int group = groups.inodeGroup(inodeNumber);
+
+      // Blocks whose content is already on disk are shared, so only the
+      // rest need free blocks
+      DedupStore<BlockSize> dedup(disk, &super);
+      vector<unsigned char> blocks(newFileBlocks * BlockSize, 0);
+      memcpy(blocks.data(), data, storeInline ? 0 : storedSize);
+      int blocksNeeded = dedup.blocksNeeded(blocks.data(), newFileBlocks);
+
+      /*out of storage errors, before modify anything*/
+      // The new blocks are taken before the old ones are let go, so the new
+      // content has to fit next to the old. The whole file is known here, so
+      // its blocks can be placed in a row.
+      vector<unsigned int> newBlocks(blocksNeeded);
+      vector<unsigned char> dataBitmap(super.data_bitmap_len * BlockSize);
+      readDataBitmap(&super, dataBitmap.data());
+      if (!allocateDataRun(&super, dataBitmap.data(), blocksNeeded, newBlocks.data(), reservedBlocks,
+                           groups.firstBlock(group))) {
+          return -ENOTENOUGHSPACE;
+      }
 
-    // Clear data blocks and update the data bitmap if it's a directory or file
-    unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
-    readDataBitmap(&super, dataBitmap);
-    unsigned char blockClearBuffer[UFS_BLOCK_SIZE];
-    for (int i = 0; i < DIRECT_PTRS && inodeToDelete.direct[i] != 0; i++) {
-        int bitmapIndex = inodeToDelete.direct[i] - super.data_region_addr;
-        dataBitmap[bitmapIndex / 8] &= ~(1 << (bitmapIndex % 8));  // Clear the bit in the data bitmap
-        memset(blockClearBuffer, 0, UFS_BLOCK_SIZE);
-        disk->writeBlock(inodeToDelete.direct[i], blockClearBuffer);  // Clear the block
-        inodeToDelete.direct[i] = 0;  // Remove reference to the block
-    }
-    writeDataBitmap(&super, dataBitmap);
+      // store takes spare blocks from the back. Shared blocks are released
+      // only after the new content is stored, so blocks that didn't
+      // change are kept.
+      reverse(newBlocks.begin(), newBlocks.end());
+      for (int i = 0; i < newFileBlocks; ++i) {
+          newInode.direct[i] = dedup.store(&blocks[i * BlockSize], newBlocks);
+      }
+      // a cold file's blocks are in the cold tier, without refcounts
+      int currentFileBlocks = fileBlockCount<BlockSize>(&fileInode);
+      vector<unsigned int> coldBlocks;
+      if (fileInode.flags & UFS_INODE_COLD) {
+          coldBlocks.assign(fileInode.direct, fileInode.direct + currentFileBlocks);
+          currentFileBlocks = 0;
+      }
+      versions.waitForReaders(inodeNumber);
+      for (int i = 0; i < currentFileBlocks; ++i) {
+          releaseFileBlock(&super, dataBitmap.data(), &dedup, fileInode.direct[i]);
+      }
+      dedup.flush();
 
-    // Free the inode
-    unsigned char inodeBitmap[super.inode_bitmap_len * UFS_BLOCK_SIZE];
-    readInodeBitmap(&super, inodeBitmap);
-    inodeBitmap[inodeToRemove / 8] &= ~(1 << (inodeToRemove % 8));  // Clear the bit in the inode bitmap
-    memset(&inodes[inodeToRemove], 0, sizeof(inode_t));  // Clear inode data
-    writeInodeBitmap(&super, inodeBitmap);
+      storeInode(&super, inodeNumber, &newInode);
+      if (newFileBlocks > 0 || currentFileBlocks > 0) {
+          writeDataBitmap(&super, dataBitmap.data());
+      }
+      releaseColdBlocks(coldBlocks);
+      return size;
+  }
 
-    // Update the parent inode and all other inodes in the inode region
-    parentInode.size -= sizeof(dir_ent_t);  // Update the size of the parent inode
-    inodes[parentInodeNumber] = parentInode;
-    writeInodeRegion(&super, inodes);
+  /*out of storage errors, before modify anything*/
+  // Otherwise the blocks come from the file's group. They are taken
+  // before the old ones are let go, so the new content has to fit next
+  // to the old.
+  AllocationLock allocationLock(&locks, false);
+  int group = groups.inodeGroup(inodeNumber);
+  vector<unsigned int> newBlocks(newFileBlocks);
+  if (!groups.allocateBlocks(group, newFileBlocks, newBlocks.data(), reservedBlocks)) {
+      return -ENOTENOUGHSPACE;
+  }
+  allocationLock.unlock();
 
-    return 0;
-}
+  // Other files can allocate and this one can be read while the content
+  // goes out. A crash before the inode is written leaks the new blocks.
+  copy(newBlocks.begin(), newBlocks.end(), newInode.direct);
+  int bytesToWrite = storeInline ? 0 : storedSize;
+  int bytesWritten = 0;
+  for (int i = 0; i < newFileBlocks && bytesToWrite > 0; ++i) {
+      int blockNumber = newInode.direct[i];
+      // Write to that block, the last one might only be partially filled
+      int bytesToCopy = min(BlockSize, bytesToWrite);
+      unsigned char blockBuffer[BlockSize];
+      memset(blockBuffer, 0, BlockSize);
+      memcpy(blockBuffer, data + bytesWritten, bytesToCopy);
+      disk->writeBlock(blockNumber, blockBuffer);
+      bytesWritten += bytesToCopy;
+      bytesToWrite -= bytesToCopy;
+  }
+
+  // Point the inode at the new blocks, in place of whatever it has now.
+  // Other inodes of the group share the inode's block. The old blocks
+  // are freed once the reads that may still use them are done.
+  vector<unsigned int> oldBlocks;
+  bool wasCold;
+  {
+      InodeLock inodeLock(&locks, inodeNumber, true);
+      loadInode(&super, inodeNumber, &fileInode);
+      if (versions.generation(inodeNumber) != generation || (fileInode.flags & UFS_INODE_ORPHAN)) {
+          // unlinked in the meantime
+          allocationLock.lock();
+          groups.releaseBlocks(newBlocks);
+          return -EINVALIDINODE;
+      }
+      oldBlocks.assign(fileInode.direct, fileInode.direct + fileBlockCount<BlockSize>(&fileInode));
+      wasCold = (fileInode.flags & UFS_INODE_COLD) != 0;
+      newInode.type = fileInode.type;
+      newInode.flags = (fileInode.flags & ~(UFS_INODE_INLINE | UFS_INODE_COMPRESSED | UFS_INODE_COLD))
+          | storedFlags;
+      newInode.size = size;
+      allocationLock.lock();
+      storeInode(&super, inodeNumber, &newInode);
+      allocationLock.unlock();
+  }
+  versions.waitForReaders(inodeNumber);
+  if (wasCold) {
+      releaseColdBlocks(oldBlocks);
+      return size;
+  }
+  allocationLock.lock();
+  groups.releaseBlocks(oldBlocks);
 
+  return size; // Success: return the number of bytes written
+}
 
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::append(int inodeNumber, const void *buffer, int size) {
+  touch(inodeNumber);
+  int ret = tryAppend(inodeNumber, buffer, size);
+  if (ret == -ENOTENOUGHSPACE && reclaimOrphans(-1) > 0) {
+    ret = tryAppend(inodeNumber, buffer, size);
+  }
+  if (ret == -ENOTENOUGHSPACE) {
+    wakeMigrator();
+  }
+  return ret;
+}
 
-int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::tryAppend(int inodeNumber, const void *buffer, int size) {
+  FileSystemLock fileSystemLock(&locks, false);
+  InodeLock inodeLock(&locks, inodeNumber, true);
   super_t super;
   readSuperBlock(&super);
 
-  // Error check: invalid inode number
   if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
-      return -EINVALIDINODE;
+    return -EINVALIDINODE;
+  }
+  // only the inode we append to is loaded, not the whole inode region
+  inode_t inode;
+  if (stat(inodeNumber, &inode) != 0) {
+    return -EINVALIDINODE;
+  }
+  if (inode.type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+  if (size < 0 || size > Layout<BlockSize>::maxFileSize - inode.size) {
+    return -EINVALIDSIZE;
+  }
+  if (size == 0) {
+    return 0;
   }
 
-  // Load inodes into memory
-  inode_t inodes[super.num_inodes];
-  readInodeRegion(&super, inodes);
-  // actual inode in inodes, update to inode will update inodes
-  inode_t *inode = &inodes[inodeNumber];
-
-  if (inode->type != UFS_REGULAR_FILE) {
-      return -EINVALIDTYPE;
+  const unsigned char *data = (const unsigned char *)buffer;
+  int appendSize = size;
+
+  // Only the last chunk of a compressed file is stored again, with the
+  // appended data, on refcounted images (mkfs makes no others with
+  // compression). The file is written again whole when the chunks no
+  // longer save a block, and so is content that is still buffered, and a
+  // cold file, which comes back to the image that way.
+  bool refcounts = (super.features & UFS_FEATURE_REFCOUNTS) != 0;
+  bool pending = isPending(inodeNumber);
+  if ((inode.flags & UFS_INODE_COMPRESSED) && !(inode.flags & UFS_INODE_COLD) && refcounts && !pending) {
+    int ret = rewriteChunks(&super, inodeNumber, &inode, inode.size + size, data);
+    if (ret <= 0) {
+      return ret < 0 ? ret : appendSize;
+    }
   }
-  if (size < 0 || size > MAX_FILE_SIZE) {
-      return -EINVALIDSIZE;
+  if ((inode.flags & (UFS_INODE_COMPRESSED | UFS_INODE_COLD)) || pending) {
+    vector<unsigned char> content(inode.size + size);
+    int ret = read(inodeNumber, content.data(), inode.size);
+    if (ret < 0) {
+      return ret;
+    }
+    memcpy(content.data() + inode.size, data, size);
+    ret = write(inodeNumber, content.data(), content.size());
+    return ret < 0 ? ret : appendSize;
   }
 
-  // Calculate the number of blocks needed for the new size
-  int newFileBlocks = size / UFS_BLOCK_SIZE;
-  if (size % UFS_BLOCK_SIZE != 0) {
-      newFileBlocks += 1;
+  // the inode block and the bitmap are shared with other files. Refcounts
+  // are one region for every group, see writeThrough.
+  AllocationLock allocationLock(&locks, refcounts);
+  int group = groups.inodeGroup(inodeNumber);
+
+  // tiny files grow in place inside the inode
+  bool canInline = (super.features & UFS_FEATURE_INLINE_DATA)
+    && (inode.size == 0 || (inode.flags & UFS_INODE_INLINE));
+  if (canInline && inode.size + size <= (int)UFS_INLINE_SIZE) {
+    memcpy((unsigned char *)inode.direct + inode.size, data, size);
+    inode.flags |= UFS_INODE_INLINE;
+    inode.size += size;
+    storeInode(&super, inodeNumber, &inode);
+    return appendSize;
   }
 
-  // Initialize the databitmap
-  unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
-  readDataBitmap(&super, dataBitmap);
+  // an inline file that outgrows the inode spills to blocks, with its old
+  // content written in front of the appended data
+  vector<unsigned char> spilled;
+  if (inode.flags & UFS_INODE_INLINE) {
+    spilled.assign((unsigned char *)inode.direct, (unsigned char *)inode.direct + inode.size);
+    spilled.insert(spilled.end(), data, data + size);
+    data = spilled.data();
+    size = spilled.size();
+    inode.size = 0;
+    inode.flags &= ~UFS_INODE_INLINE;
+    memset(inode.direct, 0, sizeof(inode.direct));
+  }
 
-  /*out of storage errors, before modify anything*/ 
-  int freeBlocks = 0;
-  // go thorugh the entire data region until enough free blocks are found
-  for (int j = 0; j < super.num_data && freeBlocks < newFileBlocks; ++j) {
-      int byteIndex = j / 8;
-      int bitIndex = j % 8;
-      if ((dataBitmap[byteIndex] & (1 << bitIndex)) == 0) {
-          freeBlocks++;
-      }
+  int currentFileBlocks = (inode.size + BlockSize - 1) / BlockSize;
+  int newFileBlocks = (inode.size + size + BlockSize - 1) / BlockSize;
+  int tailOffset = inode.size % BlockSize;
+
+  if (refcounts) {
+    // The tail block may be shared with other files, so instead of filling
+    // it up in place it is stored again together with the appended data
+    int firstBlock = tailOffset != 0 ? currentFileBlocks - 1 : currentFileBlocks;
+    int count = newFileBlocks - firstBlock;
+    vector<unsigned char> blocks(count * BlockSize, 0);
+    if (tailOffset != 0) {
+      disk->readBlock(inode.direct[firstBlock], blocks.data());
+    }
+    memcpy(blocks.data() + tailOffset, data, size);
+
+    /*out of storage errors, before modify anything*/
+    vector<unsigned char> dataBitmap(super.data_bitmap_len * BlockSize);
+    readDataBitmap(&super, dataBitmap.data());
+    DedupStore<BlockSize> dedup(disk, &super);
+    vector<unsigned int> spareBlocks(dedup.blocksNeeded(blocks.data(), count));
+    if (!allocateDataBlocks(&super, dataBitmap.data(), spareBlocks.size(), spareBlocks.data(), reservedBlocks,
+                            groups.firstBlock(group))) {
+      return -ENOTENOUGHSPACE;
+    }
+    unsigned int oldTail = inode.direct[firstBlock];
+    for (int i = 0; i < count; ++i) {
+      inode.direct[firstBlock + i] = dedup.store(&blocks[i * BlockSize], spareBlocks);
+    }
+    if (tailOffset != 0) {
+      versions.waitForReaders(inodeNumber);
+      releaseFileBlock(&super, dataBitmap.data(), &dedup, oldTail);
+    }
+    dedup.flush();
+
+    writeDataBitmap(&super, dataBitmap.data());
+    inode.size += size;
+    writeInode(&super, inodeNumber, &inode);
+    return appendSize;
   }
-  if (freeBlocks < newFileBlocks) {
+
+  /*out of storage errors, before modify anything*/
+  if (!groups.allocateBlocks(group, newFileBlocks - currentFileBlocks, &inode.direct[currentFileBlocks],
+                             reservedBlocks)) {
     return -ENOTENOUGHSPACE;
   }
 
-  // Clear existing data blocks
-  int currentFileBlocks = inode->size / UFS_BLOCK_SIZE;
-  if (inode->size % UFS_BLOCK_SIZE != 0) {
-      currentFileBlocks += 1;
+  unsigned char blockBuffer[BlockSize];
+  int bytesWritten = 0;
+
+  // fill up the partially used tail block first
+  if (tailOffset != 0) {
+    int bytesToCopy = min(BlockSize - tailOffset, size);
+    disk->readBlock(inode.direct[currentFileBlocks - 1], blockBuffer);
+    memcpy(blockBuffer + tailOffset, data, bytesToCopy);
+    disk->writeBlock(inode.direct[currentFileBlocks - 1], blockBuffer);
+    bytesWritten += bytesToCopy;
   }
-  // S I D |Data_region_addr
-  // 0 1 2 |3 4 5 6 7 8 9 10
-  for (int i = 0; i < currentFileBlocks; ++i) {
-    // data region starts at 4th block, subtract it to relatively get the true index
-    int blockNumber = inode->direct[i] - super.data_region_addr;
-    int byteIndex = blockNumber / 8;
-    int bitIndex = blockNumber % 8;
-    dataBitmap[byteIndex] &= ~(1 << bitIndex);
-    inode->direct[i] = 0;
+
+  // the rest goes to the freshly allocated blocks
+  for (int i = currentFileBlocks; i < newFileBlocks; ++i) {
+    int bytesToCopy = min(BlockSize, size - bytesWritten);
+    memset(blockBuffer, 0, BlockSize);
+    memcpy(blockBuffer, data + bytesWritten, bytesToCopy);
+    disk->writeBlock(inode.direct[i], blockBuffer);
+    bytesWritten += bytesToCopy;
   }
 
-  // Allocate new blocks for this file and write data into them
-  const char *data = (const char *)buffer;
-  int bytesToWrite = size;
-  int bytesWritten = 0;
+  // the bitmap is written already, the inode that points to the data last
+  inode.size += size;
+  storeInode(&super, inodeNumber, &inode);
 
-  for (int i = 0; i < newFileBlocks && bytesToWrite > 0; ++i) {
-      int blockNumber = -1;
-      // iterate through all data blocks and find free blocks to write in
-      for (int j = 0; j < super.num_data; ++j) {
-          int byteIndex = j / 8;
-          int bitIndex = j % 8;
-          // if there is a free block
-          if ((dataBitmap[byteIndex] & (1 << bitIndex)) == 0) {
-              blockNumber = j + super.data_region_addr;
-              // change it to indicate it's used
-              dataBitmap[byteIndex] |= (1 << bitIndex); 
-              break;
-          }
-      }
+  return appendSize;
+}
 
-      // Update the inode to the new blocknum
-      inode->direct[i] = blockNumber;
-      // Write to that block
-      int bytesToCopy = min(UFS_BLOCK_SIZE, bytesToWrite);
-      disk->writeBlock(blockNumber, (void*)(data + bytesWritten));
-      bytesWritten += bytesToCopy;
-      bytesToWrite -= bytesToCopy;
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::truncate(int inodeNumber, int size) {
+  touch(inodeNumber);
+  int ret = tryTruncate(inodeNumber, size);
+  if (ret == -ENOTENOUGHSPACE && reclaimOrphans(-1) > 0) {
+    ret = tryTruncate(inodeNumber, size);
+  }
+  if (ret == -ENOTENOUGHSPACE) {
+    wakeMigrator();
+  }
+  return ret;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::tryTruncate(int inodeNumber, int size) {
+  FileSystemLock fileSystemLock(&locks, false);
+  InodeLock inodeLock(&locks, inodeNumber, true);
+  super_t super;
+  readSuperBlock(&super);
+
+  if (inodeNumber < 0 || inodeNumber >= super.num_inodes) {
+    return -EINVALIDINODE;
+  }
+  inode_t inode;
+  if (stat(inodeNumber, &inode) != 0) {
+    return -EINVALIDINODE;
+  }
+  if (inode.type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+  if (size < 0 || size > Layout<BlockSize>::maxFileSize) {
+    return -EINVALIDSIZE;
+  }
+  if (size == inode.size) {
+    return 0;
   }
 
-  // Update inode size
-  inode->size = size;
+  // Compressed files keep the chunks before the new end, like append. The
+  // rest is written again at the new size, and so is content that is
+  // still buffered and a cold file.
+  bool refcounts = (super.features & UFS_FEATURE_REFCOUNTS) != 0;
+  bool pending = isPending(inodeNumber);
+  if ((inode.flags & UFS_INODE_COMPRESSED) && !(inode.flags & UFS_INODE_COLD) && refcounts && !pending) {
+    int ret = rewriteChunks(&super, inodeNumber, &inode, size, NULL);
+    if (ret <= 0) {
+      return ret;
+    }
+  }
+  if ((inode.flags & (UFS_INODE_COMPRESSED | UFS_INODE_COLD)) || pending) {
+    vector<unsigned char> content(size, 0);
+    int ret = read(inodeNumber, content.data(), min(size, inode.size));
+    if (ret < 0) {
+      return ret;
+    }
+    ret = write(inodeNumber, content.data(), size);
+    return ret < 0 ? ret : 0;
+  }
+
+  // the inode block and the bitmap are shared with other files. Refcounts
+  // are one region for every group, see writeThrough.
+  AllocationLock allocationLock(&locks, refcounts);
+  int group = groups.inodeGroup(inodeNumber);
+
+  bool canInline = (super.features & UFS_FEATURE_INLINE_DATA)
+    && (inode.size == 0 || (inode.flags & UFS_INODE_INLINE));
+  if (canInline && size <= (int)UFS_INLINE_SIZE) {
+    // bytes past the end of an inline file are always kept zeroed
+    if (size < inode.size) {
+      memset((unsigned char *)inode.direct + size, 0, inode.size - size);
+    }
+    inode.flags |= UFS_INODE_INLINE;
+    inode.size = size;
+    storeInode(&super, inodeNumber, &inode);
+    return 0;
+  }
+
+  int currentFileBlocks = fileBlockCount<BlockSize>(&inode);
+  int newFileBlocks = (size + BlockSize - 1) / BlockSize;
+
+  if (refcounts) {
+    // Blocks are only shared whole, so bytes past the end of a file are
+    // always zero. Growing adds zero blocks, and shrinking stores the block
+    // with the new end again, zeroed past it, instead of changing it in place.
+    int firstBlock = currentFileBlocks;
+    if (size < inode.size) {
+      firstBlock = size % BlockSize != 0 ? newFileBlocks - 1 : newFileBlocks;
+    }
+    int count = newFileBlocks - firstBlock;
+    vector<unsigned char> blocks(count * BlockSize, 0);
+    if (size < inode.size && count > 0) {
+      disk->readBlock(inode.direct[firstBlock], blocks.data());
+      memset(blocks.data() + size % BlockSize, 0, BlockSize - size % BlockSize);
+    }
+    // the blocks growing adds are all zeros, except the first when it
+    // takes the content of an inline file
+    int zeroBlocks = 0;
+    if (size > inode.size) {
+      zeroBlocks = (inode.flags & UFS_INODE_INLINE) ? count - 1 : count;
+    }
+    if (inode.flags & UFS_INODE_INLINE) {
+      memcpy(blocks.data(), inode.direct, inode.size);
+      memset(inode.direct, 0, sizeof(inode.direct));
+      inode.flags &= ~UFS_INODE_INLINE;
+    }
+
+    vector<unsigned char> dataBitmap(super.data_bitmap_len * BlockSize);
+    readDataBitmap(&super, dataBitmap.data());
+    DedupStore<BlockSize> dedup(disk, &super);
+    vector<unsigned int> spareBlocks(dedup.blocksNeeded(blocks.data(), count));
+    if (!allocateDataBlocks(&super, dataBitmap.data(), spareBlocks.size(), spareBlocks.data(), reservedBlocks,
+                            groups.firstBlock(group))) {
+      return -ENOTENOUGHSPACE;
+    }
+    // Without dedup every zero block would be a new one written with
+    // zeros, so the last ones come from the zeroed pool instead and give
+    // back as many spare blocks. With dedup they all share one block.
+    vector<unsigned int> pooled;
+    if (zeroerStarted && !(super.features & UFS_FEATURE_DEDUP) && zeroBlocks > 0) {
+      pooled.resize(zeroBlocks);
+      pooled.resize(groups.allocateZeroedBits(group, dataBitmap.data(), zeroBlocks, pooled.data()));
+      vector<unsigned int> unused(spareBlocks.end() - pooled.size(), spareBlocks.end());
+      spareBlocks.resize(spareBlocks.size() - pooled.size());
+      releaseDataBlocks(&super, dataBitmap.data(), unused);
+      wakeZeroer();
+    }
+    vector<unsigned int> oldBlocks(inode.direct + firstBlock, inode.direct + currentFileBlocks);
+    for (int i = firstBlock; i < currentFileBlocks; ++i) {
+      inode.direct[i] = 0;
+    }
+    int firstPooled = count - pooled.size();
+    for (int i = 0; i < firstPooled; ++i) {
+      inode.direct[firstBlock + i] = dedup.store(&blocks[i * BlockSize], spareBlocks);
+    }
+    // blocks from the zeroed pool are zeros already and only need their
+    // first reference
+    for (size_t i = 0; i < pooled.size(); ++i) {
+      dedup.share(pooled[i]);
+      inode.direct[firstBlock + firstPooled + i] = pooled[i];
+    }
+    versions.waitForReaders(inodeNumber);
+    for (size_t i = 0; i < oldBlocks.size(); ++i) {
+      releaseFileBlock(&super, dataBitmap.data(), &dedup, oldBlocks[i]);
+    }
+    dedup.flush();
+
+    writeDataBitmap(&super, dataBitmap.data());
+    inode.size = size;
+    writeInode(&super, inodeNumber, &inode);
+    return 0;
+  }
+
+  if (size > inode.size) {
+    // an inline file that grows past the inode spills to blocks
+    unsigned char inlineData[UFS_INLINE_SIZE];
+    int inlineSize = 0;
+    if (inode.flags & UFS_INODE_INLINE) {
+      inlineSize = inode.size;
+      memcpy(inlineData, inode.direct, inlineSize);
+      memset(inode.direct, 0, sizeof(inode.direct));
+    }
+
+    /*out of storage errors, before modify anything*/
+    int zeroed;
+    if (!groups.allocateZeroedBlocks(group, newFileBlocks - currentFileBlocks, &inode.direct[currentFileBlocks],
+                                     reservedBlocks, &zeroed)) {
+      return -ENOTENOUGHSPACE;
+    }
+    wakeZeroer();
+    inode.flags &= ~UFS_INODE_INLINE;
+
+    // the old tail block can still hold bytes from before an earlier
+    // shrink, so zero everything past the old end of the file
+    unsigned char blockBuffer[BlockSize];
+    int tailOffset = inode.size % BlockSize;
+    if (currentFileBlocks > 0 && tailOffset != 0) {
+      disk->readBlock(inode.direct[currentFileBlocks - 1], blockBuffer);
+      memset(blockBuffer + tailOffset, 0, BlockSize - tailOffset);
+      disk->writeBlock(inode.direct[currentFileBlocks - 1], blockBuffer);
+    }
+    // blocks from the zeroed pool are zeros already
+    for (int i = currentFileBlocks; i < newFileBlocks; ++i) {
+      if (i < currentFileBlocks + zeroed && !(i == 0 && inlineSize > 0)) {
+        continue;
+      }
+      memset(blockBuffer, 0, BlockSize);
+      if (i == 0) {
+        memcpy(blockBuffer, inlineData, inlineSize);
+      }
+      disk->writeBlock(inode.direct[i], blockBuffer);
+    }
+  }
 
-  // Write updated inodes and bitmaps back to the disk
-  writeInodeRegion(&super, inodes);
-  writeDataBitmap(&super, dataBitmap);
+  // the blocks past the new end of the file are released once the inode
+  // no longer points to them
+  vector<unsigned int> released;
+  for (int i = newFileBlocks; i < currentFileBlocks; ++i) {
+    released.push_back(inode.direct[i]);
+    inode.direct[i] = 0;
+  }
+  inode.size = size;
+  storeInode(&super, inodeNumber, &inode);
+  if (!released.empty()) {
+    versions.waitForReaders(inodeNumber);
+  }
+  groups.releaseBlocks(released);
 
-  return bytesWritten; // Success: return the number of bytes written
+  return 0;
 }
 
 // Helper functions, you should read/write the entire inode and bitmap regions
-void LocalFileSystem::readSuperBlock(super_t *super){
-  // since block 0 is the super block and its size ought to be 4096 bytes, we make a temp buffer to ensure it
-  char buffer[UFS_BLOCK_SIZE];
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::readSuperBlock(super_t *super){
+  // block 0 is the super block, so we read the whole block into a temp buffer
+  char buffer[BlockSize];
   disk->readBlock(0, buffer);
   memcpy(super, buffer, sizeof(super_t));
 }
 
-void LocalFileSystem::readInodeBitmap(super_t *super, unsigned char *inodeBitmap){
-    // Calculate the start address and the number of blocks to read for the inode bitmap
-    int startBlock = super->inode_bitmap_addr;
-    int numBlocks = super->inode_bitmap_len;
-
-    // Loop through the blocks and read them into the inodeBitmap buffer
-    for (int i = 0; i < numBlocks; ++i) {
-        disk->readBlock(startBlock + i, inodeBitmap + (i * UFS_BLOCK_SIZE));
-    }
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::writeSuperBlock(super_t *super){
+  char buffer[BlockSize];
+  disk->readBlock(0, buffer);
+  memcpy(buffer, super, sizeof(super_t));
+  disk->writeBlock(0, buffer);
 }
-void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *dataBitmap){
-    // Calculate the start address and the number of blocks to read for the data bitmap
-    int startBlock = super->data_bitmap_addr;
-    int numBlocks = super->data_bitmap_len;
 
-    // Loop through the blocks and read them into the dataBitmap buffer
-    for (int i = 0; i < numBlocks; ++i) {
-        disk->readBlock(startBlock + i, dataBitmap + (i * UFS_BLOCK_SIZE));
-    }
+template <int BlockSize>
+bool UfsFileSystem<BlockSize>::diskHasSpace(super_t *super, int numInodesNeeded, int numDataBytesNeeded,
+                                            int numDataBlocksNeeded) {
+  int blocksNeeded = Layout<BlockSize>::blocksFor(numDataBytesNeeded) + numDataBlocksNeeded;
+  return groups.freeInodes() >= numInodesNeeded && groups.freeBlocks() - reservedBlocks >= blocksNeeded;
 }
-void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes){
-  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
-  int numBlocks = super->inode_region_len;
 
-  for (int i = 0; i < numBlocks; ++i) {
-    unsigned char buffer[UFS_BLOCK_SIZE];
-    disk->readBlock(super->inode_region_addr + i, buffer);
-    for (int j = 0; j < inodesPerBlock; ++j) {
-        int inodeIndex = i * inodesPerBlock + j;
-        if (inodeIndex >= super->num_inodes){
-          break;
-        } 
-        memcpy(&inodes[inodeIndex], buffer + j * sizeof(inode_t), sizeof(inode_t));
-    }
-  }
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::readInodeBitmap(super_t *super, unsigned char *inodeBitmap){
+    // the whole bitmap in one read
+    disk->readBlocks(super->inode_bitmap_addr, super->inode_bitmap_len, inodeBitmap);
+}
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::readDataBitmap(super_t *super, unsigned char *dataBitmap){
+    disk->readBlocks(super->data_bitmap_addr, super->data_bitmap_len, dataBitmap);
+}
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::readInodeRegion(super_t *super, inode_t *inodes){
+  // read the region in one go, then keep the inodes that exist (the last
+  // block can be partly unused)
+  vector<unsigned char> buffer((size_t)super->inode_region_len * BlockSize);
+  disk->readBlocks(super->inode_region_addr, super->inode_region_len, buffer.data());
+  memcpy(inodes, buffer.data(), (size_t)super->num_inodes * sizeof(inode_t));
 }
 
-void LocalFileSystem::writeInodeBitmap(super_t *super, unsigned char *inodeBitmap){
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::writeInodeBitmap(super_t *super, unsigned char *inodeBitmap){
   int startBlock = super->inode_bitmap_addr;
   int numBlocks = super->inode_bitmap_len;
 
   for (int i = 0; i < numBlocks; ++i) {
-      disk->writeBlock(startBlock + i, inodeBitmap + i * UFS_BLOCK_SIZE);
+      disk->writeBlock(startBlock + i, inodeBitmap + i * BlockSize);
   }
+  groups.countInodes(inodeBitmap);
 }
-void LocalFileSystem::writeDataBitmap(super_t *super, unsigned char *dataBitmap){
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::writeDataBitmap(super_t *super, unsigned char *dataBitmap){
   int startBlock = super->data_bitmap_addr;
   int numBlocks = super->data_bitmap_len;
 
   for (int i = 0; i < numBlocks; ++i) {
-    disk->writeBlock(startBlock + i, dataBitmap + i * UFS_BLOCK_SIZE);
+    disk->writeBlock(startBlock + i, dataBitmap + i * BlockSize);
   }
+  groups.countBlocks(dataBitmap);
 }
-void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes){
-  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::writeInodeRegion(super_t *super, inode_t *inodes){
+  int inodesPerBlock = Layout<BlockSize>::inodesPerBlock;
   int numBlocks = super->inode_region_len;
   // for every block allocated for inoderegion
   for (int i = 0; i < numBlocks; ++i) {
-      unsigned char buffer[UFS_BLOCK_SIZE];
+      unsigned char buffer[BlockSize];
       // go into each block and update every inode
       for (int j = 0; j < inodesPerBlock; ++j) {
         /*
@@ -623,4 +2965,450 @@ void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes){
       // write the updated block to the disk
       disk->writeBlock(super->inode_region_addr + i, buffer);
   }
-}
\ No newline at end of file
+}
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::writeInode(super_t *super, int inodeNumber, inode_t *inode){
+  int inodesPerBlock = Layout<BlockSize>::inodesPerBlock;
+  int blockNumber = super->inode_region_addr + (inodeNumber / inodesPerBlock);
+  int inodeOffset = (inodeNumber % inodesPerBlock) * sizeof(inode_t);
+
+  // read-modify-write the one block so its other inodes are preserved
+  unsigned char buffer[BlockSize];
+  disk->readBlock(blockNumber, buffer);
+  memcpy(buffer + inodeOffset, inode, sizeof(inode_t));
+  disk->writeBlock(blockNumber, buffer);
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::storeInode(super_t *super, int inodeNumber, inode_t *inode) {
+  AllocationLock allocationLock(&locks, false);
+  GroupLock groupLock(&locks, groups.inodeGroup(inodeNumber));
+  writeInode(super, inodeNumber, inode);
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::storeInodes(super_t *super, const vector<int> &inodeNumbers,
+                                           const vector<inode_t> &inodes) {
+  int inodesPerBlock = Layout<BlockSize>::inodesPerBlock;
+  vector<pair<int, size_t> > order;
+  for (size_t i = 0; i < inodeNumbers.size(); ++i) {
+    order.push_back(make_pair(inodeNumbers[i], i));
+  }
+  sort(order.begin(), order.end());
+
+  // a group owns whole inode blocks, so one group lock covers a block
+  AllocationLock allocationLock(&locks, false);
+  unsigned char buffer[BlockSize];
+  size_t i = 0;
+  while (i < order.size()) {
+    int block = order[i].first / inodesPerBlock;
+    GroupLock groupLock(&locks, groups.inodeGroup(order[i].first));
+    disk->readBlock(super->inode_region_addr + block, buffer);
+    for (; i < order.size() && order[i].first / inodesPerBlock == block; ++i) {
+      memcpy(buffer + (order[i].first % inodesPerBlock) * sizeof(inode_t),
+             &inodes[order[i].second], sizeof(inode_t));
+    }
+    disk->writeBlock(super->inode_region_addr + block, buffer);
+  }
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::findDirEntry(inode_t *dir, const string &name, dir_ent_t *entry) {
+  DirName target(name);
+  unsigned char blockBuffer[BlockSize];
+  dir_ent_t *dirEntries = (dir_ent_t *)blockBuffer;
+  int entriesPerBlock = Layout<BlockSize>::entriesPerBlock;
+  unsigned char prints[Layout<BlockSize>::entriesPerBlock];
+  int totalEntries = dir->size / sizeof(dir_ent_t);
+
+  // entries are packed, so only the last block is partly used
+  for (int i = 0; i * entriesPerBlock < totalEntries; ++i) {
+    int numEntries = min(entriesPerBlock, totalEntries - i * entriesPerBlock);
+    int rollbacks;
+    bool known = fingerprints.get(dir->direct[i], prints, &rollbacks);
+    if (known && !target.mayBeIn(prints, numEntries)) {
+      continue;
+    }
+
+    disk->readBlock(dir->direct[i], blockBuffer);
+    if (!known) {
+      fingerprints.set(dir->direct[i], dirEntries, rollbacks);
+    }
+    int j = target.find(dirEntries, numEntries, known ? prints : NULL);
+    if (j >= 0) {
+      *entry = dirEntries[j];
+      return i * entriesPerBlock + j;
+    }
+  }
+  return -1;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::buildFilter(int dirNumber, inode_t *dir, const string &name, int rollbacks) {
+  unsigned char blockBuffer[BlockSize];
+  dir_ent_t *dirEntries = (dir_ent_t *)blockBuffer;
+  int entriesPerBlock = Layout<BlockSize>::entriesPerBlock;
+  int totalEntries = dir->size / sizeof(dir_ent_t);
+  vector<string> names;
+  names.reserve(totalEntries);
+  int inodeNumber = -ENOTFOUND;
+  for (int i = 0; i * entriesPerBlock < totalEntries; ++i) {
+    disk->readBlock(dir->direct[i], blockBuffer);
+    int numEntries = min(entriesPerBlock, totalEntries - i * entriesPerBlock);
+    for (int j = 0; j < numEntries; ++j) {
+      names.push_back(string(dirEntries[j].name, strnlen(dirEntries[j].name, DIR_ENT_NAME_SIZE)));
+      if (names.back() == name) {
+        inodeNumber = dirEntries[j].inum;
+      }
+    }
+  }
+  filters.build(dirNumber, names, rollbacks);
+  return inodeNumber;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::writeDirBlock(unsigned int block, void *entries) {
+  int rollbacks = disk->rollbackCount();
+  disk->writeBlock(block, entries);
+  fingerprints.set(block, (dir_ent_t *)entries, rollbacks);
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::addDirEntryBlocksNeeded(inode_t *dir) {
+  int entriesPerBlock = Layout<BlockSize>::entriesPerBlock;
+  int entryIndex = dir->size / sizeof(dir_ent_t);
+  bool indexed = (dir->flags & UFS_INODE_DIR_INDEX) != 0;
+  int maxEntryBlocks = indexed ? DIR_INDEX_PTR : DIRECT_PTRS;
+  if (entryIndex / entriesPerBlock >= maxEntryBlocks) {
+    return -ENOTENOUGHSPACE;
+  }
+
+  // a new entry block when the last one is full, and the index can split
+  // up to the root
+  int blocksNeeded = (entryIndex % entriesPerBlock == 0) ? 1 : 0;
+  if (indexed) {
+    DirIndex<BlockSize> index(disk, dir->direct[DIR_INDEX_PTR]);
+    blocksNeeded += index.spareBlocksNeeded();
+  }
+  return blocksNeeded;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::addDirEntry(inode_t *dir, const dir_ent_t &entry, vector<unsigned int> &reserved) {
+  // Directory entries are packed, the new entry goes right after the last one
+  int entriesPerBlock = Layout<BlockSize>::entriesPerBlock;
+  int entryIndex = dir->size / sizeof(dir_ent_t);
+  int entryBlock = entryIndex / entriesPerBlock;
+  int entrySlot = entryIndex % entriesPerBlock;
+
+  unsigned char blockBuffer[BlockSize];
+  if (entrySlot == 0) {
+    dir->direct[entryBlock] = reserved.back();
+    reserved.pop_back();
+    memset(blockBuffer, 0, BlockSize);
+  } else {
+    disk->readBlock(dir->direct[entryBlock], blockBuffer);
+  }
+  dir_ent_t *dirEntries = (dir_ent_t *)blockBuffer;
+  dirEntries[entrySlot] = entry;
+  writeDirBlock(dir->direct[entryBlock], blockBuffer);
+  dir->size += sizeof(dir_ent_t);
+
+  if (dir->flags & UFS_INODE_DIR_INDEX) {
+    DirIndex<BlockSize> index(disk, dir->direct[DIR_INDEX_PTR]);
+    index.insert(entry, reserved);
+    dir->direct[DIR_INDEX_PTR] = index.rootBlock();
+  }
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::addDirEntriesBlocksNeeded(inode_t *dir, int count) {
+  int entriesPerBlock = Layout<BlockSize>::entriesPerBlock;
+  int entries = dir->size / sizeof(dir_ent_t);
+  bool indexed = (dir->flags & UFS_INODE_DIR_INDEX) != 0;
+  int maxEntryBlocks = indexed ? DIR_INDEX_PTR : DIRECT_PTRS;
+  if (entries + count > maxEntryBlocks * entriesPerBlock) {
+    return -ENOTENOUGHSPACE;
+  }
+
+  // the entry blocks past the last one in use, and a new index of every
+  // entry, whose nodes are full where the old ones can be half empty
+  int blocksNeeded = (entries + count + entriesPerBlock - 1) / entriesPerBlock
+    - (entries + entriesPerBlock - 1) / entriesPerBlock;
+  if (indexed) {
+    blocksNeeded += DirIndex<BlockSize>::buildBlocksNeeded(entries + count);
+  }
+  return blocksNeeded;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::addDirEntries(inode_t *dir, const vector<dir_ent_t> &entries,
+                                             vector<unsigned int> &reserved, vector<unsigned int> &freed) {
+  int entriesPerBlock = Layout<BlockSize>::entriesPerBlock;
+  unsigned char blockBuffer[BlockSize];
+  dir_ent_t *dirEntries = (dir_ent_t *)blockBuffer;
+  size_t next = 0;
+  while (next < entries.size()) {
+    int entryIndex = dir->size / sizeof(dir_ent_t);
+    int entryBlock = entryIndex / entriesPerBlock;
+    int entrySlot = entryIndex % entriesPerBlock;
+    if (entrySlot == 0) {
+      dir->direct[entryBlock] = reserved.back();
+      reserved.pop_back();
+      memset(blockBuffer, 0, BlockSize);
+    } else {
+      disk->readBlock(dir->direct[entryBlock], blockBuffer);
+    }
+    int count = min((size_t)(entriesPerBlock - entrySlot), entries.size() - next);
+    memcpy(&dirEntries[entrySlot], &entries[next], count * sizeof(dir_ent_t));
+    writeDirBlock(dir->direct[entryBlock], blockBuffer);
+    dir->size += count * sizeof(dir_ent_t);
+    next += count;
+  }
+
+  // Inserting one at a time would need spare blocks for a split per
+  // entry. The new index goes in new blocks, so the old one stays whole
+  // until the directory inode points at the new one.
+  if (dir->flags & UFS_INODE_DIR_INDEX) {
+    DirIndex<BlockSize> index(disk, dir->direct[DIR_INDEX_PTR]);
+    vector<dir_ent_t> sorted;
+    index.list("", -1, sorted);
+    size_t indexed = sorted.size();
+    sorted.insert(sorted.end(), entries.begin(), entries.end());
+    sort(sorted.begin() + indexed, sorted.end(), entryNameLess);
+    inplace_merge(sorted.begin(), sorted.begin() + indexed, sorted.end(), entryNameLess);
+
+    vector<unsigned int> oldNodes;
+    index.nodeBlocks(oldNodes);
+    freed.insert(freed.end(), oldNodes.begin(), oldNodes.end());
+    dir->direct[DIR_INDEX_PTR] = DirIndex<BlockSize>::build(disk, sorted, reserved);
+  }
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::replaceDirEntry(inode_t *dir, int position, const dir_ent_t &entry) {
+  int entriesPerBlock = Layout<BlockSize>::entriesPerBlock;
+  unsigned char blockBuffer[BlockSize];
+  dir_ent_t *dirEntries = (dir_ent_t *)blockBuffer;
+
+  disk->readBlock(dir->direct[position / entriesPerBlock], blockBuffer);
+  dirEntries[position % entriesPerBlock] = entry;
+  writeDirBlock(dir->direct[position / entriesPerBlock], blockBuffer);
+
+  if (dir->flags & UFS_INODE_DIR_INDEX) {
+    // same name, so the entry stays in the same place in the index
+    DirIndex<BlockSize> index(disk, dir->direct[DIR_INDEX_PTR]);
+    index.replace(entry);
+  }
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::removeDirEntry(super_t *super, inode_t *dir, int position, vector<unsigned int> &freed) {
+  // Keep the directory packed by moving its last entry into the hole
+  int entriesPerBlock = Layout<BlockSize>::entriesPerBlock;
+  int entryBlock = position / entriesPerBlock;
+  int lastIndex = dir->size / sizeof(dir_ent_t) - 1;
+  int lastBlock = lastIndex / entriesPerBlock;
+
+  unsigned char blockBuffer[BlockSize];
+  disk->readBlock(dir->direct[entryBlock], blockBuffer);
+  dir_ent_t *dirEntries = (dir_ent_t *)blockBuffer;
+  string name = dirEntries[position % entriesPerBlock].name;
+
+  if (lastBlock == entryBlock) {
+    dirEntries[position % entriesPerBlock] = dirEntries[lastIndex % entriesPerBlock];
+    memset(&dirEntries[lastIndex % entriesPerBlock], 0, sizeof(dir_ent_t));
+    writeDirBlock(dir->direct[entryBlock], blockBuffer);
+  } else {
+    unsigned char lastBuffer[BlockSize];
+    disk->readBlock(dir->direct[lastBlock], lastBuffer);
+    dir_ent_t *lastEntries = (dir_ent_t *)lastBuffer;
+    dirEntries[position % entriesPerBlock] = lastEntries[lastIndex % entriesPerBlock];
+    memset(&lastEntries[lastIndex % entriesPerBlock], 0, sizeof(dir_ent_t));
+    writeDirBlock(dir->direct[entryBlock], blockBuffer);
+    writeDirBlock(dir->direct[lastBlock], lastBuffer);
+  }
+
+  if (dir->flags & UFS_INODE_DIR_INDEX) {
+    DirIndex<BlockSize> index(disk, dir->direct[DIR_INDEX_PTR]);
+    index.remove(name);
+  }
+
+  // The last block is released once its only entry moved out
+  if (lastIndex % entriesPerBlock == 0) {
+    freed.push_back(dir->direct[lastBlock]);
+    dir->direct[lastBlock] = 0;
+  }
+  dir->size -= sizeof(dir_ent_t);
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::freeInode(super_t *super, inode_t *inodes, int inodeNumber,
+                                         unsigned char *inodeBitmap, unsigned char *dataBitmap) {
+  inode_t &inode = inodes[inodeNumber];
+  discardPending(inodeNumber);
+
+  // file blocks can be shared with other files and snapshots
+  DedupStore<BlockSize> store(disk, super);
+  DedupStore<BlockSize> *dedup = NULL;
+  if ((super->features & UFS_FEATURE_REFCOUNTS) && inode.type == UFS_REGULAR_FILE) {
+    dedup = &store;
+  }
+  vector<unsigned int> freed;
+  versions.waitForReaders(inodeNumber);
+  releaseInodeBlocks(&inode, dedup, freed);
+  releaseDataBlocks(super, dataBitmap, freed);
+
+  // Free the inode
+  inodeBitmap[inodeNumber / 8] &= ~(1 << (inodeNumber % 8));  // Clear the bit in the inode bitmap
+  memset(&inode, 0, sizeof(inode_t));  // Clear inode data
+  versions.freed(inodeNumber);
+  counters.forget(inodeNumber);
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::releaseInodeBlocks(inode_t *inode, DedupStore<BlockSize> *dedup,
+                                                  vector<unsigned int> &freed) {
+  // the size of an orphan links the list, its blocks end at the first 0
+  if (inode->flags & UFS_INODE_COLD) {
+    vector<unsigned int> coldBlocks;
+    for (int i = 0; i < DIRECT_PTRS && inode->direct[i] != 0; i++) {
+      coldBlocks.push_back(inode->direct[i]);
+    }
+    releaseColdBlocks(coldBlocks);
+    return;
+  }
+  // inline files have no blocks, their direct pointers hold the content
+  int maxBlocks = (inode->flags & UFS_INODE_INLINE) ? 0 : DIRECT_PTRS;
+  for (int i = 0; i < maxBlocks && inode->direct[i] != 0; i++) {
+    if (dedup == NULL || dedup->release(inode->direct[i])) {
+      freed.push_back(inode->direct[i]);
+    }
+  }
+  if (dedup != NULL) {
+    dedup->flush();
+  }
+  // an indexed directory also owns every node of its index
+  if (inode->flags & UFS_INODE_DIR_INDEX) {
+    DirIndex<BlockSize> index(disk, inode->direct[DIR_INDEX_PTR]);
+    vector<unsigned int> indexBlocks;
+    index.nodeBlocks(indexBlocks);
+    freed.insert(freed.end(), indexBlocks.begin(), indexBlocks.end());
+  }
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::countTree(int inodeNumber, int *inodesNeeded, int *blocksNeeded,
+                                         int *coldBlocksNeeded) {
+  int entriesPerBlock = Layout<BlockSize>::entriesPerBlock;
+  vector<DirEntry> entries;
+  readdir(inodeNumber, entries);
+
+  int copiedEntries = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (inodeNumber == UFS_ROOT_DIRECTORY_INODE_NUMBER && entries[i].name == UFS_SNAPSHOT_DIR) {
+      continue;
+    }
+    copiedEntries++;
+    if (entries[i].name == "." || entries[i].name == "..") {
+      continue;
+    }
+    if (entries[i].type == UFS_DIRECTORY) {
+      countTree(entries[i].inum, inodesNeeded, blocksNeeded, coldBlocksNeeded);
+    } else {
+      (*inodesNeeded)++;
+      if (cold != NULL) {
+        super_t super;
+        readSuperBlock(&super);
+        inode_t file;
+        loadInode(&super, entries[i].inum, &file);
+        if (file.flags & UFS_INODE_COLD) {
+          *coldBlocksNeeded += fileBlockCount<BlockSize>(&file);
+        }
+      }
+    }
+  }
+  (*inodesNeeded)++;
+  *blocksNeeded += (copiedEntries + entriesPerBlock - 1) / entriesPerBlock;
+}
+
+template <int BlockSize>
+int UfsFileSystem<BlockSize>::copyTree(super_t *super, inode_t *inodes, unsigned char *inodeBitmap, DedupStore<BlockSize> *store,
+                                       int inodeNumber, int parentCopy, vector<unsigned int> &reserved) {
+  int copy = allocateInode(super, inodeBitmap);
+  vector<DirEntry> entries;
+  readdir(inodeNumber, entries);
+
+  vector<dir_ent_t> copiedEntries;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const DirEntry &entry = entries[i];
+    int target;
+    if (entry.name == ".") {
+      target = copy;
+    } else if (entry.name == "..") {
+      target = parentCopy;
+    } else if (inodeNumber == UFS_ROOT_DIRECTORY_INODE_NUMBER && entry.name == UFS_SNAPSHOT_DIR) {
+      continue;
+    } else if (entry.type == UFS_DIRECTORY) {
+      target = copyTree(super, inodes, inodeBitmap, store, entry.inum, copy, reserved);
+    } else {
+      // a file copy is the same inode pointing at the same blocks, except
+      // that cold blocks aren't shared and are copied
+      target = allocateInode(super, inodeBitmap);
+      inodes[target] = inodes[entry.inum];
+      int fileBlocks = fileBlockCount<BlockSize>(&inodes[target]);
+      if (inodes[target].flags & UFS_INODE_COLD) {
+        vector<unsigned int> copied(fileBlocks);
+        cold->allocateBlocks(fileBlocks, copied.data());
+        unsigned char block[BlockSize];
+        for (int j = 0; j < fileBlocks; ++j) {
+          cold->readBlock(inodes[target].direct[j], block);
+          cold->writeBlock(copied[j], block);
+          inodes[target].direct[j] = copied[j];
+        }
+      } else {
+        for (int j = 0; j < fileBlocks; ++j) {
+          store->share(inodes[target].direct[j]);
+        }
+      }
+    }
+    dir_ent_t copiedEntry;
+    setDirEntry(super, &copiedEntry, entry.name, target, entry.type);
+    copiedEntries.push_back(copiedEntry);
+  }
+
+  // Snapshots never change, so the copy is packed into new blocks and
+  // doesn't get an index
+  int entriesPerBlock = Layout<BlockSize>::entriesPerBlock;
+  inode_t dir = {UFS_DIRECTORY, 0, (int)(copiedEntries.size() * sizeof(dir_ent_t)), {0}};
+  for (size_t i = 0; i < copiedEntries.size(); i += entriesPerBlock) {
+    dir_ent_t blockEntries[entriesPerBlock];
+    memset(blockEntries, 0, sizeof(blockEntries));
+    size_t count = min(copiedEntries.size() - i, (size_t)entriesPerBlock);
+    memcpy(blockEntries, &copiedEntries[i], count * sizeof(dir_ent_t));
+
+    dir.direct[i / entriesPerBlock] = reserved.back();
+    reserved.pop_back();
+    writeDirBlock(dir.direct[i / entriesPerBlock], blockEntries);
+  }
+  inodes[copy] = dir;
+  return copy;
+}
+
+template <int BlockSize>
+void UfsFileSystem<BlockSize>::freeTree(super_t *super, inode_t *inodes, int inodeNumber,
+                                        unsigned char *inodeBitmap, unsigned char *dataBitmap) {
+  vector<DirEntry> entries;
+  readdir(inodeNumber, entries);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].name == "." || entries[i].name == "..") {
+      continue;
+    }
+    if (inodes[entries[i].inum].type == UFS_DIRECTORY) {
+      freeTree(super, inodes, entries[i].inum, inodeBitmap, dataBitmap);
+    }
+    freeInode(super, inodes, entries[i].inum, inodeBitmap, dataBitmap);
+  }
+}
+
+UFS_INSTANTIATE_BLOCK_SIZES(UfsFileSystem)
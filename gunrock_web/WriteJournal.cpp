@@ -0,0 +1,86 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "WriteJournal.h"
+
+using namespace std;
+
+// FNV-1a, enough to tell a record cut short by a crash from a whole one
+unsigned int contentChecksum(const unsigned char *content, int size) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < size; ++i) {
+    hash = (hash ^ content[i]) * 16777619u;
+  }
+  return hash;
+}
+
+WriteJournal::WriteJournal(string journalFile) {
+  this->journalFile = journalFile;
+  this->fd = open(journalFile.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    cerr << "could not open journal " << journalFile << endl;
+    exit(1);
+  }
+}
+
+WriteJournal::~WriteJournal() {
+  close(fd);
+}
+
+void WriteJournal::append(const journal_record_t &record, const void *content) {
+  struct iovec parts[2];
+  parts[0].iov_base = (void *)&record;
+  parts[0].iov_len = sizeof(journal_record_t);
+  parts[1].iov_base = (void *)content;
+  parts[1].iov_len = record.size > 0 ? record.size : 0;
+  ssize_t length = parts[0].iov_len + parts[1].iov_len;
+  if (writev(fd, parts, 2) != length || fdatasync(fd) != 0) {
+    cerr << "Could not write journal " << journalFile << endl;
+    exit(1);
+  }
+}
+
+void WriteJournal::logWrite(int inum, const void *content, int size) {
+  journal_record_t record = {JOURNAL_MAGIC, inum, size,
+                             contentChecksum((const unsigned char *)content, size)};
+  append(record, content);
+}
+
+void WriteJournal::logDiscard(int inum) {
+  journal_record_t record = {JOURNAL_MAGIC, inum, -1, 0};
+  append(record, NULL);
+}
+
+void WriteJournal::replay(map<int, vector<unsigned char> > &writes) {
+  writes.clear();
+  off_t offset = 0;
+  journal_record_t record;
+  while (pread(fd, &record, sizeof(record), offset) == sizeof(record) && record.magic == JOURNAL_MAGIC) {
+    offset += sizeof(record);
+    if (record.size < 0) {
+      writes.erase(record.inum);
+      continue;
+    }
+    vector<unsigned char> content(record.size);
+    if (pread(fd, content.data(), record.size, offset) != record.size
+        || contentChecksum(content.data(), record.size) != record.checksum) {
+      break;
+    }
+    offset += record.size;
+    writes[record.inum].swap(content);
+  }
+}
+
+void WriteJournal::clear() {
+  if (ftruncate(fd, 0) != 0 || fsync(fd) != 0) {
+    cerr << "Could not clear journal " << journalFile << endl;
+    exit(1);
+  }
+}
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <cstring>
 #include <vector>
+#include <iomanip>
 #include "LocalFileSystem.h"
 #include "Disk.h"
 #include "ufs.h"
@@ -11,7 +12,7 @@ using namespace std;
 
 
 void print_inode_bitmap(super_t& super, LocalFileSystem &fs){
-    vector<unsigned char> inodeBitmap(super.inode_bitmap_len * UFS_BLOCK_SIZE);
+    vector<unsigned char> inodeBitmap(super.inode_bitmap_len * fs.blockSize());
     fs.readInodeBitmap(&super, inodeBitmap.data());
     
     cout << "Inode bitmap" << endl;
@@ -22,7 +23,7 @@ void print_inode_bitmap(super_t& super, LocalFileSystem &fs){
 }
 
 void print_data_bitmap(super_t& super, LocalFileSystem &fs){
-    vector<unsigned char> dataBitmap(super.data_bitmap_len * UFS_BLOCK_SIZE);
+    vector<unsigned char> dataBitmap(super.data_bitmap_len * fs.blockSize());
     fs.readDataBitmap(&super, dataBitmap.data());
 
     cout << "Data bitmap" << endl;
@@ -32,6 +33,28 @@ void print_data_bitmap(super_t& super, LocalFileSystem &fs){
     cout << endl;
 }
 
+// With UFS_FEATURE_DEDUP, how many file blocks are referenced compared to
+// how many are actually stored
+void print_dedup(super_t& super, LocalFileSystem &fs){
+    // one unsigned int reference count per data block
+    vector<unsigned int> counts((size_t)super.refcount_len * fs.blockSize() / sizeof(unsigned int));
+    fs.disk->readBlocks(super.refcount_addr, super.refcount_len, counts.data());
+    unsigned long long referenced = 0;
+    int stored = 0;
+    for (int i = 0; i < super.num_data; ++i) {
+        unsigned int references = counts[i];
+        referenced += references;
+        if (references > 0) {
+            stored++;
+        }
+    }
+
+    cout << endl << "Dedup" << endl;
+    cout << "referenced blocks " << referenced << endl;
+    cout << "stored blocks " << stored << endl;
+    cout << "ratio " << fixed << setprecision(2) << (stored > 0 ? (double)referenced / stored : 1.0) << endl;
+}
+
 int main(int argc, char *argv[]) {
     if (argc != 2) {
         cerr << "Usage: " << argv[0] << " <disk image file>" << endl;
@@ -41,9 +64,12 @@ int main(int argc, char *argv[]) {
     string diskImageFile = argv[1];
 
     // Initialize the Disk and LocalFileSystem
-    Disk disk(diskImageFile, UFS_BLOCK_SIZE);
-
-    LocalFileSystem fs(&disk);
+    LocalFileSystem *fileSystem = LocalFileSystem::mount(diskImageFile);
+    if (fileSystem == NULL) {
+        cerr << "Unsupported block size in " << diskImageFile << endl;
+        return 1;
+    }
+    LocalFileSystem &fs = *fileSystem;
 
     // Read the superblock
     super_t super;
@@ -61,5 +87,9 @@ int main(int argc, char *argv[]) {
     // Read and print the data bitmap
     print_data_bitmap(super, fs);
 
+    if (super.features & UFS_FEATURE_DEDUP) {
+        print_dedup(super, fs);
+    }
+
     return 0;
 }
@@ -2,6 +2,7 @@
 #include <string>
 #include <algorithm>
 #include <cstring>
+#include <vector>
 
 #include "LocalFileSystem.h"
 #include "Disk.h"
@@ -9,38 +10,70 @@
 
 using namespace std;
 
-void print_file_blocks(inode_t& inode){
-    cout << "File blocks" << endl;
-    int fileBlocks = inode.size / UFS_BLOCK_SIZE;
-    if ((inode.size % UFS_BLOCK_SIZE) != 0) {
+void print_file_blocks(inode_t& inode, LocalFileSystem &fs){
+    // cold files' blocks are numbered in the cold tier
+    if (inode.flags & UFS_INODE_COLD) {
+        cout << "File blocks (cold tier)" << endl;
+    } else {
+        cout << "File blocks" << endl;
+    }
+    int fileBlocks = inode.size / fs.blockSize();
+    if ((inode.size % fs.blockSize()) != 0) {
         fileBlocks += 1;
     }
+    // inline files keep their data in the inode and have no blocks
+    if (inode.flags & UFS_INODE_INLINE) {
+        fileBlocks = 0;
+    }
+    // compressed files use fewer blocks than their size, always the first ones
+    if (inode.flags & UFS_INODE_COMPRESSED) {
+        fileBlocks = 0;
+        while (fileBlocks < DIRECT_PTRS && inode.direct[fileBlocks] != 0) {
+            fileBlocks++;
+        }
+    }
     for (int i = 0; i < fileBlocks; ++i) {
         cout << inode.direct[i] << endl;
     }
     cout << endl;
 }
 
-void print_file_data(inode_t& inode, LocalFileSystem fs, int inodeNum){
+void print_file_data(inode_t& inode, LocalFileSystem &fs, int inodeNum){
     cout << "File data" << endl;
     int size = inode.size;
-    unsigned char buffer[MAX_FILE_SIZE + 1];
-    fs.read(inodeNum, buffer, size);
+    vector<unsigned char> buffer(fs.maxFileSize() + 1);
+    int bytesRead = fs.read(inodeNum, buffer.data(), size);
+    if (bytesRead < 0) {
+        return;
+    }
 
-    cout << buffer;
+    cout.write((const char *)buffer.data(), bytesRead);
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    cout << argv[0] << ": diskImageFile inodeNumber" << endl;
+  if (argc != 3 && argc != 4) {
+    cout << argv[0] << ": diskImageFile inodeNumber [coldTierFile]" << endl;
     return 1;
   }
   string diskImageFile = argv[1];
   unsigned int inodeNum = atoi(argv[2]);
 
   // Initialize the Disk and LocalFileSystem
-  Disk disk(diskImageFile, UFS_BLOCK_SIZE);
-  LocalFileSystem fs(&disk);
+  LocalFileSystem *fileSystem = LocalFileSystem::mount(diskImageFile);
+  if (fileSystem == NULL) {
+    cerr << "Unsupported block size in " << diskImageFile << endl;
+    return 1;
+  }
+  LocalFileSystem &fs = *fileSystem;
+  if (argc == 4) {
+    // attaching pairs an untiered image, which isn't for a reader to do
+    super_t super;
+    fs.readSuperBlock(&super);
+    if (!(super.features & UFS_FEATURE_TIERED) || fs.attachColdTier(argv[3]) != 0) {
+      cerr << argv[3] << " isn't the cold tier of " << diskImageFile << endl;
+      return 1;
+    }
+  }
   // Retrieve the inode
   inode_t inode;
   int ret = fs.stat(inodeNum, &inode);
@@ -50,7 +83,7 @@ int main(int argc, char *argv[]) {
   }
 
   // Print file blocks num
-  print_file_blocks(inode);
+  print_file_blocks(inode, fs);
   // Print file data
   print_file_data(inode, fs, inodeNum);
   
@@ -0,0 +1,760 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <set>
+#include <map>
+#include <pthread.h>
+#include <unistd.h>
+#include "LocalFileSystem.h"
+#include "DedupStore.h"
+#include "Disk.h"
+#include "Layout.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Exit codes, like fsck(8)
+#define FSCK_OK (0)
+#define FSCK_REPAIRED (1)
+#define FSCK_UNREPAIRED (4)
+#define FSCK_USAGE (16)
+
+// Where a data block is referenced from. Blocks are referenced by a
+// direct pointer of an inode, or by an interior node of a directory index
+// (or its root, direct[DIR_INDEX_PTR]).
+struct Claim {
+  int inum;
+  bool file;              // file data, which may be shared on refcounted images
+  int slot;               // direct pointer, or -1 for an index child
+  unsigned int parent;    // index node that points to the block
+  int entry;              // entry of parent
+};
+
+// What a worker found in one directory
+struct DirResult {
+  vector<pair<int, int> > subdirs;      // (directory, its parent)
+  vector<int> children;                 // every inode named by an entry
+  vector<pair<unsigned int, Claim> > indexClaims;  // (block, claim)
+  vector<string> problems;
+};
+
+template <int BlockSize>
+class Checker {
+ public:
+  // coldDisk is the image's cold tier, or NULL to leave cold files out
+  Checker(Disk *disk, LocalFileSystem *fs, int threads, Disk *coldDisk);
+  bool load();
+  void walk();
+  void walkOrphanList();
+  void checkInodes();
+  void checkBlocks();
+  void checkColdBlocks();
+  bool repair();
+  int problemCount() { return problems.size(); }
+  int unrepaired;
+
+ private:
+  static void *worker(void *arg);
+  void checkDirectory(int inum, int parent, DirResult &result);
+  void checkIndexNode(int inum, unsigned int block, unsigned int parent, int entry,
+                      int depth, int *entries, DirResult &result);
+  void claimBlocks(bool locate);
+  void claimBlock(int index, const Claim &claim, bool locate);
+  void claimColdBlocks(int inum, const inode_t &inode, int numBlocks);
+  bool loadColdTier();
+  bool validBlock(unsigned int block);
+  bool inodeAllocated(int inum);
+  bool blockAllocated(unsigned int block);
+  int fileBlocks(const inode_t &inode);
+  // Problems that repair() doesn't fix, like damaged directory
+  // contents, are reported the same way but are left for the user
+  void problem(const string &message, bool repairable = true);
+
+  Disk *disk;
+  LocalFileSystem *fs;
+  int threads;
+  super_t super;
+  vector<inode_t> inodes;
+  vector<unsigned char> inodeBitmap;
+  vector<unsigned char> dataBitmap;
+  // reference counts minus the file claims, so 0 where they are right
+  vector<unsigned int> refCounts;
+
+  // filled in by the walk, under lock
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  deque<pair<int, int> > queue;
+  int busy;
+  vector<int> links;
+  // on the orphan list, waiting for the server to free them
+  vector<bool> listed;
+  vector<pair<unsigned int, Claim> > indexClaims;
+
+  // users of each data block (counting stops at 255, more only matters
+  // for shared file data), and whether any of them isn't file data
+  vector<unsigned char> owners;
+  vector<bool> metadata;
+  // users of the double allocated blocks, by data block index
+  map<int, vector<Claim> > conflicts;
+  vector<string> problems;
+  vector<int> orphans;
+  vector<int> unmarkedInodes;
+
+  // the cold tier, whose blocks are only ever used by one file
+  Disk *coldDisk;
+  super_t coldSuper;
+  vector<unsigned char> coldBitmap;
+  vector<unsigned char> coldOwners;
+};
+
+template <int BlockSize>
+Checker<BlockSize>::Checker(Disk *disk, LocalFileSystem *fs, int threads, Disk *coldDisk) {
+  this->disk = disk;
+  this->coldDisk = coldDisk;
+  this->fs = fs;
+  this->threads = threads;
+  this->busy = 0;
+  this->unrepaired = 0;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&changed, NULL);
+}
+
+template <int BlockSize>
+void Checker<BlockSize>::problem(const string &message, bool repairable) {
+  problems.push_back(message);
+  if (!repairable) {
+    unrepaired++;
+  }
+  cout << message << endl;
+}
+
+template <int BlockSize>
+bool Checker<BlockSize>::validBlock(unsigned int block) {
+  return block >= (unsigned int)super.data_region_addr
+    && block < (unsigned int)super.data_region_addr + super.num_data;
+}
+
+template <int BlockSize>
+bool Checker<BlockSize>::inodeAllocated(int inum) {
+  return inodeBitmap[inum / 8] & (1 << (inum % 8));
+}
+
+template <int BlockSize>
+bool Checker<BlockSize>::blockAllocated(unsigned int block) {
+  int index = block - super.data_region_addr;
+  return dataBitmap[index / 8] & (1 << (index % 8));
+}
+
+template <int BlockSize>
+int Checker<BlockSize>::fileBlocks(const inode_t &inode) {
+  if (inode.flags & UFS_INODE_INLINE) {
+    return 0;
+  }
+  if (inode.flags & UFS_INODE_COMPRESSED) {
+    int count = 0;
+    while (count < DIRECT_PTRS && inode.direct[count] != 0) {
+      count++;
+    }
+    return count;
+  }
+  return (inode.size + BlockSize - 1) / BlockSize;
+}
+
+// Reads the metadata regions, each with one large read. Returns false if
+// the super block describes a layout that doesn't fit the image.
+template <int BlockSize>
+bool Checker<BlockSize>::load() {
+  fs->readSuperBlock(&super);
+  long long blocks = disk->numberOfBlocks();
+  bool fits = super.num_inodes > 0 && super.num_data > 0
+    && (long long)super.inode_bitmap_len * BlockSize * 8 >= super.num_inodes
+    && (long long)super.data_bitmap_len * BlockSize * 8 >= super.num_data
+    && (long long)super.inode_region_len * BlockSize >= (long long)(super.num_inodes * sizeof(inode_t))
+    && super.inode_bitmap_addr > 0 && (long long)super.inode_bitmap_addr + super.inode_bitmap_len <= blocks
+    && super.data_bitmap_addr > 0 && (long long)super.data_bitmap_addr + super.data_bitmap_len <= blocks
+    && super.inode_region_addr > 0 && (long long)super.inode_region_addr + super.inode_region_len <= blocks
+    && super.data_region_addr > 0 && (long long)super.data_region_addr + super.num_data <= blocks;
+  if (fits && (super.features & UFS_FEATURE_REFCOUNTS)) {
+    fits = super.refcount_addr > 0 && (long long)super.refcount_addr + super.refcount_len <= blocks
+      && (long long)super.refcount_len * Layout<BlockSize>::refsPerBlock >= super.num_data;
+  }
+  if (!fits) {
+    problem("super block: regions don't fit in the image", false);
+    return false;
+  }
+
+  inodes.resize(super.num_inodes);
+  inodeBitmap.resize((size_t)super.inode_bitmap_len * BlockSize);
+  dataBitmap.resize((size_t)super.data_bitmap_len * BlockSize);
+  fs->readInodeRegion(&super, inodes.data());
+  fs->readInodeBitmap(&super, inodeBitmap.data());
+  fs->readDataBitmap(&super, dataBitmap.data());
+  if (super.features & UFS_FEATURE_REFCOUNTS) {
+    refCounts.resize((size_t)super.refcount_len * Layout<BlockSize>::refsPerBlock);
+    disk->readBlocks(super.refcount_addr, super.refcount_len, refCounts.data());
+  }
+  links.assign(super.num_inodes, 0);
+  listed.assign(super.num_inodes, false);
+  owners.assign(super.num_data, 0);
+  metadata.assign(super.num_data, false);
+  if (coldDisk != NULL && !loadColdTier()) {
+    coldDisk = NULL;
+  }
+  return true;
+}
+
+// Reads the super block and data bitmap of the cold tier. Returns false
+// if it isn't this image's.
+template <int BlockSize>
+bool Checker<BlockSize>::loadColdTier() {
+  unsigned char block[BlockSize];
+  coldDisk->readBlock(0, block);
+  memcpy(&coldSuper, block, sizeof(super_t));
+  if (!(coldSuper.features & UFS_FEATURE_COLD_TIER) || coldSuper.block_size != BlockSize
+      || !(super.features & UFS_FEATURE_TIERED) || coldSuper.tier_id != super.tier_id) {
+    problem("cold tier: not the cold tier of this image", false);
+    return false;
+  }
+  long long blocks = coldDisk->numberOfBlocks();
+  if (coldSuper.num_data <= 0 || (long long)coldSuper.data_bitmap_len * BlockSize * 8 < coldSuper.num_data
+      || coldSuper.data_bitmap_addr <= 0 || (long long)coldSuper.data_bitmap_addr + coldSuper.data_bitmap_len > blocks
+      || coldSuper.data_region_addr <= 0 || (long long)coldSuper.data_region_addr + coldSuper.num_data > blocks) {
+    problem("cold tier: regions don't fit in the image", false);
+    return false;
+  }
+  coldBitmap.resize((size_t)coldSuper.data_bitmap_len * BlockSize);
+  coldDisk->readBlocks(coldSuper.data_bitmap_addr, coldSuper.data_bitmap_len, coldBitmap.data());
+  coldOwners.assign(coldSuper.num_data, 0);
+  return true;
+}
+
+// Walks one index node and its children, claiming their blocks
+template <int BlockSize>
+void Checker<BlockSize>::checkIndexNode(int inum, unsigned int block, unsigned int parent, int entry,
+                                        int depth, int *entries, DirResult &result) {
+  string where = "directory " + to_string(inum) + ": ";
+  if (!validBlock(block)) {
+    result.problems.push_back(where + "index block " + to_string(block) + " is outside the data region");
+    return;
+  }
+  // deeper than any index over 30 blocks of entries could be, so a cycle
+  if (depth > 16) {
+    result.problems.push_back(where + "index has a cycle");
+    return;
+  }
+  Claim claim = {inum, false, parent == 0 ? DIR_INDEX_PTR : -1, parent, entry};
+  result.indexClaims.push_back(make_pair(block, claim));
+
+  typename Layout<BlockSize>::IndexNode node;
+  disk->readBlock(block, &node);
+  if (node.count < 0 || node.count > Layout<BlockSize>::indexFanout) {
+    result.problems.push_back(where + "index block " + to_string(block) + " has a bad entry count");
+    return;
+  }
+  if (node.leaf) {
+    *entries += node.count;
+    return;
+  }
+  for (int i = 0; i < node.count; ++i) {
+    checkIndexNode(inum, node.entries[i].inum, block, i, depth + 1, entries, result);
+  }
+}
+
+// Reads the entries of one directory. Runs on the worker threads, so it
+// only reads shared state and reports into result.
+template <int BlockSize>
+void Checker<BlockSize>::checkDirectory(int inum, int parent, DirResult &result) {
+  const inode_t &dir = inodes[inum];
+  string where = "directory " + to_string(inum) + ": ";
+  bool indexed = (dir.flags & UFS_INODE_DIR_INDEX) != 0;
+  int maxBlocks = indexed ? DIR_INDEX_PTR : DIRECT_PTRS;
+  if (dir.size < 0 || dir.size % sizeof(dir_ent_t) != 0
+      || dir.size > maxBlocks * BlockSize) {
+    result.problems.push_back(where + "bad size " + to_string(dir.size));
+    return;
+  }
+
+  int count = dir.size / sizeof(dir_ent_t);
+  int numBlocks = (dir.size + BlockSize - 1) / BlockSize;
+  int perBlock = Layout<BlockSize>::entriesPerBlock;
+  dir_ent_t entries[Layout<BlockSize>::entriesPerBlock];
+  for (int b = 0; b < numBlocks; ++b) {
+    if (!validBlock(dir.direct[b])) {
+      result.problems.push_back(where + "block " + to_string(dir.direct[b]) + " is outside the data region");
+      continue;
+    }
+    disk->readBlock(dir.direct[b], entries);
+    for (int i = 0; i < perBlock && b * perBlock + i < count; ++i) {
+      dir_ent_t &entry = entries[i];
+      string name(entry.name, strnlen(entry.name, DIR_ENT_NAME_SIZE - 1));
+      if (b == 0 && i < 2) {
+        int expected = i == 0 ? inum : parent;
+        if (name != (i == 0 ? "." : "..") || entry.inum != expected) {
+          result.problems.push_back(where + "entry " + to_string(i) + " should be "
+                                    + (i == 0 ? "." : "..") + " for inode " + to_string(expected));
+        }
+        continue;
+      }
+      if (entry.inum < 0 || entry.inum >= super.num_inodes) {
+        result.problems.push_back(where + name + " names inode " + to_string(entry.inum) + " which doesn't exist");
+        continue;
+      }
+      const inode_t &child = inodes[entry.inum];
+      if (child.type != UFS_DIRECTORY && child.type != UFS_REGULAR_FILE) {
+        result.problems.push_back(where + name + " names inode " + to_string(entry.inum) + " which has no type");
+        continue;
+      }
+      if ((super.features & UFS_FEATURE_DIRENT_TYPE)
+          && DIR_ENT_TYPE_OF(entry.name[DIR_ENT_TYPE_INDEX]) != child.type) {
+        result.problems.push_back(where + name + " has the wrong type in its entry");
+      }
+      result.children.push_back(entry.inum);
+      if (child.type == UFS_DIRECTORY) {
+        result.subdirs.push_back(make_pair(entry.inum, inum));
+      }
+    }
+  }
+
+  if (indexed) {
+    int indexEntries = 0;
+    checkIndexNode(inum, dir.direct[DIR_INDEX_PTR], 0, 0, 0, &indexEntries, result);
+    if (indexEntries != count) {
+      result.problems.push_back(where + "index has " + to_string(indexEntries)
+                                + " entries, the directory has " + to_string(count));
+    }
+  }
+}
+
+// Takes directories off the queue until the walk is done. A directory is
+// only queued the first time an entry names it, so cycles end.
+template <int BlockSize>
+void *Checker<BlockSize>::worker(void *arg) {
+  Checker *checker = (Checker *)arg;
+  pthread_mutex_lock(&checker->lock);
+  while (true) {
+    while (checker->queue.empty() && checker->busy > 0) {
+      pthread_cond_wait(&checker->changed, &checker->lock);
+    }
+    if (checker->queue.empty()) {
+      break;
+    }
+    pair<int, int> dir = checker->queue.front();
+    checker->queue.pop_front();
+    checker->busy++;
+    pthread_mutex_unlock(&checker->lock);
+
+    DirResult result;
+    checker->checkDirectory(dir.first, dir.second, result);
+
+    pthread_mutex_lock(&checker->lock);
+    for (size_t i = 0; i < result.problems.size(); ++i) {
+      checker->problem(result.problems[i], false);
+    }
+    for (size_t i = 0; i < result.children.size(); ++i) {
+      checker->links[result.children[i]]++;
+    }
+    for (size_t i = 0; i < result.subdirs.size(); ++i) {
+      if (checker->links[result.subdirs[i].first] == 1) {
+        checker->queue.push_back(result.subdirs[i]);
+      }
+    }
+    checker->indexClaims.insert(checker->indexClaims.end(), result.indexClaims.begin(), result.indexClaims.end());
+    checker->busy--;
+    pthread_cond_broadcast(&checker->changed);
+  }
+  pthread_mutex_unlock(&checker->lock);
+  return NULL;
+}
+
+template <int BlockSize>
+void Checker<BlockSize>::walk() {
+  if (inodes[UFS_ROOT_DIRECTORY_INODE_NUMBER].type != UFS_DIRECTORY) {
+    problem("inode 0: the root is not a directory", false);
+    return;
+  }
+  links[UFS_ROOT_DIRECTORY_INODE_NUMBER] = 1;
+  queue.push_back(make_pair(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_ROOT_DIRECTORY_INODE_NUMBER));
+
+  vector<pthread_t> workers(threads);
+  for (int i = 0; i < threads; ++i) {
+    pthread_create(&workers[i], NULL, worker, this);
+  }
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+}
+
+// Files on the orphan list are unlinked but still hold their inode and
+// blocks until the server frees them, so they count as in use. Only call
+// after walk(), a file that is still in the tree can't be on the list.
+template <int BlockSize>
+void Checker<BlockSize>::walkOrphanList() {
+  if (!(super.features & UFS_FEATURE_ORPHAN_LIST)) {
+    return;
+  }
+  for (int inum = super.orphan_head; inum != 0; inum = inodes[inum].size) {
+    string where = "orphan list: inode " + to_string(inum);
+    if (inum < 0 || inum >= super.num_inodes) {
+      problem("orphan list: inode " + to_string(inum) + " is out of range", false);
+      return;
+    }
+    if (listed[inum]) {
+      problem(where + " is on it twice", false);
+      return;
+    }
+    if (!(inodes[inum].flags & UFS_INODE_ORPHAN) || inodes[inum].type != UFS_REGULAR_FILE) {
+      problem(where + " is not an unlinked file", false);
+      return;
+    }
+    if (links[inum] > 0) {
+      problem(where + " is still in the tree", false);
+      return;
+    }
+    if (!inodeAllocated(inum)) {
+      problem(where + " is not allocated", false);
+      return;
+    }
+    listed[inum] = true;
+    links[inum] = 1;
+  }
+}
+
+// Orphans are allocated but named by no entry; their blocks show up as
+// leaked too, since nothing in the tree claims them
+template <int BlockSize>
+void Checker<BlockSize>::checkInodes() {
+  for (int inum = 0; inum < super.num_inodes; ++inum) {
+    bool allocated = inodeAllocated(inum);
+    if (links[inum] > 1) {
+      problem("inode " + to_string(inum) + ": named by " + to_string(links[inum]) + " directory entries", false);
+    }
+    if (allocated && links[inum] == 0) {
+      problem("inode " + to_string(inum) + ": allocated but not in the tree (orphan)");
+      orphans.push_back(inum);
+    } else if (!allocated && links[inum] > 0) {
+      problem("inode " + to_string(inum) + ": in the tree but not allocated");
+      unmarkedInodes.push_back(inum);
+    }
+  }
+}
+
+// Counts the users of every block, or with locate set, records where the
+// double allocated blocks in conflicts are used from. Only the conflicts
+// keep full claims, so large images need about one byte per block (and
+// the reference counts).
+template <int BlockSize>
+void Checker<BlockSize>::claimBlocks(bool locate) {
+  for (int inum = 0; inum < super.num_inodes; ++inum) {
+    if (links[inum] == 0) {
+      continue;
+    }
+    const inode_t &inode = inodes[inum];
+    int numBlocks;
+    if (listed[inum]) {
+      // its size links the list, its blocks end at the first 0
+      numBlocks = 0;
+      while (numBlocks < DIRECT_PTRS && inode.direct[numBlocks] != 0) {
+        numBlocks++;
+      }
+    } else if (inode.type == UFS_DIRECTORY) {
+      numBlocks = (inode.size + BlockSize - 1) / BlockSize;
+    } else {
+      numBlocks = fileBlocks(inode);
+      if (inode.size < 0 || inode.size > Layout<BlockSize>::maxFileSize || numBlocks > DIRECT_PTRS) {
+        if (!locate) {
+          problem("inode " + to_string(inum) + ": bad size " + to_string(inode.size), false);
+        }
+        continue;
+      }
+    }
+    // cold blocks are numbered in the cold tier, and checked with it
+    if (inode.type == UFS_REGULAR_FILE && (inode.flags & UFS_INODE_COLD)) {
+      if (!locate) {
+        claimColdBlocks(inum, inode, numBlocks);
+      }
+      continue;
+    }
+    for (int i = 0; i < numBlocks && i < DIRECT_PTRS; ++i) {
+      if (!validBlock(inode.direct[i])) {
+        if (inode.type == UFS_REGULAR_FILE && !locate) {
+          problem("inode " + to_string(inum) + ": block " + to_string(inode.direct[i])
+                  + " is outside the data region", false);
+        }
+        continue;
+      }
+      Claim claim = {inum, inode.type == UFS_REGULAR_FILE, i, 0, 0};
+      claimBlock(inode.direct[i] - super.data_region_addr, claim, locate);
+    }
+  }
+  for (size_t i = 0; i < indexClaims.size(); ++i) {
+    claimBlock(indexClaims[i].first - super.data_region_addr, indexClaims[i].second, locate);
+  }
+}
+
+template <int BlockSize>
+void Checker<BlockSize>::claimBlock(int index, const Claim &claim, bool locate) {
+  if (!locate) {
+    if (owners[index] < 255) {
+      owners[index]++;
+    }
+    if (!claim.file) {
+      metadata[index] = true;
+    } else if (!refCounts.empty()) {
+      refCounts[index]--;
+    }
+  } else if (conflicts.count(index) > 0) {
+    conflicts[index].push_back(claim);
+  }
+}
+
+template <int BlockSize>
+void Checker<BlockSize>::claimColdBlocks(int inum, const inode_t &inode, int numBlocks) {
+  if (coldDisk == NULL) {
+    return;
+  }
+  for (int i = 0; i < numBlocks && i < DIRECT_PTRS; ++i) {
+    unsigned int block = inode.direct[i];
+    if (block < (unsigned int)coldSuper.data_region_addr
+        || block >= (unsigned int)coldSuper.data_region_addr + coldSuper.num_data) {
+      problem("inode " + to_string(inum) + ": cold block " + to_string(block)
+              + " is outside the cold tier's data region", false);
+      continue;
+    }
+    int index = block - coldSuper.data_region_addr;
+    if (coldOwners[index] < 255) {
+      coldOwners[index]++;
+    }
+  }
+}
+
+// Cold blocks are never shared, so there are no reference counts to
+// check. Blocks used twice are left for the user, like damaged directories.
+template <int BlockSize>
+void Checker<BlockSize>::checkColdBlocks() {
+  if (coldDisk == NULL) {
+    return;
+  }
+  for (int index = 0; index < coldSuper.num_data; ++index) {
+    unsigned int block = coldSuper.data_region_addr + index;
+    bool allocated = coldBitmap[index / 8] & (1 << (index % 8));
+    if (allocated && coldOwners[index] == 0) {
+      problem("cold block " + to_string(block) + ": allocated but not used (leaked)");
+    } else if (!allocated && coldOwners[index] > 0) {
+      problem("cold block " + to_string(block) + ": in use but not allocated");
+    }
+    if (coldOwners[index] > 1) {
+      problem("cold block " + to_string(block) + ": used by " + to_string(coldOwners[index])
+              + " files (double allocated)", false);
+    }
+  }
+}
+
+template <int BlockSize>
+void Checker<BlockSize>::checkBlocks() {
+  claimBlocks(false);
+
+  DedupStore<BlockSize> store(disk, &super);
+  bool refcounted = (super.features & UFS_FEATURE_REFCOUNTS) != 0;
+  for (int index = 0; index < super.num_data; ++index) {
+    unsigned int block = super.data_region_addr + index;
+    bool allocated = blockAllocated(block);
+    if (allocated && owners[index] == 0) {
+      problem("block " + to_string(block) + ": allocated but not used (leaked)");
+    } else if (!allocated && owners[index] > 0) {
+      problem("block " + to_string(block) + ": in use but not allocated");
+    }
+
+    // shared file data is fine on refcounted images, any other sharing is
+    // a double allocation
+    if (owners[index] > 1 && (!refcounted || metadata[index])) {
+      conflicts[index];
+    } else if (refcounted && refCounts[index] != 0) {
+      unsigned int counted = store.references(block);
+      problem("block " + to_string(block) + ": " + to_string(counted) + " references counted, "
+              + to_string(counted - refCounts[index]) + " found");
+    }
+  }
+
+  if (conflicts.empty()) {
+    return;
+  }
+  claimBlocks(true);
+  for (map<int, vector<Claim> >::iterator iter = conflicts.begin(); iter != conflicts.end(); ++iter) {
+    string message = "block " + to_string(super.data_region_addr + iter->first) + ": used by inodes";
+    for (size_t i = 0; i < iter->second.size(); ++i) {
+      message += " " + to_string(iter->second[i].inum);
+    }
+    problem(message + " (double allocated)");
+  }
+}
+
+// Gives every claim after the first of a double allocated block its own
+// copy, frees orphans, and rewrites the bitmaps and reference counts from
+// what the tree uses
+template <int BlockSize>
+bool Checker<BlockSize>::repair() {
+  set<int> changedInodes;
+  int nextFree = 0;
+  unsigned char content[BlockSize];
+  for (map<int, vector<Claim> >::iterator iter = conflicts.begin(); iter != conflicts.end(); ++iter) {
+    unsigned int block = super.data_region_addr + iter->first;
+    disk->readBlock(block, content);
+    for (size_t i = 1; i < iter->second.size(); ++i) {
+      while (nextFree < super.num_data && owners[nextFree] > 0) {
+        nextFree++;
+      }
+      if (nextFree == super.num_data) {
+        cout << "block " << block << ": no free block to copy it to" << endl;
+        unrepaired++;
+        break;
+      }
+      unsigned int copy = super.data_region_addr + nextFree;
+      disk->writeBlock(copy, content);
+
+      Claim &claim = iter->second[i];
+      if (claim.slot >= 0) {
+        inodes[claim.inum].direct[claim.slot] = copy;
+        changedInodes.insert(claim.inum);
+      } else {
+        typename Layout<BlockSize>::IndexNode parent;
+        disk->readBlock(claim.parent, &parent);
+        parent.entries[claim.entry].inum = copy;
+        disk->writeBlock(claim.parent, &parent);
+      }
+      if (owners[iter->first] < 255) {
+        owners[iter->first]--;
+      }
+      owners[nextFree] = 1;
+      if (claim.file) {
+        refCounts[iter->first]++;
+        refCounts[nextFree]--;
+      } else {
+        metadata[nextFree] = true;
+      }
+    }
+  }
+  for (set<int>::iterator iter = changedInodes.begin(); iter != changedInodes.end(); ++iter) {
+    fs->writeInode(&super, *iter, &inodes[*iter]);
+  }
+
+  for (size_t i = 0; i < orphans.size(); ++i) {
+    inodeBitmap[orphans[i] / 8] &= ~(1 << (orphans[i] % 8));
+  }
+  for (size_t i = 0; i < unmarkedInodes.size(); ++i) {
+    inodeBitmap[unmarkedInodes[i] / 8] |= 1 << (unmarkedInodes[i] % 8);
+  }
+  fs->writeInodeBitmap(&super, inodeBitmap.data());
+
+  for (int index = 0; index < super.num_data; ++index) {
+    if (owners[index] > 0) {
+      dataBitmap[index / 8] |= 1 << (index % 8);
+    } else {
+      dataBitmap[index / 8] &= ~(1 << (index % 8));
+    }
+  }
+  fs->writeDataBitmap(&super, dataBitmap.data());
+
+  if (super.features & UFS_FEATURE_REFCOUNTS) {
+    DedupStore<BlockSize> store(disk, &super);
+    for (int index = 0; index < super.num_data; ++index) {
+      if (refCounts[index] != 0) {
+        unsigned int block = super.data_region_addr + index;
+        store.setReferences(block, store.references(block) - refCounts[index]);
+      }
+    }
+    // blocks may have been freed or copied, so the fingerprints are
+    // rebuilt rather than patched
+    store.reindex();
+    store.flush();
+  }
+
+  if (coldDisk != NULL) {
+    for (int index = 0; index < coldSuper.num_data; ++index) {
+      if (coldOwners[index] > 0) {
+        coldBitmap[index / 8] |= 1 << (index % 8);
+      } else {
+        coldBitmap[index / 8] &= ~(1 << (index % 8));
+      }
+    }
+    for (int i = 0; i < coldSuper.data_bitmap_len; ++i) {
+      coldDisk->writeBlock(coldSuper.data_bitmap_addr + i, &coldBitmap[(size_t)i * BlockSize]);
+    }
+  }
+  return unrepaired == 0;
+}
+
+// Checks, and with repair set fixes, an image with BlockSize byte blocks,
+// and its cold tier when coldImage isn't empty
+template <int BlockSize>
+int check(LocalFileSystem *fs, int threads, bool repair, const string &coldImage) {
+  Disk *coldDisk = coldImage.empty() ? NULL : new Disk(coldImage, BlockSize);
+  Checker<BlockSize> checker(fs->disk, fs, threads, coldDisk);
+  if (!checker.load()) {
+    return FSCK_UNREPAIRED;
+  }
+  checker.walk();
+  checker.walkOrphanList();
+  checker.checkInodes();
+  checker.checkBlocks();
+  checker.checkColdBlocks();
+
+  int problems = checker.problemCount();
+  if (problems == 0) {
+    cout << "clean" << endl;
+    return FSCK_OK;
+  }
+  cout << problems << " problems found" << endl;
+  if (!repair) {
+    return FSCK_UNREPAIRED;
+  }
+  checker.repair();
+  if (checker.unrepaired > 0) {
+    cout << checker.unrepaired << " problems left" << endl;
+    return FSCK_UNREPAIRED;
+  }
+  cout << "repaired" << endl;
+  return FSCK_REPAIRED;
+}
+
+int main(int argc, char *argv[]) {
+  bool repair = false;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  string coldImage;
+  int opt;
+  while ((opt = getopt(argc, argv, "rj:c:")) != -1) {
+    switch (opt) {
+    case 'r':
+      repair = true;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'c':
+      coldImage = optarg;
+      break;
+    default:
+      threads = 0;
+    }
+  }
+  if (optind != argc - 1 || threads <= 0) {
+    cerr << "Usage: " << argv[0] << " [-r] [-j <threads>] [-c <cold tier file>] <disk image file>" << endl;
+    return FSCK_USAGE;
+  }
+
+  LocalFileSystem *fs = LocalFileSystem::mount(argv[optind]);
+  if (fs == NULL) {
+    cout << "super block: unsupported block size" << endl;
+    return FSCK_UNREPAIRED;
+  }
+  switch (fs->blockSize()) {
+  case 4096:
+    return check<4096>(fs, threads, repair, coldImage);
+  case 16384:
+    return check<16384>(fs, threads, repair, coldImage);
+  default:
+    return check<65536>(fs, threads, repair, coldImage);
+  }
+}
@@ -20,32 +20,13 @@ void Recursive_LS(LocalFileSystem &fs, int inodeNumber, const string &full_path)
   // Print the directory path
   cout << "Directory " << full_path << "/" << endl;
 
-  vector<dir_ent_t> directory_entries;
-  unsigned char block[UFS_BLOCK_SIZE];
-  int totalBytesRead = 0;
-
-  while (totalBytesRead < inode.size) {
-    int remaining_bytes_inFile = inode.size - totalBytesRead;
-    // call read to compute bytesRead, and use it to find # of entries in this block
-    int bytesRead = fs.read(inodeNumber, block, min(UFS_BLOCK_SIZE, remaining_bytes_inFile));
-    //calculate how many entries are in this block, since it no need to be full block
-    int entriesInBlock = bytesRead / sizeof(dir_ent_t);
-    dir_ent_t *entry = (dir_ent_t *)block;
-    
-    for (int i = 0; i < entriesInBlock; ++i) {
-      directory_entries.push_back(entry[i]);
-    }
-
-    totalBytesRead += bytesRead;
+  // entries come back sorted by name (strcmp order)
+  vector<DirEntry> directory_entries;
+  if (fs.readdirSorted(inodeNumber, "", -1, directory_entries) < 0) {
+    cerr << "Error: could not read directory inode " << inodeNumber << endl;
+    return;
   }
 
-  // Sort and print the directory entries
-  sort(directory_entries.begin(), directory_entries.end(), 
-      [](const dir_ent_t &a, const dir_ent_t &b) {
-      // it needs to be in lexcio order, a < b --> a before b
-      return strcmp(a.name, b.name) < 0;
-  });
-
   for (const auto &entry : directory_entries) {
     cout << entry.inum << "\t" << entry.name << endl;
   }
@@ -53,20 +34,16 @@ void Recursive_LS(LocalFileSystem &fs, int inodeNumber, const string &full_path)
 
   // Recursively traverse subdirectories
   for (const auto &entry : directory_entries) {
-    if (strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0) {
-      inode_t entryInode;
-      fs.stat(entry.inum, &entryInode);
-      // only iterate down when it's a directory
-      if (entryInode.type == UFS_DIRECTORY) {
-        string new_full_path;
-        // for the first root
-        if (full_path == "/") {
-          new_full_path = full_path + entry.name;
-        } else {
-          new_full_path = full_path + "/" + entry.name;
-        }
-        Recursive_LS(fs, entry.inum, new_full_path);
+    // only iterate down when it's a directory
+    if (entry.name != "." && entry.name != ".." && entry.type == UFS_DIRECTORY) {
+      string new_full_path;
+      // for the first root
+      if (full_path == "/") {
+        new_full_path = full_path + entry.name;
+      } else {
+        new_full_path = full_path + "/" + entry.name;
       }
+      Recursive_LS(fs, entry.inum, new_full_path);
     }
   }
 }
@@ -83,8 +60,12 @@ int main(int argc, char *argv[]) {
   string diskImageFile = argv[1];
 
   // Initialize the Disk and LocalFileSystem
-  Disk disk(diskImageFile, UFS_BLOCK_SIZE);
-  LocalFileSystem fs(&disk);
+  LocalFileSystem *fileSystem = LocalFileSystem::mount(diskImageFile);
+  if (fileSystem == NULL) {
+    cerr << "Unsupported block size in " << diskImageFile << endl;
+    return 1;
+  }
+  LocalFileSystem &fs = *fileSystem;
 
   // fs.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "Directory1");
   // fs.create(4, UFS_REGULAR_FILE, "ABCD");
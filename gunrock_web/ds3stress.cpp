@@ -0,0 +1,179 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <set>
+#include <atomic>
+#include <pthread.h>
+
+#include "LocalFileSystem.h"
+#include "dthread.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Files each worker keeps in its own directory
+#define FILES_PER_THREAD (8)
+#define MAX_WRITE (20000)
+
+LocalFileSystem *fs;
+int steps;
+int sharedDir;
+atomic<int> failures(0);
+
+#define FAIL(msg) do { \
+    cerr << "thread " << id << " step " << step << ": " << msg << endl; \
+    failures++; \
+    return NULL; \
+  } while (0)
+
+// Each worker owns a directory t<id> with a subdirectory sub and up to
+// FILES_PER_THREAD files, and remembers what every file should hold.
+// Nothing else changes its directory, so lookups, reads and listings of
+// it must match. Files and sub are renamed through the shared directory
+// every worker uses, which is where the workers meet.
+void *worker(void *arg) {
+  long id = (long)arg;
+  unsigned int seed = id * 7919 + 1;
+  int step = 0;
+  string dirName = "t" + to_string(id);
+  int dir = fs->create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, dirName);
+  if (dir < 0) FAIL("create " << dirName << " returned " << dir);
+  int sub = fs->create(dir, UFS_DIRECTORY, "sub");
+  if (sub < 0) FAIL("create sub returned " << sub);
+
+  vector<string> model(FILES_PER_THREAD);
+  vector<bool> exists(FILES_PER_THREAD, false);
+  vector<char> buffer(fs->maxFileSize() + 1);
+  for (step = 0; step < steps; ++step) {
+    int f = rand_r(&seed) % FILES_PER_THREAD;
+    string name = "f" + to_string(f);
+    int op = rand_r(&seed) % 10;
+    if (op < 3) {
+      // put: create if needed, then replace the content
+      int len = rand_r(&seed) % MAX_WRITE;
+      string content(len, 'a' + (id % 26));
+      for (int i = 0; i < len; i += 97) {
+        content[i] = 'A' + rand_r(&seed) % 26;
+      }
+      int inum = fs->lookup(dir, name);
+      if (inum < 0) {
+        inum = fs->create(dir, UFS_REGULAR_FILE, name);
+        if (inum < 0) FAIL("create " << name << " returned " << inum);
+      }
+      int ret = fs->write(inum, content.data(), len);
+      if (ret != len) FAIL("write " << name << " returned " << ret);
+      model[f] = content;
+      exists[f] = true;
+    } else if (op < 5) {
+      // get: the file must be there exactly when the model says so
+      int inum = fs->lookup(dir, name);
+      if (exists[f] != (inum >= 0)) FAIL("lookup " << name << " returned " << inum);
+      if (inum < 0) {
+        continue;
+      }
+      int size = model[f].size();
+      int ret = fs->read(inum, buffer.data(), size);
+      if (ret != size || memcmp(buffer.data(), model[f].data(), size) != 0) {
+        FAIL("read " << name << " returned " << ret << ", want " << size << " matching bytes");
+      }
+    } else if (op < 7) {
+      int inum = fs->lookup(dir, name);
+      if (inum < 0) {
+        continue;
+      }
+      int room = fs->maxFileSize() - model[f].size();
+      string extra(min((int)(rand_r(&seed) % 3000), room), 'a' + step % 26);
+      int ret = fs->append(inum, extra.data(), extra.size());
+      if (ret != (int)extra.size()) FAIL("append " << name << " returned " << ret);
+      model[f] += extra;
+    } else if (op < 8) {
+      int ret = fs->unlink(dir, name);
+      if (ret != 0) FAIL("unlink " << name << " returned " << ret);
+      exists[f] = false;
+      model[f].clear();
+    } else if (op < 9) {
+      // rename out to sub or the shared directory and back
+      if (!exists[f]) {
+        continue;
+      }
+      string tmp = "x" + to_string(id) + "_" + to_string(f);
+      int target = (rand_r(&seed) % 2) ? sub : sharedDir;
+      int ret = fs->rename(dir, name, target, tmp);
+      if (ret != 0) FAIL("rename " << name << " out returned " << ret);
+      ret = fs->rename(target, tmp, dir, name);
+      if (ret != 0) FAIL("rename " << name << " back returned " << ret);
+    } else {
+      // list both directories, then move sub through the shared directory
+      vector<DirEntry> entries;
+      if (fs->readdir(sharedDir, entries) < 2) FAIL("readdir shared");
+      entries.clear();
+      if (fs->readdir(dir, entries) < 0) FAIL("readdir " << dirName);
+      set<string> want = { ".", "..", "sub" };
+      for (int i = 0; i < FILES_PER_THREAD; ++i) {
+        if (exists[i]) {
+          want.insert("f" + to_string(i));
+        }
+      }
+      set<string> got;
+      for (const DirEntry &entry : entries) {
+        got.insert(entry.name);
+      }
+      if (got != want || entries.size() != want.size()) {
+        FAIL("readdir " << dirName << " has " << entries.size() << " entries, want " << want.size());
+      }
+      string movedName = "s" + to_string(id);
+      int ret = fs->rename(dir, "sub", sharedDir, movedName);
+      if (ret != 0) FAIL("rename sub out returned " << ret);
+      ret = fs->rename(sharedDir, movedName, dir, "sub");
+      if (ret != 0) FAIL("rename sub back returned " << ret);
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 4) {
+    cout << argv[0] << ": diskImageFile [threads] [steps]" << endl;
+    return 1;
+  }
+  string diskImageFile = argv[1];
+  int threads = argc > 2 ? atoi(argv[2]) : 8;
+  steps = argc > 3 ? atoi(argv[3]) : 2000;
+  if (threads < 1 || steps < 0) {
+    cerr << "threads must be at least 1 and steps can't be negative" << endl;
+    return 1;
+  }
+
+  LocalFileSystem *fileSystem = LocalFileSystem::mount(diskImageFile);
+  if (fileSystem == NULL) {
+    cerr << "Unsupported block size in " << diskImageFile << endl;
+    return 1;
+  }
+  fs = fileSystem;
+  sharedDir = fs->create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, "shared");
+  if (sharedDir < 0) {
+    cerr << "Could not create the shared directory: " << sharedDir << endl;
+    return 1;
+  }
+
+  vector<pthread_t> workers(threads);
+  for (long i = 0; i < threads; ++i) {
+    if (dthread_create(&workers[i], NULL, worker, (void *)i) != 0) {
+      cerr << "Could not start worker " << i << endl;
+      exit(1);
+    }
+  }
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  delete fs;
+
+  if (failures != 0) {
+    cerr << failures << " of " << threads << " workers failed" << endl;
+    return 1;
+  }
+  cout << threads << " workers ran " << steps << " steps each" << endl;
+  return 0;
+}
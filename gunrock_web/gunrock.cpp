@@ -30,6 +30,8 @@ string BASEDIR = "ds3";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
 string DISKFILE = "disk.img";
+WriteBackOptions WRITE_BACK;
+TieringOptions TIERING;
 
 vector<HttpService *> services;
 
@@ -127,7 +129,7 @@ int main(int argc, char *argv[]) {
   signal(SIGPIPE, SIG_IGN);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:w:m:j:c:")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -150,8 +152,21 @@ int main(int argc, char *argv[]) {
     case 'i':
       DISKFILE = string(optarg);
       break;
+    case 'w':
+      WRITE_BACK.flushIntervalMs = atoi(optarg);
+      break;
+    case 'm':
+      WRITE_BACK.maxBufferedBytes = atoll(optarg);
+      break;
+    case 'j':
+      WRITE_BACK.journalFile = string(optarg);
+      break;
+    case 'c':
+      TIERING.coldImageFile = string(optarg);
+      break;
     default:
-      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile]" << endl;
+      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile]"
+          << " [-w flushIntervalMs] [-m maxBufferedBytes] [-j journalFile] [-c coldTierFile]" << endl;
       exit(1);
     }
   }
@@ -166,7 +181,7 @@ int main(int argc, char *argv[]) {
 
   // The order that you push services dictates the search order
   // for path prefix matching
-  services.push_back(new DistributedFileSystemService(DISKFILE));
+  services.push_back(new DistributedFileSystemService(DISKFILE, WRITE_BACK, TIERING));
   services.push_back(new FileService(BASEDIR));
   
   while(true) {
@@ -0,0 +1,36 @@
+#ifndef _ACCESS_COUNTERS_H_
+#define _ACCESS_COUNTERS_H_
+
+#include <map>
+#include <pthread.h>
+
+/**
+ * How often each file was read or written lately, for the migrator of a
+ * tiered image (see LocalFileSystem::startMigrator).
+ *
+ * Every access adds one to the file's count, and decay halves all of them
+ * once per migrator pass, so a count is roughly the accesses of the last
+ * few passes with the newest weighing most. Files nobody touched drop out
+ * of the map, there is no table the size of the inode region. Counts live
+ * in memory only and start from zero at mount.
+ *
+ * The lock in here is taken last.
+ */
+class AccessCounters {
+ public:
+  AccessCounters();
+  ~AccessCounters();
+
+  void touch(int inodeNumber);
+  int count(int inodeNumber);
+  // Halves every count and forgets the ones that reach zero
+  void decay();
+  // inodeNumber was freed, its count isn't the next file's
+  void forget(int inodeNumber);
+
+ private:
+  pthread_mutex_t lock;
+  std::map<int, int> counts;
+};
+
+#endif
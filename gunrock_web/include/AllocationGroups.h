@@ -0,0 +1,168 @@
+#ifndef _ALLOCATION_GROUPS_H_
+#define _ALLOCATION_GROUPS_H_
+
+#include <atomic>
+#include <set>
+#include <vector>
+#include <pthread.h>
+
+#include "Disk.h"
+#include "InodeLocks.h"
+#include "Layout.h"
+#include "ufs.h"
+
+/**
+ * Allocation groups. The inodes and data blocks of an image are split
+ * into groups of super_t.group_inodes inodes and super_t.group_blocks
+ * blocks (mkfs picks them), and every group has its own slice of the two
+ * bitmaps, its own free counts and its own lock. Threads that allocate in
+ * different groups don't wait for each other.
+ *
+ * Like ext4 with flex_bg, the bitmaps of all groups stay packed in the
+ * bitmap regions, so the layout is the same as on images without groups,
+ * which have a single group. A group owns whole blocks of the inode
+ * region, but can share a bitmap block with its neighbours, so bitmap
+ * blocks are written back with only the group's own bytes changed.
+ *
+ * Allocations start in the group a caller asks for, normally the one of
+ * the parent directory, and go on to the following groups when it is
+ * full. A directory and its files stay close together on disk.
+ *
+ * The free counts are kept in memory, counted in one pass over the
+ * bitmaps at mount, and kept up to date by every allocation and release,
+ * so capacity checks never read the bitmaps. A rolled back Disk
+ * transaction puts old bitmap blocks back, so everything is counted again
+ * after one.
+ *
+ * Below the group counts there is a count for every chunk, the bits of
+ * one group in one bitmap block. Searches skip the chunks that have
+ * nothing free without reading them, and only the bitmap blocks that
+ * change are written, so allocating stays cheap on large, nearly full
+ * images.
+ *
+ * Freed blocks keep whatever they held, and the blocks allocateBlocks
+ * hands out are for callers that write them whole. Callers that need
+ * zeros on disk take them from the zeroed pool: free blocks, mostly at
+ * the ends of the groups where searches get to last, that zeroFreeBlocks
+ * wrote zeros to. A block leaves the pool when anything allocates it,
+ * including callers that write the whole bitmap, and the whole pool is
+ * forgotten after a rolled back transaction.
+ */
+template <int BlockSize>
+class AllocationGroups {
+ public:
+  AllocationGroups(Disk *disk, InodeLocks *locks);
+  ~AllocationGroups();
+
+  // Sets the groups up for the image and counts what is free in them
+  void load(super_t *super);
+
+  int groupCount();
+  int inodeGroup(int inodeNumber);
+  // block is a disk block number in the data region
+  int blockGroup(unsigned int block);
+  // The data bitmap index of the first block of group
+  int firstBlock(int group);
+  // The group for a new directory in parentGroup: the one with the most
+  // free blocks that has a free inode, so directories spread over the
+  // groups and their files have room next to them
+  int directoryGroup(int parentGroup);
+  // Free inodes and data blocks in all groups, without reading the bitmaps
+  int freeInodes();
+  int freeBlocks();
+
+  // These take the allocation lock shared and the group locks they need,
+  // and write the bitmap blocks they change.
+  // Returns a free inode in group or after it, or -1 if there is none
+  int allocateInode(int group);
+  // Finds count blocks, in a row within a group if there are, leaving
+  // keepFree blocks free. Returns false without taking any otherwise.
+  bool allocateBlocks(int group, int count, unsigned int *blocks, int keepFree);
+  // Like allocateBlocks, but takes blocks of the zeroed pool first. The
+  // first zeroed blocks were in it and are all zeros on disk.
+  bool allocateZeroedBlocks(int group, int count, unsigned int *blocks, int keepFree, int *zeroed);
+  void releaseInode(int inodeNumber);
+  void releaseBlocks(const std::vector<unsigned int> &blocks);
+
+  // Writes zeros to up to count free blocks that aren't in the zeroed
+  // pool yet, from the end of each group, and adds them to it. Returns how
+  // many it zeroed. The caller holds a Disk transaction, so no other
+  // thread has one open that could give a freed block back its old owner.
+  int zeroFreeBlocks(int count);
+  // Blocks in the zeroed pool
+  int zeroedBlocks();
+  // For callers that hold the exclusive allocation lock and allocate in
+  // their own copy of the data bitmap: takes up to count blocks of the
+  // zeroed pool that are free in dataBitmap, from group on, and marks them
+  // used in it. Returns how many it took.
+  int allocateZeroedBits(int group, unsigned char *dataBitmap, int count, unsigned int *blocks);
+
+  // Counts the groups again after the whole bitmap was written under the
+  // exclusive allocation lock. Blocks it allocated leave the zeroed pool.
+  void countInodes(const unsigned char *inodeBitmap);
+  void countBlocks(const unsigned char *dataBitmap);
+
+ private:
+  // One of the two bitmaps, split into groups
+  struct Bitmap {
+    int addr;       // first block
+    int bits;       // inodes or data blocks
+    int groupBits;  // per group
+    std::vector<std::atomic<int> > free;  // per group
+    std::atomic<int> totalFree;
+    std::vector<int> chunkStart;  // first bit of each chunk, then bits
+    std::vector<int> groupChunk;  // first chunk of each group, then the chunk count
+    std::vector<std::atomic<int> > chunkFree;
+  };
+
+  // Takes blocks of the zeroed pool first when pooled isn't NULL, and
+  // sets it to how many
+  bool allocate(Bitmap &bitmap, int group, int count, int keepFree, unsigned int *taken, int *pooled = NULL);
+  // Bits of group, as [first, end)
+  void groupRange(Bitmap &bitmap, int group, int *first, int *end);
+  // Splits the bitmap into chunks
+  void makeChunks(Bitmap &bitmap);
+  // The chunk that holds bit
+  int chunkOf(Bitmap &bitmap, int bit);
+  // Reads the bitmap blocks holding bits [first, end) into buffer.
+  // firstBit is the bit of buffer[0].
+  void readBits(Bitmap &bitmap, int first, int end, std::vector<unsigned char> &buffer, int *firstBit);
+  // Writes the bitmap blocks holding bits [first, end) of group, leaving
+  // the bits of other groups in them as they are on disk
+  void writeBits(Bitmap &bitmap, int group, int first, int end, const std::vector<unsigned char> &buffer,
+                 int firstBit);
+  // Sets the free counts of chunks [firstChunk, endChunk) and their
+  // groups from bits, where bits[0] holds firstBit, and returns how much
+  // they changed
+  int recount(Bitmap &bitmap, int firstChunk, int endChunk, const unsigned char *bits, int firstBit);
+  void countAll(Bitmap &bitmap, const unsigned char *bits);
+  // Reads and counts every group again
+  void refresh(Bitmap &bitmap);
+  // Counts everything again if a Disk transaction was rolled back since
+  // the last look
+  void checkRollbacks();
+  // Takes up to count free bits of group, count in a row or none if run
+  // is set. Returns how many it took.
+  int take(Bitmap &bitmap, int group, int count, bool run, unsigned int *taken);
+  void release(Bitmap &bitmap, std::vector<int> &indexes);
+  // Takes up to count blocks of the zeroed pool, from group on. Returns
+  // how many it took.
+  int takeZeroed(int group, int count, unsigned int *taken);
+  void forgetZeroed();
+
+  Disk *disk;
+  InodeLocks *locks;
+  int groups;
+  int dataRegionAddr;
+  Bitmap inodes;
+  Bitmap blocks;
+  // bitmap blocks shared by two groups are written by one at a time
+  pthread_mutex_t writeLock;
+  std::atomic<int> rollbacks;
+  // data bitmap indexes of free blocks that are all zeros. The lock is
+  // taken after group locks.
+  std::set<int> zeroed;
+  pthread_mutex_t zeroedLock;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef _BLOCK_LOG_H_
+#define _BLOCK_LOG_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "ufs.h"
+
+/**
+ * The block log of an image made with mkfs -L (UFS_FEATURE_LOG, the
+ * format is in ufs.h). Disk hands it every block it reads and writes.
+ *
+ * Without it, each block a request changes (bitmaps, an inode, directory
+ * blocks, the file content) is its own synchronous write somewhere else
+ * on the image. With it, the blocks a transaction writes are kept in
+ * memory until commit, which writes them to the end of the log together
+ * as one sequential write and syncs once. Blocks written outside a
+ * transaction are a commit of their own. The block map plays the part of
+ * an LFS inode map for every block: it says where in the log the newest
+ * copy of a block is, and blocks it doesn't have are read from home.
+ *
+ * The cleaner frees whole segments. It takes the segments with the
+ * fewest blocks that are still the newest copy, and since the blocks a
+ * request rewrites every time (bitmaps, inode blocks, directories) have
+ * newer copies further on, most of a segment is usually dead by then. The
+ * live ones are written back home sorted by block number with one sync,
+ * then the block map is checkpointed, and only then are the segments used
+ * again. It runs in a thread of its own once a quarter of the segments
+ * are left, and in the writer when none are.
+ *
+ * A commit too big for the whole log is written straight home instead.
+ *
+ * The log lock serializes commits, cleaning and checkpoints. The map lock
+ * is a reader-writer lock over the block map and the uncommitted blocks,
+ * held shared by reads for the whole read, so a block the cleaner moves
+ * home can't be read in between.
+ */
+class BlockLog {
+ public:
+  BlockLog(std::string imageFile, int blockSize, const super_t &super);
+  ~BlockLog();
+
+  void readBlock(int blockNumber, void *buffer);
+  void readBlocks(int blockNumber, int count, void *buffer);
+  // inTransaction keeps the block with the others the transaction wrote
+  // until commit or rollback
+  void writeBlock(int blockNumber, const void *buffer, bool inTransaction);
+  void commit();
+  void rollback();
+
+ private:
+  enum SegmentState {
+    SEGMENT_FREE,
+    SEGMENT_HEAD,     // being filled
+    SEGMENT_FULL,
+    SEGMENT_CLEANED,  // free once the block map is checkpointed
+  };
+
+  // A chunk found while recovering, with the log blocks of its homes
+  struct Chunk {
+    long long sequence;
+    bool more;
+    int segment;
+    std::vector<std::pair<int, int> > blocks;
+  };
+
+  void recover();
+  // Reads the chunks in segment written after the checkpoint, and returns
+  // the block after the last good one
+  int scanSegment(int segment, std::vector<Chunk> &chunks);
+  bool readCheckpoint(int copy, std::vector<log_map_entry_t> &entries, log_checkpoint_t *header);
+
+  // These need the log lock
+  void append(const std::map<int, std::vector<unsigned char> > &writes);
+  void writeHome(const std::map<int, std::vector<unsigned char> > &writes);
+  int freeSegments();
+  int freeBlocks();
+  // Log blocks a commit of count blocks takes
+  int blocksNeeded(int count);
+  bool openSegment();
+  bool clean();
+  void checkpoint();
+
+  // These need the map lock exclusively
+  void mapBlock(int home, int block);
+  void unmapBlock(int home);
+
+  static void *cleaner(void *arg);
+  void wakeCleaner();
+
+  void readAt(long long blockNumber, int count, void *buffer);
+  void writeAt(long long blockNumber, int count, const void *buffer);
+  void sync();
+
+  std::string imageFile;
+  int fd;
+  int blockSize;
+  int logAddr;
+  int segments;
+  int segmentBlocks;
+  int checkpointAddr;
+  int checkpointBlocks;  // of each copy
+  int summaryEntries;
+
+  pthread_mutex_t logLock;
+  pthread_cond_t cleanWanted;
+  int head;
+  int headUsed;
+  long long sequence;
+  int nextCheckpoint;
+  // the map has entries from chunks after the checkpoint in segments
+  // that are free, so they can't be written over before the next one
+  bool checkpointNeeded;
+  std::vector<SegmentState> states;
+  bool cleanerStarted;
+  bool stopCleaner;
+  pthread_t cleanerThread;
+
+  pthread_rwlock_t mapLock;
+  std::map<int, int> blocks;  // home block -> log block
+  std::vector<int> homes;     // log block -> home block it is the newest copy of, or -1
+  std::vector<int> live;      // newest copies in each segment
+  std::map<int, std::vector<unsigned char> > uncommitted;
+};
+
+#endif
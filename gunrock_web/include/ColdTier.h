@@ -0,0 +1,57 @@
+#ifndef _COLD_TIER_H_
+#define _COLD_TIER_H_
+
+#include <string>
+#include <vector>
+
+#include "AllocationGroups.h"
+#include "Disk.h"
+#include "InodeLocks.h"
+#include "ufs.h"
+
+/**
+ * The cold tier of an image, an image made with mkfs -T on a bigger,
+ * slower device (see cold tiers in ufs.h). It only holds the blocks of
+ * files with UFS_INODE_COLD, so all there is to it is its data bitmap,
+ * kept in allocation groups like the image's own, and its data region.
+ *
+ * The tier has locks of its own, taken after every lock of the image.
+ * Once joined, its Disk begins, commits and rolls back with the image's,
+ * so a rolled back call gives back the cold blocks it took and takes
+ * back the ones it released.
+ */
+template <int BlockSize>
+class ColdTier {
+ public:
+  // Returns NULL when imageFile isn't a cold tier image with BlockSize
+  // byte blocks
+  static ColdTier<BlockSize> *open(std::string imageFile);
+  ~ColdTier();
+
+  // The pairing in the super block, 0 before the tier is attached the
+  // first time
+  int tierId();
+  void setTierId(int tierId);
+  // Makes the transactions of imageDisk the tier's too
+  void joinTransactions(Disk *imageDisk);
+
+  int dataBlocks();
+  int freeBlocks();
+  // Finds count blocks, in a row if there are. Returns false without
+  // taking any otherwise.
+  bool allocateBlocks(int count, unsigned int *blocks);
+  void releaseBlocks(const std::vector<unsigned int> &blocks);
+
+  void readBlock(unsigned int block, void *buffer);
+  void writeBlock(unsigned int block, const void *buffer);
+
+ private:
+  ColdTier(Disk *disk, const super_t &super);
+
+  Disk *disk;
+  super_t super;
+  InodeLocks locks;
+  AllocationGroups<BlockSize> groups;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _COMPRESSION_H_
+#define _COMPRESSION_H_
+
+/**
+ * Codecs for compressed files (UFS_INODE_COMPRESSED).
+ *
+ * Each chunk of a compressed file records the id of its codec in its
+ * compressed_header_t, and Codec::byId finds the codec again when the
+ * chunk is read. Adding a codec means giving it a new UFS_CODEC_* id and
+ * returning it from byId. Ids that are already in use on disk must never
+ * change.
+ */
+class Codec {
+ public:
+  virtual ~Codec() {}
+
+  // Compresses size bytes of in into out. Returns the compressed size, or
+  // -1 if it would take more than capacity bytes.
+  virtual int compress(const unsigned char *in, int size, unsigned char *out, int capacity) = 0;
+
+  // Returns the decompressed size, or -1 if in is corrupt or decompresses
+  // to more than capacity bytes
+  virtual int decompress(const unsigned char *in, int size, unsigned char *out, int capacity) = 0;
+
+  // The codec with a UFS_CODEC_* id, NULL if there isn't one
+  static Codec *byId(unsigned int id);
+};
+
+/**
+ * A byte oriented LZ77 codec in the style of LZ4, fast to compress and
+ * very fast to decompress. The output is a list of sequences, each a
+ * token byte, literals, and a match to copy from earlier output:
+ *
+ *   token         high 4 bits literal count, low 4 bits match length - 4
+ *   [length...]   more literal count bytes when the high bits are 15
+ *   literals
+ *   offset        2 bytes little endian, how far back the match starts
+ *   [length...]   more match length bytes when the low bits are 15
+ *
+ * Longer counts add bytes of 255 until one is smaller. The last sequence
+ * stops after its literals.
+ */
+class LzCodec : public Codec {
+ public:
+  virtual int compress(const unsigned char *in, int size, unsigned char *out, int capacity);
+  virtual int decompress(const unsigned char *in, int size, unsigned char *out, int capacity);
+};
+
+/**
+ * Keeps the bytes as they are, for chunks that don't get smaller
+ */
+class StoredCodec : public Codec {
+ public:
+  virtual int compress(const unsigned char *in, int size, unsigned char *out, int capacity);
+  virtual int decompress(const unsigned char *in, int size, unsigned char *out, int capacity);
+};
+
+#endif
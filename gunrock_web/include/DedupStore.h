@@ -0,0 +1,82 @@
+#ifndef _DEDUP_STORE_H_
+#define _DEDUP_STORE_H_
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "Disk.h"
+#include "Layout.h"
+#include "ufs.h"
+
+/**
+ * Reference counted file data blocks (UFS_FEATURE_REFCOUNTS), shared by
+ * snapshots and, with UFS_FEATURE_DEDUP, by files with the same content.
+ *
+ * Every block of file data goes through store(), which hashes it and
+ * looks the fingerprint up in the on-disk index (see dedup_slot_t in
+ * ufs.h). When a block with the same content already exists it gets
+ * another reference instead of a new block being written. Fingerprint
+ * matches are always confirmed by comparing the content, so hash
+ * collisions never share blocks that differ. Without UFS_FEATURE_DEDUP
+ * store() always uses a new block and only the counts are kept.
+ *
+ * File blocks are never changed in place on these images. A changed
+ * block is stored as a new one and the old one is released, and
+ * release() tells the caller when the last reference is gone.
+ *
+ * Like DirIndex, the store doesn't own the data bitmap. Callers reserve
+ * blocksNeeded() blocks before storing, give back the ones left over, and
+ * free the blocks release() hands back. Reference count and index blocks
+ * are kept in memory until flush().
+ */
+template <int BlockSize>
+class DedupStore {
+ public:
+  DedupStore(Disk *disk, super_t *super);
+
+  static unsigned long long fingerprint(const unsigned char *block);
+
+  // New blocks that storing count consecutive blocks of content needs,
+  // after sharing with blocks on disk and within the content itself
+  int blocksNeeded(const unsigned char *blocks, int count);
+
+  // Returns a block with this content, an existing one or one of
+  // spareBlocks, and adds a reference to it
+  unsigned int store(const unsigned char *block, std::vector<unsigned int> &spareBlocks);
+
+  // Drops a reference to block. Returns true when it was the last one
+  // and the block should be freed.
+  bool release(unsigned int block);
+
+  // Adds a reference to a block that is already stored, for a copy of
+  // the file that points to it
+  void share(unsigned int block);
+
+  unsigned int references(unsigned int block);
+
+  // For ds3fsck: sets a count recomputed from the inodes, and rebuilds the
+  // fingerprint index from the blocks that have references
+  void setReferences(unsigned int block, unsigned int count);
+  void reindex();
+
+  // Writes back the reference count and index blocks that changed
+  void flush();
+
+ private:
+  unsigned char *regionBlock(unsigned int block, bool modify);
+  unsigned int *refCount(unsigned int block, bool modify);
+  dedup_slot_t *slot(unsigned int index, bool modify);
+  unsigned int find(unsigned long long fingerprint, const unsigned char *block);
+  void insert(unsigned long long fingerprint, unsigned int block);
+  void remove(unsigned long long fingerprint, unsigned int block);
+
+  Disk *disk;
+  super_t *super;
+  bool dedup;
+  unsigned int slots;
+  std::map<unsigned int, std::vector<unsigned char> > cache;
+  std::set<unsigned int> dirty;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef _DIR_FILTER_H_
+#define _DIR_FILTER_H_
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "Disk.h"
+
+// What the directory filters saved, see LocalFileSystem::lookupStats
+struct LookupStats {
+  LookupStats() : filtered(0), passed(0), falsePositives(0) {}
+  long long filtered;        // lookups a filter answered without reading the directory
+  long long passed;          // lookups a filter let through to the directory
+  long long falsePositives;  // of those, the ones that didn't find the name
+};
+
+/**
+ * Bloom filters of the names in directories, so that looking up a name
+ * that isn't there mostly returns without reading the directory.
+ *
+ * A directory gets a filter the first time it is looked up, made from all
+ * of its entries, and create and rename add to it. A Bloom filter can't
+ * forget a name, so a removed one only makes the filter less sharp. Once
+ * too many were removed, or more added than it was sized for, the filter
+ * is dropped and the next lookup makes it again. Filters live in memory
+ * only. They are dropped with their directory, and all of them after a
+ * Disk rollback or a snapshot, which rewrite directories wholesale.
+ *
+ * LocalFileSystem calls these with the directory's inode locked, shared
+ * to check or build and exclusively to change it, so a filter never
+ * misses a name that is on disk. The lock in here is taken last.
+ */
+class DirFilters {
+ public:
+  DirFilters(Disk *disk);
+  ~DirFilters();
+
+  // Whether dir has a filter, and if so in *mayContain whether name can
+  // be in dir. rollbacks is Disk::rollbackCount as of the call, for build.
+  bool check(int dir, const std::string &name, bool *mayContain, int *rollbacks);
+  // Makes the filter of dir from all of its names, read when the Disk had
+  // seen rollbacks rollbacks. Nothing is kept if one happened since.
+  void build(int dir, const std::vector<std::string> &names, int rollbacks);
+  // An entry was added to or removed from dir
+  void add(int dir, const std::string &name);
+  void remove(int dir);
+  // dir was freed
+  void drop(int dir);
+  void clear();
+
+  // A lookup that check let through didn't find its name
+  void falsePositive();
+  void stats(LookupStats *stats);
+
+ private:
+  struct Filter {
+    std::vector<unsigned long long> bits;
+    int capacity;  // names it was sized for
+    int names;     // added, removed ones included
+    int removed;
+  };
+
+  static void hash(const std::string &name, unsigned int *first, unsigned int *step);
+  void insert(Filter &filter, const std::string &name);
+  // Drops filters until they take no more than the limit
+  void trim();
+  void refresh();
+
+  Disk *disk;
+  int rollbacks;
+  size_t bytes;
+  pthread_mutex_t lock;
+  std::map<int, Filter> filters;
+  std::atomic<long long> filtered;
+  std::atomic<long long> passed;
+  std::atomic<long long> falsePositives;
+};
+
+#endif
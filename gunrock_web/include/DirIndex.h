@@ -0,0 +1,70 @@
+#ifndef _DIR_INDEX_H_
+#define _DIR_INDEX_H_
+
+#include <string>
+#include <vector>
+
+#include "Disk.h"
+#include "Layout.h"
+#include "ufs.h"
+
+/**
+ * The sorted index of one directory.
+ *
+ * The index is a B+tree keyed by entry name whose nodes are data blocks
+ * (see dir_index_node_t in ufs.h), with as many entries per node as
+ * BlockSize blocks hold. LocalFileSystem keeps it up to date
+ * in create and unlink, and uses it to look up names and to list a
+ * directory in order starting after a marker.
+ *
+ * The index never allocates blocks itself. Callers reserve
+ * spareBlocksNeeded() blocks before an insert so that running out of
+ * space is detected before anything is written, and release the ones
+ * that are left over afterwards. Removing entries doesn't merge nodes;
+ * empty leaves stay in the tree until the directory is deleted.
+ */
+template <int BlockSize>
+class DirIndex {
+ public:
+  DirIndex(Disk *disk, unsigned int rootBlock);
+
+  // Writes a new index with a single leaf that holds entries
+  static void format(Disk *disk, unsigned int block, const dir_ent_t *entries, int count);
+  // Writes a new index of entries, which are sorted by name, with full
+  // nodes taken from the back of blocks, and returns its root.
+  // buildBlocksNeeded is how many it takes.
+  static int buildBlocksNeeded(int count);
+  static unsigned int build(Disk *disk, const std::vector<dir_ent_t> &entries,
+                            std::vector<unsigned int> &blocks);
+
+  // The root can move when it splits, so callers store it after inserts
+  unsigned int rootBlock();
+
+  // The most new blocks one insert can use
+  int spareBlocksNeeded();
+
+  void insert(const dir_ent_t &entry, std::vector<unsigned int> &spareBlocks);
+  bool remove(const std::string &name);
+  // Overwrites the entry with the same name, like after its inode changed
+  bool replace(const dir_ent_t &entry);
+  bool find(const std::string &name, dir_ent_t *entry);
+
+  // Up to maxEntries entries with names after marker, in order. A
+  // negative maxEntries lists all of them.
+  void list(const std::string &marker, int maxEntries, std::vector<dir_ent_t> &entries);
+
+  // Every block used by the index, for freeing it with its directory
+  void nodeBlocks(std::vector<unsigned int> &blocks);
+
+ private:
+  typedef typename Layout<BlockSize>::IndexNode Node;
+
+  bool insertInto(unsigned int block, const dir_ent_t &entry,
+                  std::vector<unsigned int> &spareBlocks, dir_ent_t *separator);
+  unsigned int findLeaf(const std::string &name);
+
+  Disk *disk;
+  unsigned int root;
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef _DIR_SCAN_H_
+#define _DIR_SCAN_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "Disk.h"
+#include "ufs.h"
+
+/**
+ * A name to look for among the entries of a directory block.
+ *
+ * The name is kept padded out to a whole dir_ent_t name, so an entry is
+ * compared with two 16 byte compares where SSE2 is there (one memcmp
+ * elsewhere) and nothing is copied into a string. Only the bytes up to
+ * and including the terminator are compared, so whatever follows it in
+ * an entry, like the type byte of UFS_FEATURE_DIRENT_TYPE, doesn't count.
+ *
+ * A fingerprint is a one byte hash of a name. Given the fingerprints of a
+ * block, find only compares the entries whose fingerprint is the name's,
+ * and mayBeIn says whether the block needs to be read at all.
+ */
+class DirName {
+ public:
+  explicit DirName(const std::string &name);
+
+  // Position of the name in entries[0, count), or -1. fingerprints are
+  // those of the entries, or NULL to compare every name.
+  int find(const dir_ent_t *entries, int count, const unsigned char *fingerprints = NULL) const;
+  bool mayBeIn(const unsigned char *fingerprints, int count) const;
+
+  static unsigned char fingerprint(const char *name, int length);
+  // The fingerprints of entries[0, count) into out
+  static void fingerprints(const dir_ent_t *entries, int count, unsigned char *out);
+
+ private:
+  bool matches(const dir_ent_t &entry) const;
+  // Bit i is set when fingerprints[i] is the name's, for up to 16
+  unsigned int candidates(const unsigned char *fingerprints, int count) const;
+
+  alignas(16) unsigned char padded[32];
+  int length;  // -1 for names that no entry can have
+  unsigned int compared;  // a bit for each byte that has to match
+  unsigned char print;
+};
+
+/**
+ * The fingerprints of directory entry blocks, kept in memory so lookups
+ * can pass over blocks without reading them.
+ *
+ * A block is added when it is read for a lookup, and LocalFileSystem
+ * writes every entry block through set, so what is here matches the
+ * disk. A rolled back Disk transaction puts old blocks back, so
+ * everything is dropped after one. Its lock is taken last and held only
+ * to copy fingerprints in or out.
+ */
+class DirFingerprints {
+ public:
+  DirFingerprints(Disk *disk, int entriesPerBlock);
+  ~DirFingerprints();
+
+  // Copies the fingerprints of block to out, false if they aren't known.
+  // rollbacks is Disk::rollbackCount as of the call, for set.
+  bool get(unsigned int block, unsigned char *out, int *rollbacks);
+  // Fingerprints a block of entriesPerBlock entries that was read or
+  // written when the Disk had seen rollbacks rollbacks. They are left out
+  // if one happened since, the block may be older than the disk by now.
+  void set(unsigned int block, const dir_ent_t *entries, int rollbacks);
+
+ private:
+  Disk *disk;
+  int entriesPerBlock;
+  size_t maxBlocks;
+  int rollbacks;
+  pthread_mutex_t lock;
+  std::map<unsigned int, std::vector<unsigned char> > blocks;
+};
+
+#endif
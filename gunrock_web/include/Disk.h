@@ -3,6 +3,9 @@
 
 #include <string>
 #include <deque>
+#include <pthread.h>
+
+class BlockLog;
 
 struct UndoRecord {
   int blockNumber;
@@ -13,19 +16,43 @@ class Disk {
  public:
   Disk(std::string imageFile, int blockSize);
   void readBlock(int blockNumber, void *buffer);
+  // count consecutive blocks with a single read
+  void readBlocks(int blockNumber, int count, void *buffer);
   void writeBlock(int blockNumber, void *buffer);
   int numberOfBlocks();
+  // From then on blocks are written to log, which reads them back too
+  // (images made with mkfs -L, see BlockLog.h)
+  void setLog(BlockLog *log);
+  // From then on every transaction of this Disk is one of other too,
+  // for a second image that has to change together with this one
+  void linkTransactions(Disk *other);
 
+  // A transaction belongs to the thread that began it: only that
+  // thread's writes are undone by rollback, and other threads wait in
+  // beginTransaction until it is committed or rolled back. Committing or
+  // rolling back without one does nothing.
   void beginTransaction();
   void commit();
   void rollback();
+  // How many transactions were rolled back, so what is cached about the
+  // disk can be read again after one
+  int rollbackCount();
   
  private:
+  bool ownsTransaction();
+  void storeBlock(int blockNumber, void *buffer);
+
   std::string imageFile;
   int blockSize;
-  int imageFileSize;
+  long long imageFileSize;
   bool isInTransaction;
+  int rollbacks;
+  pthread_t transactionOwner;
+  pthread_mutex_t transactionLock;
+  pthread_cond_t transactionEnded;
   std::deque<struct UndoRecord> undoLog;
+  BlockLog *log;
+  Disk *linked;
 };
 
 #endif
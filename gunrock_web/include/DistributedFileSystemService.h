@@ -8,11 +8,15 @@
 
 class DistributedFileSystemService : public HttpService {
  public:
-  DistributedFileSystemService(std::string driveFile);
+  DistributedFileSystemService(std::string driveFile,
+                               const WriteBackOptions &writeBack = WriteBackOptions(),
+                               const TieringOptions &tiering = TieringOptions());
 
   virtual void get(HTTPRequest *request, HTTPResponse *response);
   virtual void put(HTTPRequest *request, HTTPResponse *response);
+  virtual void post(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
+  virtual void move(HTTPRequest *request, HTTPResponse *response);
 
 private:
   LocalFileSystem *fileSystem;
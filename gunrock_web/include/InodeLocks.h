@@ -0,0 +1,166 @@
+#ifndef _INODE_LOCKS_H_
+#define _INODE_LOCKS_H_
+
+#include <map>
+#include <vector>
+#include <pthread.h>
+
+/**
+ * The locks that let several threads share one LocalFileSystem.
+ *
+ * Every inode has a reader-writer lock. Calls that only look at an inode
+ * (lookup, readdir, stat, read) take it shared, calls that change it take
+ * it exclusively, so work on unrelated files and directories doesn't
+ * wait. The locks are made when an inode is first locked and dropped
+ * once nobody holds them, there is no table the size of the inode region.
+ *
+ * Bitmaps, refcounts and the blocks of the inode region are shared by
+ * every file. Calls that allocate within allocation groups (see
+ * AllocationGroups) hold the allocation lock shared and then the lock of
+ * one group at a time while they change its slice of the bitmaps or its
+ * inodes. Calls that read and write the whole regions back hold the
+ * allocation lock exclusively, which covers every group. Either is held
+ * for as little as possible: file content is written outside of them.
+ *
+ * The file system lock is taken shared by every call. Calls that need the
+ * whole tree to hold still, like snapshot, take it exclusively and then
+ * don't need any inode locks.
+ *
+ * Locks are taken in this order:
+ *   1. the file system lock
+ *   2. the rename lock, which keeps directories where they are while a
+ *      rename works out which inodes to lock
+ *   3. inode locks, a directory before anything in it
+ *   4. the allocation lock
+ *   5. one group lock
+ *
+ * Calls use each other, so a thread can lock something it already holds
+ * again, as long as it doesn't ask for an exclusive lock on what it holds
+ * shared.
+ */
+class InodeLocks {
+ public:
+  InodeLocks();
+  ~InodeLocks();
+
+  void lockFileSystem(bool exclusive);
+  void unlockFileSystem();
+  void lockRename();
+  void unlockRename();
+  void lockInode(int inodeNumber, bool exclusive);
+  void unlockInode(int inodeNumber);
+  void lockAllocation(bool exclusive);
+  void unlockAllocation();
+  // Sets how many groups there are, before any of them is locked
+  void setGroupCount(int count);
+  // Needs the allocation lock. Returns false when it held every group
+  // already and nothing was locked.
+  bool lockGroup(int group);
+  void unlockGroup(int group);
+
+ private:
+  struct Entry {
+    pthread_rwlock_t lock;
+    int users;  // threads holding or waiting for it
+  };
+
+  pthread_rwlock_t fileSystemLock;
+  pthread_mutex_t renameLock;
+  pthread_rwlock_t allocationLock;
+  std::vector<pthread_mutex_t> groupLocks;
+  // protects inodeLocks
+  pthread_mutex_t tableLock;
+  std::map<int, Entry *> inodeLocks;
+};
+
+// Holds the file system lock until it goes out of scope
+class FileSystemLock {
+ public:
+  FileSystemLock(InodeLocks *locks, bool exclusive) : locks(locks) {
+    locks->lockFileSystem(exclusive);
+  }
+  ~FileSystemLock() {
+    locks->unlockFileSystem();
+  }
+
+ private:
+  InodeLocks *locks;
+};
+
+// Holds the rename lock until it goes out of scope
+class RenameLock {
+ public:
+  RenameLock(InodeLocks *locks) : locks(locks) {
+    locks->lockRename();
+  }
+  ~RenameLock() {
+    locks->unlockRename();
+  }
+
+ private:
+  InodeLocks *locks;
+};
+
+// Holds an inode lock until it goes out of scope
+class InodeLock {
+ public:
+  InodeLock(InodeLocks *locks, int inodeNumber, bool exclusive) : locks(locks), inodeNumber(inodeNumber) {
+    locks->lockInode(inodeNumber, exclusive);
+  }
+  ~InodeLock() {
+    locks->unlockInode(inodeNumber);
+  }
+
+ private:
+  InodeLocks *locks;
+  int inodeNumber;
+};
+
+// Holds the allocation lock while it is in scope, except between unlock()
+// and lock(). Exclusive unless asked for shared.
+class AllocationLock {
+ public:
+  AllocationLock(InodeLocks *locks, bool exclusive = true) : locks(locks), exclusive(exclusive), held(true) {
+    locks->lockAllocation(exclusive);
+  }
+  ~AllocationLock() {
+    unlock();
+  }
+  void lock() {
+    if (!held) {
+      locks->lockAllocation(exclusive);
+      held = true;
+    }
+  }
+  void unlock() {
+    if (held) {
+      locks->unlockAllocation();
+      held = false;
+    }
+  }
+
+ private:
+  InodeLocks *locks;
+  bool exclusive;
+  bool held;
+};
+
+// Holds a group lock until it goes out of scope
+class GroupLock {
+ public:
+  GroupLock(InodeLocks *locks, int group) : locks(locks), group(group) {
+    held = locks->lockGroup(group);
+  }
+  ~GroupLock() {
+    if (held) {
+      locks->unlockGroup(group);
+    }
+  }
+
+ private:
+  InodeLocks *locks;
+  int group;
+  bool held;
+};
+
+#endif
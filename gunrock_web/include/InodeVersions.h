@@ -0,0 +1,69 @@
+#ifndef _INODE_VERSIONS_H_
+#define _INODE_VERSIONS_H_
+
+#include <map>
+#include <pthread.h>
+
+/**
+ * Lets file reads go on without the inode lock while the file is
+ * written.
+ *
+ * A version of a file is the block map in its inode. read loads the
+ * inode under the lock, pins that version and lets go of the lock before
+ * reading the blocks. write puts new content into new blocks without
+ * holding the lock, and locks the inode exclusively only to point it at
+ * them. So a GET never waits for a PUT to write its data, it reads
+ * either the old content or the new.
+ *
+ * Blocks a file stops using may still be read by whoever pinned an
+ * older version. Everything that frees the blocks of a file waits in
+ * waitForReaders first. Each call starts a new epoch, and only the
+ * readers of that inode that pinned in an earlier one are waited for, so
+ * new readers don't hold it up. Readers don't take any lock after they
+ * pin, so it can be called with any lock held.
+ *
+ * Freed inodes get a new generation, which tells a write that finds its
+ * inode again after writing the data whether it is still the same file.
+ */
+class InodeVersions {
+ public:
+  InodeVersions();
+  ~InodeVersions();
+
+  // A read of inodeNumber starts with the version loaded, and gets the
+  // epoch to end it with
+  long long pin(int inodeNumber);
+  void unpin(int inodeNumber, long long epoch);
+  // Returns once every read of inodeNumber that pinned before the call
+  // is done
+  void waitForReaders(int inodeNumber);
+
+  long long generation(int inodeNumber);
+  // inodeNumber was freed, and can be handed out again
+  void freed(int inodeNumber);
+
+ private:
+  pthread_mutex_t lock;
+  pthread_cond_t unpinned;
+  long long epoch;
+  // reads in progress, by inode and the epoch they pinned in
+  std::map<int, std::map<long long, int> > readers;
+  std::map<int, long long> generations;
+};
+
+// Keeps a pinned version of an inode until it goes out of scope
+class VersionPin {
+ public:
+  VersionPin(InodeVersions *versions, int inodeNumber, long long epoch)
+    : versions(versions), inodeNumber(inodeNumber), epoch(epoch) {}
+  ~VersionPin() {
+    versions->unpin(inodeNumber, epoch);
+  }
+
+ private:
+  InodeVersions *versions;
+  int inodeNumber;
+  long long epoch;
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include "ufs.h"
+
+/**
+ * The layout math of an image with BlockSize byte blocks.
+ *
+ * The inode and directory entry formats are the same for every block
+ * size, only how many of them fit in a block changes. Everything here is
+ * a compile time constant, so code instantiated for one block size (see
+ * LocalFileSystem::mount) gets fixed loop bounds and buffer sizes just
+ * like it did from the UFS_BLOCK_SIZE macros.
+ */
+template <int BlockSize>
+struct Layout {
+  static_assert(UFS_VALID_BLOCK_SIZE(BlockSize), "unsupported block size");
+
+  static constexpr int blockSize = BlockSize;
+  static constexpr int bitsPerBlock = 8 * BlockSize;
+  static constexpr int inodesPerBlock = BlockSize / sizeof(inode_t);
+  static constexpr int entriesPerBlock = BlockSize / sizeof(dir_ent_t);
+  static constexpr int maxFileSize = DIRECT_PTRS * BlockSize;
+  // dir_index_node_t with the entries running to the end of the block
+  static constexpr int indexFanout = entriesPerBlock - 1;
+  static constexpr int refsPerBlock = BlockSize / sizeof(unsigned int);
+  static constexpr int slotsPerBlock = BlockSize / sizeof(dedup_slot_t);
+
+  // Blocks needed to hold bytes
+  static constexpr long long blocksFor(long long bytes) {
+    return (bytes + BlockSize - 1) / BlockSize;
+  }
+
+  // A directory index node, see dir_index_node_t
+  typedef struct {
+    int leaf;
+    int count;
+    unsigned int next;
+    char unused[sizeof(dir_ent_t) - 3 * sizeof(int)];
+    dir_ent_t entries[indexFanout];
+  } IndexNode;
+
+  static_assert(sizeof(IndexNode) == BlockSize, "index nodes fill a block");
+};
+
+static_assert(sizeof(Layout<UFS_BLOCK_SIZE>::IndexNode) == sizeof(dir_index_node_t),
+              "index nodes of UFS_BLOCK_SIZE blocks are dir_index_node_t");
+
+// Explicitly instantiates a class template for every block size that
+// LocalFileSystem::mount supports
+#define UFS_INSTANTIATE_BLOCK_SIZES(Template) \
+  template class Template<4096>;              \
+  template class Template<16384>;             \
+  template class Template<65536>;
+
+#endif
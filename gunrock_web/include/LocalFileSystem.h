@@ -1,9 +1,21 @@
 #ifndef _LOCAL_FILE_SYSTEM_H_
 #define _LOCAL_FILE_SYSTEM_H_
 
+#include <map>
 #include <string>
+#include <vector>
+#include <chrono>
 
+#include "AccessCounters.h"
+#include "AllocationGroups.h"
+#include "ColdTier.h"
 #include "Disk.h"
+#include "DedupStore.h"
+#include "DirFilter.h"
+#include "DirScan.h"
+#include "InodeLocks.h"
+#include "InodeVersions.h"
+#include "WriteJournal.h"
 #include "ufs.h"
 
 /**
@@ -17,6 +29,10 @@
  * callers operate will not align on disk block boundaries, so your job is
  * to manage the interactions with the underlying storage to provide a higher
  * level of abstraction for any code that uses this class.
+ *
+ * The calls can be made from several threads at once, see InodeLocks.
+ * Disk transactions are not part of that: a transaction covers every
+ * write to the Disk, so only one thread at a time can use one.
  */
 
 // Note: If a function invocation has more than one error, return
@@ -43,22 +59,156 @@
 #define EINVALIDTYPE       (9)
 // Unlinking '.' or '..'
 #define EUNLINKNOTALLOWED  (10)
+// Moving a directory into itself or one of its subdirectories
+#define EINVALIDMOVE       (11)
+// The disk image was made without a feature the operation needs
+#define ENOTSUPPORTED      (12)
+
+// A directory entry as returned by readdir
+struct DirEntry {
+  std::string name;
+  int inum;
+  int type;  // UFS_DIRECTORY or UFS_REGULAR_FILE
+};
+
+// One file or directory for LocalFileSystem::createBatch
+struct NewEntry {
+  std::string name;
+  int type;          // UFS_DIRECTORY or UFS_REGULAR_FILE
+  std::string data;  // content of a regular file, empty for none
+};
+
+// Flags of LocalFileSystem::resolve
+// Makes the directories on the way to the last component that aren't there
+#define RESOLVE_MAKE_DIRS  (1)
+// Refuses paths through the root's UFS_SNAPSHOT_DIR entry, for callers
+// that are about to change what the path leads to
+#define RESOLVE_NO_SNAPSHOTS  (2)
+
+// Where a path leads, see LocalFileSystem::resolve
+struct ResolvedPath {
+  int parent;        // the directory the last component is in
+  int inodeNumber;   // the last component, -ENOTFOUND if it isn't there
+  inode_t inode;     // as stat fills it in, when it is there
+  std::string name;  // the last component, empty for the root
+};
+
+// Delayed allocation settings, see LocalFileSystem::setWriteBack
+struct WriteBackOptions {
+  WriteBackOptions() : flushIntervalMs(0), maxBufferedBytes(64 << 20) {}
+  int flushIntervalMs;          // 0 writes file data through right away
+  long long maxBufferedBytes;   // writes that would buffer more go straight to disk
+  std::string journalFile;      // empty for no journal
+};
+
+// Migrator settings, see LocalFileSystem::startMigrator
+struct TieringOptions {
+  TieringOptions() : intervalMs(1000), highPercent(90), lowPercent(75), promoteAccesses(2) {}
+  std::string coldImageFile;  // for the server to attach, empty for none
+  int intervalMs;       // between passes
+  int highPercent;      // of the image's data blocks in use, above which files go down
+  int lowPercent;       // where moving files down stops and moving them up stops too
+  int promoteAccesses;  // a cold file accessed this often comes back up
+};
 
 class LocalFileSystem {
  public:
   LocalFileSystem(Disk *disk);
+  virtual ~LocalFileSystem();
+
+  /**
+   * Opens an image with the implementation for the block size recorded
+   * in its superblock. The Disk is made with that block size and lives
+   * as long as the file system.
+   *
+   * Success: the file system
+   * Failure: NULL when the block size is not one this build supports
+   */
+  static LocalFileSystem *mount(std::string imageFile);
+
+  // Bytes per block of the image, and the largest file it can hold
+  virtual int blockSize() = 0;
+  virtual int maxFileSize() = 0;
+
   /**
    * Lookup an inode.
    *
    * Takes the parent inode number (which should be the inode number
    * of a directory) and looks up the entry name in it. The inode
-   * number of name is returned.
+   * number of name is returned. Every directory has a Bloom filter of
+   * its names in memory, so names that aren't there are mostly turned
+   * away without reading the directory (see lookupStats).
    *
    * Success: return inode number of name
    * Failure: return -ENOTFOUND, -EINVALIDINODE.
    * Failure modes: invalid parentInodeNumber, name does not exist.
    */
-  int lookup(int parentInodeNumber, std::string name);
+  virtual int lookup(int parentInodeNumber, std::string name) = 0;
+
+  /**
+   * How the directory filters did since the file system was mounted.
+   * Their false positive rate is falsePositives / (filtered +
+   * falsePositives), the share of missing names they let through.
+   */
+  virtual void lookupStats(LookupStats *stats) = 0;
+
+  /**
+   * Walks a path like "a/b/c.txt" from the root directory. Empty
+   * components, from leading, trailing or repeated slashes, are skipped,
+   * and "." and ".." components are refused, so a path has one way down
+   * the tree and callers can tell where it leads from its components.
+   *
+   * The superblock is read once for the whole path and each directory
+   * inode once, where a lookup per component reads both again every
+   * time, and the inode of the last component comes back with it. That
+   * one doesn't have to exist: resolved->inodeNumber is -ENOTFOUND then,
+   * and parent and name say where it would go. With RESOLVE_MAKE_DIRS,
+   * missing directories before the last component are made like mkdir
+   * -p. The root resolves to itself, with parent the root and name empty.
+   * With RESOLVE_NO_SNAPSHOTS, a path that is or goes through the root's
+   * UFS_SNAPSHOT_DIR fails, so snapshots stay read only.
+   *
+   * Success: 0
+   * Failure: -ENOTFOUND, -EINVALIDTYPE, -EINVALIDNAME, -ENOTSUPPORTED, or
+   * the errors of create.
+   * Failure modes: a directory on the way isn't there (without
+   * RESOLVE_MAKE_DIRS) or is a file, or making one failed. A component
+   * is "." or "..". The path leads into the snapshots (with
+   * RESOLVE_NO_SNAPSHOTS).
+   */
+  virtual int resolve(const std::string &path, int flags, ResolvedPath *resolved) = 0;
+
+  /**
+   * List a directory.
+   *
+   * Fills in entries with the name, inode number and type of every entry
+   * in the directory specified by inodeNumber, including '.' and '..',
+   * in the order they are stored. The types come from the directory
+   * entries themselves on images with UFS_FEATURE_DIRENT_TYPE, so the
+   * child inodes are not read.
+   *
+   * Success: return the number of entries
+   * Failure: return -EINVALIDINODE.
+   * Failure modes: invalid inodeNumber, inodeNumber is not a directory.
+   */
+  virtual int readdir(int inodeNumber, std::vector<DirEntry> &entries) = 0;
+
+  /**
+   * List a directory in name order.
+   *
+   * Like readdir, but the entries are sorted by name (strcmp order) and
+   * only entries whose names sort after marker are returned, up to
+   * maxEntries of them (or all of them if maxEntries is negative). Passing
+   * the last name of one call as the marker of the next pages through a
+   * directory. Directories with an index (UFS_INODE_DIR_INDEX) are read
+   * in order straight from the index, others are sorted in memory.
+   *
+   * Success: return the number of entries
+   * Failure: return -EINVALIDINODE.
+   * Failure modes: invalid inodeNumber, inodeNumber is not a directory.
+   */
+  virtual int readdirSorted(int inodeNumber, const std::string &marker, int maxEntries,
+                            std::vector<DirEntry> &entries) = 0;
 
   /**
    * Read an inode.
@@ -70,7 +220,7 @@ class LocalFileSystem {
    * Failure: return -EINVALIDINODE
    * Failure modes: invalid inodeNumber
    */
-  int stat(int inodeNumber, inode_t *inode);
+  virtual int stat(int inodeNumber, inode_t *inode) = 0;
   
   /**
    * Makes a file or directory.
@@ -81,23 +231,48 @@ class LocalFileSystem {
    * Success: return the inode number of the new file or directory
    * Failure: -EINVALIDINODE, -EINVALIDNAME, -EINVALIDTYPE, -ENOTENOUGHSPACE.
    * Failure modes: parentInodeNumber does not exist, or name is too long.
+   * On images with snapshots, name can't be UFS_SNAPSHOT_DIR in the root,
+   * which only snapshot makes.
    * If name already exists and is of the correct type, return success, but
    * if the name already exists and is of the wrong type, return an error.
    */
-  int create(int parentInodeNumber, int type, std::string name);
+  virtual int create(int parentInodeNumber, int type, std::string name) = 0;
+
+  /**
+   * Makes many files and directories in one directory, with their
+   * content. Names are checked against the directory once, the inodes
+   * and blocks of the whole batch are allocated together, the new entries
+   * are written a block at a time and the parent inode once, so it costs
+   * far less than a create and write per entry.
+   *
+   * Either every entry is made or none is. inodeNumbers gets the inode
+   * number of each entry, in order.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -EINVALIDNAME, -EINVALIDTYPE, -EINVALIDSIZE,
+   *          -ENOTENOUGHSPACE
+   * Failure modes: parentInodeNumber is not a directory, a name is too
+   * long, taken or in the batch twice, or reserved like for create, a
+   * type is invalid or a directory has data, data is larger than the
+   * largest file, or the batch doesn't fit.
+   */
+  virtual int createBatch(int parentInodeNumber, const std::vector<NewEntry> &entries,
+                          std::vector<int> &inodeNumbers) = 0;
 
   /**
    * Write the contents of a file.
    *
    * Writes a buffer of size to the file, replacing any content that
-   * already exists.
+   * already exists. The new content goes into new blocks, and reads of
+   * the file carry on with the old ones until the inode points at them
+   * (see InodeVersions).
    *
    * Success: number of bytes written
    * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE, -ENOTENOUGHSPACE.
    * Failure modes: invalid inodeNumber, invalid size, not a regular file
    * (because you can't write to directories).
    */
-  int write(int inodeNumber, const void *buffer, int size);
+  virtual int write(int inodeNumber, const void *buffer, int size) = 0;
 
   /**
    * Read the contents of a file or directory.
@@ -105,27 +280,188 @@ class LocalFileSystem {
    * Reads up to `size` bytes of data into the buffer from file specified by
    * inodeNumber. The routine should work for either a file or directory;
    * directories should return data in the format specified by dir_ent_t.
+   * A file is read as it was when the read started, without waiting for
+   * writes to it.
    *
    * Success: number of bytes read
    * Failure: -EINVALIDINODE, -EINVALIDSIZE.
    * Failure modes: invalid inodeNumber, invalid size.
    */
-  int read(int inodeNumber, void *buffer, int size);
+  virtual int read(int inodeNumber, void *buffer, int size) = 0;
+
+  /**
+   * Append to the end of a file.
+   *
+   * Writes a buffer of size to the end of the file. Only the current
+   * tail block and any newly allocated blocks are written, so the cost
+   * is proportional to size and not to the size of the file.
+   *
+   * Success: number of bytes appended
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE, -ENOTENOUGHSPACE.
+   * Failure modes: invalid inodeNumber, invalid size (including a
+   * resulting file larger than MAX_FILE_SIZE), not a regular file.
+   */
+  virtual int append(int inodeNumber, const void *buffer, int size) = 0;
+
+  /**
+   * Change the size of a file.
+   *
+   * Shrinking a file frees the blocks past the new end of the file.
+   * Growing a file allocates zero-filled blocks, and the bytes between
+   * the old and the new end of the file read back as zeros.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE, -ENOTENOUGHSPACE.
+   * Failure modes: invalid inodeNumber, invalid size, not a regular file.
+   */
+  virtual int truncate(int inodeNumber, int size) = 0;
 
   /**
    * Remove a file or directory.
    *
    * Removes the file or directory name from the directory specified by
-   * parentInodeNumber.
+   * parentInodeNumber. While the reclaimer runs, files with blocks are
+   * only put on the orphan list and their blocks are freed later, see
+   * startReclaimer.
    *
    * Success: 0
    * Failure: -EINVALIDINODE, -EDIRNOTEMPTY, -EINVALIDNAME, -ENOTENOUGHSPACE,
    *          -EUNLINKNOTALLOWED
    * Failure modes: parentInodeNumber does not exist, directory is NOT
    * empty, or the name is invalid. Note that the name not existing is NOT
-   * a failure by our definition. You can't unlink '.' or '..'
+   * a failure by our definition. You can't unlink '.' or '..', nor the
+   * root's UFS_SNAPSHOT_DIR on images with snapshots.
    */
-  int unlink(int parentInodeNumber, std::string name);
+  virtual int unlink(int parentInodeNumber, std::string name) = 0;
+
+  /**
+   * Moves srcName in srcParentInodeNumber to dstName in
+   * dstParentInodeNumber. Only directory entries change, the inode and
+   * its data stay where they are. An existing dstName of the same type is
+   * replaced, as long as it isn't a directory with entries in it.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -EINVALIDNAME, -ENOTFOUND, -EINVALIDTYPE,
+   *          -EDIRNOTEMPTY, -ENOTENOUGHSPACE, -EUNLINKNOTALLOWED,
+   *          -EINVALIDMOVE
+   * Failure modes: either parent is not a directory, a name is invalid,
+   * srcName does not exist, dstName is a different type or a non-empty
+   * directory, or a directory would end up inside itself. You can't
+   * rename '.' or '..', and on images with snapshots nothing is moved to
+   * or from the root's UFS_SNAPSHOT_DIR entry (-EINVALIDMOVE).
+   */
+  virtual int rename(int srcParentInodeNumber, std::string srcName,
+                     int dstParentInodeNumber, std::string dstName) = 0;
+
+  /**
+   * Takes a snapshot of the whole tree under the root and stores it as
+   * UFS_SNAPSHOT_DIR/name, creating that directory the first time. The
+   * snapshot gets its own inodes and directory blocks, but file blocks
+   * are shared with the live tree through their reference counts, so no
+   * file data is copied. Earlier snapshots are not part of a new one.
+   *
+   * Success: inode number of the snapshot's root directory
+   * Failure: -ENOTSUPPORTED, -EINVALIDNAME, -ENOTENOUGHSPACE
+   * Failure modes: the image doesn't have UFS_FEATURE_SNAPSHOTS, the name
+   * is invalid or taken, or there aren't enough inodes or blocks.
+   */
+  virtual int snapshot(std::string name) = 0;
+
+  /**
+   * Deletes the snapshot name and everything in it. File blocks are
+   * freed once no file or other snapshot uses them. Deleting the last
+   * snapshot removes UFS_SNAPSHOT_DIR too.
+   *
+   * Success: 0
+   * Failure: -ENOTFOUND
+   * Failure modes: name isn't a snapshot, a directory in UFS_SNAPSHOT_DIR
+   * that snapshot made (UFS_INODE_SNAPSHOT).
+   */
+  virtual int deleteSnapshot(std::string name) = 0;
+
+  /**
+   * Delayed allocation. With a flush interval, write keeps the new
+   * content of a file in memory and only reserves the blocks it could
+   * need, so other operations can't take them. The blocks are allocated
+   * and written when the content is flushed, once the whole file is
+   * known, and a file that is overwritten or deleted before then never
+   * touches the disk. read and stat see buffered content, append and
+   * truncate change it in memory, and snapshot flushes everything first.
+   *
+   * Buffered content is lost in a crash unless options name a journal,
+   * which then holds every buffered write until it is flushed. Content
+   * left in the journal by a crash is written to the image here.
+   */
+  virtual void setWriteBack(const WriteBackOptions &options) = 0;
+
+  // Flushes buffered content older than the flush interval. Callers pick
+  // when, outside of a Disk transaction, so a rollback can't undo
+  // content that is no longer buffered.
+  virtual void flushExpired() = 0;
+  // Flushes all buffered content
+  virtual void sync() = 0;
+
+  /**
+   * Deferred reclamation, on images with UFS_FEATURE_ORPHAN_LIST. From
+   * here on unlink takes a file out of its directory and puts it on the
+   * orphan list in the super block, which only writes a few blocks
+   * whatever the size of the file. A background thread then frees the
+   * blocks of the orphans, a batch at a time, each batch in a
+   * Disk transaction of its own so it never becomes part of a caller's.
+   * Calls that run out of space free the orphans left before they give up.
+   *
+   * Orphans a crash left on the list are freed before this returns.
+   */
+  virtual void startReclaimer() = 0;
+
+  /**
+   * Pre-zeroed blocks. Freed blocks are released as they are, without
+   * writing anything to them, and most new blocks are written whole by
+   * their callers anyway. The blocks a growing truncate adds have to read
+   * back as zeros, so from here on a background thread keeps a small pool
+   * of free blocks it wrote zeros to ahead of time, each batch in a Disk
+   * transaction of its own, and truncate takes those first. Images with
+   * UFS_FEATURE_DEDUP don't start it, since the zero blocks truncate adds
+   * all share one block there.
+   */
+  virtual void startZeroer() = 0;
+
+  /**
+   * Pairs the image with a cold tier, an image made with mkfs -T on a
+   * bigger, slower device (see cold tiers in ufs.h), and opens it. The
+   * first time, both get the same new tier_id and the image
+   * UFS_FEATURE_TIERED. From then on the image is only changed with its
+   * cold tier attached: reads of cold files fail without it, and what
+   * they free would be lost. The tier's transactions are the image's.
+   *
+   * Success: 0
+   * Failure: -ENOTSUPPORTED
+   * Failure modes: the image is a legacy one or has UFS_FEATURE_LOG,
+   * whose writes only reach their home at commit, coldImageFile isn't a
+   * cold tier with the same block size, either is paired with another
+   * image, or a tier is attached already.
+   */
+  virtual int attachColdTier(std::string coldImageFile) = 0;
+
+  /**
+   * Hot/cold tiering. Directories and inodes always stay in the image,
+   * only the blocks of files move. Reads and writes of files are counted,
+   * and a background thread looks at the counts every options.intervalMs,
+   * halving them after each pass. When more of the image than
+   * options.highPercent is in use, or a write ran out of space, it moves
+   * the least used files to the cold tier until options.lowPercent is
+   * left. Cold files used options.promoteAccesses times come back up as
+   * long as that leaves usage under options.lowPercent, in place of
+   * colder files if there isn't room. Every move is a Disk transaction
+   * of its own, with the file locked throughout.
+   *
+   * A write to a cold file puts it back on the image like any other write
+   * (append and truncate write the whole file again). Files sharing blocks
+   * with a snapshot or another file stay where they are.
+   *
+   * Does nothing without a cold tier.
+   */
+  virtual void startMigrator(const TieringOptions &options) = 0;
   
   /**
    * Some helper functions that you need to implement and use in your
@@ -133,28 +469,264 @@ class LocalFileSystem {
    * file system metadata, you must read/write the entire structure instead
    * of trying to identify individual disk blocks and accessing only these.
    */
-  void readSuperBlock(super_t *super);
+  virtual void readSuperBlock(super_t *super) = 0;
 
   /**
    * numDataBytesNeeded is converted to blocks and added to numDataBlocksNeeded
    * Having two separate arguments for data helps for operations that write
    * new data to two separate entities. If you don't need a value
    * you can set the number needed to 0.
+   *
+   * The free counts are kept in memory, so this doesn't read the bitmaps.
+   * Blocks that delayed allocation reserved don't count as free.
    */
-  bool diskHasSpace(super_t *super, int numInodesNeeded, int numDataBytesNeeded, int numDataBlocksNeeded=0);
+  virtual bool diskHasSpace(super_t *super, int numInodesNeeded, int numDataBytesNeeded,
+                            int numDataBlocksNeeded = 0) = 0;
 
   // Helper functions, you should read/write the entire inode and bitmap regions
+  virtual void readInodeBitmap(super_t *super, unsigned char *inodeBitmap) = 0;
+  virtual void writeInodeBitmap(super_t *super, unsigned char *inodeBitmap) = 0;
+  virtual void readDataBitmap(super_t *super, unsigned char *dataBitmap) = 0;
+  virtual void writeDataBitmap(super_t *super, unsigned char *dataBitmap) = 0;
+  virtual void readInodeRegion(super_t *super, inode_t *inodes) = 0;
+  virtual void writeInodeRegion(super_t *super, inode_t *inodes) = 0;
+
+  // Writes back the single inode region block that holds inodeNumber, for
+  // operations like append that only change one inode
+  virtual void writeInode(super_t *super, int inodeNumber, inode_t *inode) = 0;
+
+  // Normally we'd mark this as private but we expose it so that you can access
+  // it in a function you add that is not part of the LocalFileSystem object but
+  // can still access the disk.
+  Disk *disk;
+};  
+
+/**
+ * LocalFileSystem for images with BlockSize byte blocks. The layout math
+ * comes from Layout<BlockSize>, and mount picks the instantiation.
+ */
+template <int BlockSize>
+class UfsFileSystem : public LocalFileSystem {
+ public:
+  UfsFileSystem(Disk *disk);
+  // Flushes whatever delayed allocation still buffers
+  ~UfsFileSystem();
+
+  int blockSize();
+  int maxFileSize();
+  int lookup(int parentInodeNumber, std::string name);
+  void lookupStats(LookupStats *stats);
+  int resolve(const std::string &path, int flags, ResolvedPath *resolved);
+  int readdir(int inodeNumber, std::vector<DirEntry> &entries);
+  int readdirSorted(int inodeNumber, const std::string &marker, int maxEntries,
+                    std::vector<DirEntry> &entries);
+  int stat(int inodeNumber, inode_t *inode);
+  int create(int parentInodeNumber, int type, std::string name);
+  int write(int inodeNumber, const void *buffer, int size);
+  int read(int inodeNumber, void *buffer, int size);
+  int append(int inodeNumber, const void *buffer, int size);
+  int truncate(int inodeNumber, int size);
+  int unlink(int parentInodeNumber, std::string name);
+  int rename(int srcParentInodeNumber, std::string srcName,
+             int dstParentInodeNumber, std::string dstName);
+  int snapshot(std::string name);
+  int deleteSnapshot(std::string name);
+  void setWriteBack(const WriteBackOptions &options);
+  void flushExpired();
+  void sync();
+  void startReclaimer();
+  void startZeroer();
+  int attachColdTier(std::string coldImageFile);
+  void startMigrator(const TieringOptions &options);
+  int createBatch(int parentInodeNumber, const std::vector<NewEntry> &entries,
+                  std::vector<int> &inodeNumbers);
+  void readSuperBlock(super_t *super);
+  bool diskHasSpace(super_t *super, int numInodesNeeded, int numDataBytesNeeded, int numDataBlocksNeeded = 0);
   void readInodeBitmap(super_t *super, unsigned char *inodeBitmap);
   void writeInodeBitmap(super_t *super, unsigned char *inodeBitmap);
   void readDataBitmap(super_t *super, unsigned char *dataBitmap);
   void writeDataBitmap(super_t *super, unsigned char *dataBitmap);
   void readInodeRegion(super_t *super, inode_t *inodes);
   void writeInodeRegion(super_t *super, inode_t *inodes);
+  void writeInode(super_t *super, int inodeNumber, inode_t *inode);
 
-  // Normally we'd mark this as private but we expose it so that you can access
-  // it in a function you add that is not part of the LocalFileSystem object but
-  // can still access the disk.
-  Disk *disk;
-};  
+  // Directory entry helpers shared by create, unlink and rename. Entries
+  // are packed, so a position is the entry's index in the directory.
+  // Returns the position of name, or -1 when it isn't there. Blocks whose
+  // fingerprints rule the name out aren't read.
+  int findDirEntry(inode_t *dir, const std::string &name, dir_ent_t *entry);
+  // Every block of entries is written with this, which keeps its
+  // fingerprints
+  void writeDirBlock(unsigned int block, void *entries);
+  // Makes the filter of a directory from its entries, and returns the
+  // inode number of name among them or -ENOTFOUND
+  int buildFilter(int dirNumber, inode_t *dir, const std::string &name, int rollbacks);
+  // Blocks addDirEntry can use, or -ENOTENOUGHSPACE if dir is full
+  int addDirEntryBlocksNeeded(inode_t *dir);
+  void addDirEntry(inode_t *dir, const dir_ent_t &entry, std::vector<unsigned int> &reserved);
+  // The same for count entries at once. addDirEntries writes each entry
+  // block once and builds an indexed directory's index again, adding the
+  // nodes of the old one to freed.
+  int addDirEntriesBlocksNeeded(inode_t *dir, int count);
+  void addDirEntries(inode_t *dir, const std::vector<dir_ent_t> &entries,
+                     std::vector<unsigned int> &reserved, std::vector<unsigned int> &freed);
+  void replaceDirEntry(inode_t *dir, int position, const dir_ent_t &entry);
+  // Adds a block the directory no longer needs to freed
+  void removeDirEntry(super_t *super, inode_t *dir, int position, std::vector<unsigned int> &freed);
+  // Frees inodeNumber and its data blocks in the in-memory regions
+  void freeInode(super_t *super, inode_t *inodes, int inodeNumber,
+                 unsigned char *inodeBitmap, unsigned char *dataBitmap);
+  // Adds the blocks of inode that nothing else uses to freed. dedup drops
+  // the file's references to shared blocks, and is NULL for inodes that
+  // don't have any. The blocks of a cold file go back to the cold tier
+  // instead.
+  void releaseInodeBlocks(inode_t *inode, DedupStore<BlockSize> *dedup, std::vector<unsigned int> &freed);
+
+  // Snapshot helpers. countTree adds up the inodes and directory blocks a
+  // copy of the tree at inodeNumber needs, and the cold blocks of its cold
+  // files, which get copies of their own. copyTree makes that copy and
+  // returns the inode number of its root, and freeTree frees everything
+  // below inodeNumber. The snapshot directory of the root is skipped.
+  void countTree(int inodeNumber, int *inodesNeeded, int *blocksNeeded, int *coldBlocksNeeded);
+  int copyTree(super_t *super, inode_t *inodes, unsigned char *inodeBitmap, DedupStore<BlockSize> *store,
+               int inodeNumber, int parentCopy, std::vector<unsigned int> &reserved);
+  void freeTree(super_t *super, inode_t *inodes, int inodeNumber,
+                unsigned char *inodeBitmap, unsigned char *dataBitmap);
+
+ private:
+  // Content of a file buffered by delayed allocation
+  struct PendingWrite {
+    std::vector<unsigned char> content;
+    int reservedBlocks;
+    std::chrono::steady_clock::time_point since;  // first buffered
+  };
+
+  // The calls that allocate, without freeing orphans when they run out
+  // of space
+  int tryCreate(int parentInodeNumber, int type, std::string name);
+  int tryCreateBatch(int parentInodeNumber, const std::vector<NewEntry> &entries,
+                     std::vector<int> &inodeNumbers);
+  int tryWrite(int inodeNumber, const void *buffer, int size);
+  int tryAppend(int inodeNumber, const void *buffer, int size);
+  int tryTruncate(int inodeNumber, int size);
+  int tryRename(int srcParentInodeNumber, std::string srcName,
+                int dstParentInodeNumber, std::string dstName);
+  int trySnapshot(std::string name);
+
+  // lookup in a directory whose inode the caller has loaded and locked
+  int lookupIn(int parentInodeNumber, inode_t *parentInode, const std::string &name);
+
+  // Reads up to size bytes of the content of a loaded inode, which
+  // nothing may free while this runs
+  int readContent(inode_t *inode, void *buffer, int size);
+  // A block of a loaded file, from the cold tier for cold files
+  void readFileBlock(inode_t *inode, unsigned int block, void *buffer);
+  // Where chunk number chunk of a compressed file starts in its direct
+  // pointers, found through the headers of the chunks before it
+  int chunkSlot(inode_t *inode, int chunk);
+  // Decompresses size bytes of a compressed file, from the chunk that
+  // starts at slot and byte offset on. Returns the slot after the last
+  // chunk read.
+  int readChunks(inode_t *inode, int slot, int offset, int size, unsigned char *out);
+  // Changes the size of a compressed file on a refcounted image, with the
+  // bytes past the old end from appended or zeros when it is NULL. Only
+  // the chunks from the one with the first changed byte on are stored
+  // again. Returns 1 without changing anything when the file would no
+  // longer save a block, so the caller writes it again whole.
+  int rewriteChunks(super_t *super, int inodeNumber, inode_t *inode, int size, const unsigned char *appended);
+
+  // stat without the inode lock, for inodes a caller can't lock in order
+  void loadInode(super_t *super, int inodeNumber, inode_t *inode);
+  // writeInode under the lock of the inode's group
+  void storeInode(super_t *super, int inodeNumber, inode_t *inode);
+  // storeInode for many inodes, writing each inode block once
+  void storeInodes(super_t *super, const std::vector<int> &inodeNumbers, const std::vector<inode_t> &inodes);
+  // The directories from inodeNumber up to the root, following '..'.
+  // They only stay that way under the rename lock.
+  void ancestors(int inodeNumber, std::vector<int> &chain);
+
+  // write without delayed allocation. It locks the inode itself, so the
+  // caller holds its lock exclusively or not at all.
+  int writeThrough(int inodeNumber, const void *buffer, int size);
+  void flushPending(int inodeNumber);
+  // Whether a file has buffered content. The answer holds for as long as
+  // the caller has the inode locked.
+  bool isPending(int inodeNumber);
+  // Drops buffered content of a file that is being freed
+  void discardPending(int inodeNumber);
+
+  // The orphan list. The caller of addOrphan holds the allocation lock
+  // and the inode's lock. reclaimOrphans frees orphans until at least
+  // batchBlocks blocks are freed, or all of them if batchBlocks is
+  // negative, and returns how many orphans it freed. reclaimOrphan frees
+  // one and returns its blocks, or -1 if it isn't an orphan (any more).
+  void addOrphan(int inodeNumber, inode_t *inode);
+  int reclaimOrphans(int batchBlocks);
+  int reclaimOrphan(int inodeNumber);
+  void writeSuperBlock(super_t *super);
+  static void *reclaimer(void *arg);
+  static void *zeroer(void *arg);
+  // Wakes the zeroer when the zeroed pool is running low
+  void wakeZeroer();
+
+  // Gives blocks of a cold file back to the cold tier, if it is attached
+  void releaseColdBlocks(const std::vector<unsigned int> &blocks);
+  // A migrator pass, see startMigrator
+  void migrate();
+  // Moves the blocks of a file to the cold tier or back, in a Disk
+  // transaction of its own. Returns how many blocks moved,
+  // -ENOTENOUGHSPACE when the other side is full, or -EINVALIDTYPE when
+  // the file can't move (any more).
+  int migrateFile(int inodeNumber, bool toCold);
+  int moveDown(int inodeNumber);
+  int moveUp(int inodeNumber);
+  // Counts an access to a file for the migrator
+  void touch(int inodeNumber);
+  static void *migrator(void *arg);
+  // Wakes the migrator when a write ran out of space
+  void wakeMigrator();
+
+  WriteBackOptions writeBack;
+  WriteJournal *journal;
+  std::map<int, PendingWrite> pending;
+  long long pendingBytes;
+  // blocks promised to pending writes, which allocations leave free
+  int reservedBlocks;
+
+  InodeLocks locks;
+  AllocationGroups<BlockSize> groups;
+  DirFingerprints fingerprints;
+  DirFilters filters;
+  InodeVersions versions;
+
+  // Taken after the allocation lock, before group locks. Protects the
+  // orphan list and the inodes on it.
+  pthread_mutex_t orphanLock;
+  pthread_cond_t orphansAdded;
+  bool reclaimerStarted;
+  bool orphansWaiting;
+  bool stopReclaimer;
+  pthread_t reclaimerThread;
+
+  // A leaf lock for the zeroer's flags
+  pthread_mutex_t zeroerLock;
+  pthread_cond_t zeroingWanted;
+  bool zeroerStarted;
+  bool poolLow;
+  bool stopZeroer;
+  pthread_t zeroerThread;
+
+  // NULL without a cold tier
+  ColdTier<BlockSize> *cold;
+  AccessCounters counters;
+  TieringOptions tiering;
+  // A leaf lock for the migrator's flags
+  pthread_mutex_t migratorLock;
+  pthread_cond_t migrationWanted;
+  bool migratorStarted;
+  bool spaceWanted;
+  bool stopMigrator;
+  pthread_t migratorThread;
+};
 
 #endif
@@ -0,0 +1,54 @@
+#ifndef _WRITE_JOURNAL_H_
+#define _WRITE_JOURNAL_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * The journal of file content that delayed allocation keeps in memory
+ * (see LocalFileSystem::setWriteBack).
+ *
+ * Buffered content isn't on the image until it is flushed, so with a
+ * journal every buffered write is also appended to a file next to the
+ * image and synced before write returns. When the content is flushed or
+ * the file deleted, a discard record says the image is up to date for
+ * that inode again, and once nothing is buffered the journal is cleared.
+ * After a crash, replay() hands back the content that never made it to
+ * the image.
+ *
+ * Records are a journal_record_t followed by size bytes of content. A
+ * record cut short by a crash fails its length or checksum, and replay
+ * stops there.
+ */
+typedef struct {
+  unsigned int magic;     // JOURNAL_MAGIC
+  int inum;
+  int size;               // bytes of content that follow, -1 for a discard
+  unsigned int checksum;  // of the content
+} journal_record_t;
+
+#define JOURNAL_MAGIC (0x6a726e6c)
+
+class WriteJournal {
+ public:
+  WriteJournal(std::string journalFile);
+  ~WriteJournal();
+
+  void logWrite(int inum, const void *content, int size);
+  void logDiscard(int inum);
+
+  // The content of every inode whose last record is a write, in place of
+  // what the image has for it
+  void replay(std::map<int, std::vector<unsigned char> > &writes);
+
+  void clear();
+
+ private:
+  void append(const journal_record_t &record, const void *content);
+
+  std::string journalFile;
+  int fd;
+};
+
+#endif
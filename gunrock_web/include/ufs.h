@@ -6,16 +6,88 @@
 
 #define UFS_ROOT_DIRECTORY_INODE_NUMBER (0)
 
+// Block sizes, stored in super_t.block_size. Images made before the
+// block size was recorded have UFS_BLOCK_SIZE byte blocks. The layout
+// math for each size is in Layout.h.
 #define UFS_BLOCK_SIZE (4096)
+#define UFS_MAX_BLOCK_SIZE (65536)
+#define UFS_VALID_BLOCK_SIZE(size) ((size) == 4096 || (size) == 16384 || (size) == 65536)
 
 #define DIRECT_PTRS (30)
 
+// With UFS_BLOCK_SIZE blocks. Images with bigger blocks hold bigger
+// files, see LocalFileSystem::maxFileSize()
 #define MAX_FILE_SIZE (DIRECT_PTRS * UFS_BLOCK_SIZE)
 
+// Format versions, stored in super_t.version. Images made before the
+// superblock had a version read back as UFS_VERSION_LEGACY.
+#define UFS_VERSION_LEGACY (0)
+#define UFS_VERSION (1)
+
+// Optional on-disk features, stored in super_t.features
+#define UFS_FEATURE_INLINE_DATA (1 << 0)
+#define UFS_FEATURE_DIRENT_TYPE (1 << 1)
+#define UFS_FEATURE_DIR_INDEX (1 << 2)
+#define UFS_FEATURE_DEDUP (1 << 3)
+#define UFS_FEATURE_COMPRESSION (1 << 4)
+#define UFS_FEATURE_SNAPSHOTS (1 << 5)
+// Unlinked files wait on a list in the super block until their blocks are
+// freed, see super_t.orphan_head
+#define UFS_FEATURE_ORPHAN_LIST (1 << 6)
+// Blocks are written to a log at the end of the image before they are
+// written back to where they belong, see the block log below
+#define UFS_FEATURE_LOG (1 << 7)
+// Files can have their blocks in a cold tier image, see cold tiers below
+#define UFS_FEATURE_TIERED (1 << 8)
+// The image is a cold tier, made by mkfs -T, and only its data bitmap and
+// data region are used
+#define UFS_FEATURE_COLD_TIER (1 << 9)
+// File data blocks have reference counts and are never changed in place
+// when either of these is set
+#define UFS_FEATURE_REFCOUNTS (UFS_FEATURE_DEDUP | UFS_FEATURE_SNAPSHOTS)
+
+// inode_t.flags
+// The file content is stored in place of the direct pointers
+#define UFS_INODE_INLINE (1 << 0)
+// The directory has a sorted index, see dir_index_node_t
+#define UFS_INODE_DIR_INDEX (1 << 1)
+// The file blocks hold chunks, each a compressed_header_t followed by
+// the compressed content, and size is the size before compression
+#define UFS_INODE_COMPRESSED (1 << 2)
+// The file is unlinked and on the orphan list. Its blocks are still
+// allocated, and size holds the next orphan instead of the file size.
+#define UFS_INODE_ORPHAN (1 << 3)
+// The direct pointers are blocks of the cold tier image
+#define UFS_INODE_COLD (1 << 4)
+// The directory is the root of a snapshot, made by taking it
+#define UFS_INODE_SNAPSHOT (1 << 5)
+
+// Files up to this size can be stored inline when UFS_FEATURE_INLINE_DATA is set
+#define UFS_INLINE_SIZE (DIRECT_PTRS * sizeof(unsigned int))
+
+// Compression (UFS_FEATURE_COMPRESSION). write compresses files that
+// don't fit in the inode when that saves at least one block. The content
+// is cut in chunks of UFS_COMPRESSION_CHUNK_BLOCKS blocks, the last one
+// shorter, and each chunk is compressed on its own. A chunk starts at the
+// beginning of a block and the next one in the block after its end, so
+// append and truncate only store the last chunks again. A chunk that
+// doesn't get smaller is kept as it is, with UFS_CODEC_STORED.
+#define UFS_COMPRESSION_CHUNK_BLOCKS (4)
+#define UFS_CODEC_LZ (1)
+#define UFS_CODEC_STORED (2)
+
+typedef struct {
+    unsigned int codec;   // UFS_CODEC_*
+    unsigned int length;  // bytes of compressed data after the header
+} compressed_header_t;
+
 // Note: Bitmap indexes identify disk blocks relative to the start of a region.
 
 typedef struct {
-    int type;   // UFS_DIRECTORY or UFS_REGULAR
+    short type;   // UFS_DIRECTORY or UFS_REGULAR
+    // UFS_INODE_* flags. type used to be an int, so on legacy images
+    // (little endian) the flags read back as 0.
+    unsigned short flags;
     int size;   // bytes
     unsigned int direct[DIRECT_PTRS]; 
     // return the exact blocknum(no need to be continuos) that can be used for readblock()
@@ -29,6 +101,51 @@ typedef struct {
     int  inum;      // inode number of entry (-1 means entry not used)
 } dir_ent_t;
 
+// With UFS_FEATURE_DIRENT_TYPE the last name byte records the type of the
+// entry plus one, where 0 means unknown. Names are at most
+// DIR_ENT_NAME_SIZE - 2 characters, so they always end before it.
+#define DIR_ENT_TYPE_INDEX (DIR_ENT_NAME_SIZE - 1)
+#define DIR_ENT_TYPE(type) ((char)((type) + 1))
+#define DIR_ENT_TYPE_OF(byte) ((int)(unsigned char)(byte) - 1)
+
+// Directory index (UFS_FEATURE_DIR_INDEX). Besides its regular entry
+// blocks, an indexed directory keeps a B+tree of its entries sorted by
+// name (strcmp order) so it can be listed in order without sorting. The
+// root node is in direct[DIR_INDEX_PTR], so indexed directories have one
+// less block for their entries.
+#define DIR_INDEX_PTR (DIRECT_PTRS - 1)
+// The node layout for UFS_BLOCK_SIZE blocks. With bigger blocks the
+// entries run to the end of the block, see Layout::IndexNode.
+#define DIR_INDEX_FANOUT (UFS_BLOCK_SIZE / sizeof(dir_ent_t) - 1)
+
+typedef struct {
+    int leaf;              // 1 for leaf nodes, 0 for interior nodes
+    int count;             // entries in use
+    unsigned int next;     // next leaf in name order, 0 for the last one
+    char unused[sizeof(dir_ent_t) - 3 * sizeof(int)];
+    // Leaves hold copies of the directory entries. Interior nodes hold the
+    // smallest name under each child with the child's block in inum, and
+    // the first name of an interior node is ignored.
+    dir_ent_t entries[DIR_INDEX_FANOUT];
+} dir_index_node_t;
+
+// Shared file blocks (UFS_FEATURE_REFCOUNTS). Every data block has a
+// reference count, an unsigned int in the refcount region, which is 0 for
+// blocks that aren't file data (directories, indexes). Blocks are shared
+// by snapshots, and with UFS_FEATURE_DEDUP by files with the same content.
+// The fingerprint region (dedup only) is an open addressing hash table
+// from the fingerprint of a block's content to the block, probed linearly
+// starting at slot fingerprint % slots.
+typedef struct {
+    unsigned long long fingerprint;  // hash of the block content
+    unsigned int block;              // block with that content, 0 for an empty slot
+    unsigned int unused;
+} dedup_slot_t;
+
+// Block numbers are 32 bits on disk, and images can have up to INT_MAX
+// blocks (8 TB with 4 KB blocks, 128 TB with 64 KB blocks). Byte offsets
+// into the image are 64 bits.
+
 // presumed: block 0 is the super block
 typedef struct __super {
     int inode_bitmap_addr; // block address (in blocks)
@@ -41,7 +158,81 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    // Everything below is zero on images made before it existed
+    int version;           // UFS_VERSION_*
+    int features;          // UFS_FEATURE_* flags
+    // UFS_FEATURE_REFCOUNTS regions, between the inode and data regions
+    int refcount_addr;     // block address (in blocks)
+    int refcount_len;      // in blocks
+    int fingerprint_addr;  // block address (in blocks)
+    int fingerprint_len;   // in blocks
+    int block_size;        // bytes, 0 means UFS_BLOCK_SIZE
+    // Allocation groups, see AllocationGroups.h. 0 means a single group.
+    int group_inodes;      // inodes per group, whole inode region blocks
+    int group_blocks;      // data blocks per group, a multiple of 8
+    // UFS_FEATURE_ORPHAN_LIST: the last file put on the orphan list, 0 when
+    // it is empty. The inodes on it are chained through their size.
+    int orphan_head;
+    // UFS_FEATURE_LOG regions, after the data region
+    int log_checkpoint_addr; // block address (in blocks)
+    int log_checkpoint_len;  // in blocks, two copies of the block map
+    int log_addr;            // block address (in blocks)
+    int log_len;             // in blocks, a multiple of log_segment_blocks
+    int log_segment_blocks;
+    // UFS_FEATURE_TIERED and UFS_FEATURE_COLD_TIER: the same nonzero
+    // number in an image and its cold tier
+    int tier_id;
 } super_t;
 
+// Block log (UFS_FEATURE_LOG). Every block written goes to the end of
+// the log first, and the block map says which blocks have a newer copy
+// in the log than at their home. The log is split into segments of
+// log_segment_blocks blocks. A commit is written into the segment being
+// filled as one or more chunks: a summary block with the home of each
+// block, then the blocks. The cleaner writes the blocks of a segment that
+// are still the newest copy back home and frees the segment, and then
+// writes the block map to the checkpoint region, alternating between its
+// two copies. After a crash the map is the newest whole checkpoint plus
+// the chunks written after it.
+#define UFS_LOG_SEGMENT_BYTES (1 << 20)
+#define LOG_SUMMARY_MAGIC (0x6c6f6773)
+#define LOG_CHECKPOINT_MAGIC (0x6c6f6763)
+
+typedef struct {
+    unsigned int magic;     // LOG_SUMMARY_MAGIC
+    unsigned int count;     // blocks in the chunk after the summary
+    long long sequence;     // one more than the chunk written before it
+    unsigned int more;      // 1 if the commit goes on in the next chunk
+    unsigned int checksum;  // of the summary block with this 0, and the blocks
+} log_summary_t;            // followed by count home block numbers
+
+typedef struct {
+    unsigned int magic;     // LOG_CHECKPOINT_MAGIC
+    unsigned int count;     // log_map_entry_t that follow
+    long long sequence;     // of the last chunk the map includes
+    int head;               // segment being filled
+    unsigned int checksum;  // of the header with this 0, and the entries
+} log_checkpoint_t;
+
+typedef struct {
+    unsigned int home;      // block number
+    unsigned int block;     // where its newest copy is, from log_addr
+} log_map_entry_t;
+
+// Cold tiers. An image can be paired with a cold tier image on a bigger,
+// slower device, which gives it more room for file data. The directories
+// and inodes stay in the image. A file with UFS_INODE_COLD has all its
+// blocks in the cold tier, numbered like blocks of that image, and is
+// otherwise stored the same way (compressed or not). Cold blocks are
+// never shared, so they have no reference counts. The cold tier uses
+// nothing but its data bitmap and data region, and the pairing is
+// recorded with tier_id in both super blocks.
+
+// Snapshots (UFS_FEATURE_SNAPSHOTS) are read only copies of the tree
+// under the root, kept in this directory of the root. They have their
+// own inodes and directory blocks and share file blocks with the live
+// tree.
+#define UFS_SNAPSHOT_DIR ".snapshots"
+
 
 #endif // __ufs_h__
@@ -1,38 +1,70 @@
 #include <assert.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/types.h>
 
 #include "ufs.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-b <block_size>] [-g <groups>] [-l] [-D] [-L <segments>] [-T]\n");
+    fprintf(stderr, "  -b  bytes per block: 4096 (the default), 16384 or 65536\n");
+    fprintf(stderr, "  -g  allocation groups, by default one per block of data bitmap\n");
+    fprintf(stderr, "  -l  make a legacy image without a format version or optional features\n");
+    fprintf(stderr, "  -D  share file blocks with the same content (block deduplication)\n");
+    fprintf(stderr, "  -L  write blocks to a log of this many 1 MB segments first (at least 4)\n");
+    fprintf(stderr, "  -T  make a cold tier for another image, which only holds file blocks\n");
     exit(1);
 }
 
 int main(int argc, char *argv[]) {
     int ch;
     char *image_file = NULL;
-    int num_inodes = 32;
-    int num_data = 32;
+    long long num_inodes = 32;
+    long long num_data = 32;
     int visual = 0;
-
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    int legacy = 0;
+    int dedup = 0;
+    int block_size = UFS_BLOCK_SIZE;
+    long long num_groups = 0;
+    long long log_segments = 0;
+    int cold_tier = 0;
+
+    while ((ch = getopt(argc, argv, "i:d:f:b:g:vlDL:T")) != -1) {
 	switch (ch) {
 	case 'i':
-	    num_inodes = atoi(optarg);
+	    num_inodes = atoll(optarg);
 	    break;
 	case 'd':
-	    num_data = atoi(optarg);
+	    num_data = atoll(optarg);
 	    break;
 	case 'f':
 	    image_file = optarg;
 	    break;
+	case 'b':
+	    block_size = atoi(optarg);
+	    break;
+	case 'g':
+	    num_groups = atoll(optarg);
+	    break;
 	case 'v':
 	    visual = 1;
 	    break;
+	case 'l':
+	    legacy = 1;
+	    break;
+	case 'D':
+	    dedup = 1;
+	    break;
+	case 'L':
+	    log_segments = atoll(optarg);
+	    break;
+	case 'T':
+	    cold_tier = 1;
+	    break;
 	default:
 	    usage();
 	}
@@ -40,13 +72,27 @@ int main(int argc, char *argv[]) {
     argc -= optind;
     argv += optind;
 
-    if (image_file == NULL)
+    if (image_file == NULL || !UFS_VALID_BLOCK_SIZE(block_size))
 	usage();
-
-    unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
-    if (empty_buffer == NULL) {
-	perror("calloc");
+    // legacy images can't record their block size
+    if (legacy && block_size != UFS_BLOCK_SIZE) {
+	fprintf(stderr, "mkfs: legacy images have %d byte blocks\n", UFS_BLOCK_SIZE);
+	exit(1);
+    }
+    if (num_groups < 0 || (legacy && num_groups > 1)) {
+	fprintf(stderr, "mkfs: legacy images have a single allocation group\n");
+	exit(1);
+    }
+    if (log_segments < 0 || (log_segments > 0 && log_segments < 4) || log_segments > INT_MAX) {
+	fprintf(stderr, "mkfs: the log needs at least 4 segments\n");
+	exit(1);
+    }
+    if (legacy && log_segments > 0) {
+	fprintf(stderr, "mkfs: legacy images have no log\n");
+	exit(1);
+    }
+    if (cold_tier && (legacy || dedup || log_segments > 0)) {
+	fprintf(stderr, "mkfs: a cold tier has nothing but data blocks\n");
 	exit(1);
     }
 
@@ -58,16 +104,54 @@ int main(int argc, char *argv[]) {
 
     assert(num_inodes >= 32);
     assert(num_data >= 32);
+    // counts and block numbers on disk are 32 bit
+    if (num_inodes > INT_MAX || num_data > INT_MAX) {
+	fprintf(stderr, "mkfs: at most %d inodes and data blocks\n", INT_MAX);
+	exit(1);
+    }
 
     // presumed: block 0 is the super block
     super_t s;
+    memset(&s, 0, sizeof(super_t));
+
+    // format version, block size and optional features
+    if (!legacy) {
+	s.version = UFS_VERSION;
+	s.block_size = block_size;
+	s.features = UFS_FEATURE_INLINE_DATA | UFS_FEATURE_DIRENT_TYPE | UFS_FEATURE_DIR_INDEX
+	    | UFS_FEATURE_COMPRESSION | UFS_FEATURE_SNAPSHOTS | UFS_FEATURE_ORPHAN_LIST;
+	if (dedup)
+	    s.features |= UFS_FEATURE_DEDUP;
+	if (log_segments > 0)
+	    s.features |= UFS_FEATURE_LOG;
+	// a cold tier only uses its data bitmap and data region, see ufs.h
+	if (cold_tier)
+	    s.features = UFS_FEATURE_COLD_TIER;
+    }
 
     // totals
     s.num_inodes = num_inodes;
     s.num_data = num_data;
 
     // inode bitmap
-    int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
+    int bits_per_block = (8 * block_size); // remember, there are 8 bits per byte
+
+    // allocation groups. Each group gets whole blocks of the inode region
+    // and a byte aligned slice of the data bitmap, by default a block of
+    // it like an ext4 block group. The bitmaps of all groups stay packed
+    // together, so the layout below doesn't depend on them.
+    if (!legacy) {
+	int inodes_per_block = block_size / sizeof(inode_t);
+	long long group_blocks = bits_per_block;
+	if (num_groups > 0)
+	    group_blocks = (num_data + num_groups - 1) / num_groups;
+	group_blocks = (group_blocks + 7) / 8 * 8;
+	num_groups = (num_data + group_blocks - 1) / group_blocks;
+	long long group_inodes = (num_inodes + num_groups - 1) / num_groups;
+	group_inodes = (group_inodes + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+	s.group_blocks = group_blocks;
+	s.group_inodes = group_inodes;
+    }
 
     s.inode_bitmap_addr = 1;
     s.inode_bitmap_len = num_inodes / bits_per_block;
@@ -82,16 +166,58 @@ int main(int argc, char *argv[]) {
 
     // inode table
     s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
-    int total_inode_bytes = num_inodes * sizeof(inode_t);
-    s.inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
-    if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
+    long long total_inode_bytes = (long long)num_inodes * sizeof(inode_t);
+    s.inode_region_len = total_inode_bytes / block_size;
+    if (total_inode_bytes % block_size != 0)
 	s.inode_region_len++;
 
+    // block reference counts, and the dedup fingerprint table with at
+    // least twice as many slots as data blocks
+    int refs_per_block = block_size / sizeof(unsigned int);
+    int slots_per_block = block_size / sizeof(dedup_slot_t);
+    s.refcount_addr = s.inode_region_addr + s.inode_region_len;
+    if (s.features & UFS_FEATURE_REFCOUNTS) {
+	s.refcount_len = num_data / refs_per_block;
+	if (num_data % refs_per_block != 0)
+	    s.refcount_len++;
+    }
+    s.fingerprint_addr = s.refcount_addr + s.refcount_len;
+    if (s.features & UFS_FEATURE_DEDUP) {
+	s.fingerprint_len = 2LL * num_data / slots_per_block;
+	if (2LL * num_data % slots_per_block != 0)
+	    s.fingerprint_len++;
+    }
+
     // data blocks
-    s.data_region_addr = s.inode_region_addr + s.inode_region_len;
+    s.data_region_addr = s.fingerprint_addr + s.fingerprint_len;
     s.data_region_len = num_data;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
+    // the block log, after everything else. The checkpoint region has
+    // room for two copies of a block map with an entry for every block
+    // of the log.
+    long long log_checkpoint_len = 0;
+    long long log_len = 0;
+    if (s.features & UFS_FEATURE_LOG) {
+	s.log_segment_blocks = UFS_LOG_SEGMENT_BYTES / block_size;
+	log_len = log_segments * s.log_segment_blocks;
+	long long map_bytes = sizeof(log_checkpoint_t) + log_len * sizeof(log_map_entry_t);
+	log_checkpoint_len = 2 * ((map_bytes + block_size - 1) / block_size);
+    }
+
+    long long total_blocks = 1LL + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len
+	+ s.refcount_len + s.fingerprint_len + s.data_region_len + log_checkpoint_len + log_len;
+
+    if (total_blocks > INT_MAX) {
+	fprintf(stderr, "mkfs: the image would have more than %d blocks\n", INT_MAX);
+	exit(1);
+    }
+
+    if (s.features & UFS_FEATURE_LOG) {
+	s.log_checkpoint_addr = s.data_region_addr + s.data_region_len;
+	s.log_checkpoint_len = log_checkpoint_len;
+	s.log_addr = s.log_checkpoint_addr + s.log_checkpoint_len;
+	s.log_len = log_len;
+    }
 
     // super block is the first block
     int rc = pwrite(fd, &s, sizeof(super_t), 0);
@@ -100,85 +226,125 @@ int main(int argc, char *argv[]) {
 	exit(1);
     }
 
-    printf("total blocks        %d\n", total_blocks);
-    printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
-    printf("  data blocks       %d\n", num_data);
+    printf("total blocks        %lld\n", total_blocks);
+    if (block_size != UFS_BLOCK_SIZE)
+	printf("  block size        %d\n", block_size);
+    printf("  inodes            %lld [size of each: %lu]\n", num_inodes, sizeof(inode_t));
+    printf("  data blocks       %lld\n", num_data);
+    printf("  format version    %d [features: 0x%x]\n", s.version, s.features);
+    if (s.group_blocks > 0)
+	printf("  allocation groups %lld [%d inodes, %d data blocks each]\n", num_groups, s.group_inodes, s.group_blocks);
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
+    if (s.features & UFS_FEATURE_REFCOUNTS)
+	printf("  refcount address/len     %d [%d]\n", s.refcount_addr, s.refcount_len);
+    if (s.features & UFS_FEATURE_DEDUP)
+	printf("  fingerprint address/len  %d [%d]\n", s.fingerprint_addr, s.fingerprint_len);
+    if (s.features & UFS_FEATURE_LOG) {
+	printf("  log checkpoint addr/len  %d [%d]\n", s.log_checkpoint_addr, s.log_checkpoint_len);
+	printf("  log address/len          %d [%d, %lld segments]\n", s.log_addr, s.log_len, log_segments);
+    }
 
-    // first, zero out all the blocks
+    // first, size the image. The file is sparse and reads back as
+    // zeros, which is already a valid empty bitmap, inode table (every
+    // inode free) and refcount region, so only the blocks below that hold
+    // something are written. Large images format as fast as small ones.
     int i;
-    for (i = 1; i < total_blocks; i++) {
-	rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-	if (rc != UFS_BLOCK_SIZE) {
-	    perror("write");
-	    exit(1);
-	}
+    if (ftruncate(fd, (off_t)total_blocks * block_size) != 0) {
+	perror("ftruncate");
+	exit(1);
     }
 
+    // every block below is built in this buffer, which is block_size
+    // bytes whatever the block size is
+    unsigned char *block = calloc(1, block_size);
+    assert(block != NULL);
+
+    // a cold tier has no root directory, its empty bitmaps are all there is
+    if (cold_tier)
+	goto done;
+
     //
     // need to allocate first inode in inode bitmap
     //
-    typedef struct {
-	unsigned char bits[UFS_BLOCK_SIZE / sizeof(unsigned char)];
-    } bitmap_t;
-    assert(sizeof(bitmap_t) == UFS_BLOCK_SIZE);
-
-    bitmap_t b;
-    for (i = 0; i < 4096; i++)
-	b.bits[i] = 0;
-    b.bits[0] = 0x1; // first entry is allocated
+    block[0] = 0x1; // first entry is allocated
     
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, block, block_size, (off_t)s.inode_bitmap_addr * block_size);
+    assert(rc == block_size);
 
     //
     // need to allocate first data block in data bitmap
-    // (can just reuse this to write out data bitmap too)
+    // (can just reuse this to write out data bitmap too), and the
+    // second one for the index of the root directory
     //
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    if (s.features & UFS_FEATURE_DIR_INDEX)
+	block[0] = 0x3;
+    rc = pwrite(fd, block, block_size, (off_t)s.data_bitmap_addr * block_size);
+    assert(rc == block_size);
 
     //
     // need to write out inode
     //
-    typedef struct {
-	inode_t inodes[UFS_BLOCK_SIZE / sizeof(inode_t)];
-    } inode_block;
-
-    inode_block itable;
-    itable.inodes[0].type = UFS_DIRECTORY;
-    itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
-    itable.inodes[0].direct[0] = s.data_region_addr;
+    inode_t *inodes = (inode_t *)block;
+    memset(block, 0, block_size);
+    inodes[0].type = UFS_DIRECTORY;
+    inodes[0].flags = 0;
+    inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
+    inodes[0].direct[0] = s.data_region_addr;
     for (i = 1; i < DIRECT_PTRS; i++)
-	itable.inodes[0].direct[i] = -1;
+	inodes[0].direct[i] = -1;
+    if (s.features & UFS_FEATURE_DIR_INDEX) {
+	inodes[0].flags |= UFS_INODE_DIR_INDEX;
+	inodes[0].direct[DIR_INDEX_PTR] = s.data_region_addr + 1;
+    }
 
-    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, block, block_size, (off_t)s.inode_region_addr * block_size);
+    assert(rc == block_size);
 
     // 
     // need to write out root directory contents to first data block
     // create a root directory, with nothing in it
     // 
-    typedef struct {
-	dir_ent_t entries[128];
-    } dir_block_t;
-    // xxx assumes 4096 block, 32 byte entries
-    assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
-
-    dir_block_t parent;
-    strcpy(parent.entries[0].name, ".");
-    parent.entries[0].inum = 0;
+    int entries_per_block = block_size / sizeof(dir_ent_t);
+    dir_ent_t *entries = (dir_ent_t *)block;
+    memset(block, 0, block_size);
+    strcpy(entries[0].name, ".");
+    entries[0].inum = 0;
+
+    strcpy(entries[1].name, "..");
+    entries[1].inum = 0;
+
+    if (s.features & UFS_FEATURE_DIRENT_TYPE) {
+	entries[0].name[DIR_ENT_TYPE_INDEX] = DIR_ENT_TYPE(UFS_DIRECTORY);
+	entries[1].name[DIR_ENT_TYPE_INDEX] = DIR_ENT_TYPE(UFS_DIRECTORY);
+    }
 
-    strcpy(parent.entries[1].name, "..");
-    parent.entries[1].inum = 0;
+    for (i = 2; i < entries_per_block; i++)
+	entries[i].inum = -1;
 
-    for (i = 2; i < 128; i++)
-	parent.entries[i].inum = -1;
+    rc = pwrite(fd, block, block_size, (off_t)s.data_region_addr * block_size);
+    assert(rc == block_size);
 
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    //
+    // the index of the root directory is a single leaf with '.' and '..'.
+    // With bigger blocks the node just has room for more entries, so the
+    // dir_index_node_t header is the same.
+    //
+    if (s.features & UFS_FEATURE_DIR_INDEX) {
+	dir_index_node_t root_index;
+	memset(&root_index, 0, sizeof(dir_index_node_t));
+	root_index.leaf = 1;
+	root_index.count = 2;
+	root_index.entries[0] = entries[0];
+	root_index.entries[1] = entries[1];
+	memset(block, 0, block_size);
+	memcpy(block, &root_index, sizeof(dir_index_node_t));
+	rc = pwrite(fd, block, block_size, ((off_t)s.data_region_addr + 1) * block_size);
+	assert(rc == block_size);
+    }
+ done:
+    free(block);
 
     if (visual) {
 	int i;
@@ -190,8 +356,16 @@ int main(int argc, char *argv[]) {
 	    printf("d");
 	for (i = 0; i < s.inode_region_len; i++)
 	    printf("I");
+	for (i = 0; i < s.refcount_len; i++)
+	    printf("r");
+	for (i = 0; i < s.fingerprint_len; i++)
+	    printf("f");
 	for (i = 0; i < s.data_region_len; i++)
 	    printf("D");
+	for (i = 0; i < s.log_checkpoint_len; i++)
+	    printf("c");
+	for (i = 0; i < s.log_len; i++)
+	    printf("L");
 	printf("\n\n");
     }
 